@@ -1066,11 +1066,13 @@ int says_yes()
 void display_message (BUTE *ed, const char *fmt, ...) 
   {
   va_list args;
+  char buff [EDIT_MAX_LINE + 1];
 
   va_start (args, fmt);
   term_set_cursor (ed->env->lines, 0);
   interface_write_string (STATUS_COLOR);
-  vprintf (fmt, args);
+  vsnprintf (buff, sizeof (buff), fmt, args);
+  interface_write_string (buff);
   term_clear_eol();
   interface_write_string (TEXT_COLOR);
   va_end (args);
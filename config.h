@@ -31,3 +31,157 @@
 //   runaway sender eating the entire storage.
 #define XMODEM_MAX 100000
 
+
+// Interval between PWM level updates, when pico.pwm_ramp() is ramping
+//   one or more pins. Smaller is smoother, but takes more CPU time.
+#define PWM_RAMP_TICK_MS 5
+
+// Size of the read-ahead buffer in a StorageReader, which is used to
+//   load Lua scripts, and by pico.lines(). It's best as a multiple of
+//   the filesystem's cache size (256 bytes). Lines longer than this can 
+//   still be read, but are assembled from several reads.
+#define STORAGE_READER_BUFFER_SIZE 512
+
+// Size of the buffer attached to each file opened by io.open(). Reads
+//   and writes smaller than this are gathered into whole-buffer
+//   storage operations.
+#define IO_BUFFER_SIZE 512
+
+// Size of the cache that gathers adjacent flash page programs into
+//   one operation. Each flash program disables interrupts, so fewer, 
+//   larger programs are faster, but each one keeps interrupts off for
+//   longer -- about 0.4ms per 256-byte page. Must be a multiple of 256;
+//   256 turns coalescing off.
+#define STORAGE_PROG_CACHE_SIZE 1024
+
+// Number of entries in the cache of storage_file_exists() results, which
+//   speeds up finding shell commands and Lua modules. Each entry costs
+//   a copy of the path.
+#define STORAGE_LOOKUP_CACHE_SIZE 32
+
+// Size of the buffer used to copy files. A whole flash block (4kB) is 
+//   fastest; if there isn't enough memory, a smaller buffer is used.
+#define STORAGE_COPY_BUFFER_SIZE 4096
+
+// Flash pages kept in RAM, shared by all open files and by the 
+//   filesystem's metadata reads. The cache takes 
+//   STORAGE_PAGE_CACHE_PAGES * STORAGE_PAGE_SIZE bytes, however many files
+//   are open. The page size must be a multiple of 256, and a factor of 
+//   the 4kB flash block.
+#define STORAGE_PAGE_CACHE_PAGES 8
+#define STORAGE_PAGE_SIZE 1024
+
+// Number of files that storage_write_file, storage_append_file and 
+//   storage_read_partial keep open between calls. Each costs about 
+//   350 bytes of RAM.
+#define STORAGE_HANDLE_CACHE_SIZE 4
+
+// Longest, in milliseconds, that data written through those open files
+//   waits to be committed, if the program writes again, or waits, or 
+//   the shell is idle, by then. Longer waits mean fewer commits, and
+//   less wear, but more to lose if the power fails.
+#define STORAGE_SYNC_MS 1000
+
+// df works out the free space from the filesystem allocator's own map 
+//   of free blocks, without scanning the filesystem. That map doesn't 
+//   include blocks freed since it was made, so when it shows fewer free
+//   blocks than this, df has it rebuilt, to get an exact figure.
+#define STORAGE_DF_RESCAN_BLOCKS 16
+
+// Where the RAM filesystem is mounted, and its size in bytes. Its 
+//   contents are lost at reset, but writing it costs no flash wear and
+//   doesn't stall the CPU. 0 leaves /tmp as an ordinary directory on 
+//   flash.
+#define STORAGE_TMP_PATH "/tmp"
+#define STORAGE_TMP_SIZE (32 * 1024)
+
+// Block size of the RAM filesystem. Every file takes at least one 
+//   block, so this is smaller than the flash block.
+#define STORAGE_TMP_BLOCK_SIZE 512
+
+// Where the read-only image of the files under romfs/ in the source 
+//   tree is mounted. These are built into the firmware, and read 
+//   directly from where it is stored, so they cost no RAM and can't be
+//   lost or damaged by formatting the filesystem.
+#define STORAGE_ROM_PATH "/rom"
+
+// While the shell waits for a key, it compacts and scans the filesystem,
+//   so that writes don't have to. A scan that last took longer than this
+//   is not started, so that typing doesn't lag.
+#define STORAGE_IDLE_BUDGET_US 20000
+
+// If 1, the filesystem allocator's map of free blocks is saved when the
+//   filesystem is unmounted cleanly, so that the next start-up doesn't 
+//   have to scan the whole filesystem. The map is only used once, and 
+//   only if the filesystem's metadata shows that nothing has been 
+//   written since, even by firmware that doesn't know about the map.
+#define STORAGE_MOUNT_CHECKPOINT 1
+
+// Number of segment files that a log opened by pico.log_open() is split
+//   into. When the log is full, the oldest segment is deleted, so more
+//   segments means less of the log is lost at once, at the cost of more
+//   files.
+#define LOGFILE_SEGMENTS 4
+
+// Number of hash chains in the table of shell commands. Builtins, and 
+//   commands added by shell.register(), are all found through it, so 
+//   this should be at least the number of commands, for a short search.
+#define SHELL_COMMAND_BUCKETS 32
+
+// Number of shell scripts kept compiled in memory, so that running one 
+//   again, such as from a loop in another script, doesn't parse it again.
+#define SHELL_SCRIPT_CACHE_SIZE 4
+
+// Deepest nesting of if, while, and for in a shell script
+#define SHELL_SCRIPT_MAX_DEPTH 8
+
+// Bytes that a command can write into a pipe before it is held, to let
+//   the command reading the pipe catch up. A reader that wants a longer
+//   line, or everything, lets the pipe grow to hold it.
+#define SHELL_PIPE_SIZE 512
+
+// Most commands that can be joined by | into one pipe
+#define SHELL_PIPE_MAX_STAGES 8
+
+// Most background jobs, started with &, that can exist at once
+#define SHELL_JOB_MAX 8
+
+// Lua instructions that a background job runs before it yields, times
+//   its priority. Shorter turns share the CPU more evenly, at the cost
+//   of more switching.
+#define SHELL_JOB_SLICE 1000
+
+// Priority of a new job, and the highest that renice can set
+#define SHELL_JOB_PRIORITY 1
+#define SHELL_JOB_MAX_PRIORITY 10
+
+// While a program runs in the foreground, the background jobs get a
+//   turn this often
+#define SHELL_JOB_TICK_US 10000
+
+// Most bytes that the Lua state of a background job can allocate, so
+//   that one job can't take the memory that the foreground, or other
+//   jobs, need. 0 for no limit.
+#define SHELL_JOB_MEM_LIMIT 65536
+
+// If 1, Lua programs run on the second core, while the first looks after
+//   the terminal. The host build runs them in a second thread, unless 
+//   the environment variable PICOLUA_ONE_CORE is set.
+#define INTERFACE_LUA_CORE1 1
+
+// Stack for a Lua program on the second core, in bytes. It comes out of
+//   the RAM that Lua could otherwise use.
+#define INTERFACE_CORE1_STACK_SIZE 8192
+
+// Bytes of output that a program on the second core can write before it
+//   waits for the terminal; and bytes typed that it hasn't read yet. Both
+//   must be powers of two.
+#define INTERFACE_CORE_OUT_SIZE 2048
+#define INTERFACE_CORE_IN_SIZE 128
+
+// Most bytes written to the terminal at once, between looks for a key
+#define INTERFACE_CORE_CHUNK 256
+
+// Longest that the first core sleeps, when there is nothing to write or
+//   read; it's woken sooner by a key, or by the second core
+#define INTERFACE_CORE_POLL_US 1000
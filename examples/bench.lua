@@ -0,0 +1,27 @@
+-- Use pico.bench() to compare a few ways of doing the same job
+
+function report (name, r)
+  print (string.format ("%-12s median %6d us  mean %9.2f us  %7d bytes  %4d GC steps",
+    name, r.median, r.mean, r.bytes, r.gc_steps))
+end
+
+local n = 200
+
+report ("concat", pico.bench (function ()
+  local s = ""
+  for i = 1, 100 do s = s .. i end
+end, n))
+
+report ("table.concat", pico.bench (function ()
+  local t = {}
+  for i = 1, 100 do t[i] = i end
+  local s = table.concat (t)
+end, n))
+
+report ("string.rep", pico.bench (function ()
+  local s = string.rep ("x", 100)
+end, n))
+
+report ("time_us", pico.bench (function ()
+  local t = pico.time_us ()
+end, n))
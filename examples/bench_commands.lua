@@ -0,0 +1,37 @@
+-- Compare the cost of running a small Lua program as a shell command,
+--   when it is found on the PATH, and when it has been added to the
+--   shell with shell.register(). A command on the PATH is searched for
+--   and loaded, and gets a new Lua interpreter, every time it is run; a
+--   registered command is a function that is already loaded, in a Lua
+--   state that the shell keeps.
+
+local script = "/bin/bench_cmd.lua"
+local times = 100
+
+local function report (name, f)
+  pico.flash_stats (nil, true)
+  local t = pico.time_us ()
+  f ()
+  t = pico.time_us () - t
+  local s = pico.flash_stats ()
+  if s then
+    print (string.format ("%-20s %6d us per command, %5d reads, est. %6d us",
+      name, t // times, s.reads, s.busy_us))
+  else
+    print (string.format ("%-20s %6d us per command", name, t // times))
+  end
+end
+
+pico.write (script, "n = (n or 0) + select ('#', ...)\n")
+
+report ("on the PATH", function ()
+  for i = 1, times do pico.execute ("bench_cmd a b") end
+end)
+
+shell.register ("bench_reg", script)
+report ("registered", function ()
+  for i = 1, times do pico.execute ("bench_reg a b") end
+end)
+
+shell.unregister ("bench_reg")
+os.remove (script)
@@ -0,0 +1,46 @@
+-- Compress every script in a directory (by default /bin), and report 
+--   how much smaller each becomes, and how long it takes to compress 
+--   and to load (compile) before and after. The scripts are copied 
+--   first, so the originals are not changed. The "flash rd" columns, 
+--   filled in only where pico.flash_stats() counts reads, are the bytes
+--   read to load each script, before and after.
+--
+--   lua bench_compress.lua [directory]
+
+local dir = arg and arg[1] or "/bin"
+local tmp = "/bench_compress"
+pcall (pico.mkdir, tmp)
+
+local function load_cost (path)
+  pico.flash_stats (nil, true)
+  local r = pico.bench (function () assert (loadfile (path)) end, 5, 1)
+  local s = pico.flash_stats ()
+  return r.median, s and s.bytes_read // 6 or 0
+end
+
+local total, total_stored, total_us = 0, 0, 0
+print (string.format ("%-20s %7s %7s %6s %9s %9s %8s %8s", "file", 
+  "size", "stored", "ratio", "load us", "z load us", "flash rd", "z rd"))
+for name, type in pico.dir (dir) do
+  if type == "file" and name:match ("%.lua$") then
+    local path = tmp .. "/" .. name
+    pico.write (path, pico.read (dir .. "/" .. name))
+    local us, rd = load_cost (path)
+    local t = pico.time_us ()
+    local size, stored = pico.compress (path)
+    total_us = total_us + pico.time_us () - t
+    local zus, zrd = load_cost (path)
+    print (string.format ("%-20s %7d %7d %5d%% %9d %9d %8d %8d", name, 
+      size, stored, stored * 100 // size, us, zus, rd, zrd))
+    total = total + size
+    total_stored = total_stored + stored
+    os.remove (path)
+  end
+end
+os.remove (tmp)
+
+if total > 0 then
+  print (string.format ("total %d bytes stored in %d (%d%%); compressed at %d kB/s",
+    total, total_stored, total_stored * 100 // total, 
+    (total // 1024) * 1000000 // (total_us + 1)))
+end
@@ -0,0 +1,29 @@
+-- Measure the speed of the shell's cp command, copying a 256 kB file. 
+--   Where pico.flash_stats() can time the flash, a second line gives 
+--   the copy's speed if the flash were the only cost.
+
+local size = 256 * 1024
+local src = "/bench_copy.src"
+local dst = "/bench_copy.dst"
+
+local f = assert (io.open (src, "w"))
+local chunk = string.rep ("0123456789abcdef", 256)
+for i = 1, size // #chunk do f:write (chunk) end
+f:close ()
+
+pico.flash_stats (nil, true)
+local t = pico.time_us ()
+pico.execute ("cp " .. src .. " " .. dst)
+t = pico.time_us () - t
+
+print (string.format ("copied %d kB in %d ms: %.2f MB/s", 
+  size // 1024, t // 1000, (size / 1048576) / (t / 1000000)))
+local s = pico.flash_stats ()
+if s and s.busy_us > 0 then
+  print (string.format ("estimated on the Pico: %d ms of flash time, %.2f MB/s", 
+    s.busy_us // 1000, (size / 1048576) / (s.busy_us / 1000000)))
+end
+
+assert (pico.read (src) == pico.read (dst), "copy differs")
+os.remove (src)
+os.remove (dst)
@@ -0,0 +1,35 @@
+-- Measure what a Lua program gains from running on the second core,
+--   while the first looks after the terminal. Every function call checks
+--   for the interrupt key; on one core that means asking the USB, but on
+--   the second it is just a flag that the first core sets. And printing
+--   only has to wait for the terminal when the queue between the cores
+--   is full. To compare, build with INTERFACE_LUA_CORE1 set to 0, or, on
+--   the host, set the environment variable PICOLUA_ONE_CORE.
+
+local calls = 200000
+local lines = 200
+
+local function report (name, n, unit, f)
+  local t = pico.time_us ()
+  f ()
+  t = pico.time_us () - t
+  return string.format ("%-24s %8.3f us per %s", name, t / n, unit)
+end
+
+local function nothing () end
+local r1 = report ("function call", calls, "call", function ()
+  for i = 1, calls do nothing () end
+end)
+
+local r2 = report ("print, short line", lines, "line", function ()
+  for i = 1, lines do print ("line", i) end
+end)
+
+local text = string.rep ("x", 60)
+local r3 = report ("print, 60 characters", lines, "line", function ()
+  for i = 1, lines do print (text) end
+end)
+
+print (r1)
+print (r2)
+print (r3)
@@ -0,0 +1,36 @@
+-- Time pico.df(), as a script that checks the free space before each
+--   write would call it, with the filesystem in various states. The 
+--   flash reads per call show when df has had to rebuild its map of 
+--   free blocks; they are 0 where reads aren't counted.
+
+local function time_df (name)
+  local d = pico.df ()
+  pico.flash_stats (nil, true)
+  local r = pico.bench (function () pico.df () end, 50, 1)
+  local s = pico.flash_stats ()
+  print (string.format ("%-26s used %8d  free %8d  median %6d us  flash reads %d", 
+    name, d.used, d.free, r.median, s and s.reads // 51 or 0))
+end
+
+time_df ("as found")
+
+-- Fill some of the filesystem with small files, which makes a full
+--   scan slower
+pico.mkdir ("/bench_df")
+local chunk = string.rep ("x", 1000)
+for i = 1, 100 do
+  pico.write ("/bench_df/f" .. i, chunk)
+end
+time_df ("after writing 100 files")
+
+local f = assert (io.open ("/bench_df/big", "w"))
+for i = 1, 200 do f:write (chunk) end
+f:close ()
+time_df ("after writing 200 kB")
+
+os.remove ("/bench_df/big")
+time_df ("after removing 200 kB")
+
+for i = 1, 100 do os.remove ("/bench_df/f" .. i) end
+os.remove ("/bench_df")
+time_df ("after removing the rest")
@@ -0,0 +1,53 @@
+-- Measure file throughput using the io library. Each test writes, then
+--   reads back, the same amount of data in chunks of different sizes.
+
+local total = 32768
+local fname = "/bench_fileio.tmp"
+
+function report (name, bytes, us)
+  print (string.format ("%-22s %6d bytes %8d us %8.1f kB/s",
+    name, bytes, us, (bytes / 1024) / (us / 1000000)))
+end
+
+function write_test (chunk, mode)
+  local s = string.rep ("x", chunk)
+  local f = assert (io.open (fname, "w"))
+  if mode then f:setvbuf (mode) end
+  local t = pico.time_us ()
+  for i = 1, total // chunk do f:write (s) end
+  f:close ()
+  report ("write " .. chunk .. (mode and (" " .. mode) or ""), 
+    total, pico.time_us () - t)
+end
+
+function read_test (chunk)
+  local f = assert (io.open (fname, "r"))
+  local n = 0
+  local t = pico.time_us ()
+  while true do
+    local s = f:read (chunk)
+    if not s then break end
+    n = n + #s
+  end
+  f:close ()
+  report ("read " .. chunk, n, pico.time_us () - t)
+end
+
+function lines_test ()
+  local f = assert (io.open (fname, "w"))
+  for i = 1, total // 32 do f:write (string.rep ("y", 31), "\n") end
+  f:close ()
+  local n = 0
+  local t = pico.time_us ()
+  for l in io.lines (fname) do n = n + #l + 1 end
+  report ("lines", n, pico.time_us () - t)
+end
+
+for _, chunk in ipairs ({1, 16, 256, 4096}) do
+  write_test (chunk)
+  read_test (chunk)
+end
+write_test (16, "no")
+lines_test ()
+
+os.remove (fname)
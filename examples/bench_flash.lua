@@ -0,0 +1,36 @@
+-- Write a file in small pieces, as a logging program might, and report
+--   the flash operations that resulted. Run this on the Linux build, 
+--   which emulates the flash and counts operations; pico.flash_stats()
+--   returns nil on the Pico. Each prog is one interrupts-off window on the
+--   device; STORAGE_PROG_CACHE_SIZE in config.h controls how many pages
+--   are gathered into each one.
+
+local fname = "/bench_flash.tmp"
+local records = 2000
+local record = string.rep ("x", 40) .. "\n"
+
+os.remove (fname)
+pico.flash_stats (nil, true)
+
+local t = pico.time_us ()
+local f = assert (io.open (fname, "w"))
+for i = 1, records do 
+  f:write (record) 
+  if i % 100 == 0 then f:flush () end
+end
+f:close ()
+t = pico.time_us () - t
+
+local s = pico.flash_stats ()
+if not s then
+  print ("No flash statistics on this platform; took " .. t .. " us")
+else
+  print (string.format ("%d bytes written in %d us", 
+    records * #record, t))
+  print (string.format ("reads %d (%d bytes), progs %d (%d bytes), erases %d",
+    s.reads, s.bytes_read, s.progs, s.bytes_progged, s.erases))
+  print (string.format ("estimated device flash time %d ms, violations %d",
+    s.busy_us // 1000, s.violations))
+end
+
+os.remove (fname)
@@ -0,0 +1,47 @@
+-- Measure how long it takes to expand wildcards, in a tree of
+--   directories under /bench_glob. Only the directories whose names
+--   have wildcards in the pattern are listed, so the more of the
+--   path is written out in full, the fewer are read.
+
+local root = "/bench_glob"
+local dirs = 8
+local files = 16
+local times = 10
+
+local function mkdirs ()
+  pico.mkdir (root)
+  for d = 1, dirs do
+    local dir = root .. "/d" .. d
+    pico.mkdir (dir)
+    pico.mkdir (dir .. "/sub")
+    for f = 1, files do
+      pico.write (dir .. "/f" .. f .. ".lua", "")
+      pico.write (dir .. "/sub/g" .. f .. ".txt", "")
+    end
+  end
+end
+
+local function report (pattern)
+  pico.flash_stats (nil, true)
+  local t = pico.time_us ()
+  for i = 1, times do pico.execute ("true " .. pattern) end
+  t = pico.time_us () - t
+  local s = pico.flash_stats ()
+  if s then
+    print (string.format ("%-26s %8d us per run, %5d reads", pattern,
+      t // times, s.reads // times))
+  else
+    print (string.format ("%-26s %8d us per run", pattern, t // times))
+  end
+end
+
+mkdirs ()
+report (root .. "/d3/f1?.lua")
+report (root .. "/d*/f1?.lua")
+report (root .. "/*/sub/*.txt")
+report (root .. "/**/*.lua")
+report (root .. "/**/g[0-4].txt")
+-- Deepest first, as rm only deletes empty directories
+for _, p in ipairs { "/*/sub/*", "/*/sub", "/*/*", "/*", "" } do
+  pico.execute ("rm " .. root .. p)
+end
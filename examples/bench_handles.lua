@@ -0,0 +1,42 @@
+-- Measure repeated whole-file operations on the same file: reading a 
+--   file in small pieces with pico.read(), and rewriting a small file
+--   with pico.write(). The storage layer keeps these files open between
+--   calls. A file that stays open isn't looked up in the directory 
+--   again, so, where flash reads are counted, there should be few more
+--   of them than the data itself needs.
+
+local path = "/bench_handles.dat"
+local size = 16 * 1024
+local piece = 64
+
+local function report (name, count, t)
+  local s = pico.flash_stats ()
+  print (string.format ("%s: %d calls in %d ms, %d calls/s", 
+    name, count, t // 1000, count * 1000 // (t // 1000 + 1)))
+  if s and s.busy_us > 0 then
+    print (string.format ("  estimated on the Pico: %d ms, %d reads, %d programs, %d erases",
+      s.busy_us // 1000, s.reads, s.progs, s.erases))
+  end
+end
+
+pico.write (path, string.rep ("0123456789abcdef", size // 16))
+
+pico.flash_stats (nil, true)
+local t = pico.time_us ()
+local total = 0
+for off = 0, size - piece, piece do
+  total = total + #pico.read (path, off, piece)
+end
+report ("pico.read " .. piece .. " bytes", size // piece, pico.time_us () - t)
+assert (total == size)
+
+local count = 200
+pico.flash_stats (nil, true)
+t = pico.time_us ()
+for i = 1, count do
+  pico.write (path, string.format ("counter=%d\n", i))
+end
+report ("pico.write", count, pico.time_us () - t)
+assert (pico.read (path) == string.format ("counter=%d\n", count))
+
+os.remove (path)
@@ -0,0 +1,45 @@
+-- Measure how long small writes take, as a data logger that rewrites a
+--   few small status files and then sleeps would do. Each write commits
+--   to the directory's metadata, which has to be compacted, with a 
+--   block erase, whenever it fills. When the burst is followed by 
+--   pico.sleep_ms(), the sleep is used to compact metadata and find 
+--   free blocks, so the next burst should not have to. On the Linux 
+--   build, the time each write would take on the Pico is estimated from
+--   the flash emulator.
+
+local dir = "/bench_idle"
+local bursts = 60
+local per_burst = 5
+
+local function run (name, sleep)
+  pico.mkdir (dir)
+  local times = {}
+  pico.idle_stats (true)
+  for b = 1, bursts do
+    for i = 1, per_burst do
+      local s = pico.flash_stats ()
+      local t = pico.time_us ()
+      local f = assert (io.open (dir .. "/r" .. i, "w"))
+      f:write ("burst ", b, " record ", i, "\n")
+      f:close ()
+      local e = pico.flash_stats ()
+      times[#times + 1] = e and (e.busy_us - s.busy_us)
+        or (pico.time_us () - t)
+    end
+    if sleep then pico.sleep_ms (100) end
+  end
+  table.sort (times)
+  local total = 0
+  for _, t in ipairs (times) do total = total + t end
+  local st = pico.idle_stats ()
+  print (string.format ("%-14s mean %6d us  median %6d us  p95 %6d us  max %6d us",
+    name, total // #times, times[#times // 2],
+    times[math.ceil (#times * 0.95)], times[#times]))
+  print (string.format ("  idle work: %d runs, %d erases, %d us",
+    st.runs, st.erases, st.busy_us))
+  for i = 1, per_burst do os.remove (dir .. "/r" .. i) end
+  os.remove (dir)
+end
+
+run ("no idle time", false)
+run ("sleep_ms", true)
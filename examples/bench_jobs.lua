@@ -0,0 +1,49 @@
+-- Measure what background jobs cost a program in the foreground. A job
+--   that sleeps most of the time should cost almost nothing; a busy job
+--   has a turn of SHELL_JOB_SLICE instructions, times its priority, every
+--   SHELL_JOB_TICK_US. Last, a job that keeps allocating should fail
+--   when it reaches SHELL_JOB_MEM_LIMIT, with the shell carrying on.
+--   Run this with no other jobs, as it stops jobs 1 and 2 when it has
+--   finished.
+
+local calls = 1000000
+
+pico.write ("/tmp/bench_sleeper.lua", [[
+while true do pico.sleep_ms (10) end
+]])
+
+pico.write ("/tmp/bench_busy.lua", [[
+local n = 0
+while true do n = n + 1 end
+]])
+
+pico.write ("/tmp/bench_hog.lua", [[
+local t = {}
+while true do t[#t + 1] = "item " .. #t end
+]])
+
+local function report (name)
+  local function nothing () end
+  local t = pico.time_us ()
+  for i = 1, calls do nothing () end
+  t = pico.time_us () - t
+  print (string.format ("%-24s %8.3f us per call", name, t / calls))
+end
+
+report ("no jobs")
+pico.execute ("lua /tmp/bench_sleeper.lua &")
+report ("a sleeping job")
+pico.execute ("lua /tmp/bench_busy.lua &")
+report ("and a busy job")
+pico.execute ("renice 4 2")
+report ("busy, priority 4")
+pico.execute ("jobs")
+pico.execute ("kill 1")
+pico.execute ("kill 2")
+pico.execute ("lua /tmp/bench_hog.lua &")
+report ("a job out of memory")
+pico.sleep_ms (500)
+pico.execute ("jobs")
+pico.rm ("/tmp/bench_sleeper.lua")
+pico.rm ("/tmp/bench_busy.lua")
+pico.rm ("/tmp/bench_hog.lua")
@@ -0,0 +1,28 @@
+-- Time how long it takes to load (compile) a large script from the
+--   filesystem, compared with compiling the same text from memory. The
+--   difference is the cost of reading the file.
+
+local fname = "/bench_load.tmp"
+local lines = 2000
+
+local f = assert (io.open (fname, "w"))
+f:write ("#!/bin/lua -- first-line comment, skipped by the loader\n")
+for i = 1, lines do
+  f:write (string.format ("function f%d (x) return x * %d + 1 end\n", 
+    i % 150, i))
+end
+f:close ()
+
+-- load() doesn't skip a "#" first line, as loadfile() does
+local text = (pico.read (fname):gsub ("^#[^\n]*", ""))
+
+function time_it (name, fn)
+  local r = pico.bench (fn, 5, 1)
+  print (string.format ("%-12s %6d bytes  median %8d us  %8.1f kB/s", 
+    name, #text, r.median, (#text / 1024) / (r.median / 1000000)))
+end
+
+time_it ("loadfile", function () assert (loadfile (fname)) end)
+time_it ("load string", function () assert (load (text)) end)
+
+os.remove (fname)
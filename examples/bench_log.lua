@@ -0,0 +1,54 @@
+-- Compare the rate at which records can be appended to a file that is
+--   opened, written and closed for each record, with a log opened by
+--   pico.log_open(), which keeps its segment open and writes whole 
+--   flash pages. Where the flash is timed, each method also gets a line
+--   with its page programs and block erases, which is where the log 
+--   saves most.
+
+local count = 2000
+local path = "/bench_log.txt"
+local logdir = "/bench_log"
+
+local function report (name, t)
+  local s = pico.flash_stats ()
+  print (string.format ("%s: %d records in %d ms, %d records/s", 
+    name, count, t // 1000, count * 1000 // (t // 1000 + 1)))
+  if s and s.busy_us > 0 then
+    print (string.format ("  estimated on the Pico: %d ms, %d records/s, %d programs, %d erases",
+      s.busy_us // 1000, count * 1000 // (s.busy_us // 1000 + 1), s.progs, s.erases))
+  end
+end
+
+pico.flash_stats (nil, true)
+local t = pico.time_us ()
+for i = 1, count do
+  local f = assert (io.open (path, "a"))
+  f:write (string.format ("%6d reading=%d\n", i, i * 7 % 1000))
+  f:close ()
+end
+report ("io.open per record", pico.time_us () - t)
+os.remove (path)
+
+pico.flash_stats (nil, true)
+t = pico.time_us ()
+local log = pico.log_open (logdir, 16 * 1024)
+for i = 1, count do
+  log:write (string.format ("%6d reading=%d", i, i * 7 % 1000))
+end
+log:close ()
+report ("pico.log_open", pico.time_us () - t)
+
+-- The log holds only the most recent records, oldest first
+local log = pico.log_open (logdir, 16 * 1024)
+local first, last, n = nil, nil, 0
+for rec in log:lines () do
+  first = first or rec
+  last = rec
+  n = n + 1
+end
+log:close ()
+print (string.format ("log holds %d records, from '%s' to '%s'", n, first, last))
+assert (last == string.format ("%6d reading=%d", count, count * 7 % 1000))
+
+for name in pico.dir (logdir) do os.remove (logdir .. "/" .. name) end
+os.remove (logdir)
@@ -0,0 +1,43 @@
+-- Measure how long it takes to mount the filesystem, as happens at
+--   start-up, with different numbers of files stored. After a clean
+--   unmount, the map of free blocks is saved, so the mount only reads
+--   the directories, to check that the map is still right, and not 
+--   the files' lists of blocks; after a power failure, it scans them
+--   all, which costs most with large files. On
+--   the Linux build, the flash emulator estimates how long each mount
+--   would take on the Pico.
+
+local dir = "/bench_mount"
+local data = string.rep ("x", 300) -- Too big to store inline
+local counts = { 0, 25, 50, 100, 200 }
+
+local function time_mount (checkpoint)
+  pico.remount (checkpoint) -- Settle, so that both runs start alike
+  pico.flash_stats (nil, true)
+  local t = pico.time_us ()
+  pico.remount (checkpoint)
+  t = pico.time_us () - t
+  local s = pico.flash_stats ()
+  if s and s.busy_us > 0 then
+    return string.format ("%6d us, est. %6d us, %5d reads", t, s.busy_us,
+      s.reads)
+  end
+  return string.format ("%6d us", t)
+end
+
+pico.mkdir (dir)
+local n = 0
+print (string.format ("%6s  %-40s  %s", "files", "clean unmount",
+  "power failure"))
+for _, count in ipairs (counts) do
+  while n < count do
+    n = n + 1
+    pico.write (dir .. "/f" .. n, data)
+  end
+  local fast = time_mount (true)
+  local slow = time_mount (false)
+  print (string.format ("%6d  %-40s  %s", count, fast, slow))
+end
+
+for i = 1, n do os.remove (dir .. "/f" .. i) end
+os.remove (dir)
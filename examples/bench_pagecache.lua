@@ -0,0 +1,57 @@
+-- Count the flash reads made by some common ways of reading files: a
+--   file read in small pieces, a text file read a line at a time, and
+--   looking up many files in one directory, which reads the same
+--   metadata over and over. Flash pages are cached in RAM, so repeated
+--   reads of the same data should not reach the flash. The counts are
+--   only kept by the Linux build, which also estimates how long the
+--   reads would take on the Pico.
+
+local dir = "/bench_pagecache"
+local files = 40
+
+local function report (name, f)
+  pico.flash_stats (nil, true)
+  local t = pico.time_us ()
+  f ()
+  t = pico.time_us () - t
+  local s = pico.flash_stats ()
+  if s then
+    print (string.format ("%-22s %7d us  %6d reads  %8d bytes  est. %6d us",
+      name, t, s.reads, s.bytes_read, s.busy_us))
+  else
+    print (string.format ("%-22s %7d us", name, t))
+  end
+end
+
+pico.mkdir (dir)
+local line = "0123456789 abcdefghijklmnopqrstuvwxyz 0123456789\n"
+pico.write (dir .. "/text", string.rep (line, 400))
+for i = 1, files do
+  pico.write (dir .. "/f" .. i, "file " .. i)
+end
+pico.remount () -- Close everything, and start with an empty cache
+
+report ("pico.read 64 bytes", function ()
+  local size = pico.stat (dir .. "/text").size
+  for off = 0, size - 64, 64 do pico.read (dir .. "/text", off, 64) end
+end)
+
+report ("io.lines", function ()
+  local n = 0
+  for l in io.lines (dir .. "/text") do n = n + 1 end
+  assert (n == 400)
+end)
+
+report ("stat " .. files .. " files x 5", function ()
+  for r = 1, 5 do
+    for i = 1, files do pico.stat (dir .. "/f" .. i) end
+  end
+end)
+
+report ("read " .. files .. " small files", function ()
+  for i = 1, files do pico.read (dir .. "/f" .. i) end
+end)
+
+for i = 1, files do os.remove (dir .. "/f" .. i) end
+os.remove (dir .. "/text")
+os.remove (dir)
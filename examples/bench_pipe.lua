@@ -0,0 +1,50 @@
+-- Compare passing data from one Lua program to another through a pipe,
+--   with writing it to a temporary file, and reading it back. The pipe
+--   holds only a few hundred bytes at a time, and the two programs take
+--   turns to fill and empty it, so nothing is written to flash.
+
+local lines = 2000
+local times = 5
+
+pico.write ("/bin/bench_gen.lua", [[
+local n = tonumber (arg[1])
+local f = arg[2] and io.open (arg[2], "w") or io.stdout
+for i = 1, n do
+  f:write ("line ", i, " of the data passed between two programs\n")
+end
+if f ~= io.stdout then f:close () end
+]])
+
+pico.write ("/bin/bench_count.lua", [[
+local n, bytes = 0, 0
+for l in io.lines (arg[1]) do
+  n = n + 1
+  bytes = bytes + #l + 1
+end
+]])
+
+local function report (name, runs, f)
+  pico.flash_stats (nil, true)
+  local t = pico.time_us ()
+  for i = 1, runs do f () end
+  t = pico.time_us () - t
+  local s = pico.flash_stats ()
+  if s then
+    print (string.format ("%-16s %8d us per run, %5d reads, est. %6d us",
+      name, t // runs, s.reads, s.busy_us))
+  else
+    print (string.format ("%-16s %8d us per run", name, t // runs))
+  end
+end
+
+report ("through a pipe", times, function ()
+  pico.execute ("bench_gen " .. lines .. " | bench_count")
+end)
+report ("through a file", times, function ()
+  pico.execute ("bench_gen " .. lines .. " /bench_pipe.tmp")
+  pico.execute ("bench_count /bench_pipe.tmp")
+end)
+
+os.remove ("/bench_pipe.tmp")
+os.remove ("/bin/bench_gen.lua")
+os.remove ("/bin/bench_count.lua")
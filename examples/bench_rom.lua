@@ -0,0 +1,38 @@
+-- Compare loading and reading a file from the read-only image at /rom
+--   with loading and reading a copy of it on the flash filesystem. Files
+--   in /rom are read directly from where the firmware is stored, so
+--   they shouldn't cause any filesystem reads at all. The counts are 
+--   only kept by the Linux build, which also estimates how long the 
+--   reads would take on the Pico.
+
+local rom = "/rom/bin/blink.lua"
+local copy = "/bench_rom.lua"
+local times = 200
+
+local function report (name, f)
+  pico.remount () -- Start with an empty cache
+  pico.flash_stats (nil, true)
+  local t = pico.time_us ()
+  f ()
+  t = pico.time_us () - t
+  local s = pico.flash_stats ()
+  if s then
+    print (string.format ("%-22s %7d us  %6d reads  est. %6d us",
+      name, t, s.reads, s.busy_us))
+  else
+    print (string.format ("%-22s %7d us", name, t))
+  end
+end
+
+pico.write (copy, pico.read (rom))
+for _, file in ipairs { rom, copy } do
+  report ("loadfile " .. (file == rom and "/rom" or "flash"), function ()
+    for i = 1, times do assert (loadfile (file)) end
+  end)
+  report ("io.lines " .. (file == rom and "/rom" or "flash"), function ()
+    for i = 1, times do 
+      for l in io.lines (file) do end
+    end
+  end)
+end
+os.remove (copy)
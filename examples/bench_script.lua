@@ -0,0 +1,47 @@
+-- Measure how long it takes to run a shell script that loops, as the
+--   same script is run over and over. The first run reads and compiles
+--   the script. After that it is run from the cache of compiled
+--   scripts, without reading the file at all -- unless something in
+--   the filesystem has changed, in which case the file is read again,
+--   but not compiled again unless it is different.
+
+local script = "/bin/bench_script.sh"
+local times = 20
+
+local text = [[
+n=0
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  if [ $i -le 5 ]; then
+    n=$i
+  elif test $i = 10; then
+    true
+  else
+    continue
+  fi
+done
+]]
+
+local function report (name, runs, f)
+  pico.flash_stats (nil, true)
+  local t = pico.time_us ()
+  for i = 1, runs do f () end
+  t = pico.time_us () - t
+  local s = pico.flash_stats ()
+  if s then
+    print (string.format ("%-24s %6d us per run, %5d reads, est. %6d us",
+      name, t // runs, s.reads, s.busy_us))
+  else
+    print (string.format ("%-24s %6d us per run", name, t // runs))
+  end
+end
+
+pico.write (script, text)
+report ("first run", 1, function () pico.execute ("bench_script") end)
+report ("cached", times, function () pico.execute ("bench_script") end)
+report ("after another write", times, function ()
+  pico.write ("/bench_script.tmp", "x")
+  pico.execute ("bench_script")
+end)
+
+os.remove ("/bench_script.tmp")
+os.remove (script)
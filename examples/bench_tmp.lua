@@ -0,0 +1,45 @@
+-- Compare the RAM filesystem at /tmp with the flash, by doing the same
+--   work in each: writing and reading back many small files, and
+--   appending to a log a line at a time. On the Linux build, the flash
+--   emulator also estimates how long the same work would take on the
+--   Pico; /tmp should cause no flash operations at all.
+
+local chunk = string.rep ("0123456789abcdef", 16)
+local files = 20
+local lines = 200
+
+local function run (dir)
+  pico.mkdir (dir)
+  pico.flash_stats (nil, true)
+  local t = pico.time_us ()
+  for i = 1, files do
+    pico.write (dir .. "/f" .. i, chunk)
+  end
+  local total = 0
+  for i = 1, files do
+    total = total + #pico.read (dir .. "/f" .. i)
+  end
+  assert (total == files * #chunk)
+  local f = assert (io.open (dir .. "/log", "w"))
+  for i = 1, lines do
+    f:write ("line ", i, "\n")
+    f:flush ()
+  end
+  f:close ()
+  t = pico.time_us () - t
+  local s = pico.flash_stats ()
+  local d = pico.df (dir)
+  print (string.format ("%-12s %6d us, used %6d of %6d bytes", dir, t,
+    d.used, d.total))
+  if s and s.busy_us > 0 then
+    print (string.format ("  estimated on the Pico: %d ms, %d programs, %d erases",
+      s.busy_us // 1000, s.progs, s.erases))
+  end
+  for i = 1, files do os.remove (dir .. "/f" .. i) end
+  os.remove (dir .. "/log")
+end
+
+run ("/tmp/bench")
+run ("/bench_tmp")
+os.remove ("/tmp/bench")
+os.remove ("/bench_tmp")
@@ -0,0 +1,47 @@
+-- Fade LEDs up and down using timer-driven PWM ramps. Unlike led_fade.lua,
+--   the Lua program does not have to step the levels itself, so it can
+--   fade several pins at once, and do other work meanwhile.
+-- On the host build, the PWM level changes are recorded, and the script
+--   reports how closely the ramp followed the requested timing.
+
+pins = {25, 15}
+duration = 1000
+
+for _, pin in ipairs (pins) do
+  pico.pwm_pin_init (pin)
+end
+
+function wait_ramps ()
+  for _, pin in ipairs (pins) do
+    while pico.pwm_ramp_active (pin) do
+      pico.sleep_ms (10)
+    end
+  end
+end
+
+pico.pwm_trace (true)
+for i=0,2
+do
+  pico.pwm_ramp (pins[1], 0, 65535, duration, "quad")
+  pico.pwm_ramp (pins[2], 65535, 0, duration / 2)
+  wait_ramps ()
+  pico.pwm_ramp (pins[1], 65535, 0, duration, "quad")
+  pico.pwm_ramp (pins[2], 0, 65535, duration / 2, "smooth")
+  wait_ramps ()
+end
+pico.pwm_trace (false)
+
+-- Report the time taken by the first ramp on the first pin
+local trace = pico.pwm_trace ()
+local first, last
+for _, e in ipairs (trace) do
+  if e[2] == pins[1] then
+    if first == nil then first = e[1] end
+    if e[3] == 65535 then last = e[1] break end
+  end
+end
+if first and last then
+  print ("Requested " .. duration .. " ms, took " 
+    .. math.floor ((last - first) / 1000) .. " ms, " 
+    .. #trace .. " level changes in total")
+end
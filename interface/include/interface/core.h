@@ -0,0 +1,58 @@
+/*============================================================================
+ * core.h
+ *
+ * Running Lua on the second core. While a program runs there, the first
+ * core looks after the terminal: it sends what the program writes, which
+ * is passed to it through a queue, and puts what is typed into another
+ * queue, noting the interrupt key as it goes, so that the program never
+ * waits for the USB, and checking for the interrupt key costs it no more
+ * than reading a flag. Each queue has one writer and one reader, so
+ * neither needs a lock. The host build runs the program in a second
+ * thread.
+ *
+ * Copyright (c)2021 Kevin Boone.
+ * =========================================================================*/
+
+#pragma once
+
+#include <stddef.h>
+#include <klib/defs.h>
+
+/** A function that can be run on the second core. */
+typedef int (*InterfaceCoreFn) (int argc, char **argv);
+
+BEGIN_DECLS
+
+/** Run fn on the second core, and look after the terminal until it
+    returns. If it's already running on the second core, or there isn't
+    one, fn is just called. Returns what fn returns. */
+extern int  interface_core_run (InterfaceCoreFn fn, int argc, char **argv);
+
+/** TRUE if the caller is the program on the second core, whose terminal
+    input and output go through the queues. */
+extern BOOL interface_core_active (void);
+
+/** Queue output for the first core to write to the terminal, waiting
+    for room if the queue is full. */
+extern void interface_core_write (const char *s, size_t len);
+
+/** Get a character typed at the terminal, or -1 if there is nothing
+    yet. On the first core, once the program has finished, this gets
+    what was typed but not read by it. */
+extern int  interface_core_get_char (void);
+
+/** TRUE if the interrupt key has been pressed since the last call. Any
+    characters typed before it are thrown away, as a terminal does. */
+extern BOOL interface_core_interrupt (void);
+
+/** Stop the first core, while the program on the second writes the
+    flash, which the first core runs from. Does nothing on the first
+    core, or in the host build. */
+extern void interface_core_lockout_start (void);
+extern void interface_core_lockout_end (void);
+
+/** Set up the second core; called by interface_init. */
+extern void interface_core_init (void);
+
+END_DECLS
+
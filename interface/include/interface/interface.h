@@ -66,21 +66,114 @@
 //   is safer, but might irritate the user
 #define I_ESC_TIMEOUT 100
 
+// The number of GPIO pins that can be addressed by the PWM ramp engine
+//   and the host PWM trace
+#define INTERFACE_GPIO_COUNT 30
+
+// Maximum number of PWM level changes that the host build will record
+//   in its trace buffer. The device build does not record a trace
+#define INTERFACE_PWM_TRACE_MAX 2048
+
+#if PICO_ON_DEVICE
+#define INTERFACE_CYCLES_MASK 0x00FFFFFF
+#else
+#define INTERFACE_CYCLES_MASK 0xFFFFFFFF
+#endif
+
 #define INTERFACE_STORAGE_BLOCK_SIZE 4096
 //TODO
 #define INTERFACE_STORAGE_BLOCK_COUNT 300 
 
+// Timings used by the host flash emulator to estimate how long the 
+//   same operations would take on the device. These are typical 
+//   figures for the W25Q16JV flash on the Pico, plus the cost of 
+//   leaving and re-entering XIP mode for every erase or program
+#define INTERFACE_FLASH_PAGE_SIZE 256
+#define INTERFACE_FLASH_PAGE_PROG_US 400
+#define INTERFACE_FLASH_ERASE_US 45000
+#define INTERFACE_FLASH_OVERHEAD_US 20
+#define INTERFACE_FLASH_READ_NS_PER_BYTE 50
+
 BEGIN_DECLS
 
+/** A function called periodically by the interface timer. Return FALSE
+    to stop the timer. On the device this is called in interrupt 
+    context, so it must not block or allocate. */
+typedef BOOL (*InterfaceTimerFn)(void);
+
+/** A function called repeatedly while interface_get_char() waits for 
+    input, to do background work. Return TRUE if it did anything, and 
+    might have more to do. */
+typedef BOOL (*InterfaceIdleFn)(void);
+
+/** While a command's input is a pipe, interface_get_char() reads from
+    the pipe through these functions, instead of from the terminal.
+    get_char returns the next character, waiting for it to be written
+    if necessary, or EOF at the end. ready returns TRUE if want 
+    characters, or a whole line if want is zero, or everything if it 
+    is negative, can be read without waiting, so that a Lua program 
+    can yield, instead of waiting, if they can't. */
+typedef struct _InterfaceInput
+  {
+  int (*get_char) (void *data);
+  BOOL (*ready) (void *data, int want);
+  void *data;
+  } InterfaceInput;
+
+/** While a command's output is a pipe, everything written to the 
+    terminal goes here instead. */
+typedef struct _InterfaceOutput
+  {
+  void (*write) (void *data, const char *s, int len);
+  void *data;
+  } InterfaceOutput;
+
+/** One entry in the PWM trace that is recorded by the host build. */
+typedef struct _InterfacePwmTraceEntry
+  {
+  uint32_t time_us;
+  uint8_t pin;
+  uint16_t level;
+  } InterfacePwmTraceEntry;
+
+/** Counts of flash operations, for one block or for the whole storage
+    area. busy_us is the time the operations would take on the device.
+    Only the host build keeps these. */
+typedef struct _InterfaceFlashStats
+  {
+  uint32_t reads;
+  uint32_t progs;
+  uint32_t erases;
+  uint32_t bytes_read;
+  uint32_t bytes_progged;
+  uint32_t violations;   // Programs of bytes that were not erased
+  uint64_t busy_us;
+  } InterfaceFlashStats;
+
 extern void  interface_init (void);
 extern int   interface_get_char (void);
 extern int   interface_get_char_timeout (int msec);
+/** Set the function that interface_get_char calls while it waits, or
+    NULL for none. */
+extern void  interface_set_idle_fn (InterfaceIdleFn fn);
 extern void  interface_write_endl (void);
 extern void  interface_write_char (char c);
 extern void  interface_write_buff (const char *s, int len);
 extern void  interface_write_string (const char *s);
 extern void  interface_cleanup (void);
 extern void  interface_write_stringln (const char *str);
+/** Write what a Lua program prints, without flushing it, as the 
+    C library's stdout would. */
+extern void  interface_write_stdout (const char *s, size_t len);
+/** Write an error message, formatted by printf from fmt and s, to the
+    terminal, even if the output is a pipe. */
+extern void  interface_write_error (const char *fmt, const char *s);
+/** Set where input comes from, or NULL for the terminal */
+extern void  interface_set_input (const InterfaceInput *input);
+extern const InterfaceInput *interface_get_input (void);
+/** Set where output goes, or NULL for the terminal */
+extern void  interface_set_output (const InterfaceOutput *output);
+extern const InterfaceOutput *interface_get_output (void);
 
 // LittleFS interface functions
 extern BOOL interface_block_init ();
@@ -95,6 +188,13 @@ extern int interface_block_read (const struct lfs_config *cfg,
              lfs_block_t block, lfs_off_t off, void *buffer, 
 	     lfs_size_t size);
 
+/** Get the flash statistics for one block, or for all blocks if block is
+    negative. Returns FALSE if there are no statistics (on the device), or
+    the block number is out of range. */
+extern BOOL interface_flash_stats (int32_t block, 
+             InterfaceFlashStats *stats);
+extern void interface_flash_stats_reset (void);
+
 // Return TRUE is the interrupt key was pressed. Don't block.
 extern BOOL interface_is_interrupt_key (void);
 
@@ -112,7 +212,15 @@ extern void interface_gpio_set_function (uint8_t pin, uint8_t function);
 extern void interface_gpio_pull_up (uint8_t pin);
 
 extern void interface_sleep_ms (uint32_t val);
-extern uint32_t interface_time_ms ();
+extern uint32_t interface_time_ms (void);
+/** Microseconds since start-up. */
+extern uint64_t interface_time_us (void);
+/** A free-running counter for timing very short intervals. On the Pico
+    it counts CPU clock cycles, but is only 24 bits wide, so it wraps
+    about every 130 msec at the default clock rate; use 
+    INTERFACE_CYCLES_MASK when subtracting. The host build counts
+    nanoseconds. */
+extern uint32_t interface_cycles (void);
 
 extern void interface_i2c_init (uint8_t port, uint32_t baud);
 extern ErrCode interface_i2c_write_read (uint8_t port, uint8_t addr, 
@@ -123,6 +231,23 @@ extern ErrCode interface_i2c_write_read (uint8_t port, uint8_t addr,
 extern void interface_pwm_pin_init (uint8_t pin);
 extern void interface_pwm_pin_set_level (uint8_t pin, uint16_t level);
 
+/** Start or stop recording calls to interface_pwm_pin_set_level. Starting
+    clears any existing trace. Only the host build records anything. */
+extern void interface_pwm_trace_enable (BOOL enable);
+/** Copy up to max recorded trace entries into entries, and clear the
+    trace. Returns the number of entries copied. */
+extern int  interface_pwm_trace_read (InterfacePwmTraceEntry *entries, 
+              int max);
+
+/** Start a repeating timer that calls fn every period_ms milliseconds,
+    until fn returns FALSE. There is only one timer; it must not be
+    started again while it is running. */
+extern BOOL interface_timer_start (uint32_t period_ms, InterfaceTimerFn fn);
+/** Prevent the timer function running, while the caller changes data 
+    that it shares with the timer function. These calls do not nest. */
+extern void interface_timer_lock (void);
+extern void interface_timer_unlock (void);
+
 extern ErrCode interface_i2cdetect (uint8_t pin1, uint8_t pin2);
 
 END_DECLS
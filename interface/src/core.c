@@ -0,0 +1,455 @@
+/*=========================================================================
+
+  picolua
+
+  interface/core.c
+
+  Running Lua on the second core. The queues have free-running counts
+  of the bytes put in and taken out, each changed only by one side, so
+  the number in a queue is the difference, and no lock is needed: a
+  side reads the other's count with acquire, and publishes its own
+  with release, once the bytes themselves are written or read. Only
+  loads and stores are used, as the M0+ has no atomic read-modify-write.
+
+  (c)2021 Kevin Boone, GPLv3.0
+
+=========================================================================*/
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+
+#if PICO_ON_DEVICE
+#include "pico/multicore.h"
+#include "hardware/sync.h"
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#endif
+
+#include <klib/defs.h>
+#include <config.h>
+#include "interface/interface.h"
+#include "interface/core.h"
+
+typedef struct _CoreQueue
+  {
+  uint32_t in;                  // Bytes ever put in; changed by the writer
+  uint32_t out;                 // Bytes ever taken out; by the reader
+  uint32_t size;                // A power of two
+  uint8_t *buff;
+  } CoreQueue;
+
+static uint8_t out_buff [INTERFACE_CORE_OUT_SIZE];
+static uint8_t in_buff [INTERFACE_CORE_IN_SIZE];
+static CoreQueue out_queue = { 0, 0, INTERFACE_CORE_OUT_SIZE, out_buff };
+static CoreQueue in_queue = { 0, 0, INTERFACE_CORE_IN_SIZE, in_buff };
+
+// Set by the first core when the interrupt key is pressed, and cleared
+//   by the second when it sees it
+static uint32_t interrupt_key = 0;
+// Set by the second core when the program has finished
+static uint32_t done = 0;
+static BOOL running = FALSE;
+
+static InterfaceCoreFn core_fn;
+static int core_argc;
+static char **core_argv;
+static int core_result;
+
+#if PICO_ON_DEVICE
+static uint32_t core1_stack [INTERFACE_CORE1_STACK_SIZE / sizeof (uint32_t)];
+#else
+static pthread_t core_thread_id;
+static __thread BOOL on_core1 = FALSE;
+static BOOL stdin_eof = FALSE;
+// The host's WFE and SEV: the first core sets sleeping, and waits for 
+//   the pipe, which the second writes to if it's set
+static int wake_pipe [2] = { -1, -1 };
+static uint32_t sleeping = 0;
+#endif
+
+/*=========================================================================
+
+  queue_put
+
+  Put as many of the bytes as there is room for. Returns the number put.
+
+=========================================================================*/
+static size_t queue_put (CoreQueue *q, const char *s, size_t len)
+  {
+  uint32_t in = q->in;
+  uint32_t room = q->size - (in - __atomic_load_n (&q->out, __ATOMIC_ACQUIRE));
+  if (len > room) len = room;
+  uint32_t i = in & (q->size - 1);
+  size_t first = q->size - i;
+  if (first > len) first = len;
+  memcpy (q->buff + i, s, first);
+  memcpy (q->buff, s + first, len - first);
+  __atomic_store_n (&q->in, in + (uint32_t)len, __ATOMIC_RELEASE);
+  return len;
+  }
+
+/*=========================================================================
+
+  queue_get
+
+  Take up to max bytes. Returns the number taken.
+
+=========================================================================*/
+static size_t queue_get (CoreQueue *q, char *s, size_t max)
+  {
+  uint32_t out = q->out;
+  size_t len = __atomic_load_n (&q->in, __ATOMIC_ACQUIRE) - out;
+  if (len > max) len = max;
+  uint32_t i = out & (q->size - 1);
+  size_t first = q->size - i;
+  if (first > len) first = len;
+  memcpy (s, q->buff + i, first);
+  memcpy (s + first, q->buff, len - first);
+  __atomic_store_n (&q->out, out + (uint32_t)len, __ATOMIC_RELEASE);
+  return len;
+  }
+
+/*=========================================================================
+
+  queue_clear
+
+  Throw away what's in the queue; called by the reader.
+
+=========================================================================*/
+static void queue_clear (CoreQueue *q)
+  {
+  __atomic_store_n (&q->out, __atomic_load_n (&q->in, __ATOMIC_ACQUIRE),
+    __ATOMIC_RELEASE);
+  }
+
+/*=========================================================================
+
+  core_poll_key
+
+  Get a key from the terminal, without waiting
+
+=========================================================================*/
+static int core_poll_key (void)
+  {
+#if PICO_ON_DEVICE
+  return getchar_timeout_us (0);
+#else
+  if (stdin_eof) return -1;
+  struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+  if (poll (&p, 1, 0) <= 0) return -1;
+  int c = getchar ();
+  if (c < 0) stdin_eof = TRUE;
+  return c;
+#endif
+  }
+
+/*=========================================================================
+
+  core_signal
+
+  The second core tells the first that there is something for it to do
+
+=========================================================================*/
+static void core_signal (void)
+  {
+#if PICO_ON_DEVICE
+  __sev ();
+#else
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&sleeping, __ATOMIC_RELAXED))
+    {
+    char c = 0;
+    if (write (wake_pipe[1], &c, 1) < 0) {} // Full is as good as written
+    }
+#endif
+  }
+
+/*=========================================================================
+
+  core_sleep
+
+  The first core waits for the second, or for a key, or for at most 
+  INTERFACE_CORE_POLL_US. The event that wakes it might come after it
+  last looked, but not after it's decided to sleep.
+
+=========================================================================*/
+static void core_sleep (void)
+  {
+#if PICO_ON_DEVICE
+  // Interrupts, including the USB's, wake the core as well as an event
+  best_effort_wfe_or_timeout (make_timeout_time_us (INTERFACE_CORE_POLL_US));
+#else
+  __atomic_store_n (&sleeping, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&out_queue.in, __ATOMIC_RELAXED) == out_queue.out
+       && !__atomic_load_n (&done, __ATOMIC_RELAXED))
+    {
+    struct pollfd p[2] = { { wake_pipe[0], POLLIN, 0 }, 
+                           { STDIN_FILENO, POLLIN, 0 } };
+    poll (p, stdin_eof ? 1 : 2, (INTERFACE_CORE_POLL_US + 999) / 1000);
+    }
+  __atomic_store_n (&sleeping, 0, __ATOMIC_RELAXED);
+  char buff [16];
+  while (read (wake_pipe[0], buff, sizeof (buff)) > 0) {}
+#endif
+  }
+
+/*=========================================================================
+
+  core_pump
+
+  The first core's work while the program runs: write a chunk of its
+  output, then look for a key, so that the interrupt key is seen
+  however much is being written. The terminal is read even when there
+  is no room for another key, so that the interrupt key is still seen;
+  other keys typed then are dropped, as a terminal drops type-ahead
+  that it has no room for.
+
+=========================================================================*/
+static void core_pump (void)
+  {
+  char buff [INTERFACE_CORE_CHUNK];
+  for (;;)
+    {
+    BOOL finished = __atomic_load_n (&done, __ATOMIC_ACQUIRE);
+    BOOL busy = FALSE;
+    size_t n = queue_get (&out_queue, buff, sizeof (buff));
+    if (n > 0)
+      {
+      fwrite (buff, 1, n, stdout);
+      fflush (stdout);
+      busy = TRUE;
+      }
+    int key = core_poll_key ();
+    if (key >= 0)
+      {
+      char c = (char)key;
+      if (key == I_INTR)
+        __atomic_store_n (&interrupt_key, 1, __ATOMIC_RELEASE);
+      queue_put (&in_queue, &c, 1);
+      busy = TRUE;
+      }
+    // Anything written before the program finished has been taken
+    if (finished && n == 0) break;
+    if (!busy) core_sleep ();
+    }
+  }
+
+/*=========================================================================
+
+  core_wait
+
+  The second core waits for the first
+
+=========================================================================*/
+static void core_wait (void)
+  {
+#if PICO_ON_DEVICE
+  tight_loop_contents ();
+#else
+  sched_yield ();
+#endif
+  }
+
+#if PICO_ON_DEVICE
+/*=========================================================================
+
+  core_entry
+
+  Core 1 isn't stopped when the function returns, but waits to be
+  reset, before it's launched again.
+
+=========================================================================*/
+static void core_entry (void)
+  {
+  core_result = core_fn (core_argc, core_argv);
+  __atomic_store_n (&done, 1, __ATOMIC_RELEASE);
+  core_signal ();
+  for (;;)
+    __wfe ();
+  }
+#else
+/*=========================================================================
+
+  core_thread
+
+=========================================================================*/
+static void *core_thread (void *arg)
+  {
+  (void)arg;
+  on_core1 = TRUE;
+  core_result = core_fn (core_argc, core_argv);
+  __atomic_store_n (&done, 1, __ATOMIC_RELEASE);
+  core_signal ();
+  return NULL;
+  }
+#endif
+
+/*=========================================================================
+
+  interface_core_init
+
+=========================================================================*/
+void interface_core_init (void)
+  {
+#if PICO_ON_DEVICE
+  // Core 1 has to stop this core while it writes the flash that this
+  //   core runs from
+  multicore_lockout_victim_init ();
+#else
+  // Every character is read with read(), so that poll() tells the truth
+  setvbuf (stdin, NULL, _IONBF, 0);
+#endif
+  }
+
+/*=========================================================================
+
+  core_start
+
+  Returns FALSE if the second core (thread) can't be used
+
+=========================================================================*/
+static BOOL core_start (void)
+  {
+#if PICO_ON_DEVICE
+  multicore_reset_core1 ();
+  multicore_launch_core1_with_stack (core_entry, core1_stack,
+    sizeof (core1_stack));
+  return TRUE;
+#else
+  if (wake_pipe[0] < 0)
+    {
+    if (pipe (wake_pipe) != 0) return FALSE;
+    fcntl (wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl (wake_pipe[1], F_SETFL, O_NONBLOCK);
+    }
+  return pthread_create (&core_thread_id, NULL, core_thread, NULL) == 0;
+#endif
+  }
+
+/*=========================================================================
+
+  interface_core_run
+
+=========================================================================*/
+int interface_core_run (InterfaceCoreFn fn, int argc, char **argv)
+  {
+#if !PICO_ON_DEVICE
+  // The host build can run everything in one thread, for comparison
+  if (getenv ("PICOLUA_ONE_CORE")) return fn (argc, argv);
+#endif
+  if (!INTERFACE_LUA_CORE1 || running) return fn (argc, argv);
+
+  core_fn = fn;
+  core_argc = argc;
+  core_argv = argv;
+  __atomic_store_n (&interrupt_key, 0, __ATOMIC_RELAXED);
+  __atomic_store_n (&done, 0, __ATOMIC_RELAXED);
+  running = TRUE;
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (!core_start ())
+    {
+    running = FALSE;
+    return fn (argc, argv);
+    }
+  core_pump ();
+#if !PICO_ON_DEVICE
+  pthread_join (core_thread_id, NULL);
+#endif
+  running = FALSE;
+  return core_result;
+  }
+
+/*=========================================================================
+
+  interface_core_active
+
+=========================================================================*/
+BOOL interface_core_active (void)
+  {
+#if PICO_ON_DEVICE
+  return running && get_core_num () == 1;
+#else
+  return on_core1;
+#endif
+  }
+
+/*=========================================================================
+
+  interface_core_write
+
+=========================================================================*/
+void interface_core_write (const char *s, size_t len)
+  {
+  size_t n;
+  while ((n = queue_put (&out_queue, s, len)) < len)
+    {
+    s += n;
+    len -= n;
+    core_signal ();
+    core_wait ();
+    }
+  core_signal ();
+  }
+
+/*=========================================================================
+
+  interface_core_get_char
+
+  Once the program has finished, the first core is the only reader, so
+  it can take what's left.
+
+=========================================================================*/
+int interface_core_get_char (void)
+  {
+  char c;
+  if (!queue_get (&in_queue, &c, 1)) return -1;
+  if (c == I_INTR)
+    __atomic_store_n (&interrupt_key, 0, __ATOMIC_RELEASE);
+  return (uint8_t)c;
+  }
+
+/*=========================================================================
+
+  interface_core_interrupt
+
+=========================================================================*/
+BOOL interface_core_interrupt (void)
+  {
+  if (!__atomic_load_n (&interrupt_key, __ATOMIC_ACQUIRE)) return FALSE;
+  __atomic_store_n (&interrupt_key, 0, __ATOMIC_RELEASE);
+  queue_clear (&in_queue);
+  return TRUE;
+  }
+
+/*=========================================================================
+
+  interface_core_lockout_start
+
+=========================================================================*/
+void interface_core_lockout_start (void)
+  {
+#if PICO_ON_DEVICE
+  if (interface_core_active ())
+    multicore_lockout_start_blocking ();
+#endif
+  }
+
+/*=========================================================================
+
+  interface_core_lockout_end
+
+=========================================================================*/
+void interface_core_lockout_end (void)
+  {
+#if PICO_ON_DEVICE
+  if (interface_core_active ())
+    multicore_lockout_end_blocking ();
+#endif
+  }
+
@@ -1,17 +1,21 @@
 #include <stdio.h> 
+#include "pico/stdlib.h" 
 
 #if PICO_ON_DEVICE
-#include "pico/stdlib.h" 
 #include "hardware/gpio.h" 
 #include "hardware/flash.h" 
 #include "hardware/sync.h" 
 #include "hardware/adc.h" 
 #include "hardware/pwm.h" 
 #include "hardware/i2c.h" 
+#include "hardware/structs/systick.h" 
 #endif
 
+#include <string.h> 
+#include <stdlib.h> 
 #include <klib/defs.h> 
 #include "interface/interface.h"
+#include "interface/core.h"
 #include "shell/shell.h"
 #include <libluapico/picoutils.h> 
 
@@ -22,16 +26,73 @@ extern uint32_t __flash_binary_start;
 #define FLASH_STORAGE_OFFSET 0x60000
 #define FLASH_START_MEM 0x10000000
 #define FLASH_STORAGE_START_MEM (FLASH_START_MEM + FLASH_STORAGE_OFFSET)
+// The timer function runs on the first core, even when it's started by
+//   a program on the second, so it's shut out with a spin lock, and not
+//   just by disabling interrupts
+static spin_lock_t *timer_spin;
 #else
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
 struct termios orig_termios;
 #define BLOCKFILE "/tmp/picolua.blockdev"
+#define BLOCKFILE_SIZE \
+   ((off_t)INTERFACE_STORAGE_BLOCK_SIZE * INTERFACE_STORAGE_BLOCK_COUNT)
 int blockfd = -1;
+// The emulated flash is the block file, mapped into memory 
+static uint8_t *flash = NULL;
+static InterfaceFlashStats flash_block_stats [INTERFACE_STORAGE_BLOCK_COUNT];
+static InterfaceFlashStats flash_total_stats;
+// If TRUE, flash operations really take as long as they would on the 
+//   device. Set by the environment variable PICOLUA_FLASH_DELAY 
+static BOOL flash_delay = FALSE;
+static pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pwm_trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static InterfacePwmTraceEntry pwm_trace [INTERFACE_PWM_TRACE_MAX];
+static int pwm_trace_count = 0;
+static BOOL pwm_trace_enabled = FALSE;
+static struct timespec pwm_trace_start;
 #endif 
 
+static InterfaceTimerFn timer_fn = NULL;
+static InterfaceIdleFn idle_fn = NULL;
+static const InterfaceInput *input = NULL;
+static const InterfaceOutput *output = NULL;
+static uint32_t timer_period_ms = 0;
+
+/*===========================================================================
+
+  interface_poll_char
+
+  Get a key without waiting, or -1. Keys typed while a program ran on
+  the second core, that it didn't read, come first.
+
+===========================================================================*/
+static int interface_poll_char (void)
+  {
+  int c = interface_core_get_char ();
+  if (c >= 0 || interface_core_active ()) return c;
+#if PICO_ON_DEVICE
+  return getchar_timeout_us (0);
+#else
+  // Don't wait, as the device doesn't, so that the idle function runs
+  //   as often
+  struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+  if (poll (&p, 1, 0) <= 0) return -1;
+  // A read that times out looks like the end of the file, which the C
+  //   library would remember, and never read again
+  if ((c = getchar ()) < 0) clearerr (stdin);
+  return c;
+#endif
+  }
+
 /*===========================================================================
 
   interface_get_char
@@ -39,26 +100,40 @@ int blockfd = -1;
 ===========================================================================*/
 int interface_get_char (void)
   {
+  if (input)
+    return input->get_char (input->data);
 #if PICO_ON_DEVICE
   int c;
-  while ((c = getchar_timeout_us (0)) < 0)
+  while ((c = interface_poll_char ()) < 0)
     {
     // gpio_put (LED_PIN, 1);
     // sleep_ms (50);
     // gpio_put (LED_PIN, 0);
-    sleep_ms (1); 
+    if (!idle_fn || !idle_fn ())
+      sleep_ms (1); 
     }
   return c;
 #else
   int c;
-  while ((c = getchar ()) < 0)
+  while ((c = interface_poll_char ()) < 0)
     {
-    usleep (10000); 
+    if (!idle_fn || !idle_fn ())
+      usleep (10000); 
     }
   return c;
 #endif
   }
 
+/*===========================================================================
+
+  interface_set_idle_fn
+
+===========================================================================*/
+void interface_set_idle_fn (InterfaceIdleFn fn)
+  {
+  idle_fn = fn;
+  }
+
 /*===========================================================================
 
   interface_get_char_timeout
@@ -66,10 +141,12 @@ int interface_get_char (void)
 ===========================================================================*/
 int interface_get_char_timeout (int msec)
   {
+  if (input)
+    return interface_get_char ();
 #if PICO_ON_DEVICE
   int c;
   int loops = 0;
-  while ((c = getchar_timeout_us (0)) < 0 && loops < msec)
+  while ((c = interface_poll_char ()) < 0 && loops < msec)
     {
     sleep_us (1000);
     loops++;
@@ -79,7 +156,7 @@ int interface_get_char_timeout (int msec)
   (void)msec;
   int c;
   int loops = 0;
-  while ((c = getchar ()) < 0 && loops < msec)
+  while ((c = interface_poll_char ()) < 0 && loops < msec)
     {
     usleep (1000);
     loops++;
@@ -98,6 +175,11 @@ void interface_init (void)
 #if PICO_ON_DEVICE
   gpio_init (LED_PIN);
   gpio_set_dir (LED_PIN, GPIO_OUT);
+  // Run SysTick freely from the processor clock, for interface_cycles()
+  systick_hw->rvr = INTERFACE_CYCLES_MASK;
+  systick_hw->cvr = 0;
+  systick_hw->csr = 0x5; // ENABLE | CLKSOURCE, no interrupt
+  timer_spin = spin_lock_init (spin_lock_claim_unused (true));
 #else
   tcgetattr (STDIN_FILENO, &orig_termios);
   struct termios raw = orig_termios;
@@ -107,6 +189,7 @@ void interface_init (void)
   raw.c_cc[VMIN] = 0;
   tcsetattr (STDIN_FILENO, TCSAFLUSH, &raw);
 #endif
+  interface_core_init ();
   }
 
 /*===========================================================================
@@ -116,6 +199,16 @@ void interface_init (void)
 ===========================================================================*/
 void interface_write_char (char c)
   {
+  if (output)
+    {
+    output->write (output->data, &c, 1);
+    return;
+    }
+  if (interface_core_active ())
+    {
+    interface_core_write (&c, 1);
+    return;
+    }
 #if PICO_ON_DEVICE
   putchar (c);
 #else
@@ -131,6 +224,16 @@ void interface_write_char (char c)
 ===========================================================================*/
 void interface_write_endl (void)
   {
+  if (output)
+    {
+    output->write (output->data, "\n", 1);
+    return;
+    }
+  if (interface_core_active ())
+    {
+    interface_core_write ("\r\n", 2);
+    return;
+    }
 //#if PICO_ON_DEVICE
   puts ("\r"); // \n should be automatic 
 //#endif
@@ -143,6 +246,16 @@ void interface_write_endl (void)
 ===========================================================================*/
 void interface_write_string (const char *s)
   {
+  if (output)
+    {
+    output->write (output->data, s, (int)strlen (s));
+    return;
+    }
+  if (interface_core_active ())
+    {
+    interface_core_write (s, strlen (s));
+    return;
+    }
 #if PICO_ON_DEVICE
   fputs (s, stdout);
   fflush (stdout);
@@ -175,6 +288,16 @@ void interface_write_stringln (const char *str)
 ===========================================================================*/
 void interface_write_buff (const char *s, int len)
   {
+  if (output)
+    {
+    output->write (output->data, s, len);
+    return;
+    }
+  if (interface_core_active ())
+    {
+    interface_core_write (s, (size_t)len);
+    return;
+    }
 #if PICO_ON_DEVICE
   fwrite (s, len, 1, stdout);
   fflush (stdout);
@@ -184,6 +307,122 @@ void interface_write_buff (const char *s, int len)
 #endif
   }
 
+/*===========================================================================
+
+  interface_write_stdout
+
+===========================================================================*/
+void interface_write_stdout (const char *s, size_t len)
+  {
+  if (output)
+    output->write (output->data, s, (int)len);
+  else if (interface_core_active ())
+    interface_core_write (s, len);
+  else
+    fwrite (s, 1, len, stdout);
+  }
+
+/*===========================================================================
+
+  interface_write_error
+
+  Errors go to the terminal, even while the output is a pipe. The 
+  message is formatted first, so that it goes in order with everything 
+  else written, from whichever core.
+
+===========================================================================*/
+void interface_write_error (const char *fmt, const char *s)
+  {
+  char buff [128];
+  char *msg = buff;
+  int len = snprintf (buff, sizeof (buff), fmt, s);
+  if (len < 0) return;
+  if ((size_t)len >= sizeof (buff))
+    {
+    if (!(msg = malloc ((size_t)len + 1))) return;
+    snprintf (msg, (size_t)len + 1, fmt, s);
+    }
+  const InterfaceOutput *out = output;
+  output = NULL;
+  interface_write_buff (msg, len);
+  output = out;
+  if (msg != buff) free (msg);
+  }
+
+/*===========================================================================
+
+  interface_set_input
+
+===========================================================================*/
+void interface_set_input (const InterfaceInput *in)
+  {
+  input = in;
+  }
+
+/*===========================================================================
+
+  interface_get_input
+
+===========================================================================*/
+const InterfaceInput *interface_get_input (void)
+  {
+  return input;
+  }
+
+/*===========================================================================
+
+  interface_set_output
+
+===========================================================================*/
+void interface_set_output (const InterfaceOutput *out)
+  {
+  output = out;
+  }
+
+/*===========================================================================
+
+  interface_get_output
+
+===========================================================================*/
+const InterfaceOutput *interface_get_output (void)
+  {
+  return output;
+  }
+
+
+#if !PICO_ON_DEVICE
+/*===========================================================================
+
+  interface_flash_account
+
+  Record an operation on the emulated flash, and the time it would have 
+  taken on the device. If flash_delay is set, also take that long.
+
+===========================================================================*/
+static void interface_flash_account (lfs_block_t block, uint32_t reads, 
+      uint32_t progs, uint32_t erases, uint32_t bytes_read, 
+      uint32_t bytes_progged, uint32_t busy_us)
+  {
+  InterfaceFlashStats *stats[2] = 
+    { &flash_block_stats [block], &flash_total_stats };
+  for (int i = 0; i < 2; i++)
+    {
+    stats[i]->reads += reads;
+    stats[i]->progs += progs;
+    stats[i]->erases += erases;
+    stats[i]->bytes_read += bytes_read;
+    stats[i]->bytes_progged += bytes_progged;
+    stats[i]->busy_us += busy_us;
+    }
+  if (flash_delay && busy_us > 0)
+    {
+    struct timespec ts;
+    ts.tv_sec = busy_us / 1000000;
+    ts.tv_nsec = (long)(busy_us % 1000000) * 1000;
+    nanosleep (&ts, NULL);
+    }
+  }
+#endif
 
 /*===========================================================================
 
@@ -201,12 +440,42 @@ BOOL interface_block_init (void)
 
   return TRUE;
 #else
-  blockfd = open (BLOCKFILE, O_RDWR);
+  blockfd = open (BLOCKFILE, O_RDWR | O_CREAT, 0644);
   if (blockfd < 0)
     {
     printf ("Can't open block storage file %s\n", BLOCKFILE);
     return FALSE;
     }
+
+  // A new (or short) block file is extended with erased flash, which
+  //   reads as all ones. 
+  struct stat sb;
+  if (fstat (blockfd, &sb) == 0 && sb.st_size < BLOCKFILE_SIZE)
+    {
+    uint8_t erased [INTERFACE_STORAGE_BLOCK_SIZE];
+    memset (erased, 0xFF, sizeof (erased));
+    lseek (blockfd, sb.st_size, SEEK_SET);
+    for (off_t n = sb.st_size; n < BLOCKFILE_SIZE; n += (off_t)sizeof (erased))
+      {
+      size_t k = BLOCKFILE_SIZE - n < (off_t)sizeof (erased) ? 
+        (size_t)(BLOCKFILE_SIZE - n) : sizeof (erased);
+      if (write (blockfd, erased, k) != (ssize_t)k)
+        break;
+      }
+    }
+
+  void *map = mmap (NULL, (size_t)BLOCKFILE_SIZE, PROT_READ | PROT_WRITE, 
+                MAP_SHARED, blockfd, 0);
+  if (map == MAP_FAILED)
+    {
+    printf ("Can't map block storage file %s\n", BLOCKFILE);
+    close (blockfd);
+    blockfd = -1;
+    return FALSE;
+    }
+  flash = map;
+  flash_delay = getenv ("PICOLUA_FLASH_DELAY") != NULL;
+  interface_flash_stats_reset ();
   return TRUE;
 #endif
   }
@@ -221,7 +490,14 @@ void interface_block_cleanup (void)
 #if PICO_ON_DEVICE
   // Do we have to do anything here?
 #else
+  if (flash)
+    {
+    msync (flash, (size_t)BLOCKFILE_SIZE, MS_SYNC);
+    munmap (flash, (size_t)BLOCKFILE_SIZE);
+    flash = NULL;
+    }
   close (blockfd);
+  blockfd = -1;
 #endif
   }
 
@@ -236,8 +512,8 @@ int interface_block_sync (const struct lfs_config *cfg)
 #if PICO_ON_DEVICE
   // Do we have to do anything here?
 #else
-  (void)cfg;
-  sync();
+  if (flash)
+    msync (flash, (size_t)BLOCKFILE_SIZE, MS_ASYNC);
 #endif
   return 0;
   }
@@ -252,11 +528,19 @@ extern int  interface_block_erase (const struct lfs_config *cfg,
   {
 #if PICO_ON_DEVICE
   (void)cfg;
+  interface_core_lockout_start ();
   uint32_t ints = save_and_disable_interrupts();
   flash_range_erase (FLASH_STORAGE_OFFSET + (block * INTERFACE_STORAGE_BLOCK_SIZE), INTERFACE_STORAGE_BLOCK_SIZE);
   restore_interrupts (ints);
+  interface_core_lockout_end ();
 #else
-  (void)cfg; (void)block;
+  (void)cfg;
+  if (!flash || block >= INTERFACE_STORAGE_BLOCK_COUNT) 
+    return LFS_ERR_IO;
+  memset (flash + (size_t)block * INTERFACE_STORAGE_BLOCK_SIZE, 0xFF, 
+    INTERFACE_STORAGE_BLOCK_SIZE);
+  interface_flash_account (block, 0, 0, 1, 0, 0, 
+    INTERFACE_FLASH_OVERHEAD_US + INTERFACE_FLASH_ERASE_US);
 #endif
   return 0;
   }
@@ -277,28 +561,45 @@ extern int interface_block_prog (const struct lfs_config *cfg,
       ((int)block * (int)cfg->block_size) + (int)off;
   //printf ("PROG %08X %ld %ld %02X %02X\n", mem, size,
   //  block, ((char *)buffer)[0], ((char *)buffer)[1]);
+  interface_core_lockout_start ();
   uint32_t ints = save_and_disable_interrupts();
   flash_range_program ((uint32_t)mem, buffer, size);
   restore_interrupts (ints);
+  interface_core_lockout_end ();
   //printf ("PROG done\n");
 
   return 0;
 #else
-  off_t res1 = lseek (blockfd,
-            (off_t)block*cfg->block_size + (off_t)off, SEEK_SET);
-  if (res1 < 0) 
+  if (!flash || block >= INTERFACE_STORAGE_BLOCK_COUNT || 
+       off + size > cfg->block_size) 
+    return LFS_ERR_IO;
+
+  // NOR flash programming can only clear bits. Programming a byte that
+  //   has not been erased gives the AND of the old and new values on
+  //   the device, which is what we store here too; but it's a bug in
+  //   the caller, so report it.
+  uint8_t *mem = flash + (size_t)block * cfg->block_size + off;
+  const uint8_t *src = buffer;
+  BOOL violation = FALSE;
+  for (lfs_size_t i = 0; i < size; i++)
     {
-    int err = -errno;
-    return err;
+    if ((mem[i] & src[i]) != src[i])
+      violation = TRUE;
+    mem[i] &= src[i];
     }
 
-  ssize_t res2 = write (blockfd, buffer, size);
-  if (res2 < 0) 
+  uint32_t pages = (size + INTERFACE_FLASH_PAGE_SIZE - 1) 
+                     / INTERFACE_FLASH_PAGE_SIZE;
+  interface_flash_account (block, 0, 1, 0, 0, size, 
+    INTERFACE_FLASH_OVERHEAD_US + pages * INTERFACE_FLASH_PAGE_PROG_US);
+  if (violation)
     {
-    int err = -errno;
-    return err;
+    flash_block_stats[block].violations++;
+    flash_total_stats.violations++;
+    printf ("Flash: program without erase, block %u offset %u\n", 
+      (unsigned)block, (unsigned)off);
+    return LFS_ERR_IO;
     }
-
   return 0;
 #endif
   }
@@ -321,22 +622,49 @@ extern int interface_block_read (const struct lfs_config *cfg,
   //printf ("READ done\n");
   return 0;
 #else
-  off_t res1 = lseek(blockfd,
-            (off_t)block*cfg->block_size + (off_t)off, SEEK_SET);
-  if (res1 < 0) 
-    {
-    int err = -errno;
-    return err;
-    }
-
-  ssize_t res2 = read (blockfd, buffer, size);
-  if (res2 < 0) 
-    {
-    int err = -errno;
-    return err;
-    }
+  if (!flash || block >= INTERFACE_STORAGE_BLOCK_COUNT || 
+       off + size > cfg->block_size) 
+    return LFS_ERR_IO;
+  memcpy (buffer, flash + (size_t)block * cfg->block_size + off, size);
+  interface_flash_account (block, 1, 0, 0, size, 0, 
+    (size * INTERFACE_FLASH_READ_NS_PER_BYTE + 999) / 1000);
   return 0;
-  #endif
+#endif
+  }
+
+/*===========================================================================
+
+  interface_flash_stats
+
+===========================================================================*/
+BOOL interface_flash_stats (int32_t block, InterfaceFlashStats *stats)
+  {
+#if PICO_ON_DEVICE
+  (void)block;
+  memset (stats, 0, sizeof (*stats));
+  return FALSE;
+#else
+  if (block < 0)
+    *stats = flash_total_stats;
+  else if (block < INTERFACE_STORAGE_BLOCK_COUNT)
+    *stats = flash_block_stats [block];
+  else
+    return FALSE;
+  return TRUE;
+#endif
+  }
+
+/*===========================================================================
+
+  interface_flash_stats_reset
+
+===========================================================================*/
+void interface_flash_stats_reset (void)
+  {
+#if !PICO_ON_DEVICE
+  memset (flash_block_stats, 0, sizeof (flash_block_stats));
+  memset (&flash_total_stats, 0, sizeof (flash_total_stats));
+#endif
   }
 
 /*===========================================================================
@@ -427,12 +755,35 @@ void interface_sleep_ms (uint32_t val)
   interface_time_ms
 
 ===========================================================================*/
-uint32_t interface_time_ms (uint32_t val)
+uint32_t interface_time_ms (void)
+  {
+  return to_ms_since_boot (get_absolute_time());
+  }
+
+/*===========================================================================
+
+  interface_time_us
+
+===========================================================================*/
+uint64_t interface_time_us (void)
+  {
+  return to_us_since_boot (get_absolute_time());
+  }
+
+/*===========================================================================
+
+  interface_cycles
+
+===========================================================================*/
+uint32_t interface_cycles (void)
   {
 #if PICO_ON_DEVICE
-  return to_ms_since_boot(get_absolute_time());
+  // SysTick counts down
+  return INTERFACE_CYCLES_MASK - systick_hw->cvr;
 #else
-  usleep (val * 1000);
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (uint32_t)((uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec);
 #endif
   }
 
@@ -479,7 +830,166 @@ void interface_pwm_pin_set_level (uint8_t pin, uint16_t level)
 #if PICO_ON_DEVICE
   pwm_set_gpio_level (pin, level);
 #else
-  printf ("pwm_pin_set_level: pin=%d level=%d\n", pin, level); 
+  pthread_mutex_lock (&pwm_trace_mutex);
+  if (pwm_trace_enabled)
+    {
+    if (pwm_trace_count < INTERFACE_PWM_TRACE_MAX)
+      {
+      struct timespec now;
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      InterfacePwmTraceEntry *e = &pwm_trace[pwm_trace_count++];
+      e->time_us = (uint32_t)
+        ((now.tv_sec - pwm_trace_start.tv_sec) * 1000000 
+        + (now.tv_nsec - pwm_trace_start.tv_nsec) / 1000);
+      e->pin = pin;
+      e->level = level;
+      }
+    }
+  else
+    printf ("pwm_pin_set_level: pin=%d level=%d\n", pin, level); 
+  pthread_mutex_unlock (&pwm_trace_mutex);
+#endif
+  }
+
+/*===========================================================================
+
+  interface_pwm_trace_enable
+
+===========================================================================*/
+void interface_pwm_trace_enable (BOOL enable)
+  {
+#if PICO_ON_DEVICE
+  (void)enable;
+#else
+  pthread_mutex_lock (&pwm_trace_mutex);
+  pwm_trace_enabled = enable;
+  if (enable)
+    {
+    pwm_trace_count = 0;
+    clock_gettime (CLOCK_MONOTONIC, &pwm_trace_start);
+    }
+  pthread_mutex_unlock (&pwm_trace_mutex);
+#endif
+  }
+
+/*===========================================================================
+
+  interface_pwm_trace_read
+
+===========================================================================*/
+int interface_pwm_trace_read (InterfacePwmTraceEntry *entries, int max)
+  {
+#if PICO_ON_DEVICE
+  (void)entries; (void)max;
+  return 0;
+#else
+  pthread_mutex_lock (&pwm_trace_mutex);
+  int n = pwm_trace_count < max ? pwm_trace_count : max;
+  memcpy (entries, pwm_trace, (size_t)n * sizeof (InterfacePwmTraceEntry));
+  pwm_trace_count = 0;
+  pthread_mutex_unlock (&pwm_trace_mutex);
+  return n;
+#endif
+  }
+
+#if PICO_ON_DEVICE
+static repeating_timer_t timer;
+static uint32_t timer_ints;
+
+/*===========================================================================
+
+  interface_timer_callback
+
+===========================================================================*/
+static bool interface_timer_callback (repeating_timer_t *rt)
+  {
+  (void)rt;
+  uint32_t ints = spin_lock_blocking (timer_spin);
+  BOOL more = timer_fn ();
+  spin_unlock (timer_spin, ints);
+  return more;
+  }
+#else
+/*===========================================================================
+
+  interface_timer_thread
+
+  The host build models the repeating timer with a thread, that holds
+  timer_mutex while the timer function runs, just as the device build
+  runs the timer function with the interrupted code suspended.
+
+===========================================================================*/
+static void *interface_timer_thread (void *arg)
+  {
+  (void)arg;
+  struct timespec next;
+  clock_gettime (CLOCK_MONOTONIC, &next);
+  BOOL more = TRUE;
+  while (more)
+    {
+    next.tv_nsec += (long)timer_period_ms * 1000000;
+    while (next.tv_nsec >= 1000000000)
+      {
+      next.tv_nsec -= 1000000000;
+      next.tv_sec++;
+      }
+    clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    pthread_mutex_lock (&timer_mutex);
+    more = timer_fn ();
+    pthread_mutex_unlock (&timer_mutex);
+    }
+  return NULL;
+  }
+#endif
+
+/*===========================================================================
+
+  interface_timer_start
+
+===========================================================================*/
+BOOL interface_timer_start (uint32_t period_ms, InterfaceTimerFn fn)
+  {
+  timer_fn = fn;
+  timer_period_ms = period_ms;
+#if PICO_ON_DEVICE
+  // A negative period makes the SDK measure the period from the start
+  //   of one callback to the start of the next
+  return add_repeating_timer_ms (-(int32_t)period_ms, 
+     interface_timer_callback, NULL, &timer);
+#else
+  pthread_t thread;
+  if (pthread_create (&thread, NULL, interface_timer_thread, NULL) != 0)
+    return FALSE;
+  pthread_detach (thread);
+  return TRUE;
+#endif
+  }
+
+/*===========================================================================
+
+  interface_timer_lock
+
+===========================================================================*/
+void interface_timer_lock (void)
+  {
+#if PICO_ON_DEVICE
+  timer_ints = spin_lock_blocking (timer_spin);
+#else
+  pthread_mutex_lock (&timer_mutex);
+#endif
+  }
+
+/*===========================================================================
+
+  interface_timer_unlock
+
+===========================================================================*/
+void interface_timer_unlock (void)
+  {
+#if PICO_ON_DEVICE
+  spin_unlock (timer_spin, timer_ints);
+#else
+  pthread_mutex_unlock (&timer_mutex);
 #endif
   }
 
@@ -490,11 +1000,15 @@ void interface_pwm_pin_set_level (uint8_t pin, uint16_t level)
 ===========================================================================*/
 BOOL interface_is_interrupt_key (void)
   {
+  if (interface_core_active ())
+    return interface_core_interrupt ();
 #if PICO_ON_DEVICE
   if (getchar_timeout_us (0) == I_INTR) return TRUE;
   return FALSE;
 #else
-  if (getchar() == I_INTR) return TRUE;
+  // getchar() would wait for a tenth of a second, if nothing was typed
+  struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+  if (poll (&p, 1, 0) > 0 && getchar() == I_INTR) return TRUE;
   return FALSE;
 #endif
   }
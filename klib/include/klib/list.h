@@ -40,6 +40,7 @@ void    list_destroy (List *);
 void    list_append (List *self, void *item);
 void    list_prepend (List *self, void *item);
 void   *list_get (const List *self, int index);
+void   *list_next (const List *self, void **pos);
 void    list_dump (List *self);
 int     list_length (const List *self);
 BOOL    list_contains (List *self, const void *item, ListCompareFn fn);
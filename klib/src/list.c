@@ -29,6 +29,8 @@ struct _List
   {
   ListItemFreeFn free_fn; 
   ListItem *head;
+  ListItem *tail; // So that appending doesn't walk the list
+  int length;
   };
 
 /*==========================================================================
@@ -100,7 +102,9 @@ void list_prepend (List *self, void *item)
   else
     {
     self->head = i;
+    self->tail = i;
     }
+  self->length++;
   LOG_OUT
   }
 
@@ -119,16 +123,11 @@ void list_append (List *self, void *item)
   i->next = NULL;
 
   if (self->head)
-    {
-    ListItem *l = self->head;
-    while (l->next)
-      l = l->next;
-    l->next = i;
-    }
+    self->tail->next = i;
   else
-    {
     self->head = i;
-    }
+  self->tail = i;
+  self->length++;
   LOG_OUT
   }
 
@@ -138,18 +137,7 @@ void list_append (List *self, void *item)
 *==========================================================================*/
 int list_length (const List *self)
   {
-  LOG_IN
-  ListItem *l = self->head;
-
-  int i = 0;
-  while (l != NULL)
-    {
-    l = l->next;
-    i++;
-    }
-
-  LOG_OUT
-  return i;
+  return self->length;
   }
 
 /*==========================================================================
@@ -169,6 +157,20 @@ void *list_get (const List *self, int index)
   return l->data;
   }
 
+/*==========================================================================
+  list_next
+
+  Step through the list without the cost of list_get(), which has to
+  walk from the head each time. Set *pos to NULL to get the first item;
+  returns NULL after the last.
+*==========================================================================*/
+void *list_next (const List *self, void **pos)
+  {
+  ListItem *l = *pos ? ((ListItem *)*pos)->next : self->head;
+  *pos = l;
+  return l ? l->data : NULL;
+  }
+
 
 /*==========================================================================
   list_dump
@@ -177,12 +179,9 @@ void *list_get (const List *self, int index)
 *==========================================================================*/
 void list_dump (List *self)
   {
-  int i, l = list_length (self);
-  for (i = 0; i < l; i++)
-    {
-    const char *s = list_get (self, i);
-    printf ("%s\n", s);
-    }
+  ListItem *l;
+  for (l = self->head; l != NULL; l = l->next)
+    printf ("%s\n", (const char *)l->data);
   }
 
 
@@ -229,6 +228,9 @@ void list_remove_object (List *self, const void *item)
         {
         if (last_good) last_good->next = l->next;
         }
+      if (l == self->tail)
+        self->tail = last_good;
+      self->length--;
       self->free_fn (l->data);  
       ListItem *temp = l->next;
       free (l);
@@ -275,6 +277,9 @@ void list_remove (List *self, const void *item, ListCompareFn fn)
         {
         if (last_good) last_good->next = l->next;
         }
+      if (l == self->tail)
+        self->tail = last_good;
+      self->length--;
       self->free_fn (l->data);  
       ListItem *temp = l->next;
       free (l);
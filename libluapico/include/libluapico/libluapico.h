@@ -16,9 +16,14 @@ extern int luapico_ls (lua_State *L);
 extern int luapico_edit (lua_State *L);
 extern int luapico_df (lua_State *L);
 extern int luapico_rm (lua_State *L);
+extern int luapico_compress (lua_State *L);
+extern int luapico_uncompress (lua_State *L);
 extern int luapico_read (lua_State *L); 
 extern int luapico_readline (lua_State *L);
 extern int luapico_write (lua_State *L);
+extern int luapico_lines (lua_State *L);
+extern int luapico_dir (lua_State *L);
+extern int luapico_log_open (lua_State *L);
 extern int luapico_mkdir (lua_State *L);
 extern int luapico_stat (lua_State *L);
 extern int luapico_gpio_set_dir (lua_State *L);
@@ -28,9 +33,18 @@ extern int luapico_gpio_pull_up (lua_State *L);
 extern int luapico_gpio_get (lua_State *L);
 extern int luapico_sleep_ms (lua_State *L);
 extern int luapico_time_ms (lua_State *L);
+extern int luapico_time_us (lua_State *L);
+extern int luapico_cycles (lua_State *L);
+extern int luapico_bench (lua_State *L);
+extern int luapico_flash_stats (lua_State *L);
+extern int luapico_idle_stats (lua_State *L);
+extern int luapico_remount (lua_State *L);
 extern int luapico_gpio_set_function (lua_State *L);
 extern int luapico_pwm_pin_init (lua_State *L);
 extern int luapico_pwm_pin_set_level (lua_State *L);
+extern int luapico_pwm_ramp (lua_State *L);
+extern int luapico_pwm_ramp_active (lua_State *L);
+extern int luapico_pwm_trace (lua_State *L);
 extern int luapico_adc_pin_init (lua_State *L);
 extern int luapico_adc_select_input (lua_State *L);
 extern int luapico_adc_get (lua_State *L);
@@ -41,6 +55,7 @@ extern int luapico_execute (lua_State *L);
 
 /* Function exported to lua/loadlib.c, for initializing this library. */
 LUAMOD_API int luaopen_pico (lua_State *L);
+LUAMOD_API int luaopen_shell (lua_State *L);
 extern void luapico_init_constants (lua_State *L);
 
 END_DECLS
@@ -0,0 +1,37 @@
+/*=========================================================================
+  picolua
+
+  libluapico/pwmramp.h
+
+  (c)2021 Kevin Boone, GPLv3.0
+
+=========================================================================*/
+#pragma once
+
+#include <klib/defs.h>
+#include <shell/errcodes.h>
+
+typedef enum _PwmRampCurve
+  {
+  PWMRAMP_LINEAR = 0,   // Constant rate of change
+  PWMRAMP_QUAD = 1,     // Slow start, fast finish -- suits LED brightness
+  PWMRAMP_CUBIC = 2,    // Even slower start than PWMRAMP_QUAD 
+  PWMRAMP_SMOOTH = 3    // Slow start and slow finish
+  } PwmRampCurve;
+
+BEGIN_DECLS
+
+/** Start ramping the PWM level of a pin from 'from' to 'to', over
+    duration_ms milliseconds. The function returns immediately; the
+    level is updated from a timer. Starting a ramp on a pin that is
+    already ramping replaces the existing ramp. */
+extern ErrCode pwmramp_start (uint8_t pin, uint16_t from, uint16_t to, 
+                 uint32_t duration_ms, PwmRampCurve curve);
+
+/** Stop any ramp on the pin, leaving the level where it is. */
+extern void    pwmramp_stop (uint8_t pin);
+
+/** Returns TRUE if a ramp is in progress on the pin. */
+extern BOOL    pwmramp_is_active (uint8_t pin);
+
+END_DECLS
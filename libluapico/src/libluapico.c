@@ -11,6 +11,7 @@
 #define LUA_LIB
 
 #include <stdio.h>
+#include <string.h>
 #include "pico/stdlib.h" 
 #include <config.h>
 #include <lua/lprefix.h>
@@ -18,11 +19,14 @@
 #include <lua/lualib.h>
 #include <lua/lauxlib.h>
 #include <shell/shell.h>
+#include <shell/shell_job.h>
 #include <storage/storage.h>
+#include <storage/logfile.h>
 #include <interface/interface.h>
 #include <klib/term.h> 
 #include <bute2/bute2.h>
 #include "libluapico/libluapico.h"
+#include "libluapico/pwmramp.h"
 
 BOOL adc_initialized = FALSE;
 
@@ -57,7 +61,8 @@ int luapico_edit (lua_State *L)
 int luapico_df (lua_State *L) 
   {
   uint32_t used, total;
-  ErrCode err = storage_df (NULL, &used, &total); // TODO
+  const char *path = luaL_optstring (L, 1, NULL);
+  ErrCode err = storage_df (path, &used, &total);
   if (err == 0) 
     {
     lua_newtable (L);
@@ -104,6 +109,55 @@ int luapico_rm (lua_State *L)
   return 0; 
   }
 
+/*=========================================================================
+
+  luapico_compress
+
+  size, stored = pico.compress (path)
+
+=========================================================================*/
+int luapico_compress (lua_State *L) 
+  {
+  int t = lua_gettop (L);
+
+  if (t == 1)
+    {
+    const char *path = luaL_checkstring (L, 1);
+    uint32_t size, stored;
+    ErrCode err = storage_compress_file (path, &size, &stored);
+    if (err)
+      luaL_error (L, shell_strerror (err));
+    lua_pushinteger (L, (lua_Integer)size);
+    lua_pushinteger (L, (lua_Integer)stored);
+    }
+  else
+    luaL_error (L, "Usage: size, stored = pico.compress (\"file\")");
+    
+  return 2; 
+  }
+
+/*=========================================================================
+
+  luapico_uncompress
+
+=========================================================================*/
+int luapico_uncompress (lua_State *L) 
+  {
+  int t = lua_gettop (L);
+
+  if (t == 1)
+    {
+    const char *path = luaL_checkstring (L, 1);
+    ErrCode err = storage_uncompress_file (path);
+    if (err)
+      luaL_error (L, shell_strerror (err));
+    }
+  else
+    luaL_error (L, "Usage: pico.uncompress (\"file\")");
+    
+  return 0; 
+  }
+
 /*=========================================================================
 
   luapico_readline
@@ -137,29 +191,48 @@ int luapico_readline (lua_State *L)
 
   luapico_read
 
+  pico.read (path [, offset [, length]])
+
+  The file is read straight into a Lua buffer of the right size, so
+  there is only one copy of the data, and embedded zeros survive. The
+  size comes from storage_info(), so that nothing that might raise a
+  Lua error happens while the file is open.
+
 =========================================================================*/
 int luapico_read (lua_State *L) 
   {
   int t = lua_gettop (L);
 
-  if (t == 1)
+  if (t >= 1 && t <= 3)
     {
     const char *path = luaL_checkstring (L, 1);
-    int n;
-    char *buff = NULL;
-    ErrCode err = storage_read_file (path, (uint8_t**) &buff, &n);
-    if (err == 0)
-      {
-      buff = realloc (buff, (size_t)n + 1);
-      buff[n] = 0;
-      lua_pushstring (L, buff); 
-      free (buff);
-      }
-    else
+    lua_Integer offset = luaL_optinteger (L, 2, 0);
+    lua_Integer length = luaL_optinteger (L, 3, -1);
+    luaL_argcheck (L, offset >= 0, 2, "must not be negative");
+
+    FileInfo info;
+    ErrCode err = storage_info (path, &info);
+    if (err == 0 && info.type == STORAGE_TYPE_DIR)
+      err = ERR_ISDIR;
+    if (err)
       luaL_error (L, shell_strerror (err));
+
+    lua_Integer avail = (lua_Integer)info.size - offset;
+    if (avail < 0) avail = 0;
+    if (length < 0 || length > avail) length = avail;
+
+    luaL_Buffer b;
+    char *p = luaL_buffinitsize (L, &b, (size_t)length);
+    int n = 0;
+    if (length > 0)
+      err = storage_read_partial (path, (int)offset, (int)length, 
+        (uint8_t *)p, &n);
+    if (err)
+      luaL_error (L, shell_strerror (err));
+    luaL_pushresultsize (&b, (size_t)n);
     }
   else
-    luaL_error (L, "Usage: string = pico.read (\"file\")");
+    luaL_error (L, "Usage: string = pico.read (\"file\" [, offset [, length]])");
     
   return 1; 
   }
@@ -176,13 +249,10 @@ int luapico_write (lua_State *L)
   if (t == 2)
     {
     const char *path = luaL_checkstring (L, 1);
-    const char *string = luaL_checkstring (L, 2);
-    int n = (int) strlen (string);
-    ErrCode err = storage_write_file (path, string, n);
-    if (err == 0)
-      {
-      }
-    else
+    size_t n;
+    const char *string = luaL_checklstring (L, 2, &n);
+    ErrCode err = storage_write_file (path, string, (int)n);
+    if (err)
       luaL_error (L, shell_strerror (err));
     }
   else
@@ -191,6 +261,382 @@ int luapico_write (lua_State *L)
   return 0; 
   }
 
+/*=========================================================================
+
+  Line iterator
+
+  The state of a pico.lines() iterator is a userdata, which is also 
+  returned as the for loop's closing value, so the file is closed as 
+  soon as the loop is left by break, or an error, before the end of the
+  file. If the iterator is called outside a for loop, the file is closed
+  by the garbage collector.
+
+=========================================================================*/
+#define LUAPICO_LINES "pico.lines"
+
+/*=========================================================================
+
+  luapico_push_iterator
+
+  Turn the userdata at the top of the stack, which holds an iterator's 
+  state, into the four values that a for loop expects: the iterator 
+  function, with the userdata as its upvalue, two nils, and the userdata
+  again, as the to-be-closed value.
+
+=========================================================================*/
+static int luapico_push_iterator (lua_State *L, lua_CFunction next) 
+  {
+  lua_pushvalue (L, -1);
+  lua_pushcclosure (L, next, 1);
+  lua_pushnil (L);
+  lua_pushnil (L);
+  lua_rotate (L, -4, -1);
+  return 4;
+  }
+
+
+/*=========================================================================
+
+  luapico_lines_close
+
+=========================================================================*/
+static int luapico_lines_close (lua_State *L) 
+  {
+  StorageReader *r = luaL_checkudata (L, 1, LUAPICO_LINES);
+  storage_reader_close (r);
+  return 0;
+  }
+
+/*=========================================================================
+
+  luapico_lines_next
+
+=========================================================================*/
+static int luapico_lines_next (lua_State *L) 
+  {
+  StorageReader *r = lua_touserdata (L, lua_upvalueindex (1));
+  BOOL got = FALSE;
+  BOOL eol = FALSE;
+  luaL_Buffer b;
+  luaL_buffinit (L, &b);
+  while (!eol)
+    {
+    char *p = luaL_prepbuffer (&b);
+    uint32_t n = storage_reader_readline (r, p, LUAL_BUFFERSIZE, &eol);
+    if (n == 0 && !eol)
+      break;
+    luaL_addsize (&b, n);
+    got = TRUE;
+    }
+  luaL_pushresult (&b);
+  if (!got)
+    {
+    ErrCode err = r->err;
+    storage_reader_close (r);
+    if (err)
+      luaL_error (L, shell_strerror (err));
+    lua_pop (L, 1);
+    lua_pushnil (L);
+    }
+  return 1;
+  }
+
+/*=========================================================================
+
+  luapico_lines
+
+  for line in pico.lines (path) do ... end
+
+=========================================================================*/
+int luapico_lines (lua_State *L) 
+  {
+  int t = lua_gettop (L);
+
+  if (t == 1)
+    {
+    const char *path = luaL_checkstring (L, 1);
+    StorageReader *r = lua_newuserdatauv (L, sizeof (StorageReader), 0);
+    r->open = FALSE;
+    luaL_setmetatable (L, LUAPICO_LINES);
+    ErrCode err = storage_reader_open (r, path);
+    if (err)
+      luaL_error (L, shell_strerror (err));
+    return luapico_push_iterator (L, luapico_lines_next);
+    }
+  else
+    luaL_error (L, "Usage: for line in pico.lines (\"file\") do ... end");
+    
+  return 1; 
+  }
+
+/*=========================================================================
+
+  Directory iterator
+
+  Like pico.lines(), the state of a pico.dir() iterator is a userdata,
+  and the loop's closing value, so that the directory is closed if the
+  loop is abandoned.
+
+=========================================================================*/
+#define LUAPICO_DIR "pico.dir"
+
+/*=========================================================================
+
+  luapico_dir_close
+
+=========================================================================*/
+static int luapico_dir_close (lua_State *L) 
+  {
+  DirDescriptor *d = luaL_checkudata (L, 1, LUAPICO_DIR);
+  if (d->descriptor)
+    storage_dir_close (d);
+  return 0;
+  }
+
+/*=========================================================================
+
+  luapico_dir_next
+
+=========================================================================*/
+static int luapico_dir_next (lua_State *L) 
+  {
+  DirDescriptor *d = lua_touserdata (L, lua_upvalueindex (1));
+  FileInfo info;
+  int res = 0;
+  while (d->descriptor && (res = storage_dir_read (d, &info)) > 0)
+    {
+    if (strcmp (info.name, ".") != 0 && strcmp (info.name, "..") != 0)
+      {
+      lua_pushstring (L, info.name);
+      lua_pushstring (L, info.type == STORAGE_TYPE_DIR ? "dir" : "file");
+      lua_pushinteger (L, (lua_Integer)info.size);
+      return 3;
+      }
+    }
+  if (d->descriptor)
+    storage_dir_close (d);
+  if (res < 0)
+    luaL_error (L, shell_strerror ((ErrCode)-res));
+  lua_pushnil (L);
+  return 1;
+  }
+
+/*=========================================================================
+
+  luapico_dir
+
+  for name, type, size in pico.dir (path) do ... end
+
+=========================================================================*/
+int luapico_dir (lua_State *L) 
+  {
+  int t = lua_gettop (L);
+
+  if (t <= 1)
+    {
+    const char *path = luaL_optstring (L, 1, "/");
+    DirDescriptor *d = lua_newuserdatauv (L, sizeof (DirDescriptor), 0);
+    d->descriptor = NULL;
+    luaL_setmetatable (L, LUAPICO_DIR);
+    ErrCode err = storage_dir_open (path, d);
+    if (err)
+      luaL_error (L, shell_strerror (err));
+    return luapico_push_iterator (L, luapico_dir_next);
+    }
+  else
+    luaL_error (L, "Usage: for name, type, size in pico.dir (\"dir\") do ... end");
+    
+  return 1; 
+  }
+
+/*=========================================================================
+
+  Log files
+
+  A pico.log_open() handle is a userdata holding a LogFile, so the 
+  buffered records are written, and the segment closed, by the garbage
+  collector if the script forgets to close the log. The lines() method
+  returns an iterator whose state is a LogReader userdata, for the same
+  reason as pico.lines().
+
+=========================================================================*/
+#define LUAPICO_LOG "pico.log"
+#define LUAPICO_LOG_LINES "pico.log.lines"
+
+/*=========================================================================
+
+  luapico_log_close
+
+=========================================================================*/
+static int luapico_log_close (lua_State *L) 
+  {
+  LogFile *log = luaL_checkudata (L, 1, LUAPICO_LOG);
+  ErrCode err = logfile_close (log);
+  if (err)
+    luaL_error (L, shell_strerror (err));
+  return 0;
+  }
+
+/*=========================================================================
+
+  luapico_log_gc
+
+  Unlike close(), this must not raise an error
+
+=========================================================================*/
+static int luapico_log_gc (lua_State *L) 
+  {
+  LogFile *log = luaL_checkudata (L, 1, LUAPICO_LOG);
+  logfile_close (log);
+  return 0;
+  }
+
+/*=========================================================================
+
+  luapico_log_write
+
+  log:write (record, ...)
+
+  Each argument is a separate record
+
+=========================================================================*/
+static int luapico_log_write (lua_State *L) 
+  {
+  LogFile *log = luaL_checkudata (L, 1, LUAPICO_LOG);
+  int t = lua_gettop (L);
+  for (int i = 2; i <= t; i++)
+    {
+    size_t len;
+    const char *rec = luaL_checklstring (L, i, &len);
+    ErrCode err = logfile_write (log, rec, (uint32_t)len);
+    if (err)
+      luaL_error (L, shell_strerror (err));
+    }
+  lua_settop (L, 1);
+  return 1;
+  }
+
+/*=========================================================================
+
+  luapico_log_flush
+
+=========================================================================*/
+static int luapico_log_flush (lua_State *L) 
+  {
+  LogFile *log = luaL_checkudata (L, 1, LUAPICO_LOG);
+  ErrCode err = logfile_flush (log);
+  if (err)
+    luaL_error (L, shell_strerror (err));
+  return 0;
+  }
+
+/*=========================================================================
+
+  luapico_log_lines_close
+
+=========================================================================*/
+static int luapico_log_lines_close (lua_State *L) 
+  {
+  LogReader *lr = luaL_checkudata (L, 1, LUAPICO_LOG_LINES);
+  logfile_reader_close (lr);
+  return 0;
+  }
+
+/*=========================================================================
+
+  luapico_log_lines_next
+
+=========================================================================*/
+static int luapico_log_lines_next (lua_State *L) 
+  {
+  LogReader *lr = lua_touserdata (L, lua_upvalueindex (1));
+  BOOL got = FALSE;
+  BOOL eol = FALSE;
+  luaL_Buffer b;
+  luaL_buffinit (L, &b);
+  while (!eol)
+    {
+    char *p = luaL_prepbuffer (&b);
+    uint32_t n = logfile_reader_readline (lr, p, LUAL_BUFFERSIZE, &eol);
+    if (n == 0 && !eol)
+      break;
+    luaL_addsize (&b, n);
+    got = TRUE;
+    }
+  luaL_pushresult (&b);
+  if (!got)
+    {
+    logfile_reader_close (lr);
+    lua_pop (L, 1);
+    lua_pushnil (L);
+    }
+  return 1;
+  }
+
+/*=========================================================================
+
+  luapico_log_lines
+
+  for rec in log:lines () do ... end
+
+  Buffered records are written first, so that they are included
+
+=========================================================================*/
+static int luapico_log_lines (lua_State *L) 
+  {
+  LogFile *log = luaL_checkudata (L, 1, LUAPICO_LOG);
+  ErrCode err = logfile_flush (log);
+  if (err)
+    luaL_error (L, shell_strerror (err));
+  LogReader *lr = lua_newuserdatauv (L, sizeof (LogReader), 0);
+  lr->r.open = FALSE;
+  lr->last_seq = 0;
+  luaL_setmetatable (L, LUAPICO_LOG_LINES);
+  err = logfile_reader_open (lr, log->path);
+  if (err)
+    luaL_error (L, shell_strerror (err));
+  return luapico_push_iterator (L, luapico_log_lines_next);
+  }
+
+/*=========================================================================
+
+  luapico_log_open
+
+  log = pico.log_open (path, max_bytes)
+
+=========================================================================*/
+int luapico_log_open (lua_State *L) 
+  {
+  int t = lua_gettop (L);
+
+  if (t == 2)
+    {
+    const char *path = luaL_checkstring (L, 1);
+    lua_Integer max = luaL_checkinteger (L, 2);
+    if (max <= 0)
+      luaL_error (L, "Usage: pico.log_open (path, max_bytes)");
+    LogFile *log = lua_newuserdatauv (L, sizeof (LogFile), 0);
+    log->open = FALSE;
+    luaL_setmetatable (L, LUAPICO_LOG);
+    ErrCode err = logfile_open (log, path, (uint32_t)max);
+    if (err)
+      luaL_error (L, shell_strerror (err));
+    }
+  else
+    luaL_error (L, "Usage: pico.log_open (path, max_bytes)");
+    
+  return 1; 
+  }
+
+static const luaL_Reg log_methods[] = 
+  {
+  {"write", luapico_log_write},
+  {"flush", luapico_log_flush},
+  {"lines", luapico_log_lines},
+  {"close", luapico_log_close},
+  {NULL, NULL}
+  };
+
 /*=========================================================================
 
   luapico_mkdir
@@ -236,14 +682,14 @@ int luapico_ls (lua_State *L)
     ErrCode err = storage_list_dir (path, list);
     if (err == 0) 
       {
-      lua_newtable (L);
-      int l = list_length (list);
-      for (int i = 0; i < l; i++)
+      lua_createtable (L, list_length (list), 0);
+      const char *s;
+      void *pos = NULL;
+      int i = 0;
+      while ((s = list_next (list, &pos)))
 	{
-	const char *s = list_get (list, i);
-	lua_pushnumber (L, i + 1);
 	lua_pushstring (L, s); 
-	lua_settable (L, -3);
+	lua_rawseti (L, -2, ++i);
 	}
       }
     else
@@ -382,6 +828,186 @@ int luapico_pwm_pin_set_level (lua_State *L)
   return 0;
   }
 
+/*=========================================================================
+
+  luapico_pwm_ramp
+
+=========================================================================*/
+int luapico_pwm_ramp (lua_State *L)
+  {
+  static const char *const curves[] = 
+    {"linear", "quad", "cubic", "smooth", NULL};
+  int t = lua_gettop (L);
+
+  if (t == 4 || t == 5)
+    {
+    uint8_t pin = (uint8_t)luaL_checknumber (L, 1);
+    uint16_t from = (uint16_t)luaL_checknumber (L, 2);
+    uint16_t to = (uint16_t)luaL_checknumber (L, 3);
+    uint32_t duration = (uint32_t)luaL_checknumber (L, 4);
+    PwmRampCurve curve = (PwmRampCurve)luaL_checkoption 
+      (L, 5, "linear", curves);
+    ErrCode err = pwmramp_start (pin, from, to, duration, curve);
+    if (err)
+      luaL_error (L, shell_strerror (err));
+    }
+  else
+    luaL_error (L, "Usage: pico.pwm_ramp (pin, from, to, msec "
+      "[, \"linear\" | \"quad\" | \"cubic\" | \"smooth\"])");
+    
+  return 0;
+  }
+
+/*=========================================================================
+
+  luapico_pwm_ramp_active
+
+=========================================================================*/
+int luapico_pwm_ramp_active (lua_State *L)
+  {
+  int t = lua_gettop (L);
+
+  if (t == 1)
+    {
+    uint8_t pin = (uint8_t)luaL_checknumber (L, 1);
+    lua_pushboolean (L, pwmramp_is_active (pin));
+    }
+  else
+    luaL_error (L, "Usage: active = pico.pwm_ramp_active (pin)");
+    
+  return 1;
+  }
+
+/*=========================================================================
+
+  luapico_flash_stats
+
+  pico.flash_stats ([block]) returns a table of flash operation counts
+  for one storage block, or for all blocks. pico.flash_stats (nil, true)
+  also resets the counts. Only the host build, which emulates the 
+  flash, keeps counts; on the device this returns nil.
+
+=========================================================================*/
+int luapico_flash_stats (lua_State *L)
+  {
+  int32_t block = (int32_t)luaL_optinteger (L, 1, -1);
+  BOOL reset = lua_toboolean (L, 2);
+  InterfaceFlashStats stats;
+  if (!interface_flash_stats (block, &stats))
+    {
+    if (block >= INTERFACE_STORAGE_BLOCK_COUNT)
+      luaL_error (L, "Usage: pico.flash_stats ([block [, reset]])");
+    lua_pushnil (L);
+    return 1;
+    }
+  if (reset)
+    interface_flash_stats_reset ();
+  lua_createtable (L, 0, 7);
+  lua_pushinteger (L, (lua_Integer)stats.reads);
+  lua_setfield (L, -2, "reads");
+  lua_pushinteger (L, (lua_Integer)stats.progs);
+  lua_setfield (L, -2, "progs");
+  lua_pushinteger (L, (lua_Integer)stats.erases);
+  lua_setfield (L, -2, "erases");
+  lua_pushinteger (L, (lua_Integer)stats.bytes_read);
+  lua_setfield (L, -2, "bytes_read");
+  lua_pushinteger (L, (lua_Integer)stats.bytes_progged);
+  lua_setfield (L, -2, "bytes_progged");
+  lua_pushinteger (L, (lua_Integer)stats.violations);
+  lua_setfield (L, -2, "violations");
+  lua_pushinteger (L, (lua_Integer)stats.busy_us);
+  lua_setfield (L, -2, "busy_us");
+  return 1;
+  }
+
+/*=========================================================================
+
+  luapico_idle_stats
+
+  pico.idle_stats ([reset]) returns a table of counts of the filesystem
+  maintenance done while the shell was waiting for input, or during
+  pico.sleep_ms().
+
+=========================================================================*/
+int luapico_idle_stats (lua_State *L)
+  {
+  StorageIdleStats stats;
+  storage_idle_stats (&stats, lua_toboolean (L, 1));
+  lua_createtable (L, 0, 3);
+  lua_pushinteger (L, (lua_Integer)stats.runs);
+  lua_setfield (L, -2, "runs");
+  lua_pushinteger (L, (lua_Integer)stats.erases);
+  lua_setfield (L, -2, "erases");
+  lua_pushinteger (L, (lua_Integer)stats.busy_us);
+  lua_setfield (L, -2, "busy_us");
+  return 1;
+  }
+
+/*=========================================================================
+
+  luapico_remount
+
+  pico.remount ([checkpoint]) unmounts the flash filesystem and mounts
+  it again, as a restart would. With checkpoint false, the allocator's
+  state is not saved first, as if the power had failed.
+
+=========================================================================*/
+int luapico_remount (lua_State *L)
+  {
+  BOOL checkpoint = lua_isnoneornil (L, 1) || lua_toboolean (L, 1);
+  ErrCode err = storage_remount (checkpoint);
+  if (err)
+    luaL_error (L, shell_strerror (err));
+  return 0;
+  }
+
+/*=========================================================================
+
+  luapico_pwm_trace
+
+  pico.pwm_trace (true) starts recording PWM level changes, and 
+  pico.pwm_trace (false) stops. pico.pwm_trace() returns an array
+  of {time_us, pin, level} records, and clears the trace. All three 
+  are integers, so that the times, in microseconds since the trace was
+  started, keep their resolution with 32-bit Lua numbers. Only the host
+  build records anything.
+
+=========================================================================*/
+int luapico_pwm_trace (lua_State *L)
+  {
+  int t = lua_gettop (L);
+
+  if (t == 1)
+    {
+    interface_pwm_trace_enable (lua_toboolean (L, 1));
+    return 0;
+    }
+  else if (t == 0)
+    {
+    // A userdata, not malloc(), so that it is freed by the garbage 
+    //   collector if building the result runs out of memory
+    InterfacePwmTraceEntry *entries = lua_newuserdatauv (L, 
+      INTERFACE_PWM_TRACE_MAX * sizeof (InterfacePwmTraceEntry), 0);
+    int n = interface_pwm_trace_read (entries, INTERFACE_PWM_TRACE_MAX);
+    lua_createtable (L, n, 0);
+    for (int i = 0; i < n; i++)
+      {
+      lua_createtable (L, 3, 0);
+      lua_pushinteger (L, (lua_Integer)entries[i].time_us);
+      lua_rawseti (L, -2, 1);
+      lua_pushinteger (L, (lua_Integer)entries[i].pin);
+      lua_rawseti (L, -2, 2);
+      lua_pushinteger (L, (lua_Integer)entries[i].level);
+      lua_rawseti (L, -2, 3);
+      lua_rawseti (L, -2, i + 1);
+      }
+    }
+  else
+    luaL_error (L, "Usage: pico.pwm_trace ([enable])");
+    
+  return 1;
+  }
+
 /*=========================================================================
 
   luapico_gpio_get
@@ -444,6 +1070,46 @@ int luapico_gpio_pull_up (lua_State *L)
   return 0;
   }
 
+/*=========================================================================
+
+  luapico_in_job
+
+  TRUE if the program is a background job, which can yield to the shell
+  from here
+
+=========================================================================*/
+static BOOL luapico_in_job (lua_State *L)
+  {
+  if (!lua_isyieldable (L)) return FALSE;
+  BOOL job = lua_getfield (L, LUA_REGISTRYINDEX, LUA_JOBKEY) != LUA_TNIL;
+  lua_pop (L, 1);
+  if (!job) return FALSE;
+  // Not from a coroutine of the program's own
+  lua_getfield (L, LUA_REGISTRYINDEX, LUA_STAGEKEY);
+  job = (lua_tothread (L, -1) == L);
+  lua_pop (L, 1);
+  return job;
+  }
+
+/*=========================================================================
+
+  luapico_sleep_k
+
+  Sleep in a background job, by telling the shell when to resume it, in
+  milliseconds, and yielding. If it's resumed too soon, it yields
+  again.
+
+=========================================================================*/
+static int luapico_sleep_k (lua_State *L, int status, lua_KContext ctx)
+  {
+  (void)status;
+  uint32_t end = (uint32_t)ctx;
+  if ((int32_t)(end - interface_time_ms ()) <= 0) return 0;
+  lua_pushinteger (L, (lua_Integer)end);
+  lua_setfield (L, LUA_REGISTRYINDEX, LUA_JOBKEY);
+  return lua_yieldk (L, 0, ctx, luapico_sleep_k);
+  }
+
 /*=========================================================================
 
   luapico_sleep_ms
@@ -456,7 +1122,23 @@ int luapico_sleep_ms (lua_State *L)
   if (t == 1)
     {
     uint32_t ms = (uint32_t)luaL_checknumber (L, 1);
-    interface_sleep_ms (ms); 
+    if (luapico_in_job (L))
+      return luapico_sleep_k (L, LUA_OK,
+        (lua_KContext)(interface_time_ms () + ms));
+    // Use the time to run the background jobs, and tidy the filesystem
+    uint64_t end = interface_time_us () + (uint64_t)ms * 1000;
+    uint64_t now = interface_time_us ();
+    while (now < end)
+      {
+      if (!shell_idle ((uint32_t)(end - now)))
+        {
+        // A job might be ready to run again before the end
+        uint32_t wait = (uint32_t)((end - now + 999) / 1000);
+        if (shell_job_count () > 0 && wait > 1) wait = 1;
+        interface_sleep_ms (wait);
+        }
+      now = interface_time_us ();
+      }
     }
   else
     luaL_error (L, "Usage: pico.sleep_ms (milliseconds)");
@@ -472,9 +1154,180 @@ int luapico_sleep_ms (lua_State *L)
 =========================================================================*/
 int luapico_time_ms (lua_State *L)
   {
-    uint32_t val = interface_time_ms();
-    lua_pushnumber (L, val);
-    return 1;
+  // Integers, so that differences are exact even when the count wraps
+  lua_pushinteger (L, (lua_Integer)interface_time_ms());
+  return 1;
+  }
+
+/*=========================================================================
+
+  luapico_time_us
+
+=========================================================================*/
+int luapico_time_us (lua_State *L)
+  {
+  lua_pushinteger (L, (lua_Integer)interface_time_us());
+  return 1;
+  }
+
+/*=========================================================================
+
+  luapico_cycles
+
+=========================================================================*/
+int luapico_cycles (lua_State *L)
+  {
+  lua_pushinteger (L, (lua_Integer)interface_cycles());
+  return 1;
+  }
+
+/*=========================================================================
+
+  Benchmark support
+
+  While pico.bench() is running, the Lua allocator is wrapped by one 
+  that counts the bytes allocated, since the ordinary GC count is
+  net of whatever the collector has freed. 
+
+=========================================================================*/
+typedef struct _BenchAlloc
+  {
+  lua_Alloc f;
+  void *ud;
+  uint32_t bytes;
+  } BenchAlloc;
+
+static void *luapico_bench_alloc (void *ud, void *ptr, size_t osize, 
+      size_t nsize)
+  {
+  BenchAlloc *ba = (BenchAlloc *)ud;
+  // When ptr is NULL, osize is a type code, not a size
+  size_t old = ptr ? osize : 0;
+  if (nsize > old) ba->bytes += (uint32_t)(nsize - old);
+  return ba->f (ba->ud, ptr, osize, nsize);
+  }
+
+static int luapico_bench_nop (lua_State *L)
+  {
+  (void)L;
+  return 0;
+  }
+
+static int luapico_bench_cmp (const void *p1, const void *p2)
+  {
+  uint32_t v1 = *(const uint32_t *)p1;
+  uint32_t v2 = *(const uint32_t *)p2;
+  return v1 < v2 ? -1 : v1 > v2;
+  }
+
+/*=========================================================================
+
+  luapico_bench_run
+
+  Call the function at stack index 'fn' n times, storing the time
+  of each call in samples. Returns a Lua status code.
+
+=========================================================================*/
+static int luapico_bench_run (lua_State *L, int fn, uint32_t n, 
+     uint32_t *samples)
+  {
+  for (uint32_t i = 0; i < n; i++)
+    {
+    lua_pushvalue (L, fn);
+    uint64_t start = interface_time_us();
+    int status = lua_pcall (L, 0, 0, 0);
+    uint64_t end = interface_time_us();
+    if (status != LUA_OK) return status;
+    if (samples) samples[i] = (uint32_t)(end - start);
+    }
+  return LUA_OK;
+  }
+
+/*=========================================================================
+
+  luapico_bench_field
+
+=========================================================================*/
+static void luapico_bench_field (lua_State *L, const char *name, 
+     lua_Number val)
+  {
+  lua_pushnumber (L, val);
+  lua_setfield (L, -2, name);
+  }
+
+/*=========================================================================
+
+  luapico_bench
+
+  pico.bench (fn, iterations [, warmup]) 
+
+  Runs fn 'warmup' times without measuring, then 'iterations' times. 
+  The cost of an empty call is measured the same way, and subtracted.
+  Returns a table of times in microseconds, with the bytes allocated 
+  and collector steps taken by the measured calls.
+
+=========================================================================*/
+int luapico_bench (lua_State *L)
+  {
+  int t = lua_gettop (L);
+  if (t < 2 || t > 3)
+    luaL_error (L, "Usage: results = pico.bench (function, iterations "
+      "[, warmup])");
+
+  luaL_checktype (L, 1, LUA_TFUNCTION);
+  lua_Integer n = luaL_checkinteger (L, 2);
+  lua_Integer warmup = luaL_optinteger (L, 3, n / 10 + 1);
+  luaL_argcheck (L, n > 0, 2, "must be positive");
+  luaL_argcheck (L, warmup >= 0, 3, "must not be negative");
+
+  // Samples live in a userdata, so they are freed even if fn raises
+  //   an error
+  uint32_t *samples = lua_newuserdatauv (L, 
+    (size_t)n * sizeof (uint32_t), 0);
+  lua_pushcfunction (L, luapico_bench_nop);
+  int nop = lua_gettop (L);
+
+  // Overhead of the measurement loop itself
+  luapico_bench_run (L, nop, (uint32_t)n, samples);
+  qsort (samples, (size_t)n, sizeof (uint32_t), luapico_bench_cmp);
+  uint32_t overhead = samples[n / 2];
+
+  int status = luapico_bench_run (L, 1, (uint32_t)warmup, NULL);
+
+  BenchAlloc ba;
+  int steps = 0;
+  uint64_t start = 0, end = 0;
+  if (status == LUA_OK)
+    {
+    lua_gc (L, LUA_GCCOLLECT);
+    ba.f = lua_getallocf (L, &ba.ud);
+    ba.bytes = 0;
+    lua_setallocf (L, luapico_bench_alloc, &ba);
+    steps = lua_gc (L, LUA_GCNSTEPS);
+    start = interface_time_us();
+    status = luapico_bench_run (L, 1, (uint32_t)n, samples);
+    end = interface_time_us();
+    steps = lua_gc (L, LUA_GCNSTEPS) - steps;
+    lua_setallocf (L, ba.f, ba.ud);
+    }
+  if (status != LUA_OK)
+    lua_error (L);
+
+  qsort (samples, (size_t)n, sizeof (uint32_t), luapico_bench_cmp);
+  #define NET(x) ((x) > overhead ? (x) - overhead : 0)
+
+  lua_newtable (L);
+  luapico_bench_field (L, "iterations", (lua_Number)n);
+  luapico_bench_field (L, "min", NET(samples[0]));
+  luapico_bench_field (L, "median", NET(samples[n / 2]));
+  luapico_bench_field (L, "max", NET(samples[n - 1]));
+  luapico_bench_field (L, "mean", 
+    (lua_Number)(end - start) / (lua_Number)n - (lua_Number)overhead); 
+  luapico_bench_field (L, "overhead", overhead);
+  luapico_bench_field (L, "bytes", ba.bytes);
+  luapico_bench_field (L, "gc_steps", steps);
+  #undef NET
+  return 1;
   }
 
 
@@ -660,8 +1513,13 @@ static const luaL_Reg picolib[] =
   {"edit", luapico_edit},
   {"df", luapico_df},
   {"rm", luapico_rm},
+  {"compress", luapico_compress},
+  {"uncompress", luapico_uncompress},
   {"read", luapico_read},
   {"write", luapico_write},
+  {"lines", luapico_lines},
+  {"dir", luapico_dir},
+  {"log_open", luapico_log_open},
   {"mkdir", luapico_mkdir},
   {"stat", luapico_stat},
   {"gpio_set_dir", luapico_gpio_set_dir},
@@ -669,8 +1527,18 @@ static const luaL_Reg picolib[] =
   {"gpio_pull_up", luapico_gpio_pull_up},
   {"gpio_get", luapico_gpio_get},
   {"sleep_ms", luapico_sleep_ms},
+  {"time_ms", luapico_time_ms},
+  {"time_us", luapico_time_us},
+  {"cycles", luapico_cycles},
+  {"bench", luapico_bench},
+  {"flash_stats", luapico_flash_stats},
+  {"idle_stats", luapico_idle_stats},
+  {"remount", luapico_remount},
   {"pwm_pin_init", luapico_pwm_pin_init},
   {"pwm_pin_set_level", luapico_pwm_pin_set_level},
+  {"pwm_ramp", luapico_pwm_ramp},
+  {"pwm_ramp_active", luapico_pwm_ramp_active},
+  {"pwm_trace", luapico_pwm_trace},
   {"gpio_set_function", luapico_gpio_set_function},
   {"adc_pin_init", luapico_adc_pin_init},
   {"adc_select_input", luapico_adc_select_input},
@@ -721,6 +1589,32 @@ struct PicoConstant pico_constants[] =
 =========================================================================*/
 LUAMOD_API int luaopen_pico (lua_State *L)
   {
+  luaL_newmetatable (L, LUAPICO_LINES);
+  lua_pushcfunction (L, luapico_lines_close);
+  lua_setfield (L, -2, "__gc");
+  lua_pushcfunction (L, luapico_lines_close);
+  lua_setfield (L, -2, "__close");
+  lua_pop (L, 1);
+  luaL_newmetatable (L, LUAPICO_DIR);
+  lua_pushcfunction (L, luapico_dir_close);
+  lua_setfield (L, -2, "__gc");
+  lua_pushcfunction (L, luapico_dir_close);
+  lua_setfield (L, -2, "__close");
+  lua_pop (L, 1);
+  luaL_newmetatable (L, LUAPICO_LOG);
+  luaL_newlib (L, log_methods);
+  lua_setfield (L, -2, "__index");
+  lua_pushcfunction (L, luapico_log_gc);
+  lua_setfield (L, -2, "__gc");
+  lua_pushcfunction (L, luapico_log_gc);
+  lua_setfield (L, -2, "__close");
+  lua_pop (L, 1);
+  luaL_newmetatable (L, LUAPICO_LOG_LINES);
+  lua_pushcfunction (L, luapico_log_lines_close);
+  lua_setfield (L, -2, "__gc");
+  lua_pushcfunction (L, luapico_log_lines_close);
+  lua_setfield (L, -2, "__close");
+  lua_pop (L, 1);
   luaL_newlib (L, picolib);
   return 1;
   }
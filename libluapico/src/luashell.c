@@ -0,0 +1,197 @@
+/*=========================================================================
+
+  picolua
+
+  libluapico/luashell.c
+
+  The "shell" Lua library, with which Lua programs add commands to the 
+  shell. The commands are Lua functions, held in the shell's own Lua 
+  state (see shell_lua_state()), so they are run without starting a new 
+  interpreter, or loading anything from the filesystem.
+
+  (c)2021 Kevin Boone, GPLv3.0
+
+=========================================================================*/
+#include <stdio.h>
+#include <string.h>
+#include <config.h>
+#include <lua/lprefix.h>
+#include <lua/lua.h>
+#include <lua/lualib.h>
+#include <lua/lauxlib.h>
+#include <shell/shell.h>
+#include <shell/shell_commands.h>
+#include "libluapico/libluapico.h"
+
+/*=========================================================================
+
+  luashell_check_name
+
+=========================================================================*/
+static const char *luashell_check_name (lua_State *L, int arg)
+  {
+  const char *name = luaL_checkstring (L, arg);
+  luaL_argcheck (L, name[0] && !strpbrk (name, " \t=/"), arg, 
+    "not a valid command name");
+  return name;
+  }
+
+/*=========================================================================
+
+  luashell_load
+
+  Run in protected mode on the shell's state, S, with a LuashellLoad as
+  its argument: load the bytecode, or the file, and keep a reference to
+  the function. S lasts until reset, so an error here, even running out
+  of memory, must not reach its panic handler.
+
+=========================================================================*/
+typedef struct _LuashellLoad
+  {
+  const char *code; // Bytecode, or NULL to load path
+  size_t len;
+  const char *path;
+  int ref;
+  } LuashellLoad;
+
+static int luashell_load (lua_State *S)
+  {
+  LuashellLoad *ld = lua_touserdata (S, 1);
+  int status = ld->code 
+    ? luaL_loadbufferx (S, ld->code, ld->len, "=shell.register", "b")
+    : luaL_loadfile (S, ld->path);
+  if (status != LUA_OK)
+    return lua_error (S);
+  ld->ref = luaL_ref (S, LUA_REGISTRYINDEX);
+  return 0;
+  }
+
+/*=========================================================================
+
+  luashell_load_into
+
+  Run luashell_load on S, and return the reference. An error is moved
+  from S to L, and raised there.
+
+=========================================================================*/
+static int luashell_load_into (lua_State *L, lua_State *S, LuashellLoad *ld)
+  {
+  if (!lua_checkstack (S, 2))
+    return luaL_error (L, "%s", shell_strerror (ERR_NOMEM));
+  lua_pushcfunction (S, luashell_load);
+  lua_pushlightuserdata (S, ld);
+  if (lua_pcall (S, 1, 0, 0) != LUA_OK)
+    {
+    const char *msg = lua_tostring (S, -1);
+    lua_pushstring (L, msg ? msg : shell_strerror (ERR_NOMEM));
+    lua_pop (S, 1);
+    return lua_error (L);
+    }
+  return ld->ref;
+  }
+
+/*=========================================================================
+
+  luashell_move
+
+  Put the function at index arg of L into the shell's state, S, and 
+  return a reference to it there. A function can't be shared between 
+  Lua states, so it is copied as bytecode. Its upvalues are not copied, 
+  except that it sees the globals of S. 
+
+=========================================================================*/
+static int luashell_move (lua_State *L, int arg, lua_State *S)
+  {
+  lua_getglobal (L, "string");
+  lua_getfield (L, -1, "dump");
+  lua_pushvalue (L, arg);
+  if (lua_pcall (L, 1, 1, 0) != LUA_OK)
+    luaL_error (L, "can't register this function: %s", 
+      lua_tostring (L, -1));
+  LuashellLoad ld = { NULL, 0, NULL, LUA_NOREF };
+  ld.code = lua_tolstring (L, -1, &ld.len);
+  int ref = luashell_load_into (L, S, &ld);
+  lua_pop (L, 2);
+  return ref;
+  }
+
+/*=========================================================================
+
+  luashell_register
+
+  shell.register (name, f) adds the command name to the shell. f is a 
+  function, or the name of a Lua file, which is loaded now, and run as a
+  function each time the command is used. Either way, it gets the 
+  command's arguments as strings.
+
+=========================================================================*/
+static int luashell_register (lua_State *L)
+  {
+  const char *name = luashell_check_name (L, 1);
+  luaL_argexpected (L, lua_isfunction (L, 2) || lua_isstring (L, 2), 2, 
+    "function or filename");
+  lua_State *S = shell_lua_state ();
+  if (!S)
+    return luaL_error (L, "%s", shell_strerror (ERR_NOMEM));
+
+  int ref;
+  lua_rawgeti (L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+  BOOL same = (lua_tothread (L, -1) == S);
+  lua_pop (L, 1);
+  if (same)
+    {
+    // Called from a command in the shell's state, which is already 
+    //   protected
+    if (lua_isfunction (L, 2))
+      lua_pushvalue (L, 2);
+    else if (luaL_loadfile (L, lua_tostring (L, 2)) != LUA_OK)
+      return lua_error (L);
+    ref = luaL_ref (L, LUA_REGISTRYINDEX);
+    }
+  else if (lua_isfunction (L, 2))
+    ref = luashell_move (L, 2, S);
+  else
+    {
+    LuashellLoad ld = { NULL, 0, lua_tostring (L, 2), LUA_NOREF };
+    ref = luashell_load_into (L, S, &ld);
+    }
+
+  ErrCode err = shell_register_lua_command (name, ref);
+  if (err)
+    return luaL_error (L, "%s", shell_strerror (err));
+  return 0;
+  }
+
+/*=========================================================================
+
+  luashell_unregister
+
+  shell.unregister (name) removes a command, which may be a builtin. 
+  Returns false if there was no such command.
+
+=========================================================================*/
+static int luashell_unregister (lua_State *L)
+  {
+  const char *name = luaL_checkstring (L, 1);
+  lua_pushboolean (L, shell_unregister_command (name) == 0);
+  return 1;
+  }
+
+static const luaL_Reg shelllib[] = 
+  {
+  {"register", luashell_register},
+  {"unregister", luashell_unregister},
+  {NULL, NULL}
+  };
+
+/*=========================================================================
+
+  luaopen_shell
+
+=========================================================================*/
+LUAMOD_API int luaopen_shell (lua_State *L)
+  {
+  luaL_newlib (L, shelllib);
+  return 1;
+  }
+
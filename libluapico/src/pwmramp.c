@@ -0,0 +1,167 @@
+/*=========================================================================
+
+  picolua
+
+  libluapico/pwmramp.c
+
+  This file implements PWM level ramps, that are driven from the 
+  interface timer rather than by a Lua loop. There is one entry in
+  the ramp table per GPIO pin, so any number of pins can be ramped
+  at the same time. The timer only runs while at least one ramp
+  is active.
+
+  (c)2021 Kevin Boone, GPLv3.0
+
+=========================================================================*/
+#include <config.h>
+#include <interface/interface.h>
+#include "libluapico/pwmramp.h"
+
+typedef struct _PwmRamp
+  {
+  BOOL active;
+  uint16_t from;
+  uint16_t to;
+  uint16_t last;
+  uint32_t start_ms;
+  uint32_t duration_ms;
+  PwmRampCurve curve;
+  } PwmRamp;
+
+static volatile PwmRamp ramps [INTERFACE_GPIO_COUNT];
+static volatile BOOL timer_running = FALSE;
+
+/*=========================================================================
+
+  pwmramp_shape
+
+  Apply the curve to the fraction t of the ramp that has elapsed.
+  Both t and the result are in 16.16 fixed point, from 0 to 65536.
+
+=========================================================================*/
+static uint32_t pwmramp_shape (uint32_t t, PwmRampCurve curve)
+  {
+  uint64_t t2 = ((uint64_t)t * t) >> 16;
+  switch (curve)
+    {
+    case PWMRAMP_QUAD:
+      return (uint32_t)t2;
+    case PWMRAMP_CUBIC:
+      return (uint32_t)((t2 * t) >> 16);
+    case PWMRAMP_SMOOTH:
+      // 3t^2 - 2t^3
+      return (uint32_t)((t2 * (3 * 65536 - 2 * (uint64_t)t)) >> 16);
+    default:
+      return t;
+    }
+  }
+
+/*=========================================================================
+
+  pwmramp_tick
+
+  Called from the interface timer. Returns FALSE, stopping the timer, 
+  when there are no active ramps left.
+
+=========================================================================*/
+static BOOL pwmramp_tick (void)
+  {
+  BOOL any_active = FALSE;
+  uint32_t now = interface_time_ms();
+  for (uint8_t pin = 0; pin < INTERFACE_GPIO_COUNT; pin++)
+    {
+    volatile PwmRamp *r = &ramps[pin];
+    if (!r->active) continue;
+
+    uint32_t elapsed = now - r->start_ms;
+    uint16_t level;
+    if (elapsed >= r->duration_ms)
+      {
+      level = r->to;
+      r->active = FALSE;
+      }
+    else
+      {
+      uint32_t t = (uint32_t)(((uint64_t)elapsed << 16) / r->duration_ms);
+      int32_t span = (int32_t)r->to - (int32_t)r->from;
+      int32_t delta = (int32_t)
+        (((int64_t)span * pwmramp_shape (t, r->curve)) >> 16); 
+      level = (uint16_t)(r->from + delta);
+      any_active = TRUE;
+      }
+
+    if (level != r->last)
+      {
+      interface_pwm_pin_set_level (pin, level);
+      r->last = level;
+      }
+    }
+
+  if (!any_active)
+    timer_running = FALSE;
+  return any_active;
+  }
+
+/*=========================================================================
+
+  pwmramp_start
+
+=========================================================================*/
+ErrCode pwmramp_start (uint8_t pin, uint16_t from, uint16_t to, 
+          uint32_t duration_ms, PwmRampCurve curve)
+  {
+  if (pin >= INTERFACE_GPIO_COUNT)
+    return ERR_BADPIN;
+
+  interface_timer_lock();
+  volatile PwmRamp *r = &ramps[pin];
+  r->from = from;
+  r->to = to;
+  r->curve = curve;
+  r->duration_ms = duration_ms;
+  r->start_ms = interface_time_ms();
+  r->last = from;
+  r->active = duration_ms > 0;
+  BOOL start_timer = r->active && !timer_running;
+  if (start_timer) timer_running = TRUE;
+  interface_pwm_pin_set_level (pin, duration_ms > 0 ? from : to);
+  interface_timer_unlock();
+
+  if (start_timer)
+    {
+    if (!interface_timer_start (PWM_RAMP_TICK_MS, pwmramp_tick))
+      {
+      interface_timer_lock();
+      r->active = FALSE;
+      timer_running = FALSE;
+      interface_timer_unlock();
+      return ERR_NOMEM;
+      }
+    }
+  return 0;
+  }
+
+/*=========================================================================
+
+  pwmramp_stop
+
+=========================================================================*/
+void pwmramp_stop (uint8_t pin)
+  {
+  if (pin >= INTERFACE_GPIO_COUNT) return;
+  interface_timer_lock();
+  ramps[pin].active = FALSE;
+  interface_timer_unlock();
+  }
+
+/*=========================================================================
+
+  pwmramp_is_active
+
+=========================================================================*/
+BOOL pwmramp_is_active (uint8_t pin)
+  {
+  if (pin >= INTERFACE_GPIO_COUNT) return FALSE;
+  return ramps[pin].active;
+  }
+
@@ -1163,6 +1163,10 @@ LUA_API int lua_gc (lua_State *L, int what, ...) {
       res = g->gcrunning;
       break;
     }
+    case LUA_GCNSTEPS: {
+      res = cast_int(g->gcnsteps);
+      break;
+    }
     case LUA_GCGEN: {
       int minormul = va_arg(argp, int);
       int majormul = va_arg(argp, int);
@@ -264,6 +264,28 @@ LUALIB_API int luaL_fileresult (lua_State *L, int stat, const char *fname) {
 }
 
 
+/*
+** Like 'luaL_fileresult', but for storage operations, which report
+** an ErrCode rather than setting 'errno'. 'err' is 0 on success.
+*/
+LUALIB_API int luaL_storageresult (lua_State *L, int err, const char *fname) {
+  if (err == 0) {
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  else {
+    const char *msg = shell_strerror((ErrCode)err);
+    luaL_pushfail(L);
+    if (fname)
+      lua_pushfstring(L, "%s: %s", fname, msg);
+    else
+      lua_pushstring(L, msg);
+    lua_pushinteger(L, err);
+    return 3;
+  }
+}
+
+
 #if !defined(l_inspectstat)	/* { */
 
 #if defined(LUA_USE_POSIX)
@@ -687,11 +709,15 @@ LUALIB_API void luaL_unref (lua_State *L, int t, int ref) {
 ** =======================================================
 */
 
+/*
+** Files are read through a 'StorageReader', whose buffer is handed
+** straight to the parser. 'buff' only holds the few characters read
+** while checking for a BOM or a first-line comment.
+*/
 typedef struct LoadF {
   int n;  /* number of pre-read characters */
-  FileDescriptor f;  /* file being read */
-  char buff[BUFSIZ];  /* area for reading file */
-  int readstatus;  /* status of file read */
+  char buff[4];  /* pre-read characters */
+  StorageReader r;  /* file being read */
 } LoadF;
 
 
@@ -701,24 +727,20 @@ static const char *getF (lua_State *L, void *ud, size_t *size) {
   if (lf->n > 0) {  /* are there pre-read characters to be read? */
     *size = lf->n;  /* return them (chars already in buffer) */
     lf->n = 0;  /* no more pre-read characters */
+    return lf->buff;
   }
-  else {  /* read a block from file */
-    /* 'fread' can return > 0 *and* set the EOF flag. If next call to
-       'getF' called 'fread', it might still wait for user input.
-       The next check avoids this problem. */
-    if (storage_file_eof(&lf->f)) return NULL;
-    /* read block */
-    int32_t read = storage_file_read(&lf->f, lf->buff, sizeof(lf->buff));
-    *size = read > 0 ? read : 0;
-    if (read < 0)
-      lf->readstatus = read;
+  else {  /* hand over the reader's next block */
+    uint32_t n;
+    const char *p = storage_reader_chunk(&lf->r, &n);
+    *size = n;
+    return p;
   }
-  return lf->buff;
 }
 
 
-static int errfile (lua_State *L, const char *what, int fnameindex) {
-  const char *serr = strerror(errno);
+static int errfile (lua_State *L, const char *what, int fnameindex,
+                    ErrCode err) {
+  const char *serr = shell_strerror(err);
   const char *filename = lua_tostring(L, fnameindex) + 1;
   lua_pushfstring(L, "cannot %s %s: %s", what, filename, serr);
   lua_remove(L, fnameindex);
@@ -731,12 +753,12 @@ static int skipBOM (LoadF *lf) {
   int c;
   lf->n = 0;
   do {
-    c = storage_file_getc(&lf->f);
+    c = storage_reader_getc(&lf->r);
     if (c == EOF || c != *(const unsigned char *)p++) return c;
     lf->buff[lf->n++] = c;  /* to be read by the parser */
   } while (*p != '\0');
   lf->n = 0;  /* prefix matched; discard it */
-  return storage_file_getc(&lf->f);  /* return next character */
+  return storage_reader_getc(&lf->r);  /* return next character */
 }
 
 
@@ -751,9 +773,9 @@ static int skipcomment (LoadF *lf, int *cp) {
   int c = *cp = skipBOM(lf);
   if (c == '#') {  /* first line is a comment (Unix exec. file)? */
     do {  /* skip first line */
-      c = storage_file_getc(&lf->f);
+      c = storage_reader_getc(&lf->r);
     } while (c != EOF && c != '\n');
-    *cp = storage_file_getc(&lf->f);  /* skip end-of-line, if present */
+    *cp = storage_reader_getc(&lf->r);  /* skip end-of-line, if present */
     return 1;  /* there was a comment */
   }
   else return 0;  /* no comment */
@@ -765,26 +787,25 @@ LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
   LoadF lf;
   int status;
   int c;
+  ErrCode err;
   int fnameindex = lua_gettop(L) + 1;  /* index of filename on the stack */
   if (filename == NULL) {
     lua_pushstring(L, "cannot open stdin: not supported");
     return LUA_ERRFILE;
   }
-  else {
-    lua_pushfstring(L, "@%s", filename);
-    ErrCode err = storage_file_open(filename, STORAGE_O_RDONLY, &lf.f);
-    if (err != 0) return errfile(L, "open", fnameindex);
-  }
+  lua_pushfstring(L, "@%s", filename);
+  err = storage_reader_open(&lf.r, filename);
+  if (err != 0) return errfile(L, "open", fnameindex, err);
   if (skipcomment(&lf, &c))  /* read initial portion */
     lf.buff[lf.n++] = '\n';  /* add line to correct line numbers */
   if (c != EOF)
     lf.buff[lf.n++] = c;  /* 'c' is the first character of the stream */
-  lf.readstatus = 0;
   status = lua_load(L, getF, &lf, lua_tostring(L, -1), mode);
-  if (filename) storage_file_close(&lf.f);  /* close file (even in case of errors) */
-  if (lf.readstatus) {
+  err = lf.r.err;
+  storage_reader_close(&lf.r);  /* close file (even in case of errors) */
+  if (err) {
     lua_settop(L, fnameindex);  /* ignore results from 'lua_load' */
-    return errfile(L, "read", fnameindex);
+    return errfile(L, "read", fnameindex, err);
   }
   lua_remove(L, fnameindex);
   return status;
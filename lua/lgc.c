@@ -1667,6 +1667,7 @@ void luaC_step (lua_State *L) {
   global_State *g = G(L);
   lua_assert(!g->gcemergency);
   if (g->gcrunning) {  /* running? */
+    g->gcnsteps++;
     if(isdecGCmodegen(g))
       genstep(L, g);
     else
@@ -52,6 +52,7 @@ static const luaL_Reg loadedlibs[] = {
   {LUA_UTF8LIBNAME, luaopen_utf8},
   {LUA_DBLIBNAME, luaopen_debug},
   {"pico", luaopen_pico},
+  {"shell", luaopen_shell},
   {NULL, NULL}
 };
 
@@ -17,14 +17,17 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <config.h>
+#include <shell/shell.h>
+#include <storage/storage.h>
+#include <interface/interface.h>
+
 #include "lua.h"
 
 #include "lauxlib.h"
 #include "lualib.h"
 
 
-
-
 /*
 ** Change this macro to accept other modes for 'fopen' besides
 ** the standard ones.
@@ -45,113 +48,262 @@ static int l_checkmode (const char *mode) {
 
 #endif
 
+
 /*
-** {======================================================
-** l_popen spawns a new process connected to the current
-** one through the file streams.
-** =======================================================
+** Translate a (checked) 'fopen' mode into storage open flags
 */
+static StorageOpenFlags l_openflags (const char *mode) {
+  int plus = (mode[1] == '+');
+  switch (mode[0]) {
+    case 'w':
+      return (plus ? STORAGE_O_RDWR : STORAGE_O_WRONLY) |
+             STORAGE_O_CREAT | STORAGE_O_TRUNC;
+    case 'a':
+      return (plus ? STORAGE_O_RDWR : STORAGE_O_WRONLY) |
+             STORAGE_O_CREAT | STORAGE_O_APPEND;
+    default:
+      return plus ? STORAGE_O_RDWR : STORAGE_O_RDONLY;
+  }
+}
 
-#if !defined(l_checkmodep)
-/* By default, Lua accepts only "r" or "w" as mode */
-#define l_checkmodep(m)	((m[0] == 'r' || m[0] == 'w') && m[1] == '\0')
-#endif
-
-
-#if !defined(l_popen)		/* { */
-
-#if defined(LUA_USE_POSIX)	/* { */
-
-#define l_popen(L,c,m)		(fflush(NULL), popen(c,m))
-#define l_pclose(L,file)	(pclose(file))
 
-#elif defined(LUA_USE_WINDOWS)	/* }{ */
+#define IO_PREFIX	"_IO_"
+#define IOPREF_LEN	(sizeof(IO_PREFIX)/sizeof(char) - 1)
+#define IO_INPUT	(IO_PREFIX "input")
+#define IO_OUTPUT	(IO_PREFIX "output")
 
-#define l_popen(L,c,m)		(_popen(c,m))
-#define l_pclose(L,file)	(_pclose(file))
 
-#else				/* }{ */
+/*
+** {======================================================
+** Buffered files
+** In picolua, files live in the storage filesystem rather than
+** being C 'FILE's. Each handle has its own buffer, which holds either
+** read-ahead data ('pos' to 'len') or write-behind data ('len' bytes
+** not yet written), but never both. The standard files stdin,
+** stdout and stderr are still C 'FILE's, held in 's.f'.
+** =======================================================
+*/
 
-/* ISO C definitions */
-#define l_popen(L,c,m)  \
-	  ((void)c, (void)m, \
-	  luaL_error(L, "'popen' not supported"), \
-	  (FILE*)0)
-#define l_pclose(L,file)		((void)L, (void)file, -1)
+typedef struct LStream {
+  luaL_Stream s;  /* 's.f' is the console stream, or NULL */
+  FileDescriptor fd;  /* the storage file, when 's.f' is NULL */
+  int isopen;  /* true when 'fd' is open */
+  int err;  /* ErrCode of the last failed operation, or 0 */
+  int eof;  /* true when a read reached the end of the file */
+  int writing;  /* true when the buffer holds write-behind data */
+  int unbuffered;  /* true after setvbuf("no") */
+  int pos;  /* next unread byte in 'buff' */
+  int len;  /* number of valid (or pending) bytes in 'buff' */
+  char buff[IO_BUFFER_SIZE];
+} LStream;
 
-#endif				/* } */
 
-#endif				/* } */
+#define tolstream(L)	((LStream *)luaL_checkudata(L, 1, LUA_FILEHANDLE))
 
-/* }====================================================== */
+#define isclosed(p)	((p)->s.closef == NULL)
 
+#define isconsole(p)	((p)->s.f != NULL)
 
-#if !defined(l_getc)		/* { */
+/*
+** While the standard input is a pipe from another command, it is read
+** through the terminal interface, and 'buff' holds the character that
+** can be pushed back by 'lf_ungetc'
+*/
+#define ispiped(p)	((p)->s.f == stdin && interface_get_input() != NULL)
+
+
+/* write out any pending data; returns true on success */
+static int lf_flush (LStream *p) {
+  if (isconsole(p))
+    return fflush(p->s.f) == 0;
+  if (!p->writing)
+    return 1;  /* nothing pending; keep any read-ahead data */
+  if (p->len > 0) {
+    int32_t n = storage_file_write(&p->fd, p->buff, (uint32_t)p->len);
+    if (n != p->len) {
+      p->err = (n < 0) ? (ErrCode)-n : ERR_NOSPC;
+      return 0;
+    }
+  }
+  p->writing = 0;
+  p->pos = p->len = 0;
+  return 1;
+}
 
-#if defined(LUA_USE_POSIX)
-#define l_getc(f)		getc_unlocked(f)
-#define l_lockfile(f)		flockfile(f)
-#define l_unlockfile(f)		funlockfile(f)
-#else
-#define l_getc(f)		getc(f)
-#define l_lockfile(f)		((void)0)
-#define l_unlockfile(f)		((void)0)
-#endif
 
-#endif				/* } */
+/* discard read-ahead data, moving the file back to the logical position */
+static int lf_unread (LStream *p) {
+  if (!p->writing && p->pos < p->len) {
+    if (storage_file_seek(&p->fd, p->pos - p->len, STORAGE_SEEK_CUR) < 0) {
+      p->err = ERR_IO;
+      return 0;
+    }
+  }
+  p->pos = p->len = 0;
+  return 1;
+}
 
 
-/*
-** {======================================================
-** l_fseek: configuration for longer offsets
-** =======================================================
-*/
+/* refill the read-ahead buffer; returns the number of bytes available */
+static int lf_fill (LStream *p) {
+  int32_t n;
+  if (p->writing && !lf_flush(p))
+    return 0;
+  n = storage_file_read(&p->fd, p->buff, sizeof(p->buff));
+  p->pos = 0;
+  p->len = (n > 0) ? n : 0;
+  if (n < 0) p->err = (ErrCode)-n;
+  else if (n == 0) p->eof = 1;
+  return p->len;
+}
 
-#if !defined(l_fseek)		/* { */
 
-#if defined(LUA_USE_POSIX)	/* { */
+static int lf_pipegetc (LStream *p) {
+  const InterfaceInput *in = interface_get_input();
+  int c;
+  if (p->pos < p->len)
+    return (unsigned char)p->buff[p->pos++];
+  c = in->get_char(in->data);
+  if (c < 0)
+    return EOF;
+  p->buff[0] = (char)c;
+  p->pos = p->len = 1;
+  return c;
+}
 
-#include <sys/types.h>
 
-#define l_fseek(f,o,w)		fseeko(f,o,w)
-#define l_ftell(f)		ftello(f)
-#define l_seeknum		off_t
+static int lf_getc (LStream *p) {
+  if (isconsole(p))
+    return ispiped(p) ? lf_pipegetc(p) : getc(p->s.f);
+  if (p->writing || p->pos >= p->len) {
+    if (lf_fill(p) == 0)
+      return EOF;
+  }
+  return (unsigned char)p->buff[p->pos++];
+}
 
-#elif defined(LUA_USE_WINDOWS) && !defined(_CRTIMP_TYPEINFO) \
-   && defined(_MSC_VER) && (_MSC_VER >= 1400)	/* }{ */
 
-/* Windows (but not DDK) and Visual C++ 2005 or higher */
-#define l_fseek(f,o,w)		_fseeki64(f,o,w)
-#define l_ftell(f)		_ftelli64(f)
-#define l_seeknum		__int64
+/* push back the character just read by 'lf_getc' */
+static void lf_ungetc (int c, LStream *p) {
+  if (c == EOF) return;
+  if (isconsole(p) && !ispiped(p))
+    ungetc(c, p->s.f);
+  else if (p->pos > 0)
+    p->pos--;
+}
 
-#else				/* }{ */
 
-/* ISO C definitions */
-#define l_fseek(f,o,w)		fseek(f,o,w)
-#define l_ftell(f)		ftell(f)
-#define l_seeknum		long
+static size_t lf_read (LStream *p, char *b, size_t n) {
+  size_t done = 0;
+  if (isconsole(p) && ispiped(p)) {
+    int c;
+    while (done < n && (c = lf_pipegetc(p)) != EOF)
+      b[done++] = (char)c;
+    return done;
+  }
+  if (isconsole(p))
+    return fread(b, sizeof(char), n, p->s.f);
+  if (p->writing && !lf_flush(p))
+    return 0;
+  while (done < n) {
+    size_t avail = (size_t)(p->len - p->pos);
+    if (avail > 0) {  /* take what is already buffered */
+      size_t k = (avail < n - done) ? avail : n - done;
+      memcpy(b + done, p->buff + p->pos, k);
+      p->pos += (int)k;
+      done += k;
+    }
+    else if (n - done >= sizeof(p->buff)) {  /* large read: bypass buffer */
+      int32_t r = storage_file_read(&p->fd, b + done, (uint32_t)(n - done));
+      if (r <= 0) {
+        if (r < 0) p->err = (ErrCode)-r; else p->eof = 1;
+        break;
+      }
+      done += (size_t)r;
+    }
+    else if (lf_fill(p) == 0)
+      break;
+  }
+  return done;
+}
 
-#endif				/* } */
 
-#endif				/* } */
+static int lf_write (LStream *p, const char *s, size_t n) {
+  if (isconsole(p) && p->s.f == stdout) {
+    interface_write_stdout(s, n);
+    return 1;
+  }
+  if (isconsole(p))
+    return fwrite(s, sizeof(char), n, p->s.f) == n;
+  if (!p->writing) {
+    if (!lf_unread(p)) return 0;
+    p->writing = 1;
+  }
+  if (p->len + n > sizeof(p->buff)) {
+    if (!lf_flush(p)) return 0;
+    p->writing = 1;
+    if (n >= sizeof(p->buff)) {  /* large write: bypass buffer */
+      int32_t r = storage_file_write(&p->fd, s, (uint32_t)n);
+      if (r != (int32_t)n) {
+        p->err = (r < 0) ? (ErrCode)-r : ERR_NOSPC;
+        return 0;
+      }
+      return 1;
+    }
+  }
+  memcpy(p->buff + p->len, s, n);
+  p->len += (int)n;
+  return p->unbuffered ? lf_flush(p) : 1;
+}
 
-/* }====================================================== */
 
+/* returns the new position, or -1 on error */
+static int32_t lf_seek (LStream *p, int32_t offset, StorageSeekWhence whence) {
+  int32_t res;
+  if (isconsole(p)) {
+    static const int mode[] = {SEEK_SET, SEEK_CUR, SEEK_END};
+    if (fseek(p->s.f, offset, mode[whence]) != 0) return -1;
+    return (int32_t)ftell(p->s.f);
+  }
+  if (!lf_flush(p)) return -1;
+  if (whence == STORAGE_SEEK_CUR)
+    offset -= p->len - p->pos;  /* logical position is behind the file's */
+  p->pos = p->len = 0;
+  p->eof = 0;
+  res = storage_file_seek(&p->fd, offset, whence);
+  if (res < 0) {
+    p->err = (ErrCode)-res;
+    return -1;
+  }
+  return res;
+}
 
 
-#define IO_PREFIX	"_IO_"
-#define IOPREF_LEN	(sizeof(IO_PREFIX)/sizeof(char) - 1)
-#define IO_INPUT	(IO_PREFIX "input")
-#define IO_OUTPUT	(IO_PREFIX "output")
+static int lf_error (LStream *p) {
+  return isconsole(p) ? ferror(p->s.f) : p->err;
+}
 
 
-typedef luaL_Stream LStream;
+static void lf_clearerr (LStream *p) {
+  if (isconsole(p))
+    clearerr(p->s.f);
+  else
+    p->err = p->eof = 0;
+}
 
 
-#define tolstream(L)	((LStream *)luaL_checkudata(L, 1, LUA_FILEHANDLE))
+/*
+** Push the results of a failed operation, in the same form as
+** 'luaL_fileresult'
+*/
+static int lf_result (lua_State *L, LStream *p, int stat, const char *fname) {
+  if (isconsole(p))
+    return luaL_fileresult(L, stat, fname);
+  return luaL_storageresult(L, stat ? 0 : (p->err ? p->err : ERR_IO),
+                            fname);
+}
 
-#define isclosed(p)	((p)->closef == NULL)
+/* }====================================================== */
 
 
 static int io_type (lua_State *L) {
@@ -173,17 +325,16 @@ static int f_tostring (lua_State *L) {
   if (isclosed(p))
     lua_pushliteral(L, "file (closed)");
   else
-    lua_pushfstring(L, "file (%p)", p->f);
+    lua_pushfstring(L, "file (%p)", (void *)p);
   return 1;
 }
 
 
-static FILE *tofile (lua_State *L) {
+static LStream *tofile (lua_State *L) {
   LStream *p = tolstream(L);
   if (isclosed(p))
     luaL_error(L, "attempt to use a closed file");
-  lua_assert(p->f);
-  return p->f;
+  return p;
 }
 
 
@@ -194,7 +345,11 @@ static FILE *tofile (lua_State *L) {
 */
 static LStream *newprefile (lua_State *L) {
   LStream *p = (LStream *)lua_newuserdatauv(L, sizeof(LStream), 0);
-  p->closef = NULL;  /* mark file handle as 'closed' */
+  p->s.closef = NULL;  /* mark file handle as 'closed' */
+  p->s.f = NULL;
+  p->isopen = 0;
+  p->err = p->eof = p->writing = p->unbuffered = 0;
+  p->pos = p->len = 0;
   luaL_setmetatable(L, LUA_FILEHANDLE);
   return p;
 }
@@ -207,8 +362,8 @@ static LStream *newprefile (lua_State *L) {
 */
 static int aux_close (lua_State *L) {
   LStream *p = tolstream(L);
-  volatile lua_CFunction cf = p->closef;
-  p->closef = NULL;  /* mark stream as closed */
+  volatile lua_CFunction cf = p->s.closef;
+  p->s.closef = NULL;  /* mark stream as closed */
   return (*cf)(L);  /* close it */
 }
 
@@ -228,7 +383,7 @@ static int io_close (lua_State *L) {
 
 static int f_gc (lua_State *L) {
   LStream *p = tolstream(L);
-  if (!isclosed(p) && p->f != NULL)
+  if (!isclosed(p) && (isconsole(p) || p->isopen))
     aux_close(L);  /* ignore closed and incompletely open files */
   return 0;
 }
@@ -239,24 +394,34 @@ static int f_gc (lua_State *L) {
 */
 static int io_fclose (lua_State *L) {
   LStream *p = tolstream(L);
-  int res = fclose(p->f);
-  return luaL_fileresult(L, (res == 0), NULL);
+  int ok = lf_flush(p);
+  ErrCode err = storage_file_close(&p->fd);
+  p->isopen = 0;
+  if (ok && err) p->err = err;
+  return lf_result(L, p, ok && !err, NULL);
 }
 
 
 static LStream *newfile (lua_State *L) {
   LStream *p = newprefile(L);
-  p->f = NULL;
-  p->closef = &io_fclose;
+  p->s.closef = &io_fclose;
   return p;
 }
 
 
+/* returns 0 or an ErrCode */
+static ErrCode l_openfile (LStream *p, const char *fname, const char *mode) {
+  ErrCode err = storage_file_open(fname, l_openflags(mode), &p->fd);
+  p->isopen = (err == 0);
+  return err;
+}
+
+
 static void opencheck (lua_State *L, const char *fname, const char *mode) {
   LStream *p = newfile(L);
-  p->f = fopen(fname, mode);
-  if (p->f == NULL)
-    luaL_error(L, "cannot open file '%s' (%s)", fname, strerror(errno));
+  ErrCode err = l_openfile(p, fname, mode);
+  if (err)
+    luaL_error(L, "cannot open file '%s' (%s)", fname, shell_strerror(err));
 }
 
 
@@ -265,47 +430,32 @@ static int io_open (lua_State *L) {
   const char *mode = luaL_optstring(L, 2, "r");
   LStream *p = newfile(L);
   const char *md = mode;  /* to traverse/check mode */
+  ErrCode err;
   luaL_argcheck(L, l_checkmode(md), 2, "invalid mode");
-  p->f = fopen(filename, mode);
-  return (p->f == NULL) ? luaL_fileresult(L, 0, filename) : 1;
-}
-
-
-/*
-** function to close 'popen' files
-*/
-static int io_pclose (lua_State *L) {
-  LStream *p = tolstream(L);
-  errno = 0;
-  return luaL_execresult(L, l_pclose(L, p->f));
+  err = l_openfile(p, filename, mode);
+  return err ? luaL_storageresult(L, err, filename) : 1;
 }
 
 
+/* there are no processes to run, so no pipes */
 static int io_popen (lua_State *L) {
-  const char *filename = luaL_checkstring(L, 1);
-  const char *mode = luaL_optstring(L, 2, "r");
-  LStream *p = newprefile(L);
-  luaL_argcheck(L, l_checkmodep(mode), 2, "invalid mode");
-  p->f = l_popen(L, filename, mode);
-  p->closef = &io_pclose;
-  return (p->f == NULL) ? luaL_fileresult(L, 0, filename) : 1;
+  luaL_checkstring(L, 1);
+  return luaL_error(L, "'popen' not supported");
 }
 
 
 static int io_tmpfile (lua_State *L) {
-  LStream *p = newfile(L);
-  p->f = tmpfile();
-  return (p->f == NULL) ? luaL_fileresult(L, 0, NULL) : 1;
+  return luaL_storageresult(L, ERR_NOTIMPLEMENTED, NULL);
 }
 
 
-static FILE *getiofile (lua_State *L, const char *findex) {
+static LStream *getiofile (lua_State *L, const char *findex) {
   LStream *p;
   lua_getfield(L, LUA_REGISTRYINDEX, findex);
   p = (LStream *)lua_touserdata(L, -1);
   if (isclosed(p))
     luaL_error(L, "default %s file is closed", findex + IOPREF_LEN);
-  return p->f;
+  return p;
 }
 
 
@@ -419,7 +569,7 @@ static int io_lines (lua_State *L) {
 
 /* auxiliary structure used by 'read_number' */
 typedef struct {
-  FILE *f;  /* file being read */
+  LStream *f;  /* file being read */
   int c;  /* current character (look ahead) */
   int n;  /* number of elements in buffer 'buff' */
   char buff[L_MAXLENNUM + 1];  /* +1 for ending '\0' */
@@ -436,7 +586,7 @@ static int nextc (RN *rn) {
   }
   else {
     rn->buff[rn->n++] = rn->c;  /* save current char */
-    rn->c = l_getc(rn->f);  /* read next one */
+    rn->c = lf_getc(rn->f);  /* read next one */
     return 1;
   }
 }
@@ -468,7 +618,7 @@ static int readdigits (RN *rn, int hex) {
 ** Then it calls 'lua_stringtonumber' to check whether the format is
 ** correct and to convert it to a Lua number.
 */
-static int read_number (lua_State *L, FILE *f) {
+static int read_number (lua_State *L, LStream *f) {
   RN rn;
   int count = 0;
   int hex = 0;
@@ -476,8 +626,7 @@ static int read_number (lua_State *L, FILE *f) {
   rn.f = f; rn.n = 0;
   decp[0] = lua_getlocaledecpoint();  /* get decimal point from locale */
   decp[1] = '.';  /* always accept a dot */
-  l_lockfile(rn.f);
-  do { rn.c = l_getc(rn.f); } while (isspace(rn.c));  /* skip spaces */
+  do { rn.c = lf_getc(rn.f); } while (isspace(rn.c));  /* skip spaces */
   test2(&rn, "-+");  /* optional sign */
   if (test2(&rn, "00")) {
     if (test2(&rn, "xX")) hex = 1;  /* numeral is hexadecimal */
@@ -490,8 +639,7 @@ static int read_number (lua_State *L, FILE *f) {
     test2(&rn, "-+");  /* exponent sign */
     readdigits(&rn, 0);  /* exponent digits */
   }
-  ungetc(rn.c, rn.f);  /* unread look-ahead char */
-  l_unlockfile(rn.f);
+  lf_ungetc(rn.c, rn.f);  /* unread look-ahead char */
   rn.buff[rn.n] = '\0';  /* finish string */
   if (lua_stringtonumber(L, rn.buff))  /* is this a valid number? */
     return 1;  /* ok */
@@ -502,27 +650,47 @@ static int read_number (lua_State *L, FILE *f) {
 }
 
 
-static int test_eof (lua_State *L, FILE *f) {
-  int c = getc(f);
-  ungetc(c, f);  /* no-op when c == EOF */
+static int test_eof (lua_State *L, LStream *f) {
+  int c = lf_getc(f);
+  lf_ungetc(c, f);  /* no-op when c == EOF */
   lua_pushliteral(L, "");
   return (c != EOF);
 }
 
 
-static int read_line (lua_State *L, FILE *f, int chop) {
+static int read_line (lua_State *L, LStream *f, int chop) {
   luaL_Buffer b;
   int c;
   luaL_buffinit(L, &b);
-  do {  /* may need to read several chunks to get whole line */
-    char *buff = luaL_prepbuffer(&b);  /* preallocate buffer space */
-    int i = 0;
-    l_lockfile(f);  /* no memory errors can happen inside the lock */
-    while (i < LUAL_BUFFERSIZE && (c = l_getc(f)) != EOF && c != '\n')
-      buff[i++] = c;  /* read up to end of line or buffer limit */
-    l_unlockfile(f);
-    luaL_addsize(&b, i);
-  } while (c != EOF && c != '\n');  /* repeat until end of line */
+  if (!isconsole(f)) {  /* scan the buffer directly for the newline */
+    for (;;) {
+      const char *start, *nl;
+      size_t k;
+      if ((f->writing || f->pos >= f->len) && lf_fill(f) == 0) {
+        c = EOF;
+        break;
+      }
+      start = f->buff + f->pos;
+      nl = memchr(start, '\n', (size_t)(f->len - f->pos));
+      k = nl ? (size_t)(nl - start) : (size_t)(f->len - f->pos);
+      luaL_addlstring(&b, start, k);
+      f->pos += (int)k;
+      if (nl) {
+        f->pos++;  /* skip the newline */
+        c = '\n';
+        break;
+      }
+    }
+  }
+  else {
+    do {  /* may need to read several chunks to get whole line */
+      char *buff = luaL_prepbuffer(&b);  /* preallocate buffer space */
+      int i = 0;
+      while (i < LUAL_BUFFERSIZE && (c = lf_getc(f)) != EOF && c != '\n')
+        buff[i++] = c;  /* read up to end of line or buffer limit */
+      luaL_addsize(&b, i);
+    } while (c != EOF && c != '\n');  /* repeat until end of line */
+  }
   if (!chop && c == '\n')  /* want a newline and have one? */
     luaL_addchar(&b, c);  /* add ending newline to result */
   luaL_pushresult(&b);  /* close buffer */
@@ -531,36 +699,36 @@ static int read_line (lua_State *L, FILE *f, int chop) {
 }
 
 
-static void read_all (lua_State *L, FILE *f) {
+static void read_all (lua_State *L, LStream *f) {
   size_t nr;
   luaL_Buffer b;
   luaL_buffinit(L, &b);
   do {  /* read file in chunks of LUAL_BUFFERSIZE bytes */
     char *p = luaL_prepbuffer(&b);
-    nr = fread(p, sizeof(char), LUAL_BUFFERSIZE, f);
+    nr = lf_read(f, p, LUAL_BUFFERSIZE);
     luaL_addsize(&b, nr);
   } while (nr == LUAL_BUFFERSIZE);
   luaL_pushresult(&b);  /* close buffer */
 }
 
 
-static int read_chars (lua_State *L, FILE *f, size_t n) {
+static int read_chars (lua_State *L, LStream *f, size_t n) {
   size_t nr;  /* number of chars actually read */
   char *p;
   luaL_Buffer b;
   luaL_buffinit(L, &b);
   p = luaL_prepbuffsize(&b, n);  /* prepare buffer to read whole block */
-  nr = fread(p, sizeof(char), n, f);  /* try to read 'n' chars */
+  nr = lf_read(f, p, n);  /* try to read 'n' chars */
   luaL_addsize(&b, nr);
   luaL_pushresult(&b);  /* close buffer */
   return (nr > 0);  /* true iff read something */
 }
 
 
-static int g_read (lua_State *L, FILE *f, int first) {
+static int g_read (lua_State *L, LStream *f, int first) {
   int nargs = lua_gettop(L) - 1;
   int n, success;
-  clearerr(f);
+  lf_clearerr(f);
   if (nargs == 0) {  /* no arguments? */
     success = read_line(L, f, 1);
     n = first + 1;  /* to return 1 result */
@@ -597,8 +765,8 @@ static int g_read (lua_State *L, FILE *f, int first) {
       }
     }
   }
-  if (ferror(f))
-    return luaL_fileresult(L, 0, NULL);
+  if (lf_error(f))
+    return lf_result(L, f, 0, NULL);
   if (!success) {
     lua_pop(L, 1);  /* remove last result */
     luaL_pushfail(L);  /* push nil instead */
@@ -607,13 +775,73 @@ static int g_read (lua_State *L, FILE *f, int first) {
 }
 
 
+/*
+** While the standard input is a pipe, a read has to wait until the
+** command writing to the pipe has written enough. The Lua program
+** yields to the shell, which runs the other commands of the pipe, and
+** the read is tried again when the program is resumed. 'ctx' says
+** which function to try again. Only the program's main coroutine can
+** yield to the shell; a read anywhere else waits, while the shell runs
+** the other commands.
+*/
+#define READ_IO		1
+#define READ_F		2
+#define READ_LINES	3
+
+static int read_k (lua_State *L, int status, lua_KContext ctx);
+
+static int isstage (lua_State *L) {
+  int stage;
+  lua_getfield(L, LUA_REGISTRYINDEX, LUA_STAGEKEY);
+  stage = (lua_tothread(L, -1) == L);
+  lua_pop(L, 1);
+  return stage;
+}
+
+
+static int read_mustwait (lua_State *L, LStream *f, int first, int last) {
+  const InterfaceInput *in;
+  int n;
+  if (!isconsole(f) || !ispiped(f) || !lua_isyieldable(L) || !isstage(L))
+    return 0;  /* can't yield: the read waits instead */
+  if (f->pos < f->len)
+    return 0;  /* a character has been pushed back */
+  in = interface_get_input();
+  if (first > last)
+    return !in->ready(in->data, 0);  /* a line */
+  for (n = first; n <= last; n++) {
+    int want = 0;
+    if (lua_type(L, n) == LUA_TNUMBER) {
+      want = (int)lua_tointeger(L, n);
+      if (want < 1) want = 1;
+    }
+    else {
+      const char *p = lua_tostring(L, n);
+      if (p && *p == '*') p++;
+      if (p && *p == 'a') want = -1;
+    }
+    if (!in->ready(in->data, want))
+      return 1;
+  }
+  return 0;
+}
+
+
 static int io_read (lua_State *L) {
-  return g_read(L, getiofile(L, IO_INPUT), 1);
+  LStream *f = getiofile(L, IO_INPUT);
+  if (read_mustwait(L, f, 1, lua_gettop(L) - 1)) {
+    lua_pop(L, 1);  /* the file pushed by 'getiofile' */
+    return lua_yieldk(L, 0, READ_IO, read_k);
+  }
+  return g_read(L, f, 1);
 }
 
 
 static int f_read (lua_State *L) {
-  return g_read(L, tofile(L), 2);
+  LStream *f = tofile(L);
+  if (read_mustwait(L, f, 2, lua_gettop(L)))
+    return lua_yieldk(L, 0, READ_F, read_k);
+  return g_read(L, f, 2);
 }
 
 
@@ -630,7 +858,9 @@ static int io_readline (lua_State *L) {
   luaL_checkstack(L, n, "too many arguments");
   for (i = 1; i <= n; i++)  /* push arguments to 'g_read' */
     lua_pushvalue(L, lua_upvalueindex(3 + i));
-  n = g_read(L, p->f, 2);  /* 'n' is number of results */
+  if (read_mustwait(L, p, 2, lua_gettop(L)))
+    return lua_yieldk(L, 0, READ_LINES, read_k);
+  n = g_read(L, p, 2);  /* 'n' is number of results */
   lua_assert(n > 0);  /* should return at least a nil */
   if (lua_toboolean(L, -n))  /* read at least one value? */
     return n;  /* return them */
@@ -648,30 +878,44 @@ static int io_readline (lua_State *L) {
   }
 }
 
+
+/*
+** Continuation of a read that yielded because its pipe didn't yet hold
+** enough to satisfy it: just try the read again.
+*/
+static int read_k (lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  switch (ctx) {
+    case READ_IO: return io_read(L);
+    case READ_F: return f_read(L);
+    default: return io_readline(L);
+  }
+}
+
 /* }====================================================== */
 
 
-static int g_write (lua_State *L, FILE *f, int arg) {
+static int g_write (lua_State *L, LStream *f, int arg) {
   int nargs = lua_gettop(L) - arg;
   int status = 1;
   for (; nargs--; arg++) {
     if (lua_type(L, arg) == LUA_TNUMBER) {
-      /* optimization: could be done exactly as for strings */
+      char buff[64];  /* large enough for any numeral */
       int len = lua_isinteger(L, arg)
-                ? fprintf(f, LUA_INTEGER_FMT,
+                ? snprintf(buff, sizeof(buff), LUA_INTEGER_FMT,
                              (LUAI_UACINT)lua_tointeger(L, arg))
-                : fprintf(f, LUA_NUMBER_FMT,
+                : snprintf(buff, sizeof(buff), LUA_NUMBER_FMT,
                              (LUAI_UACNUMBER)lua_tonumber(L, arg));
-      status = status && (len > 0);
+      status = status && (len > 0) && lf_write(f, buff, (size_t)len);
     }
     else {
       size_t l;
       const char *s = luaL_checklstring(L, arg, &l);
-      status = status && (fwrite(s, sizeof(char), l, f) == l);
+      status = status && lf_write(f, s, l);
     }
   }
   if (status) return 1;  /* file handle already on stack top */
-  else return luaL_fileresult(L, status, NULL);
+  else return lf_result(L, f, status, NULL);
 }
 
 
@@ -681,26 +925,28 @@ static int io_write (lua_State *L) {
 
 
 static int f_write (lua_State *L) {
-  FILE *f = tofile(L);
+  LStream *f = tofile(L);
   lua_pushvalue(L, 1);  /* push file at the stack top (to be returned) */
   return g_write(L, f, 2);
 }
 
 
 static int f_seek (lua_State *L) {
-  static const int mode[] = {SEEK_SET, SEEK_CUR, SEEK_END};
+  static const StorageSeekWhence mode[] = 
+    {STORAGE_SEEK_SET, STORAGE_SEEK_CUR, STORAGE_SEEK_END};
   static const char *const modenames[] = {"set", "cur", "end", NULL};
-  FILE *f = tofile(L);
+  LStream *f = tofile(L);
   int op = luaL_checkoption(L, 2, "cur", modenames);
   lua_Integer p3 = luaL_optinteger(L, 3, 0);
-  l_seeknum offset = (l_seeknum)p3;
+  int32_t offset = (int32_t)p3;
+  int32_t res;
   luaL_argcheck(L, (lua_Integer)offset == p3, 3,
                   "not an integer in proper range");
-  op = l_fseek(f, offset, mode[op]);
-  if (op)
-    return luaL_fileresult(L, 0, NULL);  /* error */
+  res = lf_seek(f, offset, mode[op]);
+  if (res < 0)
+    return lf_result(L, f, 0, NULL);  /* error */
   else {
-    lua_pushinteger(L, (lua_Integer)l_ftell(f));
+    lua_pushinteger(L, (lua_Integer)res);
     return 1;
   }
 }
@@ -709,22 +955,41 @@ static int f_seek (lua_State *L) {
 static int f_setvbuf (lua_State *L) {
   static const int mode[] = {_IONBF, _IOFBF, _IOLBF};
   static const char *const modenames[] = {"no", "full", "line", NULL};
-  FILE *f = tofile(L);
+  LStream *f = tofile(L);
   int op = luaL_checkoption(L, 2, NULL, modenames);
   lua_Integer sz = luaL_optinteger(L, 3, LUAL_BUFFERSIZE);
-  int res = setvbuf(f, NULL, mode[op], (size_t)sz);
-  return luaL_fileresult(L, res == 0, NULL);
+  int res;
+  if (isconsole(f))
+    res = setvbuf(f->s.f, NULL, mode[op], (size_t)sz);
+  else {  /* the buffer size is fixed; only "no" makes any difference */
+    f->unbuffered = (mode[op] == _IONBF);
+    res = f->unbuffered ? !lf_flush(f) : 0;
+  }
+  return lf_result(L, f, res == 0, NULL);
 }
 
 
+/* write out pending data, and commit it to the filesystem */
+static int aux_flush (lua_State *L, LStream *f) {
+  int ok = lf_flush(f);
+  if (ok && !isconsole(f)) {
+    ErrCode err = storage_file_sync(&f->fd);
+    if (err) {
+      f->err = err;
+      ok = 0;
+    }
+  }
+  return lf_result(L, f, ok, NULL);
+}
+
 
 static int io_flush (lua_State *L) {
-  return luaL_fileresult(L, fflush(getiofile(L, IO_OUTPUT)) == 0, NULL);
+  return aux_flush(L, getiofile(L, IO_OUTPUT));
 }
 
 
 static int f_flush (lua_State *L) {
-  return luaL_fileresult(L, fflush(tofile(L)) == 0, NULL);
+  return aux_flush(L, tofile(L));
 }
 
 
@@ -789,7 +1054,7 @@ static void createmeta (lua_State *L) {
 */
 static int io_noclose (lua_State *L) {
   LStream *p = tolstream(L);
-  p->closef = &io_noclose;  /* keep file opened */
+  p->s.closef = &io_noclose;  /* keep file opened */
   luaL_pushfail(L);
   lua_pushliteral(L, "cannot close standard file");
   return 2;
@@ -799,8 +1064,8 @@ static int io_noclose (lua_State *L) {
 static void createstdfile (lua_State *L, FILE *f, const char *k,
                            const char *fname) {
   LStream *p = newprefile(L);
-  p->f = f;
-  p->closef = &io_noclose;
+  p->s.f = f;
+  p->s.closef = &io_noclose;
   if (k != NULL) {
     lua_pushvalue(L, -1);
     lua_setfield(L, LUA_REGISTRYINDEX, k);  /* add file to registry */
@@ -16,6 +16,9 @@
 #include <string.h>
 #include <time.h>
 
+#include <shell/errcodes.h>
+#include <storage/storage.h>
+
 #include "lua.h"
 
 #include "lauxlib.h"
@@ -155,14 +158,14 @@ static int os_execute (lua_State *L) {
 
 static int os_remove (lua_State *L) {
   const char *filename = luaL_checkstring(L, 1);
-  return luaL_fileresult(L, remove(filename) == 0, filename);
+  return luaL_storageresult(L, storage_rm(filename), filename);
 }
 
 
 static int os_rename (lua_State *L) {
   const char *fromname = luaL_checkstring(L, 1);
   const char *toname = luaL_checkstring(L, 2);
-  return luaL_fileresult(L, rename(fromname, toname) == 0, NULL);
+  return luaL_storageresult(L, storage_rename(fromname, toname), NULL);
 }
 
 
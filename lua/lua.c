@@ -671,3 +671,110 @@ int lua_main (int argc, char **argv) {
   return (result && status == LUA_OK) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
+
+
+/*
+** {==================================================================
+** Stages of a pipe. A program that is one stage of a shell pipe runs
+** as a coroutine in a state of its own, and the shell resumes it
+** whenever there is something in its pipe to read, or room in its
+** pipe to write. 'argv' is as for 'lua_main', with the script name
+** in argv[1].
+** ===================================================================
+*/
+
+/*
+** Body of 'lua_stage_start' (called in protected mode). Returns the
+** coroutine, with the loaded script and its arguments on its stack,
+** or nothing if LUA_INIT failed.
+*/
+static int stagemain (lua_State *L) {
+  int argc = (int)lua_tointeger(L, 1);
+  char **argv = (char **)lua_touserdata(L, 2);
+  lua_State *co;
+  luaL_checkversion(L);
+  luaL_openlibs(L);
+  createargtable(L, argv, argc, 1);
+  lua_gc(L, LUA_GCGEN, 0, 0);
+  if (handle_luainit(L) != LUA_OK)
+    return 0;
+  co = lua_newthread(L);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, LUA_REGISTRYINDEX, LUA_STAGEKEY);
+  if (luaL_loadfile(co, argv[1]) != LUA_OK) {
+    lua_xmove(co, L, 1);
+    return lua_error(L);
+  }
+  pushargs(co);
+  return 1;
+}
+
+
+/*
+** Create the state for a stage, and its coroutine, which is set in
+** '*co'. Returns NULL, having reported the error, if the script can't
+** be loaded. The state is closed with 'lua_close'.
+*/
+lua_State *lua_stage_start (int argc, char **argv, lua_State **co) {
+  int status;
+  lua_State *L = luaL_newstate();
+  if (L == NULL) {
+    l_message(argv[0], shell_strerror(ERR_NOMEM));
+    return NULL;
+  }
+  luapico_init_constants(L);
+  lua_pushcfunction(L, &stagemain);
+  lua_pushinteger(L, argc);
+  lua_pushlightuserdata(L, argv);
+  status = lua_pcall(L, 2, 1, 0);
+  if (report(L, status) != LUA_OK || !lua_isthread(L, -1)) {
+    lua_close(L);
+    return NULL;
+  }
+  *co = lua_tothread(L, -1);  /* stays on the stack of 'L' */
+  return L;
+}
+
+
+/*
+** Report the error that ended a stage's coroutine (first argument),
+** with a traceback. Called in protected mode, because the stage might
+** have failed for want of memory, which the report needs too.
+*/
+static int stagereport (lua_State *L) {
+  lua_State *co = (lua_State *)lua_touserdata(L, 1);
+  const char *msg = lua_tostring(co, -1);
+  if (msg == NULL)
+    msg = lua_pushfstring(L, "(error object is a %s value)",
+                             luaL_typename(co, -1));
+  luaL_traceback(L, co, msg, 0);
+  l_message(progname, lua_tostring(L, -1));
+  return 0;
+}
+
+
+/*
+** Run a stage until it finishes, or yields because it must wait for
+** its pipe. Returns LUA_YIELD in the second case; errors are reported
+** here, with a traceback if there is the memory for one.
+*/
+int lua_stage_resume (lua_State *L, lua_State *co) {
+  int nres, status;
+  int nargs = (lua_status(co) == LUA_OK) ? lua_gettop(co) - 1 : 0;
+  status = lua_resume(co, L, nargs, &nres);
+  if (status == LUA_YIELD)
+    lua_pop(co, nres);
+  else if (status != LUA_OK) {
+    lua_pushcfunction(L, &stagereport);
+    lua_pushlightuserdata(L, co);
+    if (lua_pcall(L, 1, 0, 0) != LUA_OK) {  /* no traceback, then */
+      const char *msg = (lua_type(co, -1) == LUA_TSTRING) ?
+                          lua_tostring(co, -1) : "error in error reporting";
+      l_message(progname, msg);
+    }
+    lua_settop(L, 1);  /* only the coroutine */
+  }
+  return status;
+}
+
+/* }================================================================== */
@@ -327,6 +327,7 @@ LUA_API void (lua_warning)  (lua_State *L, const char *msg, int tocont);
 #define LUA_GCISRUNNING		9
 #define LUA_GCGEN		10
 #define LUA_GCINC		11
+#define LUA_GCNSTEPS		12
 
 LUA_API int (lua_gc) (lua_State *L, int what, ...);
 
@@ -753,6 +753,36 @@
 ** without modifying the main part of the file.
 */
 
+/*
+** picolua: 'print' writes through the terminal interface, so that its
+** output can be piped into another command by the shell.
+*/
+extern void interface_write_stdout (const char *s, size_t len);
+#define lua_writestring(s,l)	interface_write_stdout((s), (l))
+
+/*
+** picolua: error messages are written through the terminal interface
+** too, so that they come out in order with the program's output when
+** the program runs on the second core.
+*/
+extern void interface_write_error (const char *fmt, const char *s);
+#define lua_writestringerror(s,p)	interface_write_error((s), (p))
+
+/*
+** picolua: registry key of the coroutine that runs a program that is
+** one command of a shell pipe, which yields when it has to wait for
+** the pipe.
+*/
+#define LUA_STAGEKEY	"_PIPESTAGE"
+
+/*
+** picolua: registry key that is set in the state of a program that the
+** shell runs in the background. 'pico.sleep_ms' sets it to the time, in
+** milliseconds, until which the program has nothing to do, and yields
+** to the shell, rather than waiting.
+*/
+#define LUA_JOBKEY	"_JOBWAKE"
+
 
 
 
@@ -32,9 +32,11 @@
 
 
 uint8_t shell_get_interrupt(void);
+void shell_job_tick(void);
 void luaL_error(lua_State *L, const char *msg);
 
 void check_for_interrupt(lua_State *L) {
+  shell_job_tick();  /* let the background jobs have a turn */
   if (shell_get_interrupt())
     luaL_error(L, "Interrupted");
 }
@@ -0,0 +1,68 @@
+# Pack the files under ROMFS_DIR into a C source file, ROMFS_OUT, that
+#   holds them as the read-only filesystem image (see
+#   storage/include/storage/romfs.h). Run as a build step:
+#
+#   cmake -DROMFS_DIR=romfs -DROMFS_OUT=romfs_image.c -P romfs.cmake
+#
+# Files are stored exactly as they are, so Lua files can be stored as
+#   source, or precompiled with luac.
+
+file (GLOB_RECURSE files LIST_DIRECTORIES true RELATIVE "${ROMFS_DIR}"
+    "${ROMFS_DIR}/*")
+list (SORT files)
+set (paths "/")
+foreach (f ${files})
+    list (APPEND paths "/${f}")
+endforeach ()
+
+set (out "/* Generated by romfs.cmake from ${ROMFS_DIR} -- do not edit */\n")
+string (APPEND out "#include <stddef.h>\n#include \"storage/romfs.h\"\n\n")
+# 16 bytes to a line
+set (row "")
+foreach (n RANGE 1 16)
+    string (APPEND row "0x..,")
+endforeach ()
+
+set (index "")
+set (total 0)
+set (i 0)
+foreach (p ${paths})
+    if (p MATCHES "[\"\\\\]")
+        message (FATAL_ERROR "romfs: can't store ${p}")
+    endif ()
+    if (p STREQUAL "/")
+        set (parent 0)
+    else ()
+        get_filename_component (dir "${p}" DIRECTORY)
+        list (FIND paths "${dir}" parent)
+    endif ()
+    if (IS_DIRECTORY "${ROMFS_DIR}${p}")
+        string (APPEND index "  { \"${p}\", ${parent}, TRUE, NULL, 0 },\n")
+    else ()
+        file (READ "${ROMFS_DIR}${p}" hex HEX)
+        string (LENGTH "${hex}" size)
+        math (EXPR size "${size} / 2")
+        math (EXPR total "${total} + ${size}")
+        if (size EQUAL 0)
+            set (hex "00")
+        endif ()
+        string (REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," hex "${hex}")
+        string (REGEX REPLACE "(${row})" "\\1\n  " hex "${hex}")
+        string (APPEND out "static const uint8_t file_${i}[] = \n  {\n  ${hex}\n  };\n\n")
+        string (APPEND index "  { \"${p}\", ${parent}, FALSE, file_${i}, ${size} },\n")
+    endif ()
+    math (EXPR i "${i} + 1")
+endforeach ()
+
+string (APPEND out "const RomfsEntry romfs_entries[] = \n  {\n${index}  };\n\n")
+string (APPEND out "const uint32_t romfs_count = ${i};\n")
+string (APPEND out "const uint32_t romfs_size = ${total};\n")
+
+# Don't touch the output if nothing has changed, so it isn't recompiled
+set (old "")
+if (EXISTS "${ROMFS_OUT}")
+    file (READ "${ROMFS_OUT}" old)
+endif ()
+if (NOT old STREQUAL out)
+    file (WRITE "${ROMFS_OUT}" "${out}")
+endif ()
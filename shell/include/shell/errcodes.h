@@ -30,6 +30,13 @@ typedef uint8_t ErrCode;
 #define ERR_NOTIMPLEMENTED  107
 #define ERR_BADPIN          108
 #define ERR_NOTEXECUTABLE   109
+#define ERR_XDEV            110
+#define ERR_ROFS            111
+#define ERR_FALSE           112
+#define ERR_SYNTAX          113
+#define ERR_NOJOB           114
+#define ERR_TOOMANYJOBS     115
+#define ERR_FAILED          116
 
 
 
@@ -6,6 +6,9 @@
 BEGIN_DECLS
 
 extern ErrCode fileutil_copy (const char *source, const char *target);
+/** Copy a file, or a directory and its contents. */
+extern ErrCode fileutil_copy_tree (const char *source, const char *target,
+                 BOOL verbose);
 extern ErrCode fileutil_rename (const char *source, const char *target);
 
 END_DECLS
@@ -56,10 +56,46 @@ extern BOOL    shell_get_interrupt (void);
     running a Lua script from inside the editor. */
 extern void    shell_runlua (const char *filename);
 
+/** The Lua state in which commands registered by Lua are run, which is
+    created the first time it is needed. Returns NULL if there isn't
+    the memory. */
+extern struct lua_State *shell_lua_state (void);
+
 /** Run a single line using the shell. This function returns an error code
     but, on the whole, it will have signalled any problems to the console. */
 extern ErrCode shell_do_line (const char *buff);
 
+/** Run a command whose arguments have already been split and expanded,
+    whether it is a variable assignment, a command in the table, or a
+    file on the PATH. */
+extern ErrCode shell_do_line_argv (int argc, char **argv);
+
+/** Find the file that runs a command that isn't in the table: the 
+    command itself, if it names a file, or else the first of cmd, 
+    cmd.lua, and cmd.sh in each directory of $PATH. path must have 
+    room for MAX_PATH + 1 characters. */
+extern BOOL shell_find_path (const char *cmd, char *path);
+
+/** Find out whether a command is a Lua program, run either as 
+    "lua script args..." or by the name of a .lua file on the PATH. If
+    it is, the file is put in path, and *first is set to the index of
+    its first argument. */
+extern BOOL shell_lua_path (int argc, char **argv, char *path, int *first);
+
+/** Load a Lua program into a state of its own, to run as the coroutine
+    set in *co, which is resumed by lua_stage_resume(). The program's 
+    arguments are the argc strings in argv, which needn't last. Returns 
+    NULL, having reported why, if the program can't be loaded. The 
+    state is closed with lua_close(). */
+extern struct lua_State *shell_lua_start (const char *path, int argc, 
+                 char **argv, struct lua_State **co);
+
+/** Work done while the shell, or a program, waits: a round of the
+    background jobs, if any is ready to run, or else tidying the
+    filesystem, for no longer than budget_us. Returns TRUE if there was
+    anything to do, and might be more. */
+extern BOOL shell_idle (uint32_t budget_us);
+
 /** After formatting storage, this method creates the basic directories. */
 extern void shell_init_storage (void);
 
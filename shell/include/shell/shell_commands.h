@@ -4,6 +4,10 @@
 
   shell/shell_commands.c
 
+  The table of commands that the shell runs itself, rather than looking
+  for a file on the PATH. Each is either a C function, or a Lua function
+  held in the shell's own Lua state, which lasts until reset.
+
   (c)2021 Kevin Boone, GPLv3.0
 
 =========================================================================*/
@@ -13,8 +17,37 @@
 #include <klib/defs.h> 
 #include "shell/errcodes.h"
 
+/** A command implemented in C. The return value is reported by the 
+    shell, if it is non-zero, and stops a script. */
+typedef ErrCode (*ShellCmdFn)(int argc, char **argv);
+
+typedef struct _ShellCommand
+  {
+  struct _ShellCommand *next;   // In the same hash chain
+  ShellCmdFn fn;                // NULL for a Lua function
+  int lua_ref;                  // In the registry of shell_lua_state()
+  char name[];
+  } ShellCommand;
+
 BEGIN_DECLS
 
+/** Add a command implemented in C, replacing any command of the same
+    name. */
+extern ErrCode shell_register_command (const char *name, ShellCmdFn fn);
+/** Add a command implemented by the Lua function with the reference
+    lua_ref in the registry of shell_lua_state(). The command owns the 
+    reference, and releases it when it is replaced or removed. */
+extern ErrCode shell_register_lua_command (const char *name, int lua_ref);
+/** Remove a command. Returns ERR_NOENT if there is no such command. */
+extern ErrCode shell_unregister_command (const char *name);
+/** Returns NULL if there is no such command. */
+extern const ShellCommand *shell_find_command (const char *name);
+/** Run a command from the table. argv[0] is its name. */
+extern ErrCode shell_call_command (const ShellCommand *c, int argc, 
+                 char **argv);
+
+extern ErrCode shell_cmd_lua (int argc, char **argv);
+extern ErrCode shell_cmd_edit (int argc, char **argv);
 extern ErrCode shell_cmd_df (int argc, char **argv);
 extern ErrCode shell_cmd_ls (int argc, char **argv);
 extern ErrCode shell_cmd_mkdir (int argc, char **argv);
@@ -27,6 +60,13 @@ extern ErrCode shell_cmd_cp (int argc, char **argv);
 extern ErrCode shell_cmd_mv (int argc, char **argv);
 extern ErrCode shell_cmd_format (int argc, char **argv);
 extern ErrCode shell_cmd_i2cdetect (int argc, char **argv);
+extern ErrCode shell_cmd_test (int argc, char **argv);
+extern ErrCode shell_cmd_true (int argc, char **argv);
+extern ErrCode shell_cmd_false (int argc, char **argv);
+extern ErrCode shell_cmd_jobs (int argc, char **argv);
+extern ErrCode shell_cmd_fg (int argc, char **argv);
+extern ErrCode shell_cmd_kill (int argc, char **argv);
+extern ErrCode shell_cmd_renice (int argc, char **argv);
 
 END_DECLS
 
@@ -0,0 +1,43 @@
+/*============================================================================
+ * shell_glob.h
+ *
+ * Filename wildcards: *, ?, [...], and ** as a whole part of a path, for
+ * any number of directories. A pattern is compiled once, into a list of path
+ * segments, so that directories named in full are never listed, only
+ * the directories whose names have wildcards are read, and each name
+ * is matched without parsing the pattern again. Matching paths are
+ * passed to a function as they are found, rather than collected.
+ *
+ * Copyright (c)2021 Kevin Boone.
+ * =========================================================================*/
+
+#pragma once
+
+#include <klib/defs.h>
+#include "shell/errcodes.h"
+
+struct _ShellGlob;
+typedef struct _ShellGlob ShellGlob;
+
+/** Called with each path that matches. Returning non-zero stops the
+    expansion, and that error is returned. */
+typedef ErrCode (*ShellGlobFn) (const char *path, void *data);
+
+BEGIN_DECLS
+
+/** Compile a pattern. Returns NULL, with *err zero, if it has no
+    wildcards, so it can only name itself, or NULL with *err set if
+    there isn't the memory. */
+extern ShellGlob *shell_glob_compile (const char *pattern, ErrCode *err);
+
+extern void shell_glob_free (ShellGlob *glob);
+
+/** Find the paths that match. Names that start with . are only matched
+    by a pattern that starts with . too. *matches is set to the number
+    found; directories that can't be read are skipped, as though they
+    were empty. */
+extern ErrCode shell_glob_expand (const ShellGlob *glob, ShellGlobFn fn,
+                 void *data, uint32_t *matches);
+
+END_DECLS
+
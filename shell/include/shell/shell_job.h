@@ -0,0 +1,48 @@
+/*============================================================================
+ * shell_job.h
+ *
+ * Background jobs, as in "lua logger.lua &". Each job is a Lua program in
+ * a state of its own, which runs as a coroutine, and is made to yield
+ * after a number of instructions, set by its priority. The jobs take
+ * turns in rounds, which are run whenever the shell waits for a key, or
+ * a program sleeps, and every SHELL_JOB_TICK_US while a program runs in
+ * the foreground. A job that calls pico.sleep_ms() yields until it is
+ * time for it to wake. The memory that each job's state allocates is
+ * counted, and can be limited.
+ *
+ * Copyright (c)2021 Kevin Boone.
+ * =========================================================================*/
+
+#pragma once
+
+#include <klib/defs.h>
+#include "shell/errcodes.h"
+
+BEGIN_DECLS
+
+/** Start a Lua program, run as "lua script args..." or by the name of a
+    .lua file, as a background job. */
+extern ErrCode shell_job_start (int argc, char **argv);
+
+/** Give each job that is ready to run a turn. Returns TRUE if any job
+    ran. */
+extern BOOL shell_job_round (void);
+
+/** Called often by a program that is running in the foreground, to run
+    a round every SHELL_JOB_TICK_US. Does nothing if there are no jobs,
+    or it's called from a job in the background. */
+extern void shell_job_tick (void);
+
+/** TRUE if the caller is a job in the background, which mustn't take
+    the terminal's keys. */
+extern BOOL shell_job_background (void);
+
+/** Number of jobs that haven't finished. */
+extern int shell_job_count (void);
+
+/** Report the jobs that have finished since the last call, and forget
+    them. Called before the shell's prompt. */
+extern void shell_job_notify (void);
+
+END_DECLS
+
@@ -0,0 +1,28 @@
+/*============================================================================
+ * shell_pipe.h
+ *
+ * Pipes between commands, as in "cat log.txt | lua count.lua". Each Lua
+ * program in a pipe runs as a coroutine, which the shell resumes when
+ * there is something for it to read, or room for it to write, so the
+ * commands take turns, and what passes between them is held in a small
+ * buffer, rather than in a file. One command in a pipe can be a builtin,
+ * or a shell script, which runs as it usually does, and lets the Lua
+ * programs run whenever it reads or writes.
+ *
+ * Copyright (c)2021 Kevin Boone.
+ * =========================================================================*/
+
+#pragma once
+
+#include <klib/defs.h>
+#include "shell/errcodes.h"
+
+BEGIN_DECLS
+
+/** Run n commands, with the output of each piped into the next. The
+    arguments of command i are argvs[i], of which there are argcs[i].
+    Returns the result of the last command. */
+extern ErrCode shell_pipe_run (int n, int *argcs, char ***argvs);
+
+END_DECLS
+
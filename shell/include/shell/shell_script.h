@@ -0,0 +1,50 @@
+/*============================================================================
+ * shell_script.h
+ *
+ * Shell scripts. A script is parsed once, into a list of operations --
+ * commands, with their words already split and unquoted, and the jumps
+ * that implement if, while, and for -- and running it just steps
+ * through the list. Scripts run from files are kept, compiled, in a
+ * small cache, so a script that is run over and over is only read
+ * again if the filesystem has changed, and only parsed again if the
+ * file itself has.
+ *
+ * Copyright (c)2021 Kevin Boone.
+ * =========================================================================*/
+
+#pragma once
+
+#include <klib/defs.h>
+#include "shell/errcodes.h"
+
+struct _ShellScript;
+typedef struct _ShellScript ShellScript;
+
+BEGIN_DECLS
+
+/** Parse a script, of length len, which need not be zero-terminated.
+    The name is used in syntax error messages, which are printed here.
+    Returns NULL, and sets *err, if the script can't be parsed. */
+extern ShellScript *shell_script_compile (const char *name,
+                  const char *text, uint32_t len, ErrCode *err);
+
+/** Run a compiled script, with argv[0] as $0, and so on. A command
+    that fails stops the script, unless it is the condition of an if
+    or a while, and its error is returned. */
+extern ErrCode shell_script_run (ShellScript *script, int argc,
+                  char **argv);
+
+/** Let go of a script. It is freed when nothing is using it, so a
+    script that is running survives being dropped from the cache. */
+extern void shell_script_free (ShellScript *script);
+
+/** Run a script from a file, through the cache. */
+extern ErrCode shell_script_run_file (const char *path, int argc,
+                  char **argv);
+
+/** Run a line that the user typed, which is parsed as a script, but
+    isn't cached. */
+extern ErrCode shell_script_run_line (const char *line);
+
+END_DECLS
+
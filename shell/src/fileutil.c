@@ -24,39 +24,40 @@
 =========================================================================*/
 ErrCode fileutil_copy (const char *source, const char *target)
   {
-  ErrCode ret = 0;
+  ErrCode ret = storage_copy_file (source, target);
+  if (ret == ERR_INTERRUPTED)
+    shell_write_error (ret);
+  else if (ret)
+    shell_write_error_filename (ret, source);
+  return ret;
+  }
 
-  uint8_t buff[256];
-
-  ret = storage_write_file (target, "", 0); 
-  if (ret == 0)
-     {
-     int offset = 0;
-     int n = 0;
-     do
-       {
-       ret = storage_read_partial (source, offset, sizeof (buff), 
-               buff, &n); 
-       if (ret == 0)
-         {
-         ret = storage_append_file (target, buff, n);
-         if (ret)
-           shell_write_error_filename (ret, target);
-         }
-       else
-         shell_write_error_filename (ret, source);
-
-       offset += sizeof (buff);
-       } while (n == sizeof (buff) && ret == 0 && !shell_get_interrupt());
-     }
-  else
-     {
-     shell_write_error_filename (ret, target);
-     }
-  if (shell_get_interrupt())
-    {
-    shell_write_error (ERR_INTERRUPTED);
-    }
+/*=========================================================================
+
+  fileutil_copy_tree_verbose
+
+=========================================================================*/
+static void fileutil_copy_tree_verbose (const char *from, const char *to,
+     void *user_data)
+  {
+  (void)to; (void)user_data;
+  interface_write_stringln (from); 
+  }
+
+/*=========================================================================
+
+  fileutil_copy_tree
+
+=========================================================================*/
+ErrCode fileutil_copy_tree (const char *source, const char *target,
+     BOOL verbose)
+  {
+  ErrCode ret = storage_copy_tree (source, target, 
+    verbose ? fileutil_copy_tree_verbose : NULL, NULL);
+  if (ret == ERR_INTERRUPTED)
+    shell_write_error (ret);
+  else if (ret)
+    shell_write_error_filename (ret, source);
   return ret;
   }
 
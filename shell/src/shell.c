@@ -14,7 +14,6 @@
 #include <string.h> 
 #include <stdlib.h> 
 #include <getopt.h> 
-#include <fnmatch.h> 
 #include <libluapico/libluapico.h>
 #include "shell/shell.h" 
 #include "pico/stdlib.h" 
@@ -24,25 +23,28 @@
 #include <klib/defs.h> 
 #include <klib/string.h> 
 #include <interface/interface.h>
-#include <interface/compat.h>
+#include <interface/core.h>
 #include <klib/term.h> 
 #include <storage/storage.h>
 #include <config.h>
 #include <bute2/bute2.h>
 #include "shell/errcodes.h"
 #include "shell/shell_commands.h"
+#include "shell/shell_script.h"
+#include "shell/shell_job.h"
 
 #define SHELL_RC_FILE "/etc/shellrc.sh"
 #define LUA_RC_FILE "/etc/luarc.lua"
 
-extern char *file_bin_blink_lua;
 extern char *file_etc_luarc_lua;
 extern char *file_etc_shellrc_sh;
 
 extern int lua_main (int argc, char **argv);
+extern lua_State *lua_stage_start (int argc, char **argv, lua_State **co);
 
 BOOL interrupted = FALSE;
 lua_State *global_L = NULL;
+static lua_State *shell_L = NULL;
 
 ErrCode shell_do_line (const char *buff); // FWD
 
@@ -79,6 +81,13 @@ const char *shell_strerror (ErrCode err)
     case ERR_NOTIMPLEMENTED: return "Feature not implemented";  
     case ERR_BADPIN: return "Bad pin number";  
     case ERR_NOTEXECUTABLE: return "Not executable";  
+    case ERR_XDEV: return "Cross-device link";  // ..a directory move
+    case ERR_ROFS: return "Read-only filesystem";  
+    case ERR_FALSE: return "False";  // ..from test, which prints nothing
+    case ERR_SYNTAX: return "Syntax error";  // ..in a script
+    case ERR_NOJOB: return "No such job";  
+    case ERR_TOOMANYJOBS: return "Too many jobs";  
+    case ERR_FAILED: return "Program failed";  // ..and has said why
     }
   return "Unknown error";
   }
@@ -87,11 +96,16 @@ const char *shell_strerror (ErrCode err)
 
   shell_write_error
 
+  Errors go to the terminal, even from a command whose output is piped
+
 =========================================================================*/
 void shell_write_error (ErrCode err)
   {
+  const InterfaceOutput *output = interface_get_output ();
+  interface_set_output (NULL);
   interface_write_string (shell_strerror (err));
   interface_write_endl();
+  interface_set_output (output);
   }
 
 /*=========================================================================
@@ -101,10 +115,13 @@ void shell_write_error (ErrCode err)
 =========================================================================*/
 void shell_write_error_filename (ErrCode err, const char *filename)
   {
+  const InterfaceOutput *output = interface_get_output ();
+  interface_set_output (NULL);
   interface_write_string (filename);
   interface_write_string (": ");
   interface_write_string (shell_strerror (err));
   interface_write_endl();
+  interface_set_output (output);
   }
 
 /*=========================================================================
@@ -145,6 +162,8 @@ void shell_set_interrupt (void)
 =========================================================================*/
 BOOL shell_get_interrupt (void)
   {
+  // The interrupt key is for the program in the foreground
+  if (shell_job_background ()) return FALSE;
   if (interface_is_interrupt_key())
     interrupted = TRUE;
   return interrupted;
@@ -182,17 +201,57 @@ extern void shell_runlua (const char *filename)
     }
   }
 
+/*=========================================================================
+
+  shell_lua_state
+
+  The Lua state that holds commands added by shell.register(). Unlike 
+  the state that the lua command creates, it lasts until reset, so its 
+  globals are kept from one command to the next.
+
+=========================================================================*/
+lua_State *shell_lua_state (void)
+  {
+  if (!shell_L)
+    {
+    shell_L = luaL_newstate ();
+    if (shell_L)
+      {
+      luapico_init_constants (shell_L);
+      luaL_openlibs (shell_L);
+      }
+    }
+  return shell_L;
+  }
+
 /*=========================================================================
 
   shell_cmd_edit
 
 =========================================================================*/
-void shell_cmd_edit (int argc, char **argv)
+ErrCode shell_cmd_edit (int argc, char **argv)
   {
   if (argc >= 2)
     bute_run (argv[1]);
   else
     bute_run (NULL);
+  return 0;
+  }
+
+/*=========================================================================
+
+  shell_cmd_lua
+
+  Errors in the Lua program are reported by Lua itself, so the shell
+  doesn't report them again; but the program's failure is returned as
+  ERR_FAILED, for $? and for conditions in scripts.
+
+=========================================================================*/
+ErrCode shell_cmd_lua (int argc, char **argv)
+  {
+  if (interface_core_run (lua_main, argc, argv) != EXIT_SUCCESS)
+    return ERR_FAILED;
+  return 0;
   }
 
 /*=========================================================================
@@ -202,7 +261,8 @@ void shell_cmd_edit (int argc, char **argv)
   The function wraps a call to lua_main, which expects to be called
   with convention argc/argv. It is used when invoking Lua directly as
   a filename. The function essentially shifts argv up one place, and
-  inserts "lua" as argv[0].
+  inserts "lua" as argv[0]. As for shell_cmd_lua, a program that fails
+  returns ERR_FAILED.
 
 =========================================================================*/
 ErrCode shell_run_lua_main (const char *path, int argc, char **argv)
@@ -221,7 +281,8 @@ ErrCode shell_run_lua_main (const char *path, int argc, char **argv)
       }
     newargv[newargc] = NULL;
 
-    ret = lua_main (newargc, newargv);
+    if (interface_core_run (lua_main, newargc, newargv) != EXIT_SUCCESS)
+      ret = ERR_FAILED;
  
     free (newargv);
     }
@@ -235,72 +296,93 @@ ErrCode shell_run_lua_main (const char *path, int argc, char **argv)
 
 /*=========================================================================
 
-  shell_run_script
+  shell_find_path_try
+
+=========================================================================*/
+static BOOL shell_find_path_try (const char *dir, const char *cmd, 
+          const char *suffix, char *path) 
+  {
+  storage_join_path (dir, cmd, path);
+  strcat (path, suffix);
+  return storage_file_exists (path);
+  }
+
+/*=========================================================================
 
-  This is a very crude, line-by-line, approach to scripts
+  shell_find_path
 
 =========================================================================*/
-ErrCode shell_run_script (const char *mypath, int argc, char **argv)
+BOOL shell_find_path (const char *cmd, char *path)
   {
-  (void)argc; (void)argv;
-  int n; 
-  char *buff;
-  ErrCode ret = storage_read_file (mypath, (uint8_t **)&buff, &n);
-   
-  if (ret == 0)
+  const char *env = getenv("PATH");
+  char mypath[MAX_PATH + 1];
+  if (env)
+    strncpy (mypath, env, MAX_PATH);
+  else
+    strncpy (mypath, ".", MAX_PATH);
+  mypath[MAX_PATH] = 0;
+
+  // Try the complete filename, without path or suffix
+  if (shell_find_path_try ("", cmd, "", path)) return TRUE;
+
+  char *saveptr;
+  char *s = strtok_r (mypath, ":", &saveptr);
+  while (s)
     {
-    char *saveptr;
-    buff = realloc (buff, n + 1);
-    buff[n] = 0;
-    char *line = strtok_r (buff, "\n", &saveptr);
-    while (line && (ret == 0))
-      {
-      ret = shell_do_line (line);
-      line = strtok_r (NULL, "\n", &saveptr);
-      }
-    free (buff);
+    if (shell_find_path_try (s, cmd, "", path)
+         || shell_find_path_try (s, cmd, ".lua", path)
+         || shell_find_path_try (s, cmd, ".sh", path))
+      return TRUE;
+    s = strtok_r (NULL, ":", &saveptr);
     }
-  else
+  return FALSE;
+  }
+
+/*=========================================================================
+
+  shell_lua_path
+
+=========================================================================*/
+BOOL shell_lua_path (int argc, char **argv, char *path, int *first)
+  {
+  if (argc == 0) return FALSE;
+  if (strcmp (argv[0], "lua") == 0)
     {
-    shell_write_error_filename (ret, mypath);
+    if (argc < 2 || argv[1][0] == '-') return FALSE;
+    strncpy (path, argv[1], MAX_PATH);
+    path[MAX_PATH] = 0;
+    *first = 2;
+    return TRUE;
     }
-  return ret;
+  if (shell_find_command (argv[0]) || !shell_find_path (argv[0], path))
+    return FALSE;
+  const char *e = strrchr (path, '.');
+  *first = 1;
+  return e && strcmp (e, ".lua") == 0;
   }
 
 /*=========================================================================
 
-  shell_find_and_execute_try
+  shell_lua_start
 
 =========================================================================*/
-static ErrCode shell_find_and_execute_try (const char *dir, const char*cmd, 
-          const char *suffix, int argc, char **argv) 
+lua_State *shell_lua_start (const char *path, int argc, char **argv, 
+              lua_State **co)
   {
-  ErrCode ret = ERR_BADCOMMAND;
-  char mypath[MAX_PATH + 1];
-  storage_join_path (dir, cmd, mypath);
-  strcat (mypath, suffix);
-  if (storage_file_exists (mypath))
+  char **newargv = malloc ((size_t)(argc + 3) * sizeof (char *));
+  if (!newargv)
     {
-    const char *e = strrchr (mypath, '.');
-    if (e)
-      {
-      if (strcmp (e, ".lua") == 0)
-        {
-        shell_run_lua_main (mypath, argc, argv);
-        }
-      else if (strcmp (e, ".sh") == 0)
-        {
-        shell_run_script (mypath, argc, argv);
-        }
-      else 
-        {
-        ret = ERR_NOTEXECUTABLE;
-        shell_write_error_filename (ret, mypath);
-        }
-      } 
-    ret = 0; 
+    shell_write_error (ERR_NOMEM);
+    return NULL;
     }
-  return ret;
+  newargv[0] = "lua";
+  newargv[1] = (char *)path;
+  for (int i = 0; i < argc; i++)
+    newargv[i + 2] = argv[i];
+  newargv[argc + 2] = NULL;
+  lua_State *L = lua_stage_start (argc + 2, newargv, co);
+  free (newargv);
+  return L;
   }
 
 /*=========================================================================
@@ -310,34 +392,26 @@ static ErrCode shell_find_and_execute_try (const char *dir, const char*cmd,
 =========================================================================*/
 static ErrCode shell_find_and_execute (int argc, char **argv)
   {
-  ErrCode ret = ERR_BADCOMMAND;
-  const char *path = getenv("PATH");
-  const char *cmd = argv[0];
+  ErrCode ret = 0;
   char mypath[MAX_PATH + 1];
-  if (path)
-    strncpy (mypath, path, MAX_PATH);
-  else
-    strncpy (mypath, ".", MAX_PATH);
-
-  // Try the complete filename, without path or suffix
-  ret = shell_find_and_execute_try ("", cmd, "", argc, argv);
-  if (ret == ERR_BADCOMMAND) 
-    { 
-    char *saveptr;
-    char *s = strtok_r (mypath, ":", &saveptr);
-    while (s && (ret == ERR_BADCOMMAND))
+  if (shell_find_path (argv[0], mypath))
+    {
+    const char *e = strrchr (mypath, '.');
+    if (e && strcmp (e, ".lua") == 0)
+      ret = shell_run_lua_main (mypath, argc, argv);
+    else if (e && strcmp (e, ".sh") == 0)
+      ret = shell_script_run_file (mypath, argc, argv);
+    else if (e)
       {
-      ret = shell_find_and_execute_try (s, cmd, "", argc, argv);
-      if (ret == ERR_BADCOMMAND) 
-        ret = shell_find_and_execute_try (s, cmd, ".lua", argc, argv);
-      if (ret == ERR_BADCOMMAND) 
-        ret = shell_find_and_execute_try (s, cmd, ".sh", argc, argv);
-      s = strtok_r (NULL, ":", &saveptr);
+      ret = ERR_NOTEXECUTABLE;
+      shell_write_error_filename (ret, mypath);
       }
     }
-
-  if (ret == ERR_BADCOMMAND)
-    shell_write_error_filename (ERR_BADCOMMAND, argv[0]); 
+  else
+    {
+    ret = ERR_BADCOMMAND;
+    shell_write_error_filename (ret, argv[0]); 
+    }
 
   return ret;
   }
@@ -371,46 +445,22 @@ void shell_do_variable (const char *expr)
 
   shell_do_line_argv
 
+  Commands in the table, whether builtins or registered, are found 
+  before anything on the PATH.
+
 =========================================================================*/
 ErrCode shell_do_line_argv (int argc, char **argv)
   {
   ErrCode ret = 0;
   if (argc == 0) return 0;
 
+  const ShellCommand *c;
   if (argc == 1 && strchr (argv[0], '='))
     { 
     shell_do_variable (argv[0]);
     }
-  else if (strcmp (argv[0], "lua") == 0)
-    lua_main (argc, argv);
-  else if (strcmp (argv[0], "edit") == 0)
-    shell_cmd_edit (argc, argv);
-  else if (strcmp (argv[0], "df") == 0)
-    ret = shell_cmd_df (argc, argv);
-  else if (strcmp (argv[0], "ls") == 0)
-    ret = shell_cmd_ls (argc, argv);
-  else if (strcmp (argv[0], "mkdir") == 0)
-    ret = shell_cmd_mkdir (argc, argv);
-  else if (strcmp (argv[0], "rmdir") == 0)
-    ret = shell_cmd_rm (argc, argv);
-  else if (strcmp (argv[0], "rm") == 0)
-    ret = shell_cmd_rm (argc, argv);
-  else if (strcmp (argv[0], "echo") == 0)
-    ret = shell_cmd_echo (argc, argv);
-  else if (strcmp (argv[0], "cat") == 0)
-    ret = shell_cmd_cat (argc, argv);
-  else if (strcmp (argv[0], "yrecv") == 0)
-    ret = shell_cmd_yrecv (argc, argv);
-  else if (strcmp (argv[0], "ysend") == 0)
-    ret = shell_cmd_ysend (argc, argv);
-  else if (strcmp (argv[0], "cp") == 0)
-    ret = shell_cmd_cp (argc, argv);
-  else if (strcmp (argv[0], "mv") == 0)
-    ret = shell_cmd_cp (argc, argv);
-  else if (strcmp (argv[0], "format") == 0)
-    ret = shell_cmd_format (argc, argv);
-  else if (strcmp (argv[0], "i2cdetect") == 0)
-    ret = shell_cmd_i2cdetect (argc, argv);
+  else if ((c = shell_find_command (argv[0])))
+    ret = shell_call_command (c, argc, argv);
   else 
     ret = shell_find_and_execute (argc, argv);
     
@@ -421,110 +471,13 @@ ErrCode shell_do_line_argv (int argc, char **argv)
 
   shell_do_line
 
+  A line is compiled as a script of its own, so it can hold variables,
+  several commands separated by ;, and even a whole loop
+
 =========================================================================*/
 ErrCode shell_do_line (const char *buff)
   { 
-  ErrCode ret = 0;
-  String *sbuff = string_create (buff);
-  List *args = string_tokenize (sbuff);
-  int l = list_length (args);  
-  char **argv = malloc ((l + 1) * sizeof (char *));
-
-  if (argv)
-    {
-    for (int i = 0; i < l; i++)
-      {
-      const String *arg = list_get (args, i);
-      argv[i] = strdup (string_cstr (arg));
-      }
-    argv[l] = NULL;
-
-    int argc = l;
-    ret = shell_do_line_argv (argc, argv);
-
-    for (int i = 0; i < l; i++)
-      {
-      free (argv[i]);
-      }
-
-    free (argv);
-    } 
-  else
-    {
-    shell_write_error (ERR_NOMEM);
-    }
-
-  list_destroy (args);
-  string_destroy (sbuff);
-  return ret;
-  }
-
-/*=========================================================================
-
-  shell_glob_match
-
-=========================================================================*/
-BOOL shell_glob_match (const char *filename, const char *match)
-  {
-  return !my_fnmatch (match, filename, 0);
-  }
-
-/*=========================================================================
-
-  shell_globber
-
-=========================================================================*/
-static void shell_globber  (String *token, List *list)
-  {
-  char basename[MAX_FNAME + 1];
-  char dir[MAX_PATH + 1];
-  const char *c_token = string_cstr (token);
-  if (!(strchr (c_token, '*') || strchr (c_token, '?')))
-    {
-    list_append (list, token);
-    return;
-    }
-
-  storage_get_basename (c_token, basename);
-  storage_get_dir (string_cstr (token), dir);
-  //printf ("basename=%s\n", basename);
-  //printf ("dir=%s\n", dir);
-  BOOL matched = FALSE;
-
-  List *list2 = list_create (free);
-  if (list2)
-    {
-    if (storage_list_dir (dir, list2) == 0)
-      {
-      int l = list_length (list2);
-      for (int i = 0; i < l; i++)
-        {
-        const char *fname = list_get (list2, i);
-	if (fname[0] == '.') continue;
-        if (shell_glob_match (fname, basename))
-          {
-          char newpath[MAX_PATH + 1];
-	  storage_join_path (dir, fname, newpath);
-          list_append (list, string_create (newpath)); 
-	  matched = TRUE;
-          }
-	}
-      }
-    else
-      {
-      // Silently swallow error
-      }
-    list_destroy (list2);
-    }
-  else
-    {
-    // Silently swallow error
-    }
-  
-  if (matched)
-    string_destroy (token);
-  else
-    list_append (list, token);
+  return shell_script_run_line (buff);
   }
 
 /*=========================================================================
@@ -534,7 +487,7 @@ static void shell_globber  (String *token, List *list)
 =========================================================================*/
 void shell_init_environment (void)
   {
-  setenv ("PATH", "/bin", TRUE); // TODO
+  setenv ("PATH", "/bin:" STORAGE_ROM_PATH "/bin", TRUE);
   setenv ("LUA_INIT", "@/etc/luarc.lua", TRUE); 
   }
 
@@ -550,8 +503,6 @@ void shell_init_storage (void)
   storage_mkdir ("/bin");
   storage_mkdir ("/etc");
   storage_mkdir ("/lib");
-  storage_write_file ("/bin/blink.lua", file_bin_blink_lua, 
-    strlen (file_bin_blink_lua));
   if (!storage_file_exists (LUA_RC_FILE))
     {
     storage_write_file (LUA_RC_FILE, file_etc_luarc_lua, 
@@ -566,6 +517,35 @@ void shell_init_storage (void)
     }
   }
 
+/*=========================================================================
+
+  shell_idle
+
+  The background jobs come first; the filesystem is tidied when none of
+  them is ready to run. What has been written, by a job or otherwise,
+  is committed once it has waited for STORAGE_SYNC_MS, even if the 
+  jobs never leave the CPU idle.
+
+=========================================================================*/
+BOOL shell_idle (uint32_t budget_us)
+  {
+  storage_sync_old ();
+  if (shell_job_round ()) return TRUE;
+  return storage_idle (budget_us);
+  }
+
+/*=========================================================================
+
+  shell_wait_idle
+
+  Called while the shell waits for a key
+
+=========================================================================*/
+static BOOL shell_wait_idle (void)
+  {
+  return shell_idle (STORAGE_IDLE_BUDGET_US);
+  }
+
 /*=========================================================================
 
   shell_main
@@ -578,6 +558,7 @@ void shell_main()
   interface_init ();
   shell_init_environment ();
   shell_init_storage ();
+  interface_set_idle_fn (shell_wait_idle);
 
  // while (true)
  //   {
@@ -586,16 +567,16 @@ void shell_main()
  //   }
   
   List *history = list_create (free);
-  string_tok_globber = shell_globber;
 
   if (storage_file_exists (SHELL_RC_FILE))
     {
     char *argv[]  = {"picolua"};
-    shell_run_script (SHELL_RC_FILE, 1, argv);
+    shell_script_run_file (SHELL_RC_FILE, 1, argv);
     }
 
   char buff [READLINE_MAXINPUT + 1];
-  while (interface_write_buff ("$ ", 2), 
+  while (storage_sync (), shell_job_notify (), 
+      interface_write_buff ("$ ", 2), 
       term_get_line (buff, sizeof (buff), &interrupted, 
       READLINE_MAX_HISTORY, history))
     {
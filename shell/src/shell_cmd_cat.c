@@ -28,6 +28,57 @@ static void shell_cmd_cat_usage (void)
   interface_write_stringln ("Usage: cat {files...}");
   }
 
+/*=========================================================================
+
+  shell_cmd_cat_file
+
+  The file is written as it is read, a buffer at a time, so a large file
+  needs no more memory than a small one, and a command that it is piped
+  into can start on it straight away
+
+=========================================================================*/
+static ErrCode shell_cmd_cat_file (const char *path)
+  {
+  StorageReader r;
+  ErrCode ret = storage_reader_open (&r, path);
+  if (ret == 0)
+    {
+    const char *chunk;
+    uint32_t n;
+    while ((chunk = storage_reader_chunk (&r, &n)) 
+         && !shell_get_interrupt ())
+      interface_write_buff (chunk, (int)n);
+    ret = r.err;
+    storage_reader_close (&r);
+    }
+  if (ret != 0)
+    shell_write_error_filename (ret, path);
+  return ret;
+  }
+
+/*=========================================================================
+
+  shell_cmd_cat_input
+
+  With no files, cat copies its input, when that is a pipe
+
+=========================================================================*/
+static void shell_cmd_cat_input (void)
+  {
+  char buff[64];
+  int n = 0, c;
+  while ((c = interface_get_char ()) >= 0)
+    {
+    buff[n++] = (char)c;
+    if (n == sizeof (buff) || c == '\n')
+      {
+      interface_write_buff (buff, n);
+      n = 0;
+      }
+    }
+  if (n > 0) interface_write_buff (buff, n);
+  }
+
 /*=========================================================================
 
   shell_cmd_cat
@@ -54,7 +105,11 @@ ErrCode shell_cmd_cat (int argc, char **argv)
 
   if (ret == 0)
     {
-    if (optind == argc)
+    if (optind == argc && interface_get_input ())
+      {
+      shell_cmd_cat_input ();
+      }
+    else if (optind == argc)
       {
       shell_cmd_cat_usage ();
       ret = ERR_USAGE;
@@ -62,18 +117,9 @@ ErrCode shell_cmd_cat (int argc, char **argv)
     else
       {
       for (int i = optind; i < argc && ret == 0; i++)
-        {
-	uint8_t *buff;
-	int len;
-	ret = storage_read_file (argv[i], &buff, &len);
-	if (ret == 0)
-	  {
-          interface_write_buff ((char *)buff, len);
-	  free (buff);
-	  }
-	else
-	  shell_write_error_filename (ret, argv[i]);
-        }
+        ret = shell_cmd_cat_file (argv[i]);
+      if (ret == 0 && shell_get_interrupt ())
+        ret = ERR_INTERRUPTED;
       }
     }
 
@@ -81,5 +127,3 @@ ErrCode shell_cmd_cat (int argc, char **argv)
   return ret;
   }
 
-
-
@@ -27,7 +27,10 @@ static void shell_cmd_cp_usage (const char *cmd)
   {
   interface_write_string ("Usage: "); 
   interface_write_string (cmd); 
-  interface_write_stringln (" [-v] {files...} {file | directory}");
+  if (strcmp (cmd, "cp") == 0)
+    interface_write_stringln (" [-rv] {files...} {file | directory}");
+  else
+    interface_write_stringln (" [-v] {files...} {file | directory}");
   }
 
 /*=========================================================================
@@ -42,13 +45,18 @@ ErrCode shell_cmd_cp_or_mv (int argc, char **argv, const char *cmd)
   ErrCode ret = 0;
   BOOL usage = FALSE;
   BOOL verbose = FALSE;
-  while ((opt = getopt (argc, argv, "hv")) != -1) 
+  BOOL recursive = FALSE;
+  BOOL is_cp = (strcmp (cmd, "cp") == 0);
+  while ((opt = getopt (argc, argv, is_cp ? "hrv" : "hv")) != -1) 
     {
     switch (opt)
       { 
       case 'v':
         verbose = TRUE;
         break;
+      case 'r':
+        recursive = TRUE;
+        break;
       case 'h':
         usage = TRUE;
         // Fall through
@@ -100,10 +108,26 @@ ErrCode shell_cmd_cp_or_mv (int argc, char **argv, const char *cmd)
             }
           else
             strncpy (real_target, raw_target, MAX_PATH);
+          if (is_cp && recursive)
+            {
+            // The copy reports each item itself
+            ret = fileutil_copy_tree (source, real_target, verbose);
+            continue;
+            }
           if (verbose)
             interface_write_stringln (source); 
-          if (strcmp (cmd, "cp") == 0)
-            ret = fileutil_copy (source, real_target); 
+          if (is_cp)
+            {
+            FileInfo sinfo;
+            if (storage_info (source, &sinfo) == 0 
+                 && sinfo.type == STORAGE_TYPE_DIR)
+              {
+              ret = ERR_ISDIR;
+              shell_write_error_filename (ret, source);
+              }
+            else
+              ret = fileutil_copy (source, real_target); 
+            }
           else
             ret = fileutil_rename (source, real_target);
           }
@@ -37,24 +37,28 @@ ErrCode shell_cmd_df (int argc, char **argv)
         human = TRUE;
         break;
       default:
-        interface_write_stringln ("Usage: df [-k]");
+        interface_write_stringln ("Usage: df [-k] [path]");
         ret = ERR_USAGE;
       }
     }
 
   if (ret == 0)
     {
-    ErrCode err = storage_df (NULL, &used, &total);
+    // Each filesystem has its own space; the path says which
+    ErrCode err = storage_df (optind < argc ? argv[optind] : NULL, 
+      &used, &total);
     if (err == 0)
       {
+      char buff [80];
       if (human)
-        printf ("Used: %ldk, total %ldk, free: %ldk", used / 1024,  
-        total / 1024, 
-        (total - used) / 1024);
+        snprintf (buff, sizeof (buff), "Used: %luk, total %luk, free: %luk", 
+        (unsigned long)used / 1024, (unsigned long)total / 1024, 
+        (unsigned long)(total - used) / 1024);
       else
-        printf ("Used: %ld, total %ld, free: %ld", used, total, 
-        total - used);
-      interface_write_endl();
+        snprintf (buff, sizeof (buff), "Used: %lu, total %lu, free: %lu", 
+        (unsigned long)used, (unsigned long)total, 
+        (unsigned long)(total - used));
+      interface_write_stringln (buff);
       }
     else
       { 
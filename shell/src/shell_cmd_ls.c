@@ -20,58 +20,44 @@
 
 /*=========================================================================
 
-  shell_cmd_ls
+  shell_cmd_dols
+
+  The list holds StorageDirEntry*, so the sizes and types are already 
+  known, and nothing has to be looked up again for each entry.
 
 =========================================================================*/
-static void shell_cmd_dols (const char *path, const List *list, 
-     BOOL lng)
+static void shell_cmd_dols (const List *list, BOOL lng)
   {
-  char result [MAX_PATH + 1];
   char s[20]; // For converting numbers
-  int l = list_length (list);
   uint max_name = 0;
   uint32_t max_size = 0;
+  const StorageDirEntry *entry;
+  void *pos = NULL;
 
-  for (int i = 0; i < l; i++)
+  while ((entry = list_next (list, &pos)))
     {
-    const char *fname = list_get (list, i);
-    uint l = strlen (fname);
+    uint l = strlen (entry->name);
     if (l > max_name) max_name = l;
-   
-    storage_join_path (path, fname, result); 
-    FileInfo info;
-    if (storage_info (result, &info) == 0)
-      {
-      if (info.size > max_size) max_size = info.size;
-      }
+    if (entry->size > max_size) max_size = entry->size;
     }
 
-  sprintf (s, "%lu", max_size);
+  sprintf (s, "%lu", (unsigned long)max_size);
   int sizelen = strlen (s);
 
+  pos = NULL;
   if (lng)
     {
-    for (int i = 0; i < l; i++)
+    while ((entry = list_next (list, &pos)))
       {
-      const char *fname = list_get (list, i);
-      storage_join_path (path, fname, result); 
-      FileInfo info;
-      if (storage_info (result, &info) == 0)
-	{
-	char line [MAX_FNAME + 20];
-	char pad[20];
-	strcpy (pad, "                   ");
-	sprintf (s, "%lu", info.size);
-	pad [sizelen - strlen (s)] = 0;
-	sprintf (line, "%s %s%s %s", 
-	  info.type == STORAGE_TYPE_REG ? "     " : "<dir>", pad, 
-	  s, fname);
-	interface_write_string (line);
-	}
-      else
-	{
-	interface_write_string (fname);
-	}
+      char line [MAX_FNAME + 20];
+      char pad[20];
+      strcpy (pad, "                   ");
+      sprintf (s, "%lu", (unsigned long)entry->size);
+      pad [sizelen - strlen (s)] = 0;
+      sprintf (line, "%s %s%s %s", 
+        entry->type == STORAGE_TYPE_REG ? "     " : "<dir>", pad, 
+        s, entry->name);
+      interface_write_string (line);
       interface_write_endl();
       }
     }
@@ -87,9 +73,9 @@ static void shell_cmd_dols (const char *path, const List *list,
       per_row = cols / (max_name + 2);
     per_row--;
     int n = 0;
-    for (int i = 0; i < l; i++)
+    while ((entry = list_next (list, &pos)))
       {
-      const char *fname = list_get (list, i);
+      const char *fname = entry->name;
       for (int j = 0; j < (int)(1 + max_name - strlen (fname)); j++)
         {
         pad[j] = ' ';
@@ -125,7 +111,7 @@ ErrCode shell_cmd_lsone (const char *path, BOOL lng, BOOL show_dir)
       {
       if (info.type == STORAGE_TYPE_DIR)
         {
-        ret = storage_list_dir (path, list);
+        ret = storage_list_dir_ex (path, list);
         if (ret == 0)
           {
           if (show_dir)
@@ -134,7 +120,7 @@ ErrCode shell_cmd_lsone (const char *path, BOOL lng, BOOL show_dir)
             interface_write_string (":");
             interface_write_endl();
             }
-          shell_cmd_dols (path, list, lng);
+          shell_cmd_dols (list, lng);
           }
         else
           {
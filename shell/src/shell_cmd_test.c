@@ -0,0 +1,137 @@
+/*=========================================================================
+
+  picolua
+
+  shell/shell_cmd_test.c
+
+  test, [, true, and false, for the conditions of if and while in
+  shell scripts. A condition that doesn't hold is ERR_FALSE, which
+  prints nothing.
+
+  (c)2021 Kevin Boone, GPLv3.0
+
+=========================================================================*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "shell/shell.h"
+#include <klib/defs.h>
+#include <interface/interface.h>
+#include <storage/storage.h>
+#include <config.h>
+#include "shell/errcodes.h"
+#include "shell/shell_commands.h"
+
+/*=========================================================================
+
+  shell_test_number
+
+=========================================================================*/
+static BOOL shell_test_number (const char *s, long *n)
+  {
+  char *end;
+  *n = strtol (s, &end, 10);
+  return s[0] != 0 && *end == 0;
+  }
+
+/*=========================================================================
+
+  shell_test_eval
+
+  Returns 1 if the expression is true, 0 if it is false, or -1 if it
+  can't be understood
+
+=========================================================================*/
+static int shell_test_eval (int argc, char **argv)
+  {
+  if (argc == 0) return 0;
+  if (argc > 1 && strcmp (argv[0], "!") == 0)
+    {
+    int r = shell_test_eval (argc - 1, argv + 1);
+    return r < 0 ? r : !r;
+    }
+  if (argc == 1) return argv[0][0] != 0;
+  if (argc == 2)
+    {
+    const char *op = argv[0], *s = argv[1];
+    if (strcmp (op, "-n") == 0) return s[0] != 0;
+    if (strcmp (op, "-z") == 0) return s[0] == 0;
+    if (strcmp (op, "-e") == 0) return storage_file_exists (s);
+    if (strcmp (op, "-f") == 0 || strcmp (op, "-d") == 0)
+      {
+      FileInfo info;
+      if (storage_info (s, &info) != 0) return 0;
+      return (op[1] == 'd') == (info.type == STORAGE_TYPE_DIR);
+      }
+    return -1;
+    }
+  if (argc == 3)
+    {
+    const char *a = argv[0], *op = argv[1], *b = argv[2];
+    if (strcmp (op, "=") == 0) return strcmp (a, b) == 0;
+    if (strcmp (op, "!=") == 0) return strcmp (a, b) != 0;
+    long x, y;
+    if (op[0] != '-' || !shell_test_number (a, &x)
+         || !shell_test_number (b, &y))
+      return -1;
+    if (strcmp (op, "-eq") == 0) return x == y;
+    if (strcmp (op, "-ne") == 0) return x != y;
+    if (strcmp (op, "-lt") == 0) return x < y;
+    if (strcmp (op, "-le") == 0) return x <= y;
+    if (strcmp (op, "-gt") == 0) return x > y;
+    if (strcmp (op, "-ge") == 0) return x >= y;
+    }
+  return -1;
+  }
+
+/*=========================================================================
+
+  shell_cmd_test
+
+  Also run as [, when the last argument must be ]
+
+=========================================================================*/
+ErrCode shell_cmd_test (int argc, char **argv)
+  {
+  if (strcmp (argv[0], "[") == 0)
+    {
+    if (argc < 2 || strcmp (argv[argc - 1], "]") != 0)
+      {
+      interface_write_stringln ("[: missing ]");
+      return ERR_USAGE;
+      }
+    argc--;
+    }
+
+  int r = shell_test_eval (argc - 1, argv + 1);
+  if (r < 0)
+    {
+    interface_write_stringln
+      ("Usage: test [!] {-e|-f|-d|-n|-z} arg, or arg {=|!=|-eq|-lt...} arg");
+    return ERR_USAGE;
+    }
+  return r ? 0 : ERR_FALSE;
+  }
+
+/*=========================================================================
+
+  shell_cmd_true
+
+=========================================================================*/
+ErrCode shell_cmd_true (int argc, char **argv)
+  {
+  (void)argc; (void)argv;
+  return 0;
+  }
+
+/*=========================================================================
+
+  shell_cmd_false
+
+=========================================================================*/
+ErrCode shell_cmd_false (int argc, char **argv)
+  {
+  (void)argc; (void)argv;
+  return ERR_FALSE;
+  }
+
@@ -0,0 +1,255 @@
+/*=========================================================================
+
+  picolua
+
+  shell/shell_commands.c
+
+  The table of commands that the shell runs itself. It is a hash table
+  with a chain for each bucket, so looking up a command doesn't depend
+  on how many there are. The builtins are added the first time any 
+  command is looked up.
+
+  (c)2021 Kevin Boone, GPLv3.0
+
+=========================================================================*/
+#include <stdio.h> 
+#include <string.h> 
+#include <stdlib.h> 
+#include <lua/lua.h>
+#include <lua/lauxlib.h>
+#include <klib/defs.h> 
+#include <interface/interface.h>
+#include <config.h>
+#include "shell/shell.h" 
+#include "shell/errcodes.h"
+#include "shell/shell_commands.h"
+
+static ShellCommand *commands [SHELL_COMMAND_BUCKETS];
+static BOOL builtins_registered = FALSE;
+
+static const struct 
+  {
+  const char *name;
+  ShellCmdFn fn;
+  } builtins[] = 
+  {
+  { "lua", shell_cmd_lua },
+  { "edit", shell_cmd_edit },
+  { "df", shell_cmd_df },
+  { "ls", shell_cmd_ls },
+  { "mkdir", shell_cmd_mkdir },
+  { "rmdir", shell_cmd_rm },
+  { "rm", shell_cmd_rm },
+  { "echo", shell_cmd_echo },
+  { "cat", shell_cmd_cat },
+  { "yrecv", shell_cmd_yrecv },
+  { "ysend", shell_cmd_ysend },
+  { "cp", shell_cmd_cp },
+  { "mv", shell_cmd_mv },
+  { "format", shell_cmd_format },
+  { "i2cdetect", shell_cmd_i2cdetect },
+  { "test", shell_cmd_test },
+  { "[", shell_cmd_test },
+  { "true", shell_cmd_true },
+  { "false", shell_cmd_false },
+  { "jobs", shell_cmd_jobs },
+  { "fg", shell_cmd_fg },
+  { "kill", shell_cmd_kill },
+  { "renice", shell_cmd_renice },
+  };
+
+/*=========================================================================
+
+  shell_command_bucket
+
+=========================================================================*/
+static ShellCommand **shell_command_bucket (const char *name)
+  {
+  uint32_t h = 2166136261u; // FNV-1a
+  while (*name)
+    {
+    h ^= (uint8_t)*name++;
+    h *= 16777619u;
+    }
+  return &commands[h % SHELL_COMMAND_BUCKETS];
+  }
+
+/*=========================================================================
+
+  shell_command_free
+
+=========================================================================*/
+static void shell_command_free (ShellCommand *c)
+  {
+  if (!c->fn)
+    luaL_unref (shell_lua_state (), LUA_REGISTRYINDEX, c->lua_ref);
+  free (c);
+  }
+
+/*=========================================================================
+
+  shell_register_builtins
+
+=========================================================================*/
+static void shell_register_builtins (void)
+  {
+  builtins_registered = TRUE;
+  for (unsigned i = 0; i < sizeof (builtins) / sizeof (builtins[0]); i++)
+    shell_register_command (builtins[i].name, builtins[i].fn);
+  }
+
+/*=========================================================================
+
+  shell_add_command
+
+  Put a new command in the table, in place of any of the same name
+
+=========================================================================*/
+static ErrCode shell_add_command (const char *name, ShellCmdFn fn, 
+     int lua_ref)
+  {
+  if (!builtins_registered)
+    shell_register_builtins ();
+  size_t l = strlen (name);
+  ShellCommand *c = malloc (sizeof (ShellCommand) + l + 1);
+  if (!c)
+    return ERR_NOMEM;
+  c->fn = fn;
+  c->lua_ref = lua_ref;
+  memcpy (c->name, name, l + 1);
+  shell_unregister_command (name);
+  ShellCommand **bucket = shell_command_bucket (name);
+  c->next = *bucket;
+  *bucket = c;
+  return 0;
+  }
+
+/*=========================================================================
+
+  shell_register_command
+
+=========================================================================*/
+ErrCode shell_register_command (const char *name, ShellCmdFn fn)
+  {
+  return shell_add_command (name, fn, LUA_NOREF);
+  }
+
+/*=========================================================================
+
+  shell_register_lua_command
+
+=========================================================================*/
+ErrCode shell_register_lua_command (const char *name, int lua_ref)
+  {
+  ErrCode ret = shell_add_command (name, NULL, lua_ref);
+  if (ret)
+    luaL_unref (shell_lua_state (), LUA_REGISTRYINDEX, lua_ref);
+  return ret;
+  }
+
+/*=========================================================================
+
+  shell_unregister_command
+
+=========================================================================*/
+ErrCode shell_unregister_command (const char *name)
+  {
+  if (!builtins_registered)
+    shell_register_builtins ();
+  for (ShellCommand **p = shell_command_bucket (name); *p; p = &(*p)->next)
+    {
+    if (strcmp ((*p)->name, name) == 0)
+      {
+      ShellCommand *c = *p;
+      *p = c->next;
+      shell_command_free (c);
+      return 0;
+      }
+    }
+  return ERR_NOENT;
+  }
+
+/*=========================================================================
+
+  shell_find_command
+
+=========================================================================*/
+const ShellCommand *shell_find_command (const char *name)
+  {
+  if (!builtins_registered)
+    shell_register_builtins ();
+  for (ShellCommand *c = *shell_command_bucket (name); c; c = c->next)
+    {
+    if (strcmp (c->name, name) == 0)
+      return c;
+    }
+  return NULL;
+  }
+
+/*=========================================================================
+
+  shell_call_lua
+
+  Run in protected mode on the shell's Lua state, with a ShellLuaCall as
+  its argument, so that running out of stack, or of memory, while the
+  arguments are pushed is an error like any other that the command 
+  raises.
+
+=========================================================================*/
+typedef struct _ShellLuaCall
+  {
+  const ShellCommand *c;
+  int argc;
+  char **argv;
+  } ShellLuaCall;
+
+static int shell_call_lua (lua_State *L)
+  {
+  const ShellLuaCall *call = lua_touserdata (L, 1);
+  luaL_checkstack (L, call->argc, "too many arguments");
+  lua_rawgeti (L, LUA_REGISTRYINDEX, call->c->lua_ref);
+  for (int i = 1; i < call->argc; i++)
+    lua_pushstring (L, call->argv[i]);
+  lua_call (L, call->argc - 1, 1);
+  return 1;
+  }
+
+/*=========================================================================
+
+  shell_call_command
+
+  A Lua command gets the arguments after the name as strings. If it 
+  returns a number, that is the command's error code. If it raises an
+  error, the message is reported, and the command returns ERR_FAILED.
+  The command might itself run shell commands, so the Lua stack is left
+  as it was found.
+
+=========================================================================*/
+ErrCode shell_call_command (const ShellCommand *c, int argc, char **argv)
+  {
+  if (c->fn)
+    return c->fn (argc, argv);
+
+  lua_State *L = shell_lua_state ();
+  if (!L || !lua_checkstack (L, 2))
+    return ERR_NOMEM;
+  int top = lua_gettop (L);
+  ErrCode ret = 0;
+  ShellLuaCall call = { c, argc, argv };
+  lua_pushcfunction (L, shell_call_lua);
+  lua_pushlightuserdata (L, &call);
+  if (lua_pcall (L, 1, 1, 0) != LUA_OK)
+    {
+    const char *msg = lua_tostring (L, -1);
+    interface_write_string (argv[0]);
+    interface_write_string (": ");
+    interface_write_string (msg ? msg : "error");
+    interface_write_endl ();
+    ret = ERR_FAILED;
+    }
+  else if (lua_isinteger (L, -1))
+    ret = (ErrCode)lua_tointeger (L, -1);
+  lua_settop (L, top);
+  return ret;
+  }
+
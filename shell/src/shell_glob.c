@@ -0,0 +1,435 @@
+/*=========================================================================
+
+  picolua
+
+  shell/shell_glob.c
+
+  Filename wildcards. A pattern is split at each / into segments: a
+  LITERAL names a file or directory in full, a MATCH has wildcards, and
+  DEEP is **. A MATCH is compiled into a string of codes, in which STAR,
+  ANY, and CLASS (followed by a 256-bit set) stand for *, ?, and [...],
+  ESC is followed by a byte that stands for itself, and any other byte
+  stands for itself. The directories are walked depth first, with one
+  path buffer, and only one directory open at each level.
+
+  (c)2021 Kevin Boone, GPLv3.0
+
+=========================================================================*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <klib/defs.h>
+#include "shell/errcodes.h"
+#include <storage/storage.h>
+#include <config.h>
+#include "shell/shell_glob.h"
+
+#define GLOB_END    0
+#define GLOB_STAR   1
+#define GLOB_ANY    2
+#define GLOB_CLASS  3
+#define GLOB_ESC    4
+
+#define GLOB_CLASS_SIZE 32
+
+typedef enum { SEG_LITERAL, SEG_MATCH, SEG_DEEP } ShellGlobSegKind;
+
+typedef struct _ShellGlobSeg
+  {
+  uint8_t kind;
+  uint8_t hidden;               // Matches names that start with .
+  uint16_t code;                // Offset of the name, or the codes
+  } ShellGlobSeg;
+
+// The glob is allocated as one block, holding the segments and codes
+struct _ShellGlob
+  {
+  BOOL absolute;
+  uint16_t nsegs;
+  ShellGlobSeg *segs;
+  uint8_t *code;
+  };
+
+typedef struct _ShellGlobWalk
+  {
+  const ShellGlob *glob;
+  ShellGlobFn fn;
+  void *data;
+  uint32_t matches;
+  ErrCode err;
+  FileInfo info;                // Not needed once a directory is entered,
+                                //   so one will do for all levels
+  char path [MAX_PATH + 1];
+  } ShellGlobWalk;
+
+/*=========================================================================
+
+  glob_emit
+
+  Add a byte to the codes, if there is anywhere to put them -- they are
+  counted first, with out NULL
+
+=========================================================================*/
+static void glob_emit (uint8_t *out, uint32_t *n, uint8_t b)
+  {
+  if (out) out[*n] = b;
+  (*n)++;
+  }
+
+/*=========================================================================
+
+  glob_class
+
+  Compile [...], starting after the [, into a set. Returns the length
+  of the class in the pattern, or zero if there is no closing ]; then
+  the [ is just a character.
+
+=========================================================================*/
+static int glob_class (const char *s, int len, uint8_t *set)
+  {
+  int i = 0;
+  BOOL negate = FALSE;
+  memset (set, 0, GLOB_CLASS_SIZE);
+  if (i < len && (s[i] == '!' || s[i] == '^'))
+    {
+    negate = TRUE;
+    i++;
+    }
+  int first = i;
+  while (i < len && (s[i] != ']' || i == first))
+    {
+    uint8_t lo = (uint8_t)s[i++], hi = lo;
+    if (i + 1 < len && s[i] == '-' && s[i + 1] != ']')
+      {
+      hi = (uint8_t)s[i + 1];
+      i += 2;
+      }
+    for (unsigned c = lo; c <= hi; c++)
+      set[c >> 3] |= (uint8_t)(1 << (c & 7));
+    }
+  if (i >= len) return 0;
+  if (negate)
+    {
+    for (int b = 0; b < GLOB_CLASS_SIZE; b++)
+      set[b] = (uint8_t)~set[b];
+    }
+  return i + 1;
+  }
+
+/*=========================================================================
+
+  glob_compile_seg
+
+  Compile one segment of a pattern, of length len, into out. Returns
+  TRUE if it has wildcards.
+
+=========================================================================*/
+static BOOL glob_compile_seg (const char *s, int len, uint8_t *out,
+              uint32_t *n)
+  {
+  BOOL wild = FALSE;
+  BOOL star = FALSE;
+  uint8_t set [GLOB_CLASS_SIZE];
+  for (int i = 0; i < len; i++)
+    {
+    uint8_t c = (uint8_t)s[i];
+    int l;
+    if (c == '*')
+      {
+      if (!star) glob_emit (out, n, GLOB_STAR);
+      star = wild = TRUE;
+      continue;
+      }
+    star = FALSE;
+    if (c == '?')
+      {
+      glob_emit (out, n, GLOB_ANY);
+      wild = TRUE;
+      }
+    else if (c == '[' && (l = glob_class (s + i + 1, len - i - 1, set)))
+      {
+      glob_emit (out, n, GLOB_CLASS);
+      for (int b = 0; b < GLOB_CLASS_SIZE; b++)
+        glob_emit (out, n, set[b]);
+      i += l;
+      wild = TRUE;
+      }
+    else
+      {
+      if (c == '\\' && i + 1 < len)
+        c = (uint8_t)s[++i];
+      if (c <= GLOB_ESC)
+        glob_emit (out, n, GLOB_ESC);
+      glob_emit (out, n, c);
+      }
+    }
+  glob_emit (out, n, GLOB_END);
+  return wild;
+  }
+
+/*=========================================================================
+
+  glob_compile
+
+  Compile the segments into segs and code, or, if they are NULL, just
+  count them. Returns TRUE if any segment has wildcards.
+
+=========================================================================*/
+static BOOL glob_compile (const char *pattern, ShellGlobSeg *segs,
+              uint8_t *code, uint32_t *nsegs, uint32_t *ncode)
+  {
+  BOOL wild = FALSE;
+  BOOL deep = FALSE;
+  const char *p = pattern;
+  *nsegs = 0;
+  *ncode = 0;
+  while (*p)
+    {
+    if (*p == '/')
+      {
+      p++;
+      continue;
+      }
+    int len = (int)strcspn (p, "/");
+    ShellGlobSeg seg;
+    seg.hidden = (p[0] == '.');
+    seg.code = (uint16_t)*ncode;
+    if (len == 2 && p[0] == '*' && p[1] == '*')
+      {
+      seg.kind = SEG_DEEP;
+      wild = TRUE;
+      // **/** is the same as **
+      if (deep) (*nsegs)--;
+      }
+    else
+      {
+      uint32_t start = *ncode;
+      BOOL w = glob_compile_seg (p, len, code, ncode);
+      if (w)
+        seg.kind = SEG_MATCH;
+      else
+        {
+        // A plain name is stored as it is, without the codes
+        seg.kind = SEG_LITERAL;
+        *ncode = start;
+        for (int i = 0; i < len; i++)
+          {
+          if (p[i] == '\\' && i + 1 < len) i++;
+          glob_emit (code, ncode, (uint8_t)p[i]);
+          }
+        glob_emit (code, ncode, 0);
+        }
+      wild |= w;
+      }
+    deep = (seg.kind == SEG_DEEP);
+    if (segs) segs[*nsegs] = seg;
+    (*nsegs)++;
+    p += len;
+    }
+  return wild;
+  }
+
+/*=========================================================================
+
+  shell_glob_compile
+
+=========================================================================*/
+ShellGlob *shell_glob_compile (const char *pattern, ErrCode *err)
+  {
+  uint32_t nsegs, ncode;
+  *err = 0;
+  if (!glob_compile (pattern, NULL, NULL, &nsegs, &ncode))
+    return NULL;
+  if (ncode > 0xFFFF)
+    return NULL; // Can't be a real path anyway
+
+  ShellGlob *g = malloc (sizeof (ShellGlob) + nsegs * sizeof (ShellGlobSeg)
+    + ncode);
+  if (!g)
+    {
+    *err = ERR_NOMEM;
+    return NULL;
+    }
+  g->absolute = (pattern[0] == '/');
+  g->segs = (ShellGlobSeg *)(g + 1);
+  g->code = (uint8_t *)(g->segs + nsegs);
+  glob_compile (pattern, g->segs, g->code, &nsegs, &ncode);
+  g->nsegs = (uint16_t)nsegs;
+  return g;
+  }
+
+/*=========================================================================
+
+  shell_glob_free
+
+=========================================================================*/
+void shell_glob_free (ShellGlob *glob)
+  {
+  free (glob);
+  }
+
+/*=========================================================================
+
+  glob_match
+
+  Match a name against the codes of a segment. When a * has been
+  passed, and the rest doesn't match, the * takes one more character
+  and the rest is tried again; only the last * needs to be retried.
+
+=========================================================================*/
+static BOOL glob_match (const uint8_t *p, const char *s)
+  {
+  const uint8_t *star_p = NULL;
+  const char *star_s = NULL;
+  for (;;)
+    {
+    uint8_t c = *p;
+    if (c == GLOB_STAR)
+      {
+      star_p = ++p;
+      star_s = s;
+      continue;
+      }
+    if (c == GLOB_END && *s == 0) return TRUE;
+    if (c != GLOB_END && *s)
+      {
+      uint8_t ch = (uint8_t)*s;
+      int l = 0;
+      if (c == GLOB_ANY)
+        l = 1;
+      else if (c == GLOB_CLASS)
+        l = (p[1 + (ch >> 3)] & (1 << (ch & 7))) ? 1 + GLOB_CLASS_SIZE : 0;
+      else if (c == GLOB_ESC)
+        l = (p[1] == ch) ? 2 : 0;
+      else
+        l = (c == ch) ? 1 : 0;
+      if (l)
+        {
+        p += l;
+        s++;
+        continue;
+        }
+      }
+    if (!star_p || !*star_s) return FALSE;
+    p = star_p;
+    s = ++star_s;
+    }
+  }
+
+/*=========================================================================
+
+  glob_append
+
+  Add a name to the path, which has length len. Returns the new length,
+  or zero if it is too long.
+
+=========================================================================*/
+static size_t glob_append (ShellGlobWalk *w, size_t len, const char *name)
+  {
+  size_t l = strlen (name);
+  BOOL slash = (len > 0 && w->path[len - 1] != '/');
+  if (len + slash + l > MAX_PATH) return 0;
+  if (slash) w->path[len++] = '/';
+  memcpy (w->path + len, name, l + 1);
+  return len + l;
+  }
+
+/*=========================================================================
+
+  glob_found
+
+=========================================================================*/
+static void glob_found (ShellGlobWalk *w)
+  {
+  w->matches++;
+  w->err = w->fn (w->path, w->data);
+  }
+
+/*=========================================================================
+
+  glob_walk
+
+  Match the segments from seg onwards in the directory whose path is
+  the first len characters of the buffer
+
+=========================================================================*/
+static void glob_walk (ShellGlobWalk *w, uint32_t seg, size_t len)
+  {
+  const ShellGlob *g = w->glob;
+  const ShellGlobSeg *s = &g->segs[seg];
+  BOOL last = (seg + 1 == g->nsegs);
+  size_t l;
+
+  if (s->kind == SEG_LITERAL)
+    {
+    // Nothing to list: the next directory is named
+    if ((l = glob_append (w, len, (const char *)g->code + s->code)))
+      {
+      if (!last)
+        glob_walk (w, seg + 1, l);
+      else if (storage_info (w->path, &w->info) == 0)
+        glob_found (w);
+      }
+    return;
+    }
+
+  // ** can be no directories at all
+  if (s->kind == SEG_DEEP && !last)
+    {
+    glob_walk (w, seg + 1, len);
+    w->path[len] = 0;
+    if (w->err) return;
+    }
+
+  DirDescriptor dir;
+  if (storage_dir_open (w->path, &dir) != 0)
+    return;
+  while (!w->err && storage_dir_read (&dir, &w->info) > 0)
+    {
+    const char *name = w->info.name;
+    BOOL isdir = (w->info.type == STORAGE_TYPE_DIR);
+    if (strcmp (name, ".") == 0 || strcmp (name, "..") == 0) continue;
+    if (name[0] == '.' && !s->hidden) continue;
+    if (s->kind == SEG_MATCH && !glob_match (g->code + s->code, name))
+      continue;
+    if (!(l = glob_append (w, len, name))) continue;
+    if (s->kind == SEG_DEEP)
+      {
+      // Everything under a ** at the end matches
+      if (last) glob_found (w);
+      if (!w->err && isdir)
+        glob_walk (w, seg, l);
+      }
+    else if (last)
+      glob_found (w);
+    else if (isdir)
+      glob_walk (w, seg + 1, l);
+    w->path[len] = 0;
+    }
+  storage_dir_close (&dir);
+  }
+
+/*=========================================================================
+
+  shell_glob_expand
+
+=========================================================================*/
+ErrCode shell_glob_expand (const ShellGlob *glob, ShellGlobFn fn,
+              void *data, uint32_t *matches)
+  {
+  ShellGlobWalk *w = malloc (sizeof (ShellGlobWalk));
+  if (!w) return ERR_NOMEM;
+  w->glob = glob;
+  w->fn = fn;
+  w->data = data;
+  w->matches = 0;
+  w->err = 0;
+  strcpy (w->path, glob->absolute ? "/" : "");
+  if (glob->nsegs > 0)
+    glob_walk (w, 0, strlen (w->path));
+  ErrCode ret = w->err;
+  *matches = w->matches;
+  free (w);
+  return ret;
+  }
+
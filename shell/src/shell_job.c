@@ -0,0 +1,544 @@
+/*=========================================================================
+
+  picolua
+
+  shell/shell_job.c
+
+  Background jobs. Each job is a Lua program, loaded into a state of its
+  own by shell_lua_start(), as a stage of a pipe is, and resumed as a
+  coroutine. A count hook makes it yield after SHELL_JOB_SLICE
+  instructions, times its priority, and a round resumes each job that
+  is ready, in turn. A job can only yield from its main coroutine, so a
+  job that spends a long time in a coroutine of its own, or in a C
+  function, keeps the CPU until it comes out. pico.sleep_ms() in a job
+  stores when it wants to wake under LUA_JOBKEY, and yields; the job is
+  passed over until then. The state's allocator is wrapped, to count
+  the memory that the job is using.
+
+  (c)2021 Kevin Boone, GPLv3.0
+
+=========================================================================*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <lua/lua.h>
+#include <lua/lauxlib.h>
+#include <klib/defs.h>
+#include <interface/interface.h>
+#include <interface/core.h>
+#include <config.h>
+#include "shell/shell.h"
+#include "shell/errcodes.h"
+#include "shell/shell_commands.h"
+#include "shell/shell_job.h"
+
+extern int lua_stage_resume (lua_State *L, lua_State *co);
+
+// Longest command line kept, to show in the list of jobs
+#define SHELL_JOB_NAME 40
+
+// Reading the clock costs more than a function call, so a program in
+//   the foreground only reads it on one tick in this many
+#define SHELL_JOB_TICK_CALLS 64
+
+typedef enum { JOB_FREE, JOB_RUNNING, JOB_DONE, JOB_FAILED,
+  JOB_KILLED } ShellJobState;
+
+typedef struct _ShellJob
+  {
+  uint8_t state;
+  uint8_t priority;
+  BOOL running;                 // Being resumed, perhaps further up
+                                //   the stack
+  BOOL fg;                      // Brought to the foreground by fg
+  BOOL kill;                    // Stop at the end of this turn
+  BOOL sleeping;                // Not ready until wake_ms
+  uint32_t wake_ms;
+  uint32_t started;             // Order in which the jobs were started
+  uint64_t cpu_us;
+  lua_State *L;                 // Until the program finishes
+  lua_State *co;
+  lua_Alloc alloc;              // The state's own allocator, which
+  void *alloc_ud;               //   job_alloc() counts what passes to
+  size_t mem, mem_peak;
+  char name [SHELL_JOB_NAME + 1];
+  } ShellJob;
+
+static ShellJob jobs [SHELL_JOB_MAX];
+static ShellJob *job_current = NULL;
+static int job_live = 0;
+static uint32_t job_started = 0;
+static uint64_t job_last_round = 0;
+static uint32_t job_ticks = 0;
+
+/*=========================================================================
+
+  job_get_char
+
+  A job in the background reads nothing from the terminal, so as not
+  to take the keys of the program in the foreground
+
+=========================================================================*/
+static int job_get_char (void *data)
+  {
+  (void)data;
+  return EOF;
+  }
+
+/*=========================================================================
+
+  job_ready
+
+=========================================================================*/
+static BOOL job_ready (void *data, int want)
+  {
+  (void)data; (void)want;
+  return TRUE;
+  }
+
+static const InterfaceInput job_input = { job_get_char, job_ready, NULL };
+
+/*=========================================================================
+
+  job_alloc
+
+  Count what the job's state allocates, and refuse to let it go over
+  the limit. Lua collects its garbage, and tries again, before it
+  gives up. Once the program has failed, the limit is lifted, so that
+  there is the memory to say why.
+
+=========================================================================*/
+static void *job_alloc (void *ud, void *ptr, size_t osize, size_t nsize)
+  {
+  ShellJob *job = ud;
+  size_t old = ptr ? osize : 0;
+  if (SHELL_JOB_MEM_LIMIT > 0 && nsize > old
+       && job->mem + (nsize - old) > SHELL_JOB_MEM_LIMIT
+       && lua_status (job->co) <= LUA_YIELD)
+    return NULL;
+  void *p = job->alloc (job->alloc_ud, ptr, osize, nsize);
+  if (p || nsize == 0)
+    {
+    job->mem = job->mem - old + nsize;
+    if (job->mem > job->mem_peak) job->mem_peak = job->mem;
+    }
+  return p;
+  }
+
+/*=========================================================================
+
+  job_hook
+
+  Called when a job has used up its turn. A coroutine of the program's
+  own inherits the hook, but can't yield to the shell, so there it
+  does nothing.
+
+=========================================================================*/
+static void job_hook (lua_State *L, lua_Debug *ar)
+  {
+  (void)ar;
+  lua_getfield (L, LUA_REGISTRYINDEX, LUA_STAGEKEY);
+  BOOL stage = (lua_tothread (L, -1) == L);
+  lua_pop (L, 1);
+  if (!stage) return;
+  if (job_current && job_current->kill)
+    luaL_error (L, "Killed");
+  if (lua_isyieldable (L))
+    lua_yield (L, 0);
+  }
+
+/*=========================================================================
+
+  job_finish
+
+=========================================================================*/
+static void job_finish (ShellJob *job, ShellJobState state)
+  {
+  lua_close (job->L);
+  job->L = NULL;
+  job->co = NULL;
+  job->state = (uint8_t)state;
+  job_live--;
+  }
+
+/*=========================================================================
+
+  job_resume
+
+  Give a job one turn. Time that it spends running other jobs, in its
+  own ticks, is counted as theirs, not its.
+
+=========================================================================*/
+static void job_resume (ShellJob *job)
+  {
+  const InterfaceInput *input = interface_get_input ();
+  const InterfaceOutput *output = interface_get_output ();
+  ShellJob *caller = job_current;
+
+  // A job outlives the pipe that it might have been started in, so
+  //   always writes to the terminal
+  interface_set_input (job->fg ? NULL : &job_input);
+  interface_set_output (NULL);
+  lua_sethook (job->co, job_hook, LUA_MASKCOUNT,
+    SHELL_JOB_SLICE * job->priority);
+  job->running = TRUE;
+  job->sleeping = FALSE;
+  job_current = job;
+  uint64_t start = interface_time_us ();
+  int status = lua_stage_resume (job->L, job->co);
+  uint64_t used = interface_time_us () - start;
+  job->cpu_us += used;
+  if (caller) caller->cpu_us -= used;
+  job_current = caller;
+  job->running = FALSE;
+  interface_set_input (input);
+  interface_set_output (output);
+
+  if (status == LUA_YIELD)
+    {
+    lua_State *L = job->L;
+    lua_getfield (L, LUA_REGISTRYINDEX, LUA_JOBKEY);
+    job->wake_ms = (uint32_t)lua_tointeger (L, -1);
+    job->sleeping = (job->wake_ms != 0);
+    lua_pop (L, 1);
+    lua_pushinteger (L, 0);
+    lua_setfield (L, LUA_REGISTRYINDEX, LUA_JOBKEY);
+    if (job->kill) job_finish (job, JOB_KILLED);
+    }
+  else
+    job_finish (job, job->kill ? JOB_KILLED
+      : status == LUA_OK ? JOB_DONE : JOB_FAILED);
+  }
+
+/*=========================================================================
+
+  shell_job_round
+
+  A job that is running already, further up the stack, is passed over
+
+=========================================================================*/
+BOOL shell_job_round (void)
+  {
+  if (job_live == 0) return FALSE;
+  BOOL ran = FALSE;
+  uint32_t now = interface_time_ms ();
+  job_last_round = interface_time_us ();
+  for (int i = 0; i < SHELL_JOB_MAX; i++)
+    {
+    ShellJob *job = &jobs[i];
+    if (job->state != JOB_RUNNING || job->running) continue;
+    if (job->sleeping && (int32_t)(job->wake_ms - now) > 0) continue;
+    job_resume (job);
+    ran = TRUE;
+    }
+  return ran;
+  }
+
+/*=========================================================================
+
+  shell_job_tick
+
+=========================================================================*/
+void shell_job_tick (void)
+  {
+  if (job_live == 0 || (job_current && !job_current->fg)) return;
+  if (++job_ticks % SHELL_JOB_TICK_CALLS != 0) return;
+  if (interface_time_us () - job_last_round >= SHELL_JOB_TICK_US)
+    shell_job_round ();
+  }
+
+/*=========================================================================
+
+  shell_job_background
+
+=========================================================================*/
+BOOL shell_job_background (void)
+  {
+  return job_current && !job_current->fg;
+  }
+
+/*=========================================================================
+
+  shell_job_count
+
+=========================================================================*/
+int shell_job_count (void)
+  {
+  return job_live;
+  }
+
+/*=========================================================================
+
+  job_state_name
+
+=========================================================================*/
+static const char *job_state_name (const ShellJob *job)
+  {
+  switch (job->state)
+    {
+    case JOB_RUNNING: return job->sleeping ? "Sleeping" : "Running";
+    case JOB_DONE: return "Done";
+    case JOB_FAILED: return "Failed";
+    case JOB_KILLED: return "Killed";
+    }
+  return "";
+  }
+
+/*=========================================================================
+
+  job_report
+
+=========================================================================*/
+static void job_report (const ShellJob *job)
+  {
+  char buff [SHELL_JOB_NAME + 32];
+  snprintf (buff, sizeof (buff), "[%d]  %-8s  %s", (int)(job - jobs) + 1,
+    job_state_name (job), job->name);
+  interface_write_stringln (buff);
+  }
+
+/*=========================================================================
+
+  shell_job_notify
+
+=========================================================================*/
+void shell_job_notify (void)
+  {
+  for (int i = 0; i < SHELL_JOB_MAX; i++)
+    {
+    ShellJob *job = &jobs[i];
+    if (job->state == JOB_FREE || job->state == JOB_RUNNING) continue;
+    job_report (job);
+    job->state = JOB_FREE;
+    }
+  }
+
+/*=========================================================================
+
+  shell_job_start
+
+  A job is numbered by its place in the table, from 1
+
+=========================================================================*/
+ErrCode shell_job_start (int argc, char **argv)
+  {
+  char path [MAX_PATH + 1];
+  int first;
+  if (!shell_lua_path (argc, argv, path, &first))
+    {
+    shell_write_error_filename (ERR_NOTEXECUTABLE, argv[0]);
+    return ERR_NOTEXECUTABLE;
+    }
+  // Finished jobs that haven't been reported yet keep their numbers
+  ShellJob *job = NULL;
+  for (int i = 0; i < SHELL_JOB_MAX && !job; i++)
+    if (jobs[i].state == JOB_FREE) job = &jobs[i];
+  if (!job)
+    {
+    shell_write_error (ERR_TOOMANYJOBS);
+    return ERR_TOOMANYJOBS;
+    }
+
+  memset (job, 0, sizeof (ShellJob));
+  // Errors in loading the program are reported by Lua
+  job->L = shell_lua_start (path, argc - first, argv + first, &job->co);
+  if (!job->L) return ERR_FAILED;
+  lua_State *L = job->L;
+  lua_pushinteger (L, 0);
+  lua_setfield (L, LUA_REGISTRYINDEX, LUA_JOBKEY);
+  job->alloc = lua_getallocf (L, &job->alloc_ud);
+  job->mem = (size_t)lua_gc (L, LUA_GCCOUNT, 0) * 1024
+    + (size_t)lua_gc (L, LUA_GCCOUNTB, 0);
+  job->mem_peak = job->mem;
+  lua_setallocf (L, job_alloc, job);
+
+  size_t len = 0;
+  for (int i = 0; i < argc && len < SHELL_JOB_NAME; i++)
+    len += (size_t)snprintf (job->name + len, sizeof (job->name) - len,
+      i ? " %s" : "%s", argv[i]);
+  job->priority = SHELL_JOB_PRIORITY;
+  job->started = ++job_started;
+  job->state = JOB_RUNNING;
+  job_live++;
+
+  char buff [16];
+  snprintf (buff, sizeof (buff), "[%d]", (int)(job - jobs) + 1);
+  interface_write_stringln (buff);
+  return 0;
+  }
+
+/*=========================================================================
+
+  job_find
+
+  A job is named by its number, with or without %. Without a name, the
+  job started most recently is meant.
+
+=========================================================================*/
+static ShellJob *job_find (int argc, char **argv, int arg)
+  {
+  ShellJob *job = NULL;
+  if (arg < argc)
+    {
+    const char *s = argv[arg];
+    if (*s == '%') s++;
+    int n = atoi (s);
+    if (n >= 1 && n <= SHELL_JOB_MAX) job = &jobs[n - 1];
+    }
+  else
+    {
+    for (int i = 0; i < SHELL_JOB_MAX; i++)
+      if (jobs[i].state == JOB_RUNNING
+           && (!job || jobs[i].started > job->started))
+        job = &jobs[i];
+    }
+  if (!job || job->state != JOB_RUNNING)
+    {
+    if (arg < argc)
+      shell_write_error_filename (ERR_NOJOB, argv[arg]);
+    else
+      shell_write_error (ERR_NOJOB);
+    return NULL;
+    }
+  return job;
+  }
+
+/*=========================================================================
+
+  shell_cmd_jobs
+
+=========================================================================*/
+ErrCode shell_cmd_jobs (int argc, char **argv)
+  {
+  (void)argv;
+  if (argc > 1)
+    {
+    interface_write_stringln ("Usage: jobs");
+    return ERR_USAGE;
+    }
+  for (int i = 0; i < SHELL_JOB_MAX; i++)
+    {
+    const ShellJob *job = &jobs[i];
+    if (job->state == JOB_FREE) continue;
+    // The name is written separately, as it may be as long as the rest
+    char buff [160];
+    uint32_t ms = (uint32_t)(job->cpu_us / 1000);
+    snprintf (buff, sizeof (buff),
+      "[%d]  %-8s  pri %d  mem %luk, peak %luk  cpu %lu.%03lus  ",
+      i + 1, job_state_name (job), job->priority,
+      (unsigned long)(job->mem + 1023) / 1024,
+      (unsigned long)(job->mem_peak + 1023) / 1024,
+      (unsigned long)(ms / 1000), (unsigned long)(ms % 1000));
+    interface_write_string (buff);
+    interface_write_stringln (job->name);
+    }
+  return 0;
+  }
+
+/*=========================================================================
+
+  job_fg
+
+  Run a job in the foreground, on the second core, until it finishes.
+  The other jobs carry on in their rounds. The interrupt key stops the
+  job, in the same way as any other program. A job that finishes in the
+  foreground isn't reported afterwards. A job that ends in an error 
+  returns ERR_FAILED, as a program run in the foreground does; Lua has
+  already reported the error.
+
+=========================================================================*/
+static int job_fg (int argc, char **argv)
+  {
+  if (argc > 2)
+    {
+    interface_write_stringln ("Usage: fg [[%]job]");
+    return ERR_USAGE;
+    }
+  ShellJob *job = job_find (argc, argv, 1);
+  if (!job) return ERR_NOJOB;
+  if (job->running)
+    {
+    // fg from the job itself
+    shell_write_error (ERR_INVAL);
+    return ERR_INVAL;
+    }
+
+  ErrCode ret = 0;
+  interface_write_stringln (job->name);
+  job->fg = TRUE;
+  while (job->state == JOB_RUNNING)
+    {
+    if (shell_get_interrupt ())
+      {
+      job_finish (job, JOB_KILLED);
+      ret = ERR_INTERRUPTED;
+      shell_write_error (ret);
+      }
+    else if (!shell_job_round ())
+      interface_sleep_ms (1);
+    }
+  if (ret == 0 && job->state == JOB_FAILED)
+    ret = ERR_FAILED;
+  job->fg = FALSE;
+  job->state = JOB_FREE;
+  return ret;
+  }
+
+/*=========================================================================
+
+  shell_cmd_fg
+
+=========================================================================*/
+ErrCode shell_cmd_fg (int argc, char **argv)
+  {
+  return (ErrCode)interface_core_run (job_fg, argc, argv);
+  }
+
+/*=========================================================================
+
+  shell_cmd_kill
+
+  A job that kills itself stops when it next yields
+
+=========================================================================*/
+ErrCode shell_cmd_kill (int argc, char **argv)
+  {
+  if (argc != 2)
+    {
+    interface_write_stringln ("Usage: kill [%]job");
+    return ERR_USAGE;
+    }
+  ShellJob *job = job_find (argc, argv, 1);
+  if (!job) return ERR_NOJOB;
+  if (job->running)
+    job->kill = TRUE;
+  else
+    job_finish (job, JOB_KILLED);
+  return 0;
+  }
+
+/*=========================================================================
+
+  shell_cmd_renice
+
+  Set the priority of a job, which is how many slices it gets in each
+  of its turns
+
+=========================================================================*/
+ErrCode shell_cmd_renice (int argc, char **argv)
+  {
+  int priority = argc == 3 ? atoi (argv[1]) : 0;
+  if (priority < 1 || priority > SHELL_JOB_MAX_PRIORITY)
+    {
+    char buff [48];
+    snprintf (buff, sizeof (buff), "Usage: renice {1-%d} [%%]job",
+      SHELL_JOB_MAX_PRIORITY);
+    interface_write_stringln (buff);
+    return ERR_USAGE;
+    }
+  ShellJob *job = job_find (argc, argv, 2);
+  if (!job) return ERR_NOJOB;
+  job->priority = (uint8_t)priority;
+  return 0;
+  }
+
@@ -0,0 +1,410 @@
+/*=========================================================================
+
+  picolua
+
+  shell/shell_pipe.c
+
+  Running the commands of a pipe. There is only one core to run them
+  on, so they take turns. Each Lua program runs as a coroutine in a
+  state of its own, and yields when it must wait to read from its pipe,
+  or when it has filled the pipe that it writes to. A "round" resumes
+  each program that has something to do, in turn. The one command that
+  isn't Lua, if there is one, runs as it would without a pipe, and runs
+  rounds whenever it waits to read, or has filled its pipe.
+
+  (c)2021 Kevin Boone, GPLv3.0
+
+=========================================================================*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <lua/lua.h>
+#include <klib/defs.h>
+#include <interface/interface.h>
+#include <config.h>
+#include "shell/shell.h"
+#include "shell/errcodes.h"
+#include "shell/shell_commands.h"
+#include "shell/shell_pipe.h"
+
+extern int lua_stage_resume (lua_State *L, lua_State *co);
+
+struct _ShellPipeline;
+struct _ShellStage;
+
+typedef struct _ShellPipe
+  {
+  InterfaceInput in;            // How the reader sees the pipe
+  InterfaceOutput out;          // How the writer sees it
+  struct _ShellPipeline *pipeline;
+  struct _ShellStage *reader;
+  struct _ShellStage *writer;
+  char *buff;                   // Bytes start..start+count-1 are unread
+  uint32_t start, count, size;
+  uint32_t limit;               // Writer is held once count reaches this
+  BOOL waiting;                 // Reader can't go on until more is written
+  BOOL closed;                  // Writer has finished
+  BOOL broken;                  // Reader has finished
+  } ShellPipe;
+
+typedef struct _ShellStage
+  {
+  int argc;
+  char **argv;
+  BOOL lua;
+  lua_State *L;                 // Until the program finishes
+  lua_State *co;
+  ShellPipe *in;                // NULL for the first command
+  ShellPipe *out;               // NULL for the last
+  BOOL running;
+  BOOL done;
+  ErrCode ret;
+  } ShellStage;
+
+typedef struct _ShellPipeline
+  {
+  int n;
+  ShellStage stages [SHELL_PIPE_MAX_STAGES];
+  ShellPipe pipes [SHELL_PIPE_MAX_STAGES - 1];
+  // Where the first command reads, and the last writes
+  const InterfaceInput *input;
+  const InterfaceOutput *output;
+  uint32_t activity;            // Changes whenever anything happens
+  } ShellPipeline;
+
+static BOOL pipe_round (ShellPipeline *pl); // FWD
+
+/*=========================================================================
+
+  pipe_hook
+
+  Set on a Lua program that has filled its pipe, to make it yield as
+  soon as it can. A coroutine of the program's own inherits the hook,
+  but it can't yield to the shell, so there the hook is just removed.
+
+=========================================================================*/
+static void pipe_hook (lua_State *L, lua_Debug *ar)
+  {
+  (void)ar;
+  lua_getfield (L, LUA_REGISTRYINDEX, LUA_STAGEKEY);
+  BOOL stage = (lua_tothread (L, -1) == L);
+  lua_pop (L, 1);
+  if (!stage || lua_isyieldable (L))
+    lua_sethook (L, NULL, 0, 0);
+  if (stage && lua_isyieldable (L))
+    lua_yield (L, 0);
+  }
+
+/*=========================================================================
+
+  pipe_room
+
+  Make room to write n more bytes. A pipe only grows past
+  SHELL_PIPE_SIZE if its reader wants more than that at once, or its
+  writer can't be held.
+
+=========================================================================*/
+static BOOL pipe_room (ShellPipe *p, uint32_t n)
+  {
+  if (p->start + p->count + n <= p->size) return TRUE;
+  if (p->start > 0)
+    {
+    memmove (p->buff, p->buff + p->start, p->count);
+    p->start = 0;
+    }
+  if (p->count + n <= p->size) return TRUE;
+  uint32_t size = p->size;
+  while (size < p->count + n) size *= 2;
+  char *buff = realloc (p->buff, size);
+  if (!buff) return FALSE;
+  p->buff = buff;
+  p->size = size;
+  return TRUE;
+  }
+
+/*=========================================================================
+
+  pipe_write
+
+  What is written to a pipe that nothing reads any more is dropped.
+
+=========================================================================*/
+static void pipe_write (void *data, const char *s, int len)
+  {
+  ShellPipe *p = data;
+  if (!p->broken && len > 0)
+    {
+    if (pipe_room (p, (uint32_t)len))
+      {
+      memcpy (p->buff + p->start + p->count, s, (size_t)len);
+      p->count += (uint32_t)len;
+      p->waiting = FALSE;
+      p->pipeline->activity++;
+      }
+    else
+      {
+      p->broken = TRUE;
+      shell_write_error (ERR_NOMEM);
+      }
+    }
+
+  if (p->count < p->limit && !p->broken) return;
+  if (p->writer->lua)
+    lua_sethook (p->writer->co, pipe_hook, LUA_MASKCOUNT, 1);
+  else
+    {
+    while (p->count >= p->limit && !p->broken && pipe_round (p->pipeline))
+      ;
+    }
+  }
+
+/*=========================================================================
+
+  pipe_get_char
+
+  If the pipe is empty, other commands are run until it isn't. A Lua
+  program only gets here with an empty pipe if it can't yield.
+
+=========================================================================*/
+static int pipe_get_char (void *data)
+  {
+  ShellPipe *p = data;
+  while (p->count == 0 && !p->closed && pipe_round (p->pipeline))
+    ;
+  if (p->count == 0) return EOF;
+  int c = (unsigned char)p->buff[p->start++];
+  p->count--;
+  if (p->count == 0)
+    {
+    p->start = 0;
+    if (p->size > SHELL_PIPE_SIZE)
+      {
+      char *buff = realloc (p->buff, SHELL_PIPE_SIZE);
+      if (buff)
+        {
+        p->buff = buff;
+        p->size = SHELL_PIPE_SIZE;
+        }
+      }
+    }
+  p->pipeline->activity++;
+  return c;
+  }
+
+/*=========================================================================
+
+  pipe_ready
+
+  Also sets how much the writer can write before it is held, so that
+  the pipe can fill up with what the reader wants
+
+=========================================================================*/
+static BOOL pipe_ready (void *data, int want)
+  {
+  ShellPipe *p = data;
+  BOOL ready;
+  if (p->closed)
+    ready = TRUE;
+  else if (want < 0)
+    ready = FALSE;
+  else if (want == 0)
+    ready = memchr (p->buff + p->start, '\n', p->count) != NULL;
+  else
+    ready = p->count >= (uint32_t)want;
+
+  if (ready || (want > 0 && want <= SHELL_PIPE_SIZE))
+    p->limit = SHELL_PIPE_SIZE;
+  else
+    p->limit = want > 0 ? (uint32_t)want : UINT32_MAX;
+  p->waiting = !ready;
+  return ready;
+  }
+
+/*=========================================================================
+
+  pipe_finish
+
+  When a command finishes, the command that reads its output sees the
+  end of it, and the one that writes its input has nowhere to write
+
+=========================================================================*/
+static void pipe_finish (ShellPipeline *pl, ShellStage *st)
+  {
+  st->done = TRUE;
+  if (st->out)
+    {
+    st->out->closed = TRUE;
+    st->out->waiting = FALSE;
+    }
+  if (st->in)
+    {
+    st->in->broken = TRUE;
+    st->in->count = 0;
+    }
+  if (st->L)
+    {
+    lua_close (st->L);
+    st->L = NULL;
+    st->co = NULL;
+    }
+  pl->activity++;
+  }
+
+/*=========================================================================
+
+  pipe_select
+
+  Point the terminal interface at a command's pipes
+
+=========================================================================*/
+static void pipe_select (const ShellPipeline *pl, const ShellStage *st)
+  {
+  interface_set_input (st->in ? &st->in->in : pl->input);
+  interface_set_output (st->out ? &st->out->out : pl->output);
+  }
+
+/*=========================================================================
+
+  pipe_round
+
+  Resume each Lua program that isn't waiting, once. A program whose
+  output nothing reads any more is stopped, as they all are if the user
+  interrupts. Returns TRUE if anything happened.
+
+=========================================================================*/
+static BOOL pipe_round (ShellPipeline *pl)
+  {
+  uint32_t activity = pl->activity;
+  BOOL interrupted = shell_get_interrupt ();
+  const InterfaceInput *input = interface_get_input ();
+  const InterfaceOutput *output = interface_get_output ();
+
+  for (int i = 0; i < pl->n; i++)
+    {
+    ShellStage *st = &pl->stages[i];
+    if (!st->lua || st->done || st->running) continue;
+    if (interrupted || (st->out && st->out->broken))
+      {
+      if (interrupted) st->ret = ERR_INTERRUPTED;
+      pipe_finish (pl, st);
+      continue;
+      }
+    if ((st->out && st->out->count >= st->out->limit)
+         || (st->in && st->in->waiting))
+      continue;
+
+    pipe_select (pl, st);
+    st->running = TRUE;
+    int status = lua_stage_resume (st->L, st->co);
+    st->running = FALSE;
+    interface_set_input (input);
+    interface_set_output (output);
+    if (status != LUA_YIELD)
+      pipe_finish (pl, st);
+    }
+
+  return pl->activity != activity;
+  }
+
+/*=========================================================================
+
+  pipe_start
+
+  Load a Lua program, which starts running in the first round
+
+=========================================================================*/
+static void pipe_start (ShellStage *st, const char *path, int first)
+  {
+  // Errors in loading the program are reported by Lua
+  st->L = shell_lua_start (path, st->argc - first, st->argv + first, 
+    &st->co);
+  }
+
+/*=========================================================================
+
+  shell_pipe_run
+
+=========================================================================*/
+ErrCode shell_pipe_run (int n, int *argcs, char ***argvs)
+  {
+  ErrCode ret = 0;
+  ShellPipeline pl;
+  ShellStage *driver = NULL;
+  char path[MAX_PATH + 1];
+  int first;
+
+  memset (&pl, 0, sizeof (pl));
+  pl.n = n;
+  pl.input = interface_get_input ();
+  pl.output = interface_get_output ();
+
+  for (int i = 0; i < n - 1 && ret == 0; i++)
+    {
+    ShellPipe *p = &pl.pipes[i];
+    p->in.get_char = pipe_get_char;
+    p->in.ready = pipe_ready;
+    p->in.data = p;
+    p->out.write = pipe_write;
+    p->out.data = p;
+    p->pipeline = &pl;
+    p->writer = &pl.stages[i];
+    p->reader = &pl.stages[i + 1];
+    p->size = p->limit = SHELL_PIPE_SIZE;
+    p->buff = malloc (SHELL_PIPE_SIZE);
+    if (!p->buff) ret = ERR_NOMEM;
+    pl.stages[i].out = p;
+    pl.stages[i + 1].in = p;
+    }
+
+  for (int i = 0; i < n && ret == 0; i++)
+    {
+    ShellStage *st = &pl.stages[i];
+    st->argc = argcs[i];
+    st->argv = argvs[i];
+    st->lua = shell_lua_path (st->argc, st->argv, path, &first);
+    if (st->lua)
+      {
+      pipe_start (st, path, first);
+      if (!st->L) pipe_finish (&pl, st);
+      }
+    else if (driver)
+      {
+      interface_write_stringln
+        ("Only one command in a pipe can be other than a Lua program");
+      ret = ERR_USAGE;
+      }
+    else
+      driver = st;
+    }
+
+  if (ret == 0)
+    {
+    if (driver)
+      {
+      pipe_select (&pl, driver);
+      driver->running = TRUE;
+      driver->ret = shell_do_line_argv (driver->argc, driver->argv);
+      driver->running = FALSE;
+      interface_set_input (pl.input);
+      interface_set_output (pl.output);
+      pipe_finish (&pl, driver);
+      }
+    while (pipe_round (&pl))
+      ;
+    // Anything still waiting now would wait for ever
+    for (int i = 0; i < n; i++)
+      if (!pl.stages[i].done) pipe_finish (&pl, &pl.stages[i]);
+    ret = pl.stages[n - 1].ret;
+    }
+  else if (ret == ERR_NOMEM)
+    shell_write_error (ret);
+
+  for (int i = 0; i < n; i++)
+    {
+    if (pl.stages[i].L) lua_close (pl.stages[i].L);
+    }
+  for (int i = 0; i < n - 1; i++)
+    free (pl.pipes[i].buff);
+  return ret;
+  }
+
@@ -0,0 +1,1344 @@
+/*=========================================================================
+
+  picolua
+
+  shell/shell_script.c
+
+  Parsing and running shell scripts. A script is compiled into an array
+  of operations: CMD runs a command, NOT reverses its result, JFAIL
+  jumps if it failed, JUMP always jumps, and FOR and NEXT step through
+  the words of a for loop. STAGE holds a command that is piped into
+  the next, and the CMD at the end of a pipe runs them all. BG starts
+  a command that ends with & as a background job. The words of each
+  command are split and unquoted when the script is compiled, so all
+  that is left to do when it runs is to expand variables and wildcards
+  in the words that have them. Wildcards in words without variables
+  are compiled along with the script.
+
+  (c)2021 Kevin Boone, GPLv3.0
+
+=========================================================================*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <klib/defs.h>
+#include <klib/string.h>
+#include <interface/interface.h>
+#include <storage/storage.h>
+#include <config.h>
+#include "shell/shell.h"
+#include "shell/errcodes.h"
+#include "shell/shell_script.h"
+#include "shell/shell_pipe.h"
+#include "shell/shell_glob.h"
+#include "shell/shell_job.h"
+
+// End of a chain of jumps that are waiting for their target
+#define SCRIPT_NONE 0xFFFFFFFF
+
+// Longest variable name that can be expanded
+#define SCRIPT_MAX_NAME 64
+
+// Flags of a word
+#define WORD_EXPAND  0x01 // Contains $, so must be expanded
+#define WORD_GLOB    0x02 // Not quoted, and might match filenames
+#define WORD_QUOTED  0x04 // Kept, even if it expands to nothing
+#define WORD_PLAIN   0x08 // No quotes, escapes, or $, so maybe a keyword
+
+typedef enum { OP_CMD, OP_NOT, OP_JFAIL, OP_JUMP, OP_FOR, OP_NEXT,
+  OP_STAGE, OP_BG } ShellOpType;
+
+typedef struct _ShellWord
+  {
+  uint32_t text;                // Offset in the script's text
+  uint16_t flags;
+  uint16_t glob;                // In the script's globs, plus one, if any
+  } ShellWord;
+
+typedef struct _ShellOp
+  {
+  uint8_t type;
+  uint8_t pops;                 // For loops that a JUMP breaks out of
+  uint16_t nwords;
+  uint32_t word;                // First word. For FOR and NEXT, the name
+  uint32_t target;              // Op to jump to
+  } ShellOp;
+
+// The script is allocated as one block, holding all of these, except
+//   the compiled globs
+struct _ShellScript
+  {
+  uint32_t refs;
+  uint32_t nops;
+  uint32_t nglobs;
+  ShellOp *ops;
+  ShellWord *words;
+  ShellGlob **globs;
+  char *text;
+  };
+
+typedef enum { BLOCK_IF, BLOCK_WHILE, BLOCK_FOR } ShellBlockKind;
+
+// An if, while, or for that is being compiled
+typedef struct _ShellBlock
+  {
+  uint8_t kind;
+  uint8_t stage;                // 0 waiting for then or do, 1 in the
+                                //   body, 2 in else
+  uint32_t start;               // First op of a while's condition, or a FOR
+  uint32_t jfail;               // JFAIL to the next part of an if, or out
+  uint32_t ends;                // Chain of jumps to the end
+  uint32_t conts;               // Chain of jumps to the NEXT of a for
+  } ShellBlock;
+
+typedef struct _ShellCompiler
+  {
+  const char *name;
+  const char *p;
+  const char *end;
+  int line;
+  int cmd_line;                 // Line that the current command started on
+  const char *error;
+  BOOL nomem;
+  ShellOp *ops;
+  uint32_t nops, max_ops;
+  ShellWord *words;
+  uint32_t nwords, max_words;
+  char *text;
+  uint32_t ntext, max_text;
+  ShellGlob **globs;
+  uint32_t nglobs, max_globs;
+  ShellBlock blocks [SHELL_SCRIPT_MAX_DEPTH];
+  int depth;
+  BOOL piped;                   // The command just read ended with |
+  BOOL background;              // The command just read ended with &
+  int stages;                   // STAGEs since the last CMD
+  BOOL pipe_not;                // The pipe started with !
+  ShellBlock *pipe_cond;        // The pipe is the condition of this block
+  } ShellCompiler;
+
+// Arguments of a command, or the items of a for loop, as they are
+//   expanded. Words that need no expansion point into the script.
+typedef struct _ShellArgs
+  {
+  char **argv;
+  int argc;
+  uint32_t max_argv;
+  char **own;                   // Strings that must be freed
+  uint32_t nown, max_own;
+  } ShellArgs;
+
+typedef struct _ShellFrame
+  {
+  ShellArgs items;
+  int next;
+  } ShellFrame;
+
+typedef struct _ShellCacheEntry
+  {
+  char *path;                   // NULL if not in use
+  ShellScript *script;
+  uint32_t generation;          // Of the filesystem, when last checked
+  uint32_t size;
+  uint32_t hash;
+  uint32_t last_used;
+  } ShellCacheEntry;
+
+static ShellCacheEntry script_cache [SHELL_SCRIPT_CACHE_SIZE];
+static uint32_t script_clock = 0;
+
+// Status of the last command, for $?
+static ErrCode script_status = 0;
+
+/*=========================================================================
+
+  script_grow
+
+  Make room for one more item in an array that grows by doubling
+
+=========================================================================*/
+static BOOL script_grow (void **array, uint32_t *max, uint32_t n,
+              size_t size)
+  {
+  if (n < *max) return TRUE;
+  uint32_t m = *max ? *max * 2 : 16;
+  void *a = realloc (*array, m * size);
+  if (!a) return FALSE;
+  *array = a;
+  *max = m;
+  return TRUE;
+  }
+
+/*=========================================================================
+
+  script_add_char
+
+=========================================================================*/
+static void script_add_char (ShellCompiler *c, char ch)
+  {
+  if (script_grow ((void **)&c->text, &c->max_text, c->ntext, 1))
+    c->text[c->ntext++] = ch;
+  else
+    c->nomem = TRUE;
+  }
+
+/*=========================================================================
+
+  script_add_word
+
+=========================================================================*/
+static void script_add_word (ShellCompiler *c, uint32_t text,
+              uint32_t flags)
+  {
+  if (script_grow ((void **)&c->words, &c->max_words, c->nwords,
+        sizeof (ShellWord)))
+    {
+    c->words[c->nwords].text = text;
+    c->words[c->nwords].flags = (uint16_t)flags;
+    c->words[c->nwords].glob = 0;
+    c->nwords++;
+    }
+  else
+    c->nomem = TRUE;
+  }
+
+/*=========================================================================
+
+  script_add_op
+
+  Returns the index of the new op
+
+=========================================================================*/
+static uint32_t script_add_op (ShellCompiler *c, ShellOpType type,
+              uint32_t word, uint32_t nwords, uint32_t target)
+  {
+  if (!script_grow ((void **)&c->ops, &c->max_ops, c->nops,
+        sizeof (ShellOp)))
+    {
+    c->nomem = TRUE;
+    return 0;
+    }
+  ShellOp *op = &c->ops[c->nops];
+  op->type = (uint8_t)type;
+  op->pops = 0;
+  op->nwords = (uint16_t)nwords;
+  op->word = word;
+  op->target = target;
+  return c->nops++;
+  }
+
+/*=========================================================================
+
+  script_add_jump
+
+  Add a jump whose target isn't known yet to a chain, which is linked
+  through the targets
+
+=========================================================================*/
+static void script_add_jump (ShellCompiler *c, ShellOpType type,
+              uint32_t *chain)
+  {
+  uint32_t op = script_add_op (c, type, 0, 0, *chain);
+  if (!c->nomem) *chain = op;
+  }
+
+/*=========================================================================
+
+  script_patch
+
+  Point every jump in a chain at the target
+
+=========================================================================*/
+static void script_patch (ShellCompiler *c, uint32_t *chain,
+              uint32_t target)
+  {
+  uint32_t op = *chain;
+  while (op != SCRIPT_NONE)
+    {
+    uint32_t next = c->ops[op].target;
+    c->ops[op].target = target;
+    op = next;
+    }
+  *chain = SCRIPT_NONE;
+  }
+
+/*=========================================================================
+
+  script_lex_word
+
+  Words are split and quoted as string_tokenize() does it: double
+  quotes, a backslash before any character, and # for a comment,
+  except in $#. $ is expanded when the script runs, even in quotes, so
+  \$ is stored as $$, which expands to $.
+
+=========================================================================*/
+static void script_lex_word (ShellCompiler *c)
+  {
+  uint32_t text = c->ntext;
+  uint32_t flags = WORD_PLAIN;
+  BOOL quoted = FALSE;
+  BOOL wild = FALSE;
+  while (c->p < c->end)
+    {
+    char ch = *c->p;
+    if (!quoted && (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n'
+         || ch == ';' || ch == '|' || ch == '&'
+         || (ch == '#' && c->p[-1] != '$')))
+      break;
+    c->p++;
+    if (ch == '"')
+      {
+      quoted = !quoted;
+      flags = (flags | WORD_QUOTED) & ~WORD_PLAIN;
+      }
+    else if (ch == '\\' && c->p < c->end)
+      {
+      flags &= ~WORD_PLAIN;
+      ch = *c->p++;
+      if (ch == '\n')
+        {
+        c->line++; // Carry on with the next line
+        continue;
+        }
+      if (ch == '$')
+        {
+        flags |= WORD_EXPAND;
+        script_add_char (c, '$');
+        }
+      script_add_char (c, ch);
+      }
+    else
+      {
+      if (ch == '$')
+        flags = (flags | WORD_EXPAND) & ~WORD_PLAIN;
+      else if (!quoted && (ch == '*' || ch == '?' || ch == '['))
+        wild = TRUE;
+      else if (ch == '\n')
+        c->line++;
+      script_add_char (c, ch);
+      }
+    }
+  if (quoted)
+    c->error = "unterminated quote";
+  script_add_char (c, 0);
+  if (!(flags & WORD_QUOTED) && (wild || (flags & WORD_EXPAND)))
+    flags |= WORD_GLOB;
+  script_add_word (c, text, flags);
+  }
+
+/*=========================================================================
+
+  script_lex_command
+
+  Read the words of the next command, which ends with ;, |, &, or a
+  new line, into the compiler's words, from *first. Empty commands are
+  skipped, so this returns zero only at the end of the script. After
+  |, the next command can be on the next line.
+
+=========================================================================*/
+static uint32_t script_lex_command (ShellCompiler *c, uint32_t *first)
+  {
+  uint32_t n = 0;
+  *first = c->nwords;
+  c->piped = FALSE;
+  c->background = FALSE;
+  while (c->p < c->end && !c->error)
+    {
+    char ch = *c->p;
+    if (ch == ' ' || ch == '\t' || ch == '\r')
+      c->p++;
+    else if (ch == '|')
+      {
+      c->p++;
+      if (n == 0)
+        {
+        c->cmd_line = c->line;
+        c->error = "unexpected |";
+        }
+      c->piped = TRUE;
+      break;
+      }
+    else if (ch == '&')
+      {
+      c->p++;
+      if (n == 0)
+        {
+        c->cmd_line = c->line;
+        c->error = "unexpected &";
+        }
+      c->background = TRUE;
+      break;
+      }
+    else if (ch == ';' && n == 0 && c->stages > 0)
+      {
+      c->cmd_line = c->line;
+      c->error = "expected a command after |";
+      }
+    else if (ch == '\n' || ch == ';')
+      {
+      c->p++;
+      if (ch == '\n') c->line++;
+      if (n > 0) break;
+      }
+    else if (ch == '#')
+      {
+      while (c->p < c->end && *c->p != '\n') c->p++;
+      }
+    else
+      {
+      if (n == 0) c->cmd_line = c->line;
+      script_lex_word (c);
+      n++;
+      }
+    }
+  return n;
+  }
+
+/*=========================================================================
+
+  script_is
+
+  Test whether a word is a particular keyword. Keywords can't be
+  quoted, so "if" is just a word.
+
+=========================================================================*/
+static BOOL script_is (const ShellCompiler *c, uint32_t word,
+              const char *keyword)
+  {
+  return (c->words[word].flags & WORD_PLAIN)
+    && strcmp (c->text + c->words[word].text, keyword) == 0;
+  }
+
+/*=========================================================================
+
+  script_is_keyword
+
+=========================================================================*/
+static BOOL script_is_keyword (const ShellCompiler *c, uint32_t word)
+  {
+  static const char *const keywords[] = { "if", "then", "elif", "else",
+    "fi", "while", "do", "done", "for", "break", "continue", NULL };
+  for (int i = 0; keywords[i]; i++)
+    if (script_is (c, word, keywords[i])) return TRUE;
+  return FALSE;
+  }
+
+/*=========================================================================
+
+  script_push
+
+=========================================================================*/
+static ShellBlock *script_push (ShellCompiler *c, ShellBlockKind kind)
+  {
+  if (c->depth == SHELL_SCRIPT_MAX_DEPTH)
+    {
+    c->error = "too deeply nested";
+    return NULL;
+    }
+  ShellBlock *b = &c->blocks[c->depth++];
+  b->kind = (uint8_t)kind;
+  b->stage = 0;
+  b->start = c->nops;
+  b->jfail = SCRIPT_NONE;
+  b->ends = SCRIPT_NONE;
+  b->conts = SCRIPT_NONE;
+  return b;
+  }
+
+/*=========================================================================
+
+  script_command
+
+  A command that isn't a keyword, which may be preceded by !. A command
+  that is piped into the next is a STAGE, and the last command of the
+  pipe is the CMD, so the ! of a pipe, and the JFAIL of a pipe that is
+  a condition, come after that. A command that ends with & is a BG;
+  a pipe can't be.
+
+=========================================================================*/
+static void script_command (ShellCompiler *c, uint32_t first, uint32_t n)
+  {
+  BOOL not = n > 0 && c->stages == 0 && script_is (c, first, "!");
+  if (not)
+    {
+    first++;
+    n--;
+    }
+  if (n == 0)
+    {
+    c->error = "expected a command";
+    return;
+    }
+  if (c->background)
+    {
+    c->background = FALSE;
+    if (c->stages > 0)
+      c->error = "a pipe can't run in the background";
+    script_add_op (c, OP_BG, first, n, 0);
+    if (not) script_add_op (c, OP_NOT, 0, 0, 0);
+    return;
+    }
+  if (c->piped)
+    {
+    if (++c->stages == SHELL_PIPE_MAX_STAGES)
+      c->error = "too many commands in a pipe";
+    script_add_op (c, OP_STAGE, first, n, 0);
+    if (not) c->pipe_not = TRUE;
+    return;
+    }
+  script_add_op (c, OP_CMD, first, n, 0);
+  if (not || c->pipe_not) script_add_op (c, OP_NOT, 0, 0, 0);
+  if (c->pipe_cond)
+    script_add_jump (c, OP_JFAIL, &c->pipe_cond->jfail);
+  c->stages = 0;
+  c->pipe_not = FALSE;
+  c->pipe_cond = NULL;
+  }
+
+/*=========================================================================
+
+  script_condition
+
+  The command after if, elif, or while. If it fails, the JFAIL after
+  it goes to the next part of the block. If it is a pipe, that is
+  added after the last command of the pipe.
+
+=========================================================================*/
+static void script_condition (ShellCompiler *c, ShellBlock *b,
+              uint32_t first, uint32_t n)
+  {
+  if (c->piped)
+    c->pipe_cond = b;
+  script_command (c, first, n);
+  if (!c->piped)
+    script_add_jump (c, OP_JFAIL, &b->jfail);
+  }
+
+/*=========================================================================
+
+  script_loop
+
+  The innermost loop, for break and continue
+
+=========================================================================*/
+static ShellBlock *script_loop (ShellCompiler *c)
+  {
+  for (int i = c->depth - 1; i >= 0; i--)
+    if (c->blocks[i].kind != BLOCK_IF) return &c->blocks[i];
+  return NULL;
+  }
+
+/*=========================================================================
+
+  script_parse_for
+
+  for NAME [in WORDS...]. The FOR op's words are the name followed by
+  the items, so the name is moved into the place of "in". With no
+  "in", the items are the script's arguments.
+
+=========================================================================*/
+static void script_parse_for (ShellCompiler *c, uint32_t first,
+              uint32_t n)
+  {
+  if (n < 2 || !(c->words[first + 1].flags & WORD_PLAIN))
+    {
+    c->error = "expected a variable name";
+    return;
+    }
+  if (n == 2)
+    {
+    uint32_t text = c->ntext;
+    script_add_char (c, '$');
+    script_add_char (c, '@');
+    script_add_char (c, 0);
+    script_add_word (c, c->words[first + 1].text, WORD_PLAIN);
+    script_add_word (c, text, WORD_EXPAND | WORD_QUOTED);
+    n += 2;
+    }
+  else if (script_is (c, first + 2, "in"))
+    c->words[first + 2] = c->words[first + 1];
+  else
+    {
+    c->error = "expected in";
+    return;
+    }
+  ShellBlock *b = script_push (c, BLOCK_FOR);
+  if (b)
+    script_add_op (c, OP_FOR, first + 2, n - 2, SCRIPT_NONE);
+  }
+
+/*=========================================================================
+
+  script_parse_command
+
+  Compile one command, which might start with a keyword. After then,
+  do, and else, the rest of the words are another command.
+
+=========================================================================*/
+static void script_parse_command (ShellCompiler *c, uint32_t first,
+              uint32_t n)
+  {
+  ShellBlock *b = c->depth > 0 ? &c->blocks[c->depth - 1] : NULL;
+
+  if (b && b->stage == 0)
+    {
+    const char *want = b->kind == BLOCK_IF ? "then" : "do";
+    if (!script_is (c, first, want))
+      {
+      c->error = b->kind == BLOCK_IF ? "expected then" : "expected do";
+      return;
+      }
+    b->stage = 1;
+    if (n > 1) script_parse_command (c, first + 1, n - 1);
+    }
+  else if (script_is (c, first, "if"))
+    {
+    b = script_push (c, BLOCK_IF);
+    if (b) script_condition (c, b, first + 1, n - 1);
+    }
+  else if (script_is (c, first, "while"))
+    {
+    b = script_push (c, BLOCK_WHILE);
+    if (b) script_condition (c, b, first + 1, n - 1);
+    }
+  else if (script_is (c, first, "for"))
+    {
+    script_parse_for (c, first, n);
+    }
+  else if (script_is (c, first, "elif"))
+    {
+    if (!b || b->kind != BLOCK_IF || b->stage != 1)
+      {
+      c->error = "unexpected elif";
+      return;
+      }
+    script_add_jump (c, OP_JUMP, &b->ends);
+    script_patch (c, &b->jfail, c->nops);
+    b->stage = 0;
+    script_condition (c, b, first + 1, n - 1);
+    }
+  else if (script_is (c, first, "else"))
+    {
+    if (!b || b->kind != BLOCK_IF || b->stage != 1)
+      {
+      c->error = "unexpected else";
+      return;
+      }
+    script_add_jump (c, OP_JUMP, &b->ends);
+    script_patch (c, &b->jfail, c->nops);
+    b->stage = 2;
+    if (n > 1) script_parse_command (c, first + 1, n - 1);
+    }
+  else if (script_is (c, first, "fi") || script_is (c, first, "done"))
+    {
+    BOOL fi = script_is (c, first, "fi");
+    if (!b || (b->kind == BLOCK_IF) != fi)
+      {
+      c->error = fi ? "unexpected fi" : "unexpected done";
+      return;
+      }
+    if (n > 1)
+      {
+      c->error = "expected ; or a new line";
+      return;
+      }
+    if (b->kind == BLOCK_WHILE)
+      script_add_op (c, OP_JUMP, 0, 0, b->start);
+    else if (b->kind == BLOCK_FOR)
+      {
+      uint32_t next = script_add_op (c, OP_NEXT, c->ops[b->start].word,
+        0, b->start + 1);
+      c->ops[b->start].target = next;
+      script_patch (c, &b->conts, next);
+      }
+    script_patch (c, &b->jfail, c->nops);
+    script_patch (c, &b->ends, c->nops);
+    c->depth--;
+    }
+  else if (script_is (c, first, "break") ||
+           script_is (c, first, "continue"))
+    {
+    BOOL brk = script_is (c, first, "break");
+    ShellBlock *loop = script_loop (c);
+    if (!loop)
+      c->error = brk ? "break outside a loop" : "continue outside a loop";
+    else if (brk)
+      {
+      script_add_jump (c, OP_JUMP, &loop->ends);
+      // Leaving a for loop drops the list that it is stepping through
+      if (!c->nomem && loop->kind == BLOCK_FOR)
+        c->ops[loop->ends].pops = 1;
+      }
+    else if (loop->kind == BLOCK_WHILE)
+      script_add_op (c, OP_JUMP, 0, 0, loop->start);
+    else
+      script_add_jump (c, OP_JUMP, &loop->conts);
+    }
+  else if (script_is (c, first, "then") || script_is (c, first, "do"))
+    {
+    c->error = script_is (c, first, "then") ?
+      "unexpected then" : "unexpected do";
+    }
+  else
+    {
+    script_command (c, first, n);
+    }
+  }
+
+/*=========================================================================
+
+  script_syntax_error
+
+=========================================================================*/
+static void script_syntax_error (const ShellCompiler *c, int line,
+              const char *msg)
+  {
+  char s[MAX_PATH + 80];
+  snprintf (s, sizeof (s), "%s:%d: %s", c->name, line, msg);
+  interface_write_stringln (s);
+  }
+
+/*=========================================================================
+
+  script_compile_globs
+
+  Compile the wildcards in each word that has them, but has no
+  variables, which would have to be expanded first
+
+=========================================================================*/
+static void script_compile_globs (ShellCompiler *c)
+  {
+  for (uint32_t w = 0; w < c->nwords && !c->nomem; w++)
+    {
+    ShellWord *word = &c->words[w];
+    if (!(word->flags & WORD_GLOB) || (word->flags & WORD_EXPAND)
+         || c->nglobs == 0xFFFF)
+      continue;
+    ErrCode err;
+    ShellGlob *g = shell_glob_compile (c->text + word->text, &err);
+    if (!g)
+      {
+      if (err) c->nomem = TRUE;
+      }
+    else if (script_grow ((void **)&c->globs, &c->max_globs, c->nglobs,
+           sizeof (ShellGlob *)))
+      {
+      c->globs[c->nglobs++] = g;
+      word->glob = (uint16_t)c->nglobs;
+      }
+    else
+      {
+      shell_glob_free (g);
+      c->nomem = TRUE;
+      }
+    }
+  }
+
+/*=========================================================================
+
+  shell_script_compile
+
+=========================================================================*/
+ShellScript *shell_script_compile (const char *name, const char *text,
+              uint32_t len, ErrCode *err)
+  {
+  ShellCompiler c;
+  memset (&c, 0, sizeof (c));
+  c.name = name;
+  c.p = text;
+  c.end = text + len;
+  c.line = 1;
+
+  uint32_t first, n;
+  while (!c.error && !c.nomem && (n = script_lex_command (&c, &first)) > 0)
+    {
+    if (c.error)
+      break;
+    if (c.stages > 0)
+      {
+      // The rest of a pipe can't start a block, or end one
+      if (script_is_keyword (&c, first))
+        c.error = "expected a command after |";
+      else
+        script_command (&c, first, n);
+      }
+    else
+      {
+      script_parse_command (&c, first, n);
+      if (c.piped && c.stages == 0 && !c.error)
+        c.error = "unexpected |";
+      }
+    // Left over if the command was a keyword
+    if (c.background && !c.error)
+      c.error = "unexpected &";
+    }
+  if (!c.error && c.stages > 0)
+    {
+    c.cmd_line = c.line;
+    c.error = "expected a command after |";
+    }
+  if (!c.error && c.depth > 0)
+    {
+    c.cmd_line = c.line;
+    c.error = c.blocks[c.depth - 1].kind == BLOCK_IF ?
+      "expected fi" : "expected done";
+    }
+
+  if (!c.error && !c.nomem)
+    script_compile_globs (&c);
+
+  ShellScript *s = NULL;
+  if (c.nomem)
+    {
+    *err = ERR_NOMEM;
+    shell_write_error (*err);
+    }
+  else if (c.error)
+    {
+    *err = ERR_SYNTAX;
+    script_syntax_error (&c, c.cmd_line, c.error);
+    }
+  else
+    {
+    s = malloc (sizeof (ShellScript) + c.nops * sizeof (ShellOp)
+          + c.nwords * sizeof (ShellWord) + c.nglobs * sizeof (ShellGlob *)
+          + c.ntext);
+    if (s)
+      {
+      s->refs = 1;
+      s->nops = c.nops;
+      s->nglobs = c.nglobs;
+      s->ops = (ShellOp *)(s + 1);
+      s->words = (ShellWord *)(s->ops + c.nops);
+      s->globs = (ShellGlob **)(s->words + c.nwords);
+      s->text = (char *)(s->globs + c.nglobs);
+      if (c.nops) memcpy (s->ops, c.ops, c.nops * sizeof (ShellOp));
+      if (c.nwords) memcpy (s->words, c.words, c.nwords * sizeof (ShellWord));
+      if (c.nglobs) 
+        memcpy (s->globs, c.globs, c.nglobs * sizeof (ShellGlob *));
+      if (c.ntext) memcpy (s->text, c.text, c.ntext);
+      c.nglobs = 0; // The script has them now
+      }
+    else
+      {
+      *err = ERR_NOMEM;
+      shell_write_error (*err);
+      }
+    }
+
+  for (uint32_t i = 0; i < c.nglobs; i++)
+    shell_glob_free (c.globs[i]);
+  free (c.globs);
+  free (c.ops);
+  free (c.words);
+  free (c.text);
+  return s;
+  }
+
+/*=========================================================================
+
+  shell_script_free
+
+=========================================================================*/
+void shell_script_free (ShellScript *script)
+  {
+  if (script && --script->refs == 0)
+    {
+    for (uint32_t i = 0; i < script->nglobs; i++)
+      shell_glob_free (script->globs[i]);
+    free (script);
+    }
+  }
+
+/*=========================================================================
+
+  script_args_add
+
+  Add an argument. If own is TRUE, it was allocated for this, and
+  will be freed along with the arguments -- even if this fails.
+
+=========================================================================*/
+static ErrCode script_args_add (ShellArgs *a, char *arg, BOOL own)
+  {
+  if (!arg) return ERR_NOMEM;
+  if (own)
+    {
+    if (!script_grow ((void **)&a->own, &a->max_own, a->nown,
+           sizeof (char *)))
+      {
+      free (arg);
+      return ERR_NOMEM;
+      }
+    a->own[a->nown++] = arg;
+    }
+  // One more for the NULL at the end
+  if (!script_grow ((void **)&a->argv, &a->max_argv,
+         (uint32_t)a->argc + 1, sizeof (char *)))
+    return ERR_NOMEM;
+  a->argv[a->argc++] = arg;
+  a->argv[a->argc] = NULL;
+  return 0;
+  }
+
+/*=========================================================================
+
+  script_args_clear
+
+  Empty the arguments, but keep the arrays for the next command
+
+=========================================================================*/
+static void script_args_clear (ShellArgs *a)
+  {
+  for (uint32_t i = 0; i < a->nown; i++)
+    free (a->own[i]);
+  a->nown = 0;
+  a->argc = 0;
+  }
+
+/*=========================================================================
+
+  script_args_free
+
+=========================================================================*/
+static void script_args_free (ShellArgs *a)
+  {
+  script_args_clear (a);
+  free (a->argv);
+  free (a->own);
+  memset (a, 0, sizeof (*a));
+  }
+
+/*=========================================================================
+
+  script_expand_vars
+
+  Expand $NAME, ${NAME}, $0 to $9, $#, $?, and $@ into out
+
+=========================================================================*/
+static void script_expand_vars (const char *t, int argc, char **argv,
+              String *out)
+  {
+  while (*t)
+    {
+    if (*t != '$')
+      {
+      string_append_byte (out, (BYTE)*t++);
+      continue;
+      }
+    t++;
+    char name [SCRIPT_MAX_NAME + 1];
+    int l = 0;
+    if (*t == '{' && strchr (t, '}'))
+      {
+      for (t++; *t != '}'; t++)
+        if (l < SCRIPT_MAX_NAME) name[l++] = *t;
+      t++;
+      }
+    else if (isalpha ((unsigned char)*t) || *t == '_')
+      {
+      for (; isalnum ((unsigned char)*t) || *t == '_'; t++)
+        if (l < SCRIPT_MAX_NAME) name[l++] = *t;
+      }
+    else if (*t && strchr ("0123456789#?@$", *t))
+      name[l++] = *t++;
+    name[l] = 0;
+
+    if (l == 0)
+      string_append_byte (out, '$');
+    else if (l == 1 && isdigit ((unsigned char)name[0]))
+      {
+      int i = name[0] - '0';
+      if (i < argc) string_append (out, argv[i]);
+      }
+    else if (strcmp (name, "#") == 0)
+      string_append_printf (out, "%d", argc > 1 ? argc - 1 : 0);
+    else if (strcmp (name, "?") == 0)
+      string_append_printf (out, "%d", script_status);
+    else if (strcmp (name, "@") == 0)
+      {
+      for (int i = 1; i < argc; i++)
+        {
+        if (i > 1) string_append_byte (out, ' ');
+        string_append (out, argv[i]);
+        }
+      }
+    else if (strcmp (name, "$") == 0)
+      string_append_byte (out, '$');
+    else
+      {
+      const char *value = getenv (name);
+      if (value) string_append (out, value);
+      }
+    }
+  }
+
+/*=========================================================================
+
+  script_glob_add
+
+=========================================================================*/
+static ErrCode script_glob_add (const char *path, void *data)
+  {
+  return script_args_add (data, strdup (path), TRUE);
+  }
+
+/*=========================================================================
+
+  script_glob
+
+  Add the files that match a word, or the word itself if none does
+
+=========================================================================*/
+static ErrCode script_glob (const ShellGlob *g, const char *word,
+              ShellArgs *a)
+  {
+  uint32_t matches;
+  ErrCode ret = shell_glob_expand (g, script_glob_add, a, &matches);
+  if (ret == 0 && matches == 0)
+    ret = script_args_add (a, strdup (word), TRUE);
+  return ret;
+  }
+
+/*=========================================================================
+
+  script_expand
+
+  Expand n words into arguments. An unquoted word that expands to
+  nothing is dropped, and one with wildcards is globbed, and replaced
+  by the files that match, as they are found.
+
+=========================================================================*/
+static ErrCode script_expand (const ShellScript *s, uint32_t word,
+              uint32_t n, int argc, char **argv, ShellArgs *a)
+  {
+  ErrCode ret = 0;
+  for (uint32_t w = word; w < word + n && ret == 0; w++)
+    {
+    char *t = s->text + s->words[w].text;
+    uint32_t flags = s->words[w].flags;
+    if (!(flags & WORD_EXPAND))
+      {
+      if (s->words[w].glob)
+        ret = script_glob (s->globs[s->words[w].glob - 1], t, a);
+      else
+        ret = script_args_add (a, t, FALSE);
+      continue;
+      }
+    if (strcmp (t, "$@") == 0)
+      {
+      // One argument for each of the script's
+      for (int i = 1; i < argc && ret == 0; i++)
+        ret = script_args_add (a, argv[i], FALSE);
+      continue;
+      }
+
+    String *e = string_create_empty ();
+    script_expand_vars (t, argc, argv, e);
+    const char *ce = string_cstr (e);
+    ShellGlob *g = NULL;
+
+    if (ce[0] == 0 && !(flags & WORD_QUOTED))
+      ;
+    else if ((flags & WORD_GLOB) && (g = shell_glob_compile (ce, &ret)))
+      {
+      ret = script_glob (g, ce, a);
+      shell_glob_free (g);
+      }
+    else if (ret == 0)
+      ret = script_args_add (a, strdup (ce), TRUE);
+    string_destroy (e);
+    }
+  return ret;
+  }
+
+/*=========================================================================
+
+  script_pipe
+
+  Run the commands held by the STAGEs, and the last command, as a pipe
+
+=========================================================================*/
+static ErrCode script_pipe (ShellArgs *stages, int n, ShellArgs *last)
+  {
+  int argcs [SHELL_PIPE_MAX_STAGES];
+  char **argvs [SHELL_PIPE_MAX_STAGES];
+  for (int i = 0; i < n; i++)
+    {
+    argcs[i] = stages[i].argc;
+    argvs[i] = stages[i].argv;
+    }
+  argcs[n] = last->argc;
+  argvs[n] = last->argv;
+  return shell_pipe_run (n + 1, argcs, argvs);
+  }
+
+/*=========================================================================
+
+  shell_script_run
+
+=========================================================================*/
+ErrCode shell_script_run (ShellScript *s, int argc, char **argv)
+  {
+  ErrCode ret = 0;
+  ShellArgs args;
+  ShellArgs stages [SHELL_PIPE_MAX_STAGES - 1];
+  int nstages = 0;
+  ShellFrame frames [SHELL_SCRIPT_MAX_DEPTH];
+  int nframes = 0;
+  memset (&args, 0, sizeof (args));
+  memset (stages, 0, sizeof (stages));
+  s->refs++;
+
+  uint32_t pc = 0;
+  while (pc < s->nops && ret == 0)
+    {
+    const ShellOp *op = &s->ops[pc++];
+    switch (op->type)
+      {
+      case OP_STAGE:
+        ret = script_expand (s, op->word, op->nwords, argc, argv,
+          &stages[nstages++]);
+        if (ret) shell_write_error (ret);
+        break;
+
+      case OP_CMD:
+        ret = script_expand (s, op->word, op->nwords, argc, argv, &args);
+        if (ret == 0 && nstages > 0)
+          ret = script_pipe (stages, nstages, &args);
+        else if (ret == 0)
+          ret = shell_do_line_argv (args.argc, args.argv);
+        else
+          shell_write_error (ret);
+        script_args_clear (&args);
+        while (nstages > 0)
+          script_args_clear (&stages[--nstages]);
+        script_status = ret;
+        if (shell_get_interrupt ())
+          ret = ERR_INTERRUPTED;
+        else if (pc < s->nops && (s->ops[pc].type == OP_JFAIL
+             || s->ops[pc].type == OP_NOT))
+          ret = 0; // A condition, which may fail
+        break;
+
+      case OP_BG:
+        ret = script_expand (s, op->word, op->nwords, argc, argv, &args);
+        if (ret == 0)
+          ret = shell_job_start (args.argc, args.argv);
+        else
+          shell_write_error (ret);
+        script_args_clear (&args);
+        script_status = ret;
+        if (pc < s->nops && (s->ops[pc].type == OP_JFAIL
+             || s->ops[pc].type == OP_NOT))
+          ret = 0;
+        break;
+
+      case OP_NOT:
+        script_status = script_status ? 0 : ERR_FALSE;
+        break;
+
+      case OP_JFAIL:
+        if (script_status != 0)
+          pc = op->target;
+        break;
+
+      case OP_JUMP:
+        for (int i = 0; i < op->pops; i++)
+          script_args_free (&frames[--nframes].items);
+        if (op->target < pc && shell_get_interrupt ())
+          ret = ERR_INTERRUPTED;
+        pc = op->target;
+        break;
+
+      case OP_FOR:
+        {
+        ShellFrame *f = &frames[nframes++];
+        memset (f, 0, sizeof (*f));
+        ret = script_expand (s, op->word + 1, op->nwords - 1u, argc, argv,
+          &f->items);
+        if (ret) shell_write_error (ret);
+        pc = op->target;
+        }
+        break;
+
+      case OP_NEXT:
+        {
+        ShellFrame *f = &frames[nframes - 1];
+        if (f->next < f->items.argc)
+          {
+          setenv (s->text + s->words[op->word].text,
+            f->items.argv[f->next++], TRUE);
+          if (shell_get_interrupt ())
+            ret = ERR_INTERRUPTED;
+          pc = op->target;
+          }
+        else
+          {
+          script_args_free (&f->items);
+          nframes--;
+          }
+        }
+        break;
+      }
+    }
+
+  while (nframes > 0)
+    script_args_free (&frames[--nframes].items);
+  for (int i = 0; i < SHELL_PIPE_MAX_STAGES - 1; i++)
+    script_args_free (&stages[i]);
+  script_args_free (&args);
+  shell_script_free (s);
+  return ret;
+  }
+
+/*=========================================================================
+
+  script_hash
+
+=========================================================================*/
+static uint32_t script_hash (const uint8_t *data, uint32_t size)
+  {
+  uint32_t h = 2166136261u; // FNV-1a
+  for (uint32_t i = 0; i < size; i++)
+    {
+    h ^= data[i];
+    h *= 16777619u;
+    }
+  return h;
+  }
+
+/*=========================================================================
+
+  script_cache_find
+
+=========================================================================*/
+static ShellCacheEntry *script_cache_find (const char *path)
+  {
+  for (int i = 0; i < SHELL_SCRIPT_CACHE_SIZE; i++)
+    {
+    ShellCacheEntry *e = &script_cache[i];
+    if (e->path && strcmp (e->path, path) == 0)
+      return e;
+    }
+  return NULL;
+  }
+
+/*=========================================================================
+
+  script_cache_store
+
+  Store a script in the cache, in place of e if it isn't NULL, or else
+  of the one least recently used. The cache takes the script from the
+  caller; if there isn't the memory to store it, this returns NULL,
+  and the caller keeps it.
+
+=========================================================================*/
+static ShellCacheEntry *script_cache_store (ShellCacheEntry *e,
+              const char *path, ShellScript *script)
+  {
+  if (!e)
+    {
+    char *p = strdup (path);
+    if (!p) return NULL;
+    e = &script_cache[0];
+    for (int i = 1; i < SHELL_SCRIPT_CACHE_SIZE && e->path; i++)
+      {
+      if (!script_cache[i].path ||
+           script_cache[i].last_used < e->last_used)
+        e = &script_cache[i];
+      }
+    free (e->path);
+    e->path = p;
+    }
+  shell_script_free (e->script);
+  e->script = script;
+  return e;
+  }
+
+/*=========================================================================
+
+  shell_script_run_file
+
+  The flash filesystem doesn't store times, so it can't tell us
+  whether a file has changed since it was compiled. But nothing can
+  have changed while storage_generation() stays the same, and if it
+  does change, the file is read again, and only compiled again if its
+  size or hash differs. Files in /rom are mapped, not read.
+
+=========================================================================*/
+ErrCode shell_script_run_file (const char *path, int argc, char **argv)
+  {
+  ErrCode ret = 0;
+  ShellScript *script = NULL;
+  BOOL cached = TRUE;
+  uint32_t generation = storage_generation ();
+  ShellCacheEntry *e = script_cache_find (path);
+
+  if (e && e->generation == generation)
+    script = e->script;
+  else
+    {
+    const void *data;
+    uint32_t size;
+    uint8_t *buff = NULL;
+    ret = storage_map (path, &data, &size);
+    if (ret == ERR_NOTIMPLEMENTED)
+      {
+      int n;
+      ret = storage_read_file (path, &buff, &n);
+      data = buff;
+      size = (uint32_t)n;
+      }
+    if (ret == 0)
+      {
+      uint32_t hash = script_hash (data, size);
+      if (e && e->size == size && e->hash == hash)
+        {
+        script = e->script;
+        e->generation = generation;
+        }
+      else if ((script = shell_script_compile (path, data, size, &ret)))
+        {
+        e = script_cache_store (e, path, script);
+        cached = (e != NULL);
+        if (e)
+          {
+          e->generation = generation;
+          e->size = size;
+          e->hash = hash;
+          }
+        }
+      free (buff);
+      }
+    else
+      shell_write_error_filename (ret, path);
+    }
+
+  if (script)
+    {
+    if (cached) e->last_used = ++script_clock;
+    ret = shell_script_run (script, argc, argv);
+    if (!cached) shell_script_free (script);
+    }
+  return ret;
+  }
+
+/*=========================================================================
+
+  shell_script_run_line
+
+=========================================================================*/
+ErrCode shell_script_run_line (const char *line)
+  {
+  ErrCode ret = 0;
+  ShellScript *script = shell_script_compile ("sh", line,
+    (uint32_t)strlen (line), &ret);
+  if (script)
+    {
+    ret = shell_script_run (script, 0, NULL);
+    shell_script_free (script);
+    }
+  return ret;
+  }
+
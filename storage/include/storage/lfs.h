@@ -229,6 +229,17 @@ struct lfs_config {
     // can track 8 blocks. Must be a multiple of 8.
     lfs_size_t lookahead_size;
 
+    // Threshold for metadata compaction during lfs_fs_gc in bytes. Metadata
+    // pairs that exceed this threshold will be compacted during lfs_fs_gc.
+    // Defaults to ~88% block_size when zero, though the default may change
+    // in the future.
+    //
+    // Note this only affects lfs_fs_gc. Normal compactions still only occur
+    // when full.
+    //
+    // Set to -1 to disable metadata compaction during lfs_fs_gc.
+    lfs_size_t compact_thresh;
+
     // Optional statically allocated read buffer. Must be cache_size.
     // By default lfs_malloc is used to allocate this buffer.
     void *read_buffer;
@@ -712,16 +723,33 @@ lfs_ssize_t lfs_fs_size(lfs_t *lfs);
 // Returns a negative error code on failure.
 int lfs_fs_traverse(lfs_t *lfs, int (*cb)(void*, lfs_block_t), void *data);
 
-// Attempt to proactively find free blocks
+// Traverse through the metadata of the filesystem, without following the
+// files' block lists
+//
+// The provided callback will be called with each metadata block address,
+// with the head block and the size of each file's block list, and with 
+// the metadata pair of each directory. Any change to the blocks in use
+// changes this sequence, but it only reads metadata, so it is much 
+// cheaper than lfs_fs_traverse for large files.
+//
+// Returns a negative error code on failure.
+int lfs_fs_traverseheads(lfs_t *lfs,
+        int (*cb)(void*, lfs_block_t), void *data);
+
+// Attempt any janitorial work
+//
+// This currently:
+// 1. Calls mkconsistent if not already consistent
+// 2. Compacts metadata > compact_thresh
+// 3. Populates the block allocator
 //
-// Calling this function is not required, but may allowing the offloading of
-// the expensive block allocation scan to a less time-critical code path.
+// Though additional janitorial work may be added in the future.
 //
-// Note: littlefs currently does not persist any found free blocks to disk.
-// This may change in the future.
+// Calling this function is not required, but may allow the offloading of
+// expensive janitorial work to a less time-critical code path.
 //
-// Returns a negative error code on failure. Finding no free blocks is
-// not an error.
+// Returns a negative error code on failure. Accomplishing nothing is not
+// an error.
 int lfs_fs_gc(lfs_t *lfs);
 
 #ifndef LFS_READONLY
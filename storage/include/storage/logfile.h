@@ -0,0 +1,67 @@
+/*============================================================================
+ * logfile.h
+ *
+ * Bounded, append-only logs. A log is a directory of numbered segment 
+ * files. Records are gathered in RAM and written a flash page at a time;
+ * when a segment is full a new one is started and, if there are then too
+ * many, the oldest is deleted. So the log never grows beyond its limit,
+ * and appending never rewrites data that is already in flash.
+ *
+ * Copyright (c)2021 Kevin Boone.
+ * =========================================================================*/
+
+#pragma once
+
+#include <klib/defs.h>
+#include <config.h>
+#include <storage/storage.h>
+
+// Size of the RAM buffer that records are gathered in. This matches
+//   the filesystem's program size, so the buffer is written out as
+//   whole flash pages.
+#define LOGFILE_PAGE_SIZE 256
+
+typedef struct _LogFile
+  {
+  char path[MAX_PATH + 1];
+  BOOL open;
+  FileDescriptor file;          // The newest segment
+  uint32_t segment_size;        // Largest size of one segment
+  uint32_t first_seq;           // Number of the oldest segment
+  uint32_t last_seq;            // Number of the newest segment
+  uint32_t written;             // Bytes in the newest segment's file
+  uint32_t buffered;            // Bytes in buff, not yet written
+  uint8_t buff[LOGFILE_PAGE_SIZE];
+  } LogFile;
+
+/** Reads the records of a log, oldest first. */
+typedef struct _LogReader
+  {
+  char path[MAX_PATH + 1];
+  uint32_t seq;                 // Segment being read 
+  uint32_t last_seq;
+  StorageReader r;
+  } LogReader;
+
+BEGIN_DECLS
+
+/** Open a log, creating its directory if necessary. The log will hold
+    at most about max_bytes of records. If the log already exists, new
+    records are added after the existing ones. */
+extern ErrCode logfile_open (LogFile *log, const char *path, 
+                 uint32_t max_bytes);
+/** Add one record. A newline is added after it. */
+extern ErrCode logfile_write (LogFile *log, const char *rec, uint32_t len);
+/** Write any buffered records, and commit them to the filesystem. */
+extern ErrCode logfile_flush (LogFile *log);
+/** Flush and close the log. It is safe to call this more than once. */
+extern ErrCode logfile_close (LogFile *log);
+
+extern ErrCode logfile_reader_open (LogReader *lr, const char *path);
+/** Read a record, in the same way as storage_reader_readline. Returns 
+    zero when there are no more records. */
+extern uint32_t logfile_reader_readline (LogReader *lr, char *buf, 
+                 uint32_t max, BOOL *eol);
+extern void logfile_reader_close (LogReader *lr);
+
+END_DECLS
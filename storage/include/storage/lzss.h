@@ -0,0 +1,69 @@
+/*============================================================================
+ * lzss.h
+ *
+ * A small streaming LZSS codec, used to store files compressed. The 
+ * decoder needs only a window of LZSS_WINDOW bytes, and a little 
+ * read-ahead; it pulls the compressed data through a callback, so a 
+ * file can be decompressed as it is read, without holding all of it.
+ *
+ * The compressed data is a stream of bits, most significant first. A 
+ * 1 is followed by an 8-bit literal byte; a 0 by an LZSS_OFFSET_BITS 
+ * distance (minus one) back into the window, and an LZSS_LENGTH_BITS
+ * length (minus LZSS_MIN_MATCH) to copy from there. The stream doesn't
+ * record its own length; the caller must know the decompressed size.
+ *
+ * Copyright (c)2021 Kevin Boone.
+ * =========================================================================*/
+
+#pragma once
+
+#include <klib/defs.h>
+
+#define LZSS_OFFSET_BITS 10
+#define LZSS_LENGTH_BITS 4
+#define LZSS_WINDOW (1 << LZSS_OFFSET_BITS)
+#define LZSS_MIN_MATCH 3
+#define LZSS_MAX_MATCH (LZSS_MIN_MATCH + (1 << LZSS_LENGTH_BITS) - 1)
+
+// Size of the decoder's buffer of compressed data
+#define LZSS_INPUT_SIZE 128
+
+/** Read up to n bytes of data. Returns the number read, which is zero
+    at the end, or a negative ErrCode. */
+typedef int32_t (*LzssReadFn)(void *user_data, uint8_t *buff, uint32_t n);
+/** Write n bytes of data. Returns the number written, or a negative 
+    ErrCode. */
+typedef int32_t (*LzssWriteFn)(void *user_data, const uint8_t *buff, 
+             uint32_t n);
+
+typedef struct _LzssDecoder
+  {
+  LzssReadFn read;
+  void *user_data;
+  ErrCode err;
+  uint32_t bits;                // Bits not yet used, at the top
+  int nbits;
+  uint16_t wpos;                // Where the next output byte goes
+  uint16_t match_pos;           // Remainder of a partly-copied match
+  uint16_t match_len;
+  uint16_t in_pos, in_len;
+  uint8_t in[LZSS_INPUT_SIZE];
+  uint8_t window[LZSS_WINDOW];
+  } LzssDecoder;
+
+BEGIN_DECLS
+
+extern void lzss_decoder_init (LzssDecoder *d, LzssReadFn read, 
+                 void *user_data);
+/** Decompress up to n bytes into buff. Returns the number of bytes 
+    produced, which is less than n only at the end of the input, or on
+    error. On error, d->err is set. */
+extern uint32_t lzss_decode (LzssDecoder *d, uint8_t *buff, uint32_t n);
+
+/** Compress everything that read supplies, passing the result to 
+    write. The sizes, if not NULL, are set to the number of bytes read
+    and written. This allocates about 12kB while it runs. */
+extern ErrCode lzss_encode (LzssReadFn read, LzssWriteFn write, 
+                 void *user_data, uint32_t *in_size, uint32_t *out_size);
+
+END_DECLS
@@ -0,0 +1,49 @@
+/*============================================================================
+ * romfs.h
+ *
+ * A read-only filesystem image, built into the firmware from the files
+ * under romfs/ in the source tree. romfs.cmake packs them into a C
+ * source file, which holds the contents of each file as a constant
+ * array, and an index of every file and directory, sorted by path.
+ * So the image is stored in flash along with the code, and files are
+ * read from where they are, without being copied.
+ *
+ * Copyright (c)2021 Kevin Boone.
+ * =========================================================================*/
+
+#pragma once
+
+#include <klib/defs.h>
+
+typedef struct _RomfsEntry
+  {
+  const char *path;             // From the root of the image, e.g. "/bin/x"
+  uint32_t parent;              // Index of the directory holding it
+  BOOL dir;
+  const uint8_t *data;          // NULL for a directory
+  uint32_t size;
+  } RomfsEntry;
+
+// Generated by romfs.cmake. The first entry is the root directory.
+extern const RomfsEntry romfs_entries[];
+extern const uint32_t romfs_count;
+// Total size of the files
+extern const uint32_t romfs_size;
+
+BEGIN_DECLS
+
+/** Find a file or directory. The path is taken from the root of the
+    image, and needn't be in canonical form. Returns NULL if there is
+    no such entry. */
+extern const RomfsEntry *romfs_find (const char *path);
+
+/** Get the next entry in a directory, starting from *pos, which should
+    be zero for the first call. Returns NULL after the last. */
+extern const RomfsEntry *romfs_read_dir (const RomfsEntry *dir,
+                 uint32_t *pos);
+
+/** The last part of an entry's path */
+extern const char *romfs_name (const RomfsEntry *e);
+
+END_DECLS
+
@@ -6,6 +6,7 @@
 
 #pragma once
 
+#include <stdio.h>
 #include <klib/defs.h>
 #include <klib/list.h>
 #include <config.h>
@@ -14,6 +15,10 @@
 
 typedef ErrCode (*StorageEnumBytesFn)(uint8_t byte, void *user_data);
 
+/** Called by storage_copy_tree before each file or directory is copied. */
+typedef void (*StorageCopyFn)(const char *from, const char *to, 
+               void *user_data);
+
 typedef enum _FileType
   {
   STORAGE_TYPE_REG = 0,
@@ -32,6 +37,30 @@ typedef struct _FileDescriptor
   void *descriptor;
   } FileDescriptor;
 
+/** An open directory, for reading one entry at a time. */
+typedef struct _DirDescriptor
+  {
+  void *descriptor;
+  } DirDescriptor;
+
+/** A directory entry as stored by storage_list_dir_ex. The name is
+    allocated to fit, so a long listing doesn't cost a full FileInfo
+    per entry. */
+typedef struct _StorageDirEntry
+  {
+  FileType type;
+  uint32_t size;
+  char name[];
+  } StorageDirEntry;
+
+/** Counts of the maintenance done by storage_idle(). */
+typedef struct _StorageIdleStats
+  {
+  uint32_t runs;                // Filesystems tidied
+  uint32_t erases;              // Blocks erased to compact metadata
+  uint64_t busy_us;             // Time spent
+  } StorageIdleStats;
+
 typedef enum _StorageOpenFlags
   {
   STORAGE_O_RDONLY = 1,         // Open a file as read only
@@ -43,10 +72,39 @@ typedef enum _StorageOpenFlags
   STORAGE_O_APPEND = 0x0800     // Move to end of file on every write
   } StorageOpenFlags;
 
+typedef enum _StorageSeekWhence
+  {
+  STORAGE_SEEK_SET = 0,         // Seek relative to the start of the file
+  STORAGE_SEEK_CUR = 1,         // Seek relative to the current position
+  STORAGE_SEEK_END = 2          // Seek relative to the end of the file
+  } StorageSeekWhence;
+
+/** A StorageReader reads a file sequentially through a read-ahead 
+    buffer, so that reading a character at a time does not cost a 
+    filesystem call per character. Bytes pos..len-1 of data have been
+    read from the file, but not yet by the caller. data is buff, unless
+    the file could be mapped by storage_map, in which case it is the
+    whole file, and no file is open. */
+typedef struct _StorageReader
+  {
+  FileDescriptor file;
+  BOOL open;
+  ErrCode err;                  // First read error, or zero
+  uint32_t pos;
+  uint32_t len;
+  const uint8_t *data;
+  uint8_t buff[STORAGE_READER_BUFFER_SIZE];
+  } StorageReader;
+
 BEGIN_DECLS
 
 extern void    storage_init (void);
 extern void    storage_cleanup (void);
+/** Unmount the flash filesystem and mount it again, as a restart 
+    would. If checkpoint is FALSE, the state that makes the next mount
+    fast is not saved, as if the power had failed. /tmp is unaffected.
+    Fails if any file or directory on flash is open. */
+extern ErrCode storage_remount (BOOL checkpoint);
 
 extern ErrCode storage_file_open (const char *filename, StorageOpenFlags flags,
                  FileDescriptor *file);
@@ -57,12 +115,67 @@ extern int storage_file_getc (FileDescriptor *file);
 extern int32_t storage_file_write (FileDescriptor *file, const void *buf,
                  uint32_t len);
 extern int32_t storage_file_tell (FileDescriptor *file);
+/** Returns the new position, or a negative LFS error code. */
+extern int32_t storage_file_seek (FileDescriptor *file, int32_t offset,
+                 StorageSeekWhence whence);
 extern int32_t storage_file_size (FileDescriptor *file);
+/** Commit any data cached by the filesystem for this file. */
+extern ErrCode storage_file_sync (FileDescriptor *file);
 extern BOOL storage_file_eof (FileDescriptor *file);
 
+/** Open a file for reading through a StorageReader. The reader is
+    usually on the stack, or inside a Lua userdata; it holds no other
+    allocated memory than the open file. */
+extern ErrCode storage_reader_open (StorageReader *r, const char *path);
+/** Close the reader's file. It is safe to call this on a reader that 
+    has already been closed, or failed to open. */
+extern ErrCode storage_reader_close (StorageReader *r);
+/** Refill an empty read-ahead buffer. Returns the number of bytes now
+    buffered, which is zero at the end of the file or on error. Most 
+    callers won't need this, as the other functions call it. */
+extern uint32_t storage_reader_fill (StorageReader *r);
+/** Return all the buffered bytes, refilling first if necessary, and 
+    mark them as read. Returns NULL at the end of the file. This is
+    the fastest way to read a whole file, as nothing is copied. */
+extern const char *storage_reader_chunk (StorageReader *r, uint32_t *n);
+/** Read up to n bytes; returns the number read, which is only short
+    at the end of the file or on error. */
+extern uint32_t storage_reader_read (StorageReader *r, void *buf, 
+                  uint32_t n);
+/** Read characters up to and including a newline into buf, which has
+    room for max bytes. The newline is consumed but not stored, and 
+    buf is not terminated. *eol is set TRUE if a newline was found; if 
+    not, and the return value is non-zero, the line continues in the
+    next call. Returns zero at the end of the file. */
+extern uint32_t storage_reader_readline (StorageReader *r, char *buf, 
+                  uint32_t max, BOOL *eol);
+
+/** Get the next byte, or EOF. */
+static inline int storage_reader_getc (StorageReader *r)
+  {
+  if (r->pos < r->len || storage_reader_fill (r) > 0)
+    return r->data[r->pos++];
+  return EOF;
+  }
+
+/** Get the next byte, or EOF, without consuming it. */
+static inline int storage_reader_peek (StorageReader *r)
+  {
+  if (r->pos < r->len || storage_reader_fill (r) > 0)
+    return r->data[r->pos];
+  return EOF;
+  }
+
 extern ErrCode storage_read_file (const char *filename, uint8_t **buff,
                   int *n);
 
+/** Get a pointer to the whole of a file, where it is stored, without 
+    reading it. Only files in the read-only image can be mapped; for 
+    anything else, ERR_NOTIMPLEMENTED is returned, and the file must 
+    be read. The data can't change, and remains valid for ever. */
+extern ErrCode storage_map (const char *path, const void **data, 
+                  uint32_t *size);
+
 extern ErrCode storage_read_partial (const char *filename, int offset, 
                   int count, uint8_t *buff, int *n);
 
@@ -100,9 +213,30 @@ extern ErrCode storage_rm (const char *path);
     been initialized. */
 extern ErrCode storage_list_dir (const char *path, List *list);
 
-/** Copy a file. Both arguments must be filenames, not directories. */
+/** Like storage_list_dir, but the List holds StorageDirEntry*, with the
+    type and size of each entry, which is read along with the name. 
+    The List should be created with free as its free function. */
+extern ErrCode storage_list_dir_ex (const char *path, List *list);
+
+/** Open a directory, to read its entries one at a time with 
+    storage_dir_read. */
+extern ErrCode storage_dir_open (const char *path, DirDescriptor *dir);
+/** Read the next entry. Returns 1 if an entry was read into info, 0 at
+    the end of the directory, or a negative ErrCode. */
+extern int storage_dir_read (DirDescriptor *dir, FileInfo *info);
+extern ErrCode storage_dir_close (DirDescriptor *dir);
+
+/** Copy a file. Both arguments must be filenames, not directories. Both
+    files are held open, and the data is moved in large chunks. If the
+    copy fails or is interrupted, the partial target is removed. */
 extern ErrCode storage_copy_file (const char *from, const char *to);
 
+/** Copy a file, or a directory and everything in it. Directories are 
+    created in the target as necessary. fn, if not NULL, is called 
+    for each item copied. */
+extern ErrCode storage_copy_tree (const char *from, const char *to,
+                 StorageCopyFn fn, void *user_data);
+
 extern ErrCode storage_info (const char *path, FileInfo *info);
 
 extern ErrCode storage_mkdir (const char *path);
@@ -128,5 +262,47 @@ extern void storage_get_dir (const char *path,
 
 extern ErrCode storage_rename (const char *source, const char *target);
 
+/** Store a file compressed, if that makes it smaller. It is then 
+    decompressed as it is read, by storage_file_read and everything built
+    on it; if it is opened for writing, it is first expanded again, unless
+    it is being truncated. size and stored are set to the file's real 
+    size, and the space it now takes. */
+extern ErrCode storage_compress_file (const char *path, uint32_t *size,
+                 uint32_t *stored);
+
+/** Store a compressed file uncompressed. Does nothing if it isn't 
+    compressed. */
+extern ErrCode storage_uncompress_file (const char *path);
+
+/** Commit any data written by storage_write_file or storage_append_file
+    that is still held in an open file. Until this is called, or the file
+    is used in some other way, the data may be lost if the power fails.
+    The shell calls this before each prompt. */
+extern ErrCode storage_sync (void);
+
+/** Commit the data held in open files that has waited for
+    STORAGE_SYNC_MS. The shell calls this while it, or a program, is 
+    idle; data that has waited that long is also committed by the next
+    write to the same file. */
+extern void storage_sync_old (void);
+
+/** A number that changes whenever any file might have been created,
+    changed, or removed, so that anything worked out from the contents
+    of a file is still valid while it stays the same. This is no help 
+    after a restart. */
+extern uint32_t storage_generation (void);
+
+/** Do some of the filesystem maintenance that would otherwise be done
+    in the middle of a write: compacting metadata that is nearly full,
+    and finding free blocks. Work is only started if it last took no 
+    longer than budget_us, not counting the time spent erasing blocks,
+    which the next time needn't do again. Returns TRUE if anything was 
+    done, in which case there may be more to do. */
+extern BOOL storage_idle (uint32_t budget_us);
+
+/** Get the counts of work done by storage_idle, and optionally set 
+    them to zero. */
+extern void storage_idle_stats (StorageIdleStats *stats, BOOL reset);
+
 END_DECLS
 
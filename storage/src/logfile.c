@@ -0,0 +1,298 @@
+/*=========================================================================
+
+  picolua
+
+  storage/logfile.c
+
+  Bounded, append-only logs. See logfile.h.
+
+  Overwriting the middle of a LittleFS file copies everything after the
+  change, so a log that wrapped around inside a single file would be 
+  slow, and wear the flash. Instead, the log is a directory of segment
+  files, named by an increasing hexadecimal number, and each is only
+  ever appended to. Wrapping around is done by deleting the oldest.
+
+  (c)2021 Kevin Boone, GPLv3.0
+
+=========================================================================*/
+#include <stdio.h> 
+#include <string.h> 
+#include <stdlib.h> 
+#include <config.h>
+#include <shell/errcodes.h>
+#include "storage/storage.h"
+#include "storage/logfile.h"
+
+/*=========================================================================
+
+  logfile_segment_path
+
+=========================================================================*/
+static void logfile_segment_path (const char *path, uint32_t seq, 
+     char result[MAX_PATH + 1])
+  {
+  char name[12];
+  sprintf (name, "%08lX", (unsigned long)seq);
+  storage_join_path (path, name, result);
+  }
+
+/*=========================================================================
+
+  logfile_scan
+
+  Find the oldest and newest segments in the log directory. Returns 
+  FALSE if there are none. Files that aren't segments are ignored.
+
+=========================================================================*/
+static BOOL logfile_scan (const char *path, uint32_t *first, 
+     uint32_t *last, ErrCode *err)
+  {
+  BOOL found = FALSE;
+  DirDescriptor dir;
+  *err = storage_dir_open (path, &dir);
+  if (*err)
+    return FALSE;
+
+  FileInfo info;
+  while (storage_dir_read (&dir, &info) > 0)
+    {
+    char *end;
+    if (info.type != STORAGE_TYPE_REG || strlen (info.name) != 8)
+      continue;
+    uint32_t seq = (uint32_t)strtoul (info.name, &end, 16);
+    if (*end != 0)
+      continue;
+    if (!found || seq < *first) *first = seq;
+    if (!found || seq > *last) *last = seq;
+    found = TRUE;
+    }
+  storage_dir_close (&dir);
+  return found;
+  }
+
+/*=========================================================================
+
+  logfile_open_segment
+
+  Open (or create) the newest segment for appending. 
+
+=========================================================================*/
+static ErrCode logfile_open_segment (LogFile *log)
+  {
+  char seg[MAX_PATH + 1];
+  logfile_segment_path (log->path, log->last_seq, seg);
+  ErrCode err = storage_file_open (seg, 
+    STORAGE_O_WRONLY | STORAGE_O_CREAT | STORAGE_O_APPEND, &log->file);
+  if (err)
+    return err;
+  int32_t size = storage_file_size (&log->file);
+  log->written = size > 0 ? (uint32_t)size : 0;
+  log->buffered = 0;
+  log->open = TRUE;
+  return 0;
+  }
+
+/*=========================================================================
+
+  logfile_open
+
+=========================================================================*/
+ErrCode logfile_open (LogFile *log, const char *path, uint32_t max_bytes)
+  {
+  log->open = FALSE;
+  if (strlen (path) > MAX_PATH - 10)
+    return ERR_NAMETOOLONG;
+  strcpy (log->path, path);
+
+  uint32_t size = max_bytes / LOGFILE_SEGMENTS;
+  size -= size % LOGFILE_PAGE_SIZE;
+  if (size < LOGFILE_PAGE_SIZE) 
+    size = LOGFILE_PAGE_SIZE;
+  log->segment_size = size;
+
+  ErrCode err = storage_mkdir (path);
+  if (err && err != ERR_EXIST)
+    return err;
+
+  if (!logfile_scan (path, &log->first_seq, &log->last_seq, &err))
+    {
+    if (err)
+      return err;
+    log->first_seq = log->last_seq = 1;
+    }
+
+  return logfile_open_segment (log);
+  }
+
+/*=========================================================================
+
+  logfile_write_buffer
+
+=========================================================================*/
+static ErrCode logfile_write_buffer (LogFile *log)
+  {
+  if (log->buffered == 0)
+    return 0;
+  int32_t n = storage_file_write (&log->file, log->buff, log->buffered);
+  if (n != (int32_t)log->buffered)
+    return n < 0 ? (ErrCode) -n : ERR_NOSPC;
+  log->written += log->buffered;
+  log->buffered = 0;
+  return 0;
+  }
+
+/*=========================================================================
+
+  logfile_next_segment
+
+  Close the full segment, start a new one, and delete the oldest if
+  there are now too many.
+
+=========================================================================*/
+static ErrCode logfile_next_segment (LogFile *log)
+  {
+  ErrCode err = logfile_write_buffer (log);
+  ErrCode err2 = storage_file_close (&log->file);
+  log->open = FALSE;
+  if (err) return err;
+  if (err2) return err2;
+
+  log->last_seq++;
+  while (log->last_seq - log->first_seq + 1 > LOGFILE_SEGMENTS)
+    {
+    char seg[MAX_PATH + 1];
+    logfile_segment_path (log->path, log->first_seq, seg);
+    storage_rm (seg); // It may already be gone; that's fine
+    log->first_seq++;
+    }
+
+  return logfile_open_segment (log);
+  }
+
+/*=========================================================================
+
+  logfile_write
+
+=========================================================================*/
+ErrCode logfile_write (LogFile *log, const char *rec, uint32_t len)
+  {
+  if (!log->open)
+    return ERR_BADF;
+  if (len + 1 > log->segment_size)
+    return ERR_FBIG;
+
+  // Records don't straddle segments, so deleting a segment never 
+  //   leaves part of a record behind
+  if (log->written + log->buffered + len + 1 > log->segment_size)
+    {
+    ErrCode err = logfile_next_segment (log);
+    if (err) return err;
+    }
+
+  for (uint32_t i = 0; i <= len; i++)
+    {
+    log->buff[log->buffered++] = i < len ? (uint8_t)rec[i] : '\n';
+    // Write whenever the file reaches a page boundary; if an existing 
+    //   segment was reopened part-way through a page, the first write 
+    //   is short, and later ones are aligned 
+    if ((log->written + log->buffered) % LOGFILE_PAGE_SIZE == 0)
+      {
+      ErrCode err = logfile_write_buffer (log);
+      if (err) return err;
+      }
+    }
+  return 0;
+  }
+
+/*=========================================================================
+
+  logfile_flush
+
+=========================================================================*/
+ErrCode logfile_flush (LogFile *log)
+  {
+  if (!log->open)
+    return ERR_BADF;
+  ErrCode err = logfile_write_buffer (log);
+  if (err) return err;
+  return storage_file_sync (&log->file);
+  }
+
+/*=========================================================================
+
+  logfile_close
+
+=========================================================================*/
+ErrCode logfile_close (LogFile *log)
+  {
+  if (!log->open)
+    return 0;
+  ErrCode err = logfile_write_buffer (log);
+  ErrCode err2 = storage_file_close (&log->file);
+  log->open = FALSE;
+  return err ? err : err2;
+  }
+
+/*=========================================================================
+
+  logfile_reader_open
+
+=========================================================================*/
+ErrCode logfile_reader_open (LogReader *lr, const char *path)
+  {
+  ErrCode err;
+  lr->r.open = FALSE;
+  if (strlen (path) > MAX_PATH - 10)
+    return ERR_NAMETOOLONG;
+  strcpy (lr->path, path);
+  if (!logfile_scan (path, &lr->seq, &lr->last_seq, &err))
+    {
+    if (err)
+      return err;
+    lr->seq = 1;
+    lr->last_seq = 0; // Nothing to read
+    }
+  return 0;
+  }
+
+/*=========================================================================
+
+  logfile_reader_readline
+
+=========================================================================*/
+uint32_t logfile_reader_readline (LogReader *lr, char *buf, uint32_t max,
+     BOOL *eol)
+  {
+  *eol = FALSE;
+  while (lr->seq <= lr->last_seq)
+    {
+    if (!lr->r.open)
+      {
+      char seg[MAX_PATH + 1];
+      logfile_segment_path (lr->path, lr->seq, seg);
+      if (storage_reader_open (&lr->r, seg) != 0)
+        {
+        lr->seq++; // Deleted since the scan; skip it
+        continue;
+        }
+      }
+    uint32_t n = storage_reader_readline (&lr->r, buf, max, eol);
+    if (n > 0 || *eol)
+      return n;
+    storage_reader_close (&lr->r);
+    lr->seq++;
+    }
+  return 0;
+  }
+
+/*=========================================================================
+
+  logfile_reader_close
+
+=========================================================================*/
+void logfile_reader_close (LogReader *lr)
+  {
+  storage_reader_close (&lr->r);
+  lr->seq = 1;
+  lr->last_seq = 0;
+  }
@@ -0,0 +1,294 @@
+/*=========================================================================
+
+  picolua
+
+  storage/lzss.c
+
+  A small streaming LZSS codec. See lzss.h for the format.
+
+  The encoder keeps the last LZSS_WINDOW bytes of input, and a block of
+  new input, in one buffer. Matches are found through hash chains on 
+  the next three bytes; the chains hold absolute positions in the input,
+  so they don't need adjusting when the buffer is shifted.
+
+  (c)2021 Kevin Boone, GPLv3.0
+
+=========================================================================*/
+#include <stdio.h> 
+#include <string.h> 
+#include <stdlib.h> 
+#include <shell/errcodes.h>
+#include "storage/lzss.h"
+
+#define LZSS_BLOCK 1024
+#define LZSS_HASH_BITS 10
+#define LZSS_HASH_SIZE (1 << LZSS_HASH_BITS)
+// Longest hash chain to search. Longer finds slightly better matches, 
+//   but slowly
+#define LZSS_MAX_CHAIN 32
+#define LZSS_NONE 0xFFFFFFFFu
+
+typedef struct _LzssEncoder
+  {
+  LzssWriteFn write;
+  void *user_data;
+  ErrCode err;
+  uint32_t out_size;
+  uint32_t bits;
+  int nbits;
+  uint32_t out_len;
+  uint8_t out[LZSS_BLOCK];
+  uint32_t head[LZSS_HASH_SIZE];
+  uint32_t prev[LZSS_WINDOW];
+  uint8_t buff[LZSS_WINDOW + LZSS_BLOCK];
+  } LzssEncoder;
+
+/*=========================================================================
+
+  lzss_decoder_init
+
+=========================================================================*/
+void lzss_decoder_init (LzssDecoder *d, LzssReadFn read, void *user_data)
+  {
+  d->read = read;
+  d->user_data = user_data;
+  d->err = 0;
+  d->bits = 0;
+  d->nbits = 0;
+  d->wpos = 0;
+  d->match_len = 0;
+  d->in_pos = d->in_len = 0;
+  memset (d->window, 0, sizeof (d->window));
+  }
+
+/*=========================================================================
+
+  lzss_get_bits
+
+  Returns the next n bits (n <= 16), or -1 at the end of the input.
+
+=========================================================================*/
+static int lzss_get_bits (LzssDecoder *d, int n)
+  {
+  while (d->nbits < n)
+    {
+    if (d->in_pos == d->in_len)
+      {
+      int32_t r = d->read (d->user_data, d->in, LZSS_INPUT_SIZE);
+      if (r <= 0)
+        {
+        if (r < 0) d->err = (ErrCode) -r;
+        return -1;
+        }
+      d->in_pos = 0;
+      d->in_len = (uint16_t)r;
+      }
+    d->bits |= (uint32_t)d->in[d->in_pos++] << (24 - d->nbits);
+    d->nbits += 8;
+    }
+  int v = (int)(d->bits >> (32 - n));
+  d->bits <<= n;
+  d->nbits -= n;
+  return v;
+  }
+
+/*=========================================================================
+
+  lzss_decode
+
+=========================================================================*/
+uint32_t lzss_decode (LzssDecoder *d, uint8_t *buff, uint32_t n)
+  {
+  uint32_t done = 0;
+  while (done < n)
+    {
+    if (d->match_len > 0)
+      {
+      uint8_t c = d->window[d->match_pos];
+      d->match_pos = (d->match_pos + 1) & (LZSS_WINDOW - 1);
+      d->match_len--;
+      d->window[d->wpos] = c;
+      d->wpos = (d->wpos + 1) & (LZSS_WINDOW - 1);
+      buff[done++] = c;
+      continue;
+      }
+
+    int flag = lzss_get_bits (d, 1);
+    if (flag < 0) break;
+    if (flag)
+      {
+      int c = lzss_get_bits (d, 8);
+      if (c < 0) break;
+      d->window[d->wpos] = (uint8_t)c;
+      d->wpos = (d->wpos + 1) & (LZSS_WINDOW - 1);
+      buff[done++] = (uint8_t)c;
+      }
+    else
+      {
+      int off = lzss_get_bits (d, LZSS_OFFSET_BITS);
+      int len = lzss_get_bits (d, LZSS_LENGTH_BITS);
+      if (off < 0 || len < 0) break;
+      d->match_pos = (d->wpos - off - 1) & (LZSS_WINDOW - 1);
+      d->match_len = (uint16_t)(len + LZSS_MIN_MATCH);
+      }
+    }
+  return done;
+  }
+
+/*=========================================================================
+
+  lzss_put_bits
+
+=========================================================================*/
+static void lzss_put_bits (LzssEncoder *e, uint32_t v, int n)
+  {
+  e->bits |= v << (32 - n - e->nbits);
+  e->nbits += n;
+  while (e->nbits >= 8)
+    {
+    e->out[e->out_len++] = (uint8_t)(e->bits >> 24);
+    e->bits <<= 8;
+    e->nbits -= 8;
+    if (e->out_len == LZSS_BLOCK)
+      {
+      if (e->err == 0)
+        {
+        int32_t w = e->write (e->user_data, e->out, e->out_len);
+        if (w != (int32_t)e->out_len) 
+          e->err = w < 0 ? (ErrCode) -w : ERR_NOSPC;
+        }
+      e->out_size += e->out_len;
+      e->out_len = 0;
+      }
+    }
+  }
+
+/*=========================================================================
+
+  lzss_hash
+
+=========================================================================*/
+static inline uint32_t lzss_hash (const uint8_t *p)
+  {
+  return ((p[0] << 6) ^ (p[1] << 3) ^ p[2]) & (LZSS_HASH_SIZE - 1);
+  }
+
+/*=========================================================================
+
+  lzss_encode
+
+=========================================================================*/
+ErrCode lzss_encode (LzssReadFn read, LzssWriteFn write, 
+     void *user_data, uint32_t *in_size, uint32_t *out_size)
+  {
+  LzssEncoder *e = malloc (sizeof (LzssEncoder));
+  if (!e)
+    return ERR_NOMEM;
+  e->write = write;
+  e->user_data = user_data;
+  e->err = 0;
+  e->out_size = 0;
+  e->bits = 0;
+  e->nbits = 0;
+  e->out_len = 0;
+  for (int i = 0; i < LZSS_HASH_SIZE; i++) 
+    e->head[i] = LZSS_NONE;
+
+  uint32_t base = 0;            // Input position of buff[0]
+  uint32_t len = 0;             // Bytes in buff
+  uint32_t pos = 0;             // Input position being encoded 
+  BOOL eof = FALSE;
+
+  while (e->err == 0)
+    {
+    // Keep enough input buffered to find the longest match
+    if (!eof && pos + LZSS_MAX_MATCH > base + len)
+      {
+      if (len == sizeof (e->buff))
+        {
+        uint32_t keep = base + len - pos + LZSS_WINDOW;
+        if (keep > len) keep = len;
+        memmove (e->buff, e->buff + len - keep, keep);
+        base += len - keep;
+        len = keep;
+        }
+      int32_t r = read (user_data, e->buff + len, sizeof (e->buff) - len);
+      if (r < 0) 
+        e->err = (ErrCode) -r;
+      else if (r == 0) 
+        eof = TRUE;
+      else
+        len += (uint32_t)r;
+      continue;
+      }
+    if (pos == base + len)
+      break;
+
+    const uint8_t *p = e->buff + (pos - base);
+    uint32_t avail = base + len - pos;
+    uint32_t max = avail < LZSS_MAX_MATCH ? avail : LZSS_MAX_MATCH;
+    uint32_t best_len = 0, best_pos = 0;
+    if (max >= LZSS_MIN_MATCH)
+      {
+      uint32_t cand = e->head[lzss_hash (p)];
+      for (int chain = 0; chain < LZSS_MAX_CHAIN && cand != LZSS_NONE
+             && cand < pos && pos - cand <= LZSS_WINDOW && cand >= base; 
+             chain++)
+        {
+        const uint8_t *q = e->buff + (cand - base);
+        uint32_t l = 0;
+        while (l < max && q[l] == p[l]) l++;
+        if (l > best_len)
+          {
+          best_len = l;
+          best_pos = cand;
+          if (l == max) break;
+          }
+        uint32_t next = e->prev[cand & (LZSS_WINDOW - 1)];
+        if (next == LZSS_NONE || next >= cand) break;
+        cand = next;
+        }
+      }
+
+    uint32_t step;
+    if (best_len >= LZSS_MIN_MATCH)
+      {
+      lzss_put_bits (e, 0, 1);
+      lzss_put_bits (e, pos - best_pos - 1, LZSS_OFFSET_BITS);
+      lzss_put_bits (e, best_len - LZSS_MIN_MATCH, LZSS_LENGTH_BITS);
+      step = best_len;
+      }
+    else
+      {
+      lzss_put_bits (e, 0x100 | *p, 9);
+      step = 1;
+      }
+
+    // Add every position passed over to the hash chains
+    for (uint32_t i = 0; i < step; i++, pos++)
+      {
+      if (base + len - pos >= LZSS_MIN_MATCH)
+        {
+        uint32_t h = lzss_hash (e->buff + (pos - base));
+        e->prev[pos & (LZSS_WINDOW - 1)] = e->head[h];
+        e->head[h] = pos;
+        }
+      }
+    }
+
+  if (e->nbits > 0)
+    lzss_put_bits (e, 0, 8 - e->nbits);
+  if (e->out_len > 0 && e->err == 0)
+    {
+    int32_t w = e->write (user_data, e->out, e->out_len);
+    if (w != (int32_t)e->out_len) 
+      e->err = w < 0 ? (ErrCode) -w : ERR_NOSPC;
+    }
+  e->out_size += e->out_len;
+
+  if (in_size) *in_size = pos;
+  if (out_size) *out_size = e->out_size;
+  ErrCode ret = e->err;
+  free (e);
+  return ret;
+  }
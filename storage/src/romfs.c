@@ -0,0 +1,116 @@
+/*=========================================================================
+
+  picolua
+
+  storage/romfs.c
+
+  Look-ups in the read-only filesystem image. See romfs.h for how the
+  image is made.
+
+  (c)2021 Kevin Boone, GPLv3.0
+
+=========================================================================*/
+#include <stdio.h>
+#include <string.h>
+#include <config.h>
+#include "storage/romfs.h"
+
+/*=========================================================================
+
+  romfs_canonical
+
+  Put a path into the form that the index uses: a single "/" before
+  each part, and nothing at the end. "." parts are dropped, and ".."
+  removes the part before it. Returns FALSE if the path is too long.
+
+=========================================================================*/
+static BOOL romfs_canonical (const char *path, char key[MAX_PATH + 1])
+  {
+  int n = 0;
+  while (*path)
+    {
+    while (*path == '/') path++;
+    const char *end = path;
+    while (*end && *end != '/') end++;
+    int l = (int)(end - path);
+    if (l == 2 && path[0] == '.' && path[1] == '.')
+      {
+      while (n > 0 && key[n - 1] != '/') n--;
+      if (n > 0) n--;
+      }
+    else if (l > 0 && !(l == 1 && path[0] == '.'))
+      {
+      if (n + l + 1 > MAX_PATH)
+        return FALSE;
+      key[n++] = '/';
+      memcpy (key + n, path, (size_t)l);
+      n += l;
+      }
+    path = end;
+    }
+  if (n == 0)
+    key[n++] = '/';
+  key[n] = 0;
+  return TRUE;
+  }
+
+/*=========================================================================
+
+  romfs_find
+
+  The index is sorted with strcmp(), so this is a binary search
+
+=========================================================================*/
+const RomfsEntry *romfs_find (const char *path)
+  {
+  char key[MAX_PATH + 1];
+  if (!romfs_canonical (path, key))
+    return NULL;
+  uint32_t lo = 0, hi = romfs_count;
+  while (lo < hi)
+    {
+    uint32_t mid = lo + (hi - lo) / 2;
+    int c = strcmp (romfs_entries[mid].path, key);
+    if (c == 0)
+      return &romfs_entries[mid];
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+    }
+  return NULL;
+  }
+
+/*=========================================================================
+
+  romfs_read_dir
+
+  Everything in a directory sorts after it, so the search starts there
+
+=========================================================================*/
+const RomfsEntry *romfs_read_dir (const RomfsEntry *dir, uint32_t *pos)
+  {
+  uint32_t index = (uint32_t)(dir - romfs_entries);
+  if (*pos <= index)
+    *pos = index + 1;
+  while (*pos < romfs_count)
+    {
+    const RomfsEntry *e = &romfs_entries[(*pos)++];
+    if (e->parent == index)
+      return e;
+    }
+  return NULL;
+  }
+
+/*=========================================================================
+
+  romfs_name
+
+=========================================================================*/
+const char *romfs_name (const RomfsEntry *e)
+  {
+  if (e == romfs_entries)
+    return "/";
+  return strrchr (e->path, '/') + 1;
+  }
+
@@ -17,18 +17,199 @@
 #include <shell/shell.h>
 #include "storage/storage.h"
 #include "storage/lfs.h"
+#include "storage/lzss.h"
+#include "storage/romfs.h"
 
 extern char *itoa (int n, char *buff, int base);
 
 lfs_t lfs;
-BOOL mounted = FALSE;
+static lfs_t tmp_lfs;
+static uint8_t *tmp_ram = NULL;
+
+// Programs of adjacent pages in the same block are gathered here, and 
+//   passed to the flash driver as one operation. 
+static struct 
+  {
+  BOOL dirty;
+  lfs_block_t block;
+  lfs_off_t off;
+  lfs_size_t len;
+  uint8_t buff[STORAGE_PROG_CACHE_SIZE];
+  } prog_cache;
+
+// Pages of flash, shared by everything that reads it: open files, 
+//   directories, and LittleFS's own metadata reads. These hold what is
+//   in the flash, so pending programs in prog_cache are not included.
+typedef struct _StoragePage
+  {
+  BOOL valid;
+  lfs_block_t block;
+  lfs_off_t off;                // Offset of the page in the block
+  uint32_t last_used;
+  uint8_t data[STORAGE_PAGE_SIZE];
+  } StoragePage;
+
+static StoragePage page_cache [STORAGE_PAGE_CACHE_PAGES];
+static uint32_t page_clock = 0;
+
+// Results of storage_file_exists, so that searching PATH for a command,
+//   or package.path for a module, doesn't look up the same names in the
+//   filesystem every time. Anything that might create a file bumps 
+//   create_generation, which invalidates the negative entries; anything
+//   that might remove one bumps remove_generation, which invalidates
+//   the positive ones.
+typedef struct _LookupEntry
+  {
+  char *path;
+  uint32_t hash;
+  BOOL exists;
+  uint32_t generation;
+  } LookupEntry;
+
+static LookupEntry lookup_cache [STORAGE_LOOKUP_CACHE_SIZE];
+static uint32_t create_generation = 0;
+static uint32_t remove_generation = 0;
+// Bumped by writes through a FileDescriptor, which change files without
+//   creating or removing any. See storage_generation().
+static uint32_t write_generation = 0;
+
+
+// Files kept open by storage_write_file, storage_append_file and 
+//   storage_read_partial, so that a loop that works on the same file 
+//   doesn't look up the path, and commit the metadata, every time. Data
+//   written through these handles is committed by storage_sync(), which
+//   the shell calls before its prompt, or, once it has waited for 
+//   STORAGE_SYNC_MS, by the next write to the file, or by 
+//   storage_sync_old(), which the shell calls while it, or a program, is
+//   idle. Any other operation on the same path closes the handle first, 
+//   so that LittleFS never has the file open twice with different ideas
+//   of what is in it.
+typedef struct _OpenHandle
+  {
+  char *path;                   // Canonical form, or NULL if free
+  lfs_file_t file;
+  lfs_t *fs;
+  BOOL dirty;
+  uint32_t dirty_ms;            // When the oldest data not committed
+                                //   was written
+  uint32_t last_used;
+  } OpenHandle;
+
+static OpenHandle handle_cache [STORAGE_HANDLE_CACHE_SIZE];
+static uint32_t handle_clock = 0;
+
+// A file stored compressed has this LittleFS user attribute. It holds
+//   the codec, its parameters, and the decompressed size. 
+#define STORAGE_ATTR_COMPRESSED 'z'
+#define STORAGE_ZATTR_SIZE 8
+#define STORAGE_CODEC_LZSS 1
+
+// When the flash filesystem is unmounted, the allocator's map of free
+//   blocks is saved in this attribute of the root directory. The next 
+//   mount takes it back and removes it, so that it is never used twice, 
+//   and the filesystem doesn't have to be scanned. The map is only 
+//   trusted if a fingerprint of the metadata, and of where each file's
+//   blocks start, is as it was when the map was saved.
+#define STORAGE_ATTR_CHECKPOINT 'a'
+#define STORAGE_CHECKPOINT_MAGIC 0x504B4341 // "ACKP"
+
+typedef struct _StorageCheckpoint
+  {
+  uint32_t magic;
+  uint32_t block_size;
+  uint32_t block_count;
+  uint32_t off;                 // The allocator's lookahead window
+  uint32_t size;
+  uint32_t i;
+  uint32_t fingerprint;         // See storage_fingerprint()
+  uint32_t map[(INTERFACE_STORAGE_BLOCK_COUNT + 31) / 32];
+  } StorageCheckpoint;
+
+// What a DirDescriptor points to. If the directory is in the read-only
+//   image, fs is NULL, and rom is used instead of dir.
+typedef struct _StorageDir
+  {
+  lfs_dir_t dir;
+  lfs_t *fs;
+  const RomfsEntry *rom;
+  uint32_t rom_pos;
+  char path[MAX_PATH + 1]; // To find the real size of compressed files
+  } StorageDir;
+
+// What a FileDescriptor points to. The lfs_file_t is first, so that the
+//   descriptor can still be used directly as an lfs_file_t. z is NULL 
+//   unless the file is compressed and open for reading. If the file is
+//   in the read-only image, fs is NULL, and only rom and rom_pos are 
+//   used.
+typedef struct _StorageFile
+  {
+  lfs_file_t file;
+  lfs_t *fs;
+  const RomfsEntry *rom;
+  uint32_t rom_pos;
+  struct lfs_file_config fcfg;
+  struct lfs_attr attr;
+  uint8_t zattr[STORAGE_ZATTR_SIZE];
+  uint32_t zsize;               // Decompressed size
+  uint32_t zpos;                // Position in the decompressed data
+  LzssDecoder *z;
+  } StorageFile;
+
+static int storage_block_read (const struct lfs_config *c, 
+     lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size);
+static int storage_block_prog (const struct lfs_config *c, 
+     lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size);
+static int storage_block_erase (const struct lfs_config *c, 
+     lfs_block_t block);
+static int storage_block_sync (const struct lfs_config *c);
+static int storage_ram_read (const struct lfs_config *c, 
+     lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size);
+static int storage_ram_prog (const struct lfs_config *c, 
+     lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size);
+static int storage_ram_erase (const struct lfs_config *c, 
+     lfs_block_t block);
+static int storage_ram_sync (const struct lfs_config *c);
+
+// The filesystems, and where they appear in the directory tree. A path
+//   belongs to the first mount whose prefix matches it, so the root 
+//   must come last. The flash has a directory where each other mount 
+//   is, so that it shows up in listings. The read-only image has no
+//   LittleFS instance, and fs is NULL.
+typedef struct _StorageMount
+  {
+  const char *prefix;           // No trailing "/"; empty for the root
+  lfs_t *fs;
+  const struct lfs_config *cfg;
+  BOOL mounted;
+  uint32_t erase_count;         // Blocks erased since startup
+  uint32_t sync_count;          // Commits since startup
+  // The state at the last scan for free blocks, so that df and 
+  //   storage_idle know whether another would find anything new
+  uint32_t usage_generation;
+  uint32_t usage_erase_count;
+  uint32_t usage_sync_count;
+  uint32_t scan_us;             // How long the last scan took, apart
+                                //   from erasing
+  uint64_t erase_us;            // Time spent erasing since startup
+  } StorageMount;
+
+#define STORAGE_MOUNT_TMP 0
+#define STORAGE_MOUNT_ROM 1
+#define STORAGE_MOUNT_ROOT 2
+static StorageMount mounts[];
+
+// Work done by storage_idle, and the mount it will look at next
+static StorageIdleStats idle_stats;
+static unsigned idle_next = 0;
+
+static ErrCode storage_allocator_scan (StorageMount *m);
 
 const struct lfs_config cfg = {
     // block device operations
-    .read  = interface_block_read,
-    .prog  = interface_block_prog,
-    .erase = interface_block_erase,
-    .sync  = interface_block_sync,
+    .read  = storage_block_read,
+    .prog  = storage_block_prog,
+    .erase = storage_block_erase,
+    .sync  = storage_block_sync,
 
     // block device configuration
     .read_size = 256,
@@ -38,222 +219,2112 @@ const struct lfs_config cfg = {
     .cache_size = 256,
     .lookahead_size = 256,
     .block_cycles = 500,
+    .context = &mounts[STORAGE_MOUNT_ROOT],
 };
 
+#define STORAGE_TMP_BLOCK_COUNT (STORAGE_TMP_SIZE / STORAGE_TMP_BLOCK_SIZE)
+
+// RAM is written a byte at a time, so small caches will do. There's no
+//   wear to level.
+static const struct lfs_config tmp_cfg = {
+    .read  = storage_ram_read,
+    .prog  = storage_ram_prog,
+    .erase = storage_ram_erase,
+    .sync  = storage_ram_sync,
+
+    .read_size = 16,
+    .prog_size = 16,
+    .block_size = STORAGE_TMP_BLOCK_SIZE,
+    .block_count = STORAGE_TMP_BLOCK_COUNT,
+    .cache_size = 64,
+    .lookahead_size = ((STORAGE_TMP_BLOCK_COUNT + 63) / 64) * 8,
+    .block_cycles = -1,
+    .context = &mounts[STORAGE_MOUNT_TMP],
+};
+
+static StorageMount mounts[] = 
+  {
+  { STORAGE_TMP_PATH, &tmp_lfs, &tmp_cfg, FALSE, 0, 0, 0, 0, 0, 0, 0 },
+  { STORAGE_ROM_PATH, NULL, NULL, FALSE, 0, 0, 0, 0, 0, 0, 0 },
+  { "", &lfs, &cfg, FALSE, 0, 0, 0, 0, 0, 0, 0 }
+  };
+#define STORAGE_MOUNTS (sizeof (mounts) / sizeof (mounts[0]))
+
+
+/*=========================================================================
+
+  storage_page_find
+
+  Returns the cached page that holds block:off, or NULL
+
+=========================================================================*/
+static StoragePage *storage_page_find (lfs_block_t block, lfs_off_t off)
+  {
+  lfs_off_t page_off = off - off % STORAGE_PAGE_SIZE;
+  for (int i = 0; i < STORAGE_PAGE_CACHE_PAGES; i++)
+    {
+    StoragePage *p = &page_cache[i];
+    if (p->valid && p->block == block && p->off == page_off)
+      return p;
+    }
+  return NULL;
+  }
+
+/*=========================================================================
+
+  storage_page_load
+
+  Read the page that holds block:off into the cache, replacing the one
+  used least recently
+
+=========================================================================*/
+static StoragePage *storage_page_load (const struct lfs_config *c, 
+     lfs_block_t block, lfs_off_t off)
+  {
+  StoragePage *victim = &page_cache[0];
+  for (int i = 1; i < STORAGE_PAGE_CACHE_PAGES && victim->valid; i++)
+    {
+    StoragePage *p = &page_cache[i];
+    if (!p->valid || p->last_used < victim->last_used)
+      victim = p;
+    }
+  victim->valid = FALSE;
+  lfs_off_t page_off = off - off % STORAGE_PAGE_SIZE;
+  if (interface_block_read (c, block, page_off, victim->data, 
+       STORAGE_PAGE_SIZE))
+    return NULL;
+  victim->valid = TRUE;
+  victim->block = block;
+  victim->off = page_off;
+  return victim;
+  }
+
+/*=========================================================================
+
+  storage_flash_prog
+
+  Program the flash, and any cached page of it
+
+=========================================================================*/
+static int storage_flash_prog (const struct lfs_config *c, 
+     lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+  {
+  int err = interface_block_prog (c, block, off, buffer, size);
+  for (int i = 0; i < STORAGE_PAGE_CACHE_PAGES; i++)
+    {
+    StoragePage *p = &page_cache[i];
+    if (!p->valid || p->block != block) 
+      continue;
+    if (err)
+      {
+      p->valid = FALSE; // Who knows what the flash holds now
+      continue;
+      }
+    lfs_off_t start = off > p->off ? off : p->off;
+    lfs_off_t end = off + size < p->off + STORAGE_PAGE_SIZE ? 
+      off + size : p->off + STORAGE_PAGE_SIZE;
+    if (start < end)
+      memcpy (p->data + (start - p->off), 
+        (const uint8_t *)buffer + (start - off), end - start);
+    }
+  return err;
+  }
+
+/*=========================================================================
+
+  storage_prog_cache_flush
+
+  Program any pending pages into flash.
+
+=========================================================================*/
+static int storage_prog_cache_flush (const struct lfs_config *c)
+  {
+  if (!prog_cache.dirty)
+    return 0;
+  prog_cache.dirty = FALSE;
+  return storage_flash_prog (c, prog_cache.block, prog_cache.off, 
+    prog_cache.buff, prog_cache.len);
+  }
+
+/*=========================================================================
+
+  storage_block_prog
+
+  LittleFS programs a cache-sized piece at a time, and usually works 
+  through a block in order. Pieces that carry on from the pending ones
+  are added to the cache; anything else flushes it first. 
+
+=========================================================================*/
+static int storage_block_prog (const struct lfs_config *c, 
+     lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+  {
+  if (prog_cache.dirty && (block != prog_cache.block 
+       || off != prog_cache.off + prog_cache.len
+       || prog_cache.len + size > sizeof (prog_cache.buff)))
+    {
+    int err = storage_prog_cache_flush (c);
+    if (err) return err;
+    }
+
+  if (size > sizeof (prog_cache.buff))
+    return storage_flash_prog (c, block, off, buffer, size);
+
+  if (!prog_cache.dirty)
+    {
+    prog_cache.dirty = TRUE;
+    prog_cache.block = block;
+    prog_cache.off = off;
+    prog_cache.len = 0;
+    }
+  memcpy (prog_cache.buff + prog_cache.len, buffer, size);
+  prog_cache.len += size;
+
+  if (prog_cache.len == sizeof (prog_cache.buff))
+    return storage_prog_cache_flush (c);
+  return 0;
+  }
+
+/*=========================================================================
+
+  storage_block_read
+
+  Reads are served from the page cache. A read that covers a whole page
+  that isn't cached goes straight to the flash, so that reading a large
+  file doesn't push everything else out of the cache. Pending pages have
+  not reached the flash yet, so they are copied over whatever the flash
+  returns for them. 
+
+=========================================================================*/
+static int storage_block_read (const struct lfs_config *c, 
+     lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+  {
+  uint8_t *dest = buffer;
+  lfs_off_t pos = off;
+  while (pos < off + size)
+    {
+    lfs_size_t n = STORAGE_PAGE_SIZE - pos % STORAGE_PAGE_SIZE;
+    if (n > off + size - pos)
+      n = off + size - pos;
+    StoragePage *p = storage_page_find (block, pos);
+    if (!p && n == STORAGE_PAGE_SIZE)
+      {
+      int err = interface_block_read (c, block, pos, dest, n);
+      if (err) return err;
+      }
+    else
+      {
+      if (!p && !(p = storage_page_load (c, block, pos)))
+        return LFS_ERR_IO;
+      p->last_used = ++page_clock;
+      memcpy (dest, p->data + (pos - p->off), n);
+      }
+    dest += n;
+    pos += n;
+    }
+  if (!prog_cache.dirty || block != prog_cache.block)
+    return 0;
+
+  lfs_off_t start = off > prog_cache.off ? off : prog_cache.off;
+  lfs_off_t end = off + size < prog_cache.off + prog_cache.len ? 
+    off + size : prog_cache.off + prog_cache.len;
+  if (start < end)
+    memcpy ((uint8_t *)buffer + (start - off), 
+      prog_cache.buff + (start - prog_cache.off), end - start);
+  return 0;
+  }
+
+/*=========================================================================
+
+  storage_block_erase
+
+=========================================================================*/
+static int storage_block_erase (const struct lfs_config *c, 
+     lfs_block_t block)
+  {
+  StorageMount *m = c->context;
+  m->erase_count++; 
+  int err = storage_prog_cache_flush (c);
+  if (err) return err;
+  for (int i = 0; i < STORAGE_PAGE_CACHE_PAGES; i++)
+    {
+    if (page_cache[i].block == block) 
+      page_cache[i].valid = FALSE;
+    }
+  uint64_t start = interface_time_us ();
+  err = interface_block_erase (c, block);
+  m->erase_us += interface_time_us () - start;
+  return err;
+  }
+
+/*=========================================================================
+
+  storage_block_sync
+
+  LittleFS syncs when it needs its data to be in flash, so the cache
+  must be flushed here.
+
+=========================================================================*/
+static int storage_block_sync (const struct lfs_config *c)
+  {
+  ((StorageMount *)c->context)->sync_count++; 
+  int err = storage_prog_cache_flush (c);
+  if (err) return err;
+  return interface_block_sync (c);
+  }
+
+/*=========================================================================
+
+  storage_ram_read
+
+  The RAM block device, for /tmp
+
+=========================================================================*/
+static int storage_ram_read (const struct lfs_config *c, 
+     lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+  {
+  memcpy (buffer, tmp_ram + block * c->block_size + off, size);
+  return 0;
+  }
+
+/*=========================================================================
+
+  storage_ram_prog
+
+=========================================================================*/
+static int storage_ram_prog (const struct lfs_config *c, 
+     lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+  {
+  memcpy (tmp_ram + block * c->block_size + off, buffer, size);
+  return 0;
+  }
+
+/*=========================================================================
+
+  storage_ram_erase
+
+  Nothing needs to be done to RAM before it is written
+
+=========================================================================*/
+static int storage_ram_erase (const struct lfs_config *c, 
+     lfs_block_t block)
+  {
+  (void)block;
+  ((StorageMount *)c->context)->erase_count++; 
+  return 0;
+  }
+
+/*=========================================================================
+
+  storage_ram_sync
+
+=========================================================================*/
+static int storage_ram_sync (const struct lfs_config *c)
+  {
+  ((StorageMount *)c->context)->sync_count++; 
+  return 0;
+  }
+
+/*=========================================================================
+
+  storage_mount_for
+
+  Find the mount that a path belongs to, and set *rel to the path 
+  within that filesystem. A NULL path means the root filesystem.
+
+=========================================================================*/
+static StorageMount *storage_mount_for (const char *path, const char **rel)
+  {
+  if (path == NULL)
+    {
+    *rel = "/";
+    return &mounts[STORAGE_MOUNT_ROOT];
+    }
+  const char *p = path;
+  while (*p == '/') p++;
+  for (unsigned i = 0; i < STORAGE_MOUNTS - 1; i++)
+    {
+    StorageMount *m = &mounts[i];
+    if (!m->mounted) 
+      continue;
+    size_t l = strlen (m->prefix + 1);
+    if (strncmp (p, m->prefix + 1, l) == 0 && (p[l] == 0 || p[l] == '/'))
+      {
+      *rel = p[l] ? p + l : "/";
+      return m;
+      }
+    }
+  *rel = path;
+  return &mounts[STORAGE_MOUNT_ROOT];
+  }
+
+/*=========================================================================
+
+  storage_fs
+
+  The LittleFS instance for a path, and the path within it. NULL if the
+  path is in the read-only image.
+
+=========================================================================*/
+static lfs_t *storage_fs (const char *path, const char **rel)
+  {
+  return storage_mount_for (path, rel)->fs;
+  }
+
+/*=========================================================================
+
+  storage_lookup_hash
+
+=========================================================================*/
+static uint32_t storage_lookup_hash (const char *path)
+  {
+  uint32_t h = 2166136261u; // FNV-1a
+  while (*path)
+    {
+    h ^= (uint8_t)*path++;
+    h *= 16777619u;
+    }
+  return h;
+  }
+
+/*=========================================================================
+
+  storage_lookup_find
+
+  Returns the valid cache entry for the path, or NULL.
+
+=========================================================================*/
+static const LookupEntry *storage_lookup_find (const char *path, 
+     uint32_t hash)
+  {
+  const LookupEntry *e = &lookup_cache [hash % STORAGE_LOOKUP_CACHE_SIZE];
+  if (e->path == NULL || e->hash != hash || strcmp (e->path, path) != 0)
+    return NULL;
+  if (e->generation != (e->exists ? remove_generation : create_generation))
+    return NULL;
+  return e;
+  }
+
+/*=========================================================================
+
+  storage_lookup_store
+
+=========================================================================*/
+static void storage_lookup_store (const char *path, uint32_t hash, 
+     BOOL exists)
+  {
+  LookupEntry *e = &lookup_cache [hash % STORAGE_LOOKUP_CACHE_SIZE];
+  if (e->path == NULL || strcmp (e->path, path) != 0)
+    {
+    char *copy = strdup (path);
+    if (!copy) return;
+    free (e->path);
+    e->path = copy;
+    }
+  e->hash = hash;
+  e->exists = exists;
+  e->generation = exists ? remove_generation : create_generation;
+  }
+
+/*=========================================================================
+
+  storage_zattr_parse
+
+  Returns TRUE, and the decompressed size, if the attribute describes 
+  data that this build can decompress.
+
+=========================================================================*/
+static BOOL storage_zattr_parse (const uint8_t a[STORAGE_ZATTR_SIZE], 
+     uint32_t *size)
+  {
+  if (a[0] != STORAGE_CODEC_LZSS || a[1] != LZSS_OFFSET_BITS 
+       || a[2] != LZSS_LENGTH_BITS)
+    return FALSE;
+  if (size)
+    *size = (uint32_t)a[4] | ((uint32_t)a[5] << 8) 
+      | ((uint32_t)a[6] << 16) | ((uint32_t)a[7] << 24);
+  return TRUE;
+  }
+
+/*=========================================================================
+
+  storage_zattr_make
+
+=========================================================================*/
+static void storage_zattr_make (uint8_t a[STORAGE_ZATTR_SIZE], 
+     uint32_t size)
+  {
+  a[0] = STORAGE_CODEC_LZSS;
+  a[1] = LZSS_OFFSET_BITS;
+  a[2] = LZSS_LENGTH_BITS;
+  a[3] = 0;
+  a[4] = (uint8_t)size;
+  a[5] = (uint8_t)(size >> 8);
+  a[6] = (uint8_t)(size >> 16);
+  a[7] = (uint8_t)(size >> 24);
+  }
+
+/*=========================================================================
+
+  storage_lfs_read
+
+  LzssReadFn that reads the raw contents of an open StorageFile
+
+=========================================================================*/
+static int32_t storage_lfs_read (void *user_data, uint8_t *buff, 
+     uint32_t n)
+  {
+  StorageFile *f = user_data;
+  return (int32_t)lfs_file_read (f->fs, &f->file, buff, n);
+  }
+
+/*=========================================================================
+
+  storage_codec_read, storage_codec_write
+
+  Move data between two open files for the encoder
+
+=========================================================================*/
+typedef struct _StorageCodecIO
+  {
+  lfs_t *fs;
+  lfs_file_t *in;
+  lfs_file_t *out;
+  } StorageCodecIO;
+
+static int32_t storage_codec_read (void *user_data, uint8_t *buff, 
+     uint32_t n)
+  {
+  StorageCodecIO *io = user_data;
+  return (int32_t)lfs_file_read (io->fs, io->in, buff, n);
+  }
+
+static int32_t storage_codec_write (void *user_data, const uint8_t *buff, 
+     uint32_t n)
+  {
+  StorageCodecIO *io = user_data;
+  return (int32_t)lfs_file_write (io->fs, io->out, buff, n);
+  }
+
+/*=========================================================================
+
+  storage_compressed
+
+  Returns TRUE if the file is stored compressed.
+
+=========================================================================*/
+static BOOL storage_compressed (const char *path, uint32_t *size)
+  {
+  uint8_t a[STORAGE_ZATTR_SIZE];
+  const char *rel;
+  lfs_t *fs = storage_fs (path, &rel);
+  if (!fs)
+    return FALSE;
+  lfs_ssize_t res = lfs_getattr (fs, rel, STORAGE_ATTR_COMPRESSED, 
+    a, sizeof (a));
+  return res == (lfs_ssize_t)sizeof (a) && storage_zattr_parse (a, size);
+  }
+
+/*=========================================================================
+
+  storage_compressed_entry
+
+  As storage_compressed(), for the entry name in the directory dir, to 
+  give directory listings the size that a compressed file has when it
+  is read, as storage_info() does.
+
+=========================================================================*/
+static void storage_compressed_entry (const char *dir, const char *name,
+     uint32_t *size)
+  {
+  char path[MAX_PATH + 1];
+  storage_join_path (dir, name, path);
+  storage_compressed (path, size);
+  }
+
+/*=========================================================================
+
+  storage_handle_key
+
+  Put a path into a canonical form, so that "/a//b", "a/b" and "/a/b/" 
+  all refer to the same cached handle. Paths that contain ".." are not
+  cached at all, and FALSE is returned.
+
+=========================================================================*/
+static BOOL storage_handle_key (const char *path, char key[MAX_PATH + 1])
+  {
+  int n = 0;
+  while (*path)
+    {
+    while (*path == '/') path++;
+    const char *end = path;
+    while (*end && *end != '/') end++;
+    int l = (int)(end - path);
+    if (l == 2 && path[0] == '.' && path[1] == '.')
+      return FALSE;
+    if (l > 0 && !(l == 1 && path[0] == '.'))
+      {
+      if (n + l + 1 > MAX_PATH)
+        return FALSE;
+      key[n++] = '/';
+      memcpy (key + n, path, (size_t)l);
+      n += l;
+      }
+    path = end;
+    }
+  if (n == 0) 
+    key[n++] = '/';
+  key[n] = 0;
+  return TRUE;
+  }
+
+/*=========================================================================
+
+  storage_handle_close
+
+=========================================================================*/
+static ErrCode storage_handle_close (OpenHandle *h)
+  {
+  if (!h->path)
+    return 0;
+  int err = lfs_file_close (h->fs, &h->file);
+  free (h->path);
+  h->path = NULL;
+  h->dirty = FALSE;
+  return (ErrCode) -err;
+  }
+
+/*=========================================================================
+
+  storage_handle_drop
+
+  Close any cached handles for the path, or for anything inside it if
+  it is a directory. If the path can't be put in canonical form, all 
+  handles are closed, to be safe.
+
+=========================================================================*/
+static void storage_handle_drop (const char *path)
+  {
+  char key[MAX_PATH + 1];
+  BOOL all = !storage_handle_key (path, key);
+  size_t l = strlen (key);
+  for (int i = 0; i < STORAGE_HANDLE_CACHE_SIZE; i++)
+    {
+    OpenHandle *h = &handle_cache[i];
+    if (h->path && (all || l == 1 || (strncmp (h->path, key, l) == 0 
+          && (h->path[l] == 0 || h->path[l] == '/'))))
+      storage_handle_close (h);
+    }
+  }
+
+/*=========================================================================
+
+  storage_handle_drop_all
+
+=========================================================================*/
+static void storage_handle_drop_all (void)
+  {
+  for (int i = 0; i < STORAGE_HANDLE_CACHE_SIZE; i++)
+    storage_handle_close (&handle_cache[i]);
+  }
+
+/*=========================================================================
+
+  storage_handle_get
+
+  Find the cached handle for the path, opening the file if necessary, 
+  and evicting the least recently used handle to make room. Returns 
+  NULL with *err set if the file can't be opened; if the path can't be
+  cached, *err is zero, and the caller should open the file itself.
+  Files in the read-only image are never cached, as they are read 
+  directly.
+
+=========================================================================*/
+static OpenHandle *storage_handle_get (const char *path, BOOL create, 
+     ErrCode *err)
+  {
+  char key[MAX_PATH + 1];
+  const char *rel;
+  *err = 0;
+  if (!storage_fs (path, &rel))
+    {
+    if (create)
+      *err = ERR_ROFS;
+    return NULL;
+    }
+  if (!storage_handle_key (path, key))
+    return NULL;
+
+  OpenHandle *victim = &handle_cache[0];
+  for (int i = 0; i < STORAGE_HANDLE_CACHE_SIZE; i++)
+    {
+    OpenHandle *h = &handle_cache[i];
+    if (h->path && strcmp (h->path, key) == 0)
+      {
+      h->last_used = ++handle_clock;
+      return h;
+      }
+    if (victim->path && (!h->path || h->last_used < victim->last_used))
+      victim = h;
+    }
+
+  // Compressed files are read through storage_file_open, which 
+  //   decompresses them, and expanded before they are written
+  if (storage_compressed (key, NULL))
+    {
+    if (!create)
+      return NULL;
+    *err = storage_uncompress_file (key);
+    if (*err)
+      return NULL;
+    }
+
+  char *copy = strdup (key);
+  if (!copy)
+    {
+    *err = ERR_NOMEM;
+    return NULL;
+    }
+  storage_handle_close (victim);
+  victim->fs = storage_fs (key, &rel);
+  int res = lfs_file_open (victim->fs, &victim->file, rel, 
+     LFS_O_RDWR | (create ? LFS_O_CREAT : 0));
+  if (res)
+    {
+    free (copy);
+    *err = (ErrCode) -res;
+    return NULL;
+    }
+  victim->path = copy;
+  victim->dirty = FALSE;
+  victim->last_used = ++handle_clock;
+  return victim;
+  }
+
+/*=========================================================================
+
+  storage_handle_sync_all
+
+  Commit everything written through cached handles, so that listings,
+  sizes, and the free space are up to date. 
+
+=========================================================================*/
+static ErrCode storage_handle_sync_all (void)
+  {
+  ErrCode ret = 0;
+  for (int i = 0; i < STORAGE_HANDLE_CACHE_SIZE; i++)
+    {
+    OpenHandle *h = &handle_cache[i];
+    if (h->path && h->dirty)
+      {
+      int err = lfs_file_sync (h->fs, &h->file);
+      h->dirty = FALSE;
+      if (err && ret == 0)
+        ret = (ErrCode) -err;
+      }
+    }
+  return ret;
+  }
+
+/*=========================================================================
+
+  storage_generation
+
+=========================================================================*/
+uint32_t storage_generation (void)
+  {
+  return create_generation + remove_generation + write_generation;
+  }
+
+/*=========================================================================
+
+  storage_sync
+
+=========================================================================*/
+ErrCode storage_sync (void)
+  {
+  if (!mounts[STORAGE_MOUNT_ROOT].mounted)
+    return 0;
+  return storage_handle_sync_all ();
+  }
+
+/*=========================================================================
+
+  storage_handle_dirty
+
+  Note that a handle holds data that isn't committed
+
+=========================================================================*/
+static void storage_handle_dirty (OpenHandle *h)
+  {
+  if (h->dirty) return;
+  h->dirty = TRUE;
+  h->dirty_ms = interface_time_ms ();
+  }
+
+/*=========================================================================
+
+  storage_handle_sync_old
+
+  Commit a handle's data, if it has waited for STORAGE_SYNC_MS
+
+=========================================================================*/
+static ErrCode storage_handle_sync_old (OpenHandle *h, uint32_t now)
+  {
+  if (!h->path || !h->dirty || now - h->dirty_ms < STORAGE_SYNC_MS)
+    return 0;
+  h->dirty = FALSE;
+  return (ErrCode) -lfs_file_sync (h->fs, &h->file);
+  }
+
+/*=========================================================================
+
+  storage_sync_old
+
+=========================================================================*/
+void storage_sync_old (void)
+  {
+  uint32_t now = interface_time_ms ();
+  for (int i = 0; i < STORAGE_HANDLE_CACHE_SIZE; i++)
+    storage_handle_sync_old (&handle_cache[i], now);
+  }
+
+/*=========================================================================
+
+  storage_tmp_mount
+
+  Create /tmp as a new, empty filesystem in RAM. Its mountpoint is a
+  directory on the flash, so that it shows up in listings. If there isn't
+  the memory, /tmp is just that directory. 
+
+=========================================================================*/
+static void storage_tmp_mount (void)
+  {
+  StorageMount *m = &mounts[STORAGE_MOUNT_TMP];
+  int err = lfs_mkdir (&lfs, m->prefix);
+  if (err && err != LFS_ERR_EXIST) 
+    return;
+  if (STORAGE_TMP_BLOCK_COUNT < 2) 
+    return;
+  tmp_ram = malloc (STORAGE_TMP_SIZE);
+  if (!tmp_ram) 
+    return;
+  if (lfs_format (&tmp_lfs, &tmp_cfg) == 0 
+       && lfs_mount (&tmp_lfs, &tmp_cfg) == 0)
+    {
+    m->mounted = TRUE;
+    storage_allocator_scan (m);
+    }
+  else
+    {
+    free (tmp_ram);
+    tmp_ram = NULL;
+    }
+  }
+
+/*=========================================================================
+
+  storage_tmp_unmount
+
+  The contents of /tmp are lost
+
+=========================================================================*/
+static void storage_tmp_unmount (void)
+  {
+  StorageMount *m = &mounts[STORAGE_MOUNT_TMP];
+  if (m->mounted)
+    {
+    lfs_unmount (&tmp_lfs);
+    m->mounted = FALSE;
+    }
+  free (tmp_ram);
+  tmp_ram = NULL;
+  }
+
+/*=========================================================================
+
+  storage_rom_mount
+
+  The read-only image is always there, but it needs a mountpoint on
+  the flash, like /tmp
+
+=========================================================================*/
+static void storage_rom_mount (void)
+  {
+  StorageMount *m = &mounts[STORAGE_MOUNT_ROM];
+  int err = lfs_mkdir (&lfs, m->prefix);
+  m->mounted = (err == 0 || err == LFS_ERR_EXIST) && romfs_count > 0;
+  }
+
+/*=========================================================================
+
+  storage_fingerprint_add
+
+=========================================================================*/
+static int storage_fingerprint_add (void *data, lfs_block_t value)
+  {
+  uint32_t *crc = data;
+  *crc = lfs_crc (*crc, &value, sizeof (value));
+  return 0;
+  }
+
+/*=========================================================================
+
+  storage_fingerprint
+
+  A CRC of every metadata block, and of the first block and size of
+  every file. Which blocks are in use follows from these, so any write 
+  that uses or frees a block, even by firmware that knows nothing of 
+  checkpoints, changes it. Only the metadata is read, not the files' 
+  lists of blocks, so this is much quicker than a scan. Returns FALSE 
+  if the metadata can't be read.
+
+=========================================================================*/
+static BOOL storage_fingerprint (lfs_t *fs, uint32_t *fingerprint)
+  {
+  *fingerprint = 0xFFFFFFFF;
+  return lfs_fs_traverseheads (fs, storage_fingerprint_add, 
+    fingerprint) == 0;
+  }
+
+/*=========================================================================
+
+  storage_checkpoint_save
+
+  Save the allocator's map of free blocks, if the filesystem is about to
+  be unmounted
+
+=========================================================================*/
+static void storage_checkpoint_save (StorageMount *m)
+  {
+  lfs_t *fs = m->fs;
+  if (m->usage_generation != remove_generation 
+       || m->usage_sync_count != m->sync_count)
+    storage_allocator_scan (m); // The next mount gets an exact map
+  if (fs->free.size > m->cfg->block_count)
+    return;
+
+  StorageCheckpoint c;
+  memset (&c, 0, sizeof (c));
+  // Saving the attribute doesn't change the fingerprint, unless it 
+  //   moves the root directory, and then the map isn't used
+  if (!storage_fingerprint (fs, &c.fingerprint))
+    return;
+  c.magic = STORAGE_CHECKPOINT_MAGIC;
+  c.block_size = m->cfg->block_size;
+  c.block_count = m->cfg->block_count;
+  c.off = fs->free.off;
+  c.size = fs->free.size;
+  c.i = fs->free.i;
+  memcpy (c.map, fs->free.buffer, (c.size + 31) / 32 * 4);
+  int err = lfs_setattr (fs, "/", STORAGE_ATTR_CHECKPOINT, &c, sizeof (c));
+  // Saving the map mustn't have used any of the blocks that it says 
+  //   are free
+  if (err == 0 && (fs->free.off != c.off || fs->free.i != c.i))
+    lfs_removeattr (fs, "/", STORAGE_ATTR_CHECKPOINT);
+  }
+
+/*=========================================================================
+
+  storage_checkpoint_load
+
+  Take back the map of free blocks saved at the last unmount, if there
+  is one, and nothing has been written since. Returns FALSE if the 
+  filesystem must be scanned instead.
+
+=========================================================================*/
+static BOOL storage_checkpoint_load (StorageMount *m)
+  {
+  lfs_t *fs = m->fs;
+  StorageCheckpoint c;
+  lfs_ssize_t n = lfs_getattr (fs, "/", STORAGE_ATTR_CHECKPOINT, 
+    &c, sizeof (c));
+  if (n < 0)
+    return FALSE;
+
+  BOOL ok = STORAGE_MOUNT_CHECKPOINT && n == sizeof (c) 
+    && c.magic == STORAGE_CHECKPOINT_MAGIC 
+    && c.block_size == m->cfg->block_size 
+    && c.block_count == m->cfg->block_count 
+    && c.off < c.block_count && c.size <= c.block_count 
+    && c.size <= 8 * m->cfg->lookahead_size && c.i <= c.size;
+  uint32_t fingerprint;
+  ok = ok && storage_fingerprint (fs, &fingerprint) 
+    && fingerprint == c.fingerprint;
+  if (ok)
+    {
+    // Anything that removing the attribute allocates comes from here
+    memset (fs->free.buffer, 0, m->cfg->lookahead_size);
+    memcpy (fs->free.buffer, c.map, (c.size + 31) / 32 * 4);
+    fs->free.off = c.off;
+    fs->free.size = c.size;
+    fs->free.i = c.i;
+    }
+
+  // Whether or not it was any use, it must not outlive this mount
+  if (lfs_removeattr (fs, "/", STORAGE_ATTR_CHECKPOINT) != 0)
+    {
+    fs->free.size = 0;
+    fs->free.i = 0;
+    return FALSE;
+    }
+  if (ok)
+    {
+    // As if the filesystem had just been scanned
+    m->usage_generation = remove_generation;
+    m->usage_erase_count = m->erase_count;
+    m->usage_sync_count = m->sync_count;
+    }
+  return ok;
+  }
+
+/*=========================================================================
+
+  storage_root_mount
+
+  Mount the flash, formatting it if it can't be mounted
+
+=========================================================================*/
+static void storage_root_mount (void)
+  {
+  StorageMount *root = &mounts[STORAGE_MOUNT_ROOT];
+  root->mounted = FALSE;
+  int err = lfs_mount (&lfs, &cfg);
+  if (err)
+    {
+    if (lfs_format (&lfs, &cfg))
+      {
+      printf ("Format failed\n"); // TODO
+      }
+    else
+      {
+      lfs_mount (&lfs, &cfg);
+      root->mounted = TRUE; // We hope...
+      }
+    }
+  else
+    root->mounted = TRUE;
+  // Fill in the allocator's map of free blocks now, so that df doesn't
+  //   have to scan the filesystem
+  if (root->mounted && !storage_checkpoint_load (root))
+    storage_allocator_scan (root);
+  }
+
+/*=========================================================================
+
+  storage_root_unmount
+
+=========================================================================*/
+static void storage_root_unmount (BOOL checkpoint)
+  {
+  StorageMount *root = &mounts[STORAGE_MOUNT_ROOT];
+  if (root->mounted)
+    {
+    if (checkpoint && STORAGE_MOUNT_CHECKPOINT)
+      storage_checkpoint_save (root);
+    lfs_unmount (&lfs);
+    root->mounted = FALSE;
+    }
+  storage_prog_cache_flush (&cfg);
+  }
+
+/*=========================================================================
+
+  storage_init 
+
+=========================================================================*/
+void storage_init (void)
+  {
+  interface_block_init ();
+  storage_root_mount ();
+  if (mounts[STORAGE_MOUNT_ROOT].mounted)
+    {
+    storage_tmp_mount ();
+    storage_rom_mount ();
+    }
+  }
+
+/*=========================================================================
+
+  storage_remount
+
+=========================================================================*/
+ErrCode storage_remount (BOOL checkpoint)
+  {
+  storage_handle_drop_all ();
+  if (lfs.mlist)
+    return ERR_INVAL; // Something still has a file or directory open
+  storage_root_unmount (checkpoint);
+  memset (page_cache, 0, sizeof (page_cache)); // As a restart would
+  storage_root_mount ();
+  return mounts[STORAGE_MOUNT_ROOT].mounted ? 0 : ERR_IO;
+  }
+
+/*=========================================================================
+
+  storage_cleanup
+
+=========================================================================*/
+void storage_cleanup (void)
+  {
+  storage_handle_drop_all ();
+  storage_tmp_unmount ();
+  storage_root_unmount (TRUE);
+  interface_block_cleanup ();
+  }
+
+/*=========================================================================
+
+  storage_prepare_write
+
+  A compressed file can't be written in place. If it is about to be 
+  truncated, it is simply removed first; otherwise it is expanded.
+
+=========================================================================*/
+static ErrCode storage_prepare_write (const char *path, BOOL truncate)
+  {
+  if (!storage_compressed (path, NULL))
+    return 0;
+  if (truncate)
+    {
+    const char *rel;
+    lfs_t *fs = storage_fs (path, &rel);
+    remove_generation++;
+    return (ErrCode) -lfs_remove (fs, rel);
+    }
+  return storage_uncompress_file (path);
+  }
+
+/*=========================================================================
+
+  storage_temp_path
+
+  The name used while a file is being rewritten. The rename at the end
+  is atomic, so the original is never lost.
+
+=========================================================================*/
+static ErrCode storage_temp_path (const char *path, char temp[MAX_PATH + 1])
+  {
+  size_t l = strlen (path);
+  if (l + 1 > MAX_PATH)
+    return ERR_NAMETOOLONG;
+  memcpy (temp, path, l);
+  temp[l] = '~';
+  temp[l + 1] = 0;
+  return 0;
+  }
+
+/*=========================================================================
+
+  storage_compress_file
+
+=========================================================================*/
+ErrCode storage_compress_file (const char *path, uint32_t *size, 
+     uint32_t *stored)
+  {
+  storage_handle_drop (path);
+  const char *rel;
+  lfs_t *fs = storage_fs (path, &rel);
+  if (!fs)
+    return ERR_ROFS;
+  struct lfs_info info;
+  int err = lfs_stat (fs, rel, &info);
+  if (err)
+    return (ErrCode) -err;
+  if (info.type != LFS_TYPE_REG)
+    return ERR_ISDIR;
+  *stored = info.size;
+  if (storage_compressed (path, size))
+    return 0;
+  *size = info.size;
+
+  char temp[MAX_PATH + 1];
+  ErrCode ret = storage_temp_path (rel, temp);
+  if (ret)
+    return ret;
+
+  lfs_file_t in;
+  err = lfs_file_open (fs, &in, rel, LFS_O_RDONLY);
+  if (err)
+    return (ErrCode) -err;
+
+  // The attribute is committed with the data, when the file is closed
+  uint8_t zattr[STORAGE_ZATTR_SIZE];
+  struct lfs_attr attr = { STORAGE_ATTR_COMPRESSED, zattr, sizeof (zattr) };
+  struct lfs_file_config fcfg;
+  memset (&fcfg, 0, sizeof (fcfg));
+  fcfg.attrs = &attr;
+  fcfg.attr_count = 1;
+  lfs_file_t out;
+  create_generation++;
+  err = lfs_file_opencfg (fs, &out, temp, 
+     LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC, &fcfg);
+  if (err)
+    {
+    lfs_file_close (fs, &in);
+    return (ErrCode) -err;
+    }
+
+  StorageCodecIO io = { fs, &in, &out };
+  uint32_t n_in, n_out;
+  ret = lzss_encode (storage_codec_read, storage_codec_write, &io, 
+     &n_in, &n_out);
+  storage_zattr_make (zattr, n_in);
+  err = lfs_file_close (fs, &out);
+  if (err && ret == 0)
+    ret = (ErrCode) -err;
+  lfs_file_close (fs, &in);
+
+  remove_generation++;
+  if (ret == 0 && n_out < n_in)
+    {
+    ret = (ErrCode) -lfs_rename (fs, temp, rel);
+    if (ret == 0)
+      *stored = n_out;
+    }
+  else
+    {
+    // Not worth it; leave the file as it was
+    lfs_remove (fs, temp);
+    }
+  return ret;
+  }
+
+/*=========================================================================
+
+  storage_uncompress_file
+
+=========================================================================*/
+ErrCode storage_uncompress_file (const char *path)
+  {
+  if (!storage_compressed (path, NULL))
+    return 0;
+  const char *rel;
+  lfs_t *fs = storage_fs (path, &rel);
+  char temp[MAX_PATH + 1];
+  ErrCode ret = storage_temp_path (rel, temp);
+  if (ret)
+    return ret;
+
+  uint8_t *buff = malloc (STORAGE_READER_BUFFER_SIZE);
+  if (!buff)
+    return ERR_NOMEM;
+  FileDescriptor in;
+  ret = storage_file_open (path, STORAGE_O_RDONLY, &in);
+  if (ret == 0)
+    {
+    lfs_file_t out;
+    create_generation++;
+    int err = lfs_file_open (fs, &out, temp, 
+       LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    if (err == 0)
+      {
+      int32_t n;
+      while ((n = storage_file_read (&in, buff, 
+           STORAGE_READER_BUFFER_SIZE)) > 0)
+        {
+        lfs_ssize_t w = lfs_file_write (fs, &out, buff, (lfs_size_t)n);
+        if (w != n)
+          {
+          ret = w < 0 ? (ErrCode) -w : ERR_NOSPC;
+          break;
+          }
+        }
+      if (n < 0 && ret == 0)
+        ret = (ErrCode) -n;
+      err = lfs_file_close (fs, &out);
+      if (err && ret == 0)
+        ret = (ErrCode) -err;
+      remove_generation++;
+      if (ret == 0)
+        ret = (ErrCode) -lfs_rename (fs, temp, rel);
+      else
+        lfs_remove (fs, temp);
+      }
+    else
+      ret = (ErrCode) -err;
+    storage_file_close (&in);
+    }
+  free (buff);
+  return ret;
+  }
+
+/*=========================================================================
+
+  storage_rom_open
+
+  Open a file in the read-only image
+
+=========================================================================*/
+static ErrCode storage_rom_open (const char *rel, StorageOpenFlags flags,
+     FileDescriptor *file)
+  {
+  if ((flags & STORAGE_O_RDWR) != STORAGE_O_RDONLY)
+    return ERR_ROFS;
+  const RomfsEntry *e = romfs_find (rel);
+  if (!e)
+    return ERR_NOENT;
+  if (e->dir)
+    return ERR_ISDIR;
+  StorageFile *f = calloc (1, sizeof (StorageFile));
+  if (f == NULL)
+    return ERR_NOMEM;
+  f->rom = e;
+  file->descriptor = f;
+  return 0;
+  }
+
+/*=========================================================================
+
+  storage_file_open
+
+=========================================================================*/
+ErrCode storage_file_open (const char *filename, StorageOpenFlags flags,
+          FileDescriptor *file)
+  {
+  const char *rel;
+  if (!storage_fs (filename, &rel))
+    return storage_rom_open (rel, flags, file);
+  if (flags & STORAGE_O_CREAT)
+    create_generation++;
+  storage_handle_drop (filename);
+  BOOL readonly = (flags & STORAGE_O_RDWR) == STORAGE_O_RDONLY;
+  if (!readonly)
+    {
+    write_generation++;
+    ErrCode ret = storage_prepare_write (filename, 
+      (flags & STORAGE_O_TRUNC) != 0);
+    if (ret)
+      return ret;
+    }
+
+  StorageFile *f = calloc (1, sizeof (StorageFile));
+  if (f == NULL)
+    return ERR_NOMEM;
+  f->fs = storage_fs (filename, &rel);
+  int err;
+  if (readonly)
+    {
+    // The compression attribute, if there is one, is read along with
+    //   the rest of the file's metadata
+    f->attr.type = STORAGE_ATTR_COMPRESSED;
+    f->attr.buffer = f->zattr;
+    f->attr.size = sizeof (f->zattr);
+    f->fcfg.attrs = &f->attr;
+    f->fcfg.attr_count = 1;
+    err = lfs_file_opencfg (f->fs, &f->file, rel, flags, &f->fcfg);
+    }
+  else
+    err = lfs_file_open (f->fs, &f->file, rel, flags);
+  if (err != LFS_ERR_OK)
+    {
+    free (f);
+    return (ErrCode) -err;
+    }
+
+  if (readonly && storage_zattr_parse (f->zattr, &f->zsize))
+    {
+    f->z = malloc (sizeof (LzssDecoder));
+    if (f->z == NULL)
+      {
+      lfs_file_close (f->fs, &f->file);
+      free (f);
+      return ERR_NOMEM;
+      }
+    lzss_decoder_init (f->z, storage_lfs_read, f);
+    }
+  file->descriptor = f;
+  return 0;
+  }
+
+/*=========================================================================
+
+  storage_file_close
+
+=========================================================================*/
+ErrCode storage_file_close (FileDescriptor *file)
+  {
+  if (file->descriptor == NULL)
+    return ERR_INVAL;
+  StorageFile *f = file->descriptor;
+  if (!f->rom && (f->file.flags & LFS_O_WRONLY))
+    write_generation++; // The data is committed now
+  int err = f->rom ? 0 : lfs_file_close (f->fs, &f->file);
+  free (f->z);
+  free (f);
+  file->descriptor = NULL;
+  return (ErrCode) -err;
+  }
+
+/*=========================================================================
+
+  storage_file_read
+
+=========================================================================*/
+int32_t storage_file_read (FileDescriptor *file, void *buff, uint32_t n)
+  {
+  StorageFile *f = file->descriptor;
+  if (f->rom)
+    {
+    if (f->rom_pos >= f->rom->size)
+      return 0;
+    if (n > f->rom->size - f->rom_pos)
+      n = f->rom->size - f->rom_pos;
+    memcpy (buff, f->rom->data + f->rom_pos, n);
+    f->rom_pos += n;
+    return (int32_t)n;
+    }
+  if (f->z == NULL)
+    return (int32_t)lfs_file_read (f->fs, &f->file, buff, n);
+
+  if (f->zpos >= f->zsize)
+    return 0;
+  if (n > f->zsize - f->zpos)
+    n = f->zsize - f->zpos;
+  uint32_t got = lzss_decode (f->z, buff, n);
+  f->zpos += got;
+  if (got < n)
+    return f->z->err ? -(int32_t)f->z->err : -(int32_t)ERR_IO; 
+  return (int32_t)got;
+  }
+
+/*=========================================================================
+
+  storage_file_getc
+
+=========================================================================*/
+int storage_file_getc (FileDescriptor *file)
+  {
+  unsigned char c = 0;
+  int32_t read = storage_file_read (file, &c, 1);
+  return read == 1 ? c : EOF;
+  }
+
+/*=========================================================================
+
+  storage_file_write
+
+=========================================================================*/
+int32_t storage_file_write (FileDescriptor *file, const void *buf,
+          uint32_t len)
+  {
+  StorageFile *f = file->descriptor;
+  if (f->rom)
+    return -(int32_t)ERR_BADF; // Can only be open for reading
+  write_generation++;
+  return (int32_t)lfs_file_write (f->fs, &f->file, buf, len);
+  }
+
+/*=========================================================================
+
+  storage_file_tell
+
+=========================================================================*/
+int32_t storage_file_tell (FileDescriptor *file)
+  {
+  StorageFile *f = file->descriptor;
+  if (f->rom)
+    return (int32_t)f->rom_pos;
+  if (f->z)
+    return (int32_t)f->zpos;
+  return (int32_t)lfs_file_tell (f->fs, &f->file);
+  }
+
+/*=========================================================================
+
+  storage_file_seek
+
+  A compressed file can only be decompressed from the start, so seeking
+  backwards starts again, and seeking forwards decompresses and 
+  discards the data in between. 
+
+=========================================================================*/
+int32_t storage_file_seek (FileDescriptor *file, int32_t offset, 
+          StorageSeekWhence whence)
+  {
+  StorageFile *f = file->descriptor;
+  if (f->rom == NULL && f->z == NULL)
+    return (int32_t)lfs_file_seek (f->fs, &f->file, offset, (int)whence);
+
+  int32_t target = offset;
+  if (whence == STORAGE_SEEK_CUR)
+    target += (int32_t)storage_file_tell (file);
+  else if (whence == STORAGE_SEEK_END)
+    target += storage_file_size (file);
+  if (target < 0)
+    return -ERR_INVAL;
+  if (f->rom)
+    {
+    // As LittleFS does, allow seeking past the end
+    f->rom_pos = (uint32_t)target;
+    return target;
+    }
+
+  if ((uint32_t)target < f->zpos)
+    {
+    int err = lfs_file_rewind (f->fs, &f->file);
+    if (err) 
+      return err;
+    lzss_decoder_init (f->z, storage_lfs_read, f);
+    f->zpos = 0;
+    }
+  uint8_t scratch[64];
+  while (f->zpos < (uint32_t)target && f->zpos < f->zsize)
+    {
+    uint32_t n = (uint32_t)target - f->zpos;
+    if (n > sizeof (scratch)) n = sizeof (scratch);
+    int32_t got = storage_file_read (file, scratch, n);
+    if (got <= 0)
+      return got < 0 ? got : -ERR_IO;
+    }
+  f->zpos = (uint32_t)target;
+  return target;
+  }
+
+/*=========================================================================
+
+  storage_file_sync
+
+=========================================================================*/
+ErrCode storage_file_sync (FileDescriptor *file)
+  {
+  StorageFile *f = file->descriptor;
+  if (f->rom)
+    return 0;
+  write_generation++;
+  return (ErrCode) -lfs_file_sync (f->fs, &f->file);
+  }
+
+/*=========================================================================
+
+  storage_file_size
+
+=========================================================================*/
+int32_t storage_file_size (FileDescriptor *file)
+  {
+  StorageFile *f = file->descriptor;
+  if (f->rom)
+    return (int32_t)f->rom->size;
+  if (f->z)
+    return (int32_t)f->zsize;
+  return (int32_t)lfs_file_size (f->fs, &f->file);
+  }
+
+/*=========================================================================
+
+  storage_file_eof
+
+=========================================================================*/
+BOOL storage_file_eof (FileDescriptor *file)
+  {
+  int32_t offset = storage_file_tell (file);
+  if (offset < 0)
+    return TRUE;
+
+  int32_t size = storage_file_size (file);
+  if (size < 0)
+    return TRUE;
+
+  return offset == size;
+  }
+
+/*=========================================================================
+
+  storage_map
+
+=========================================================================*/
+ErrCode storage_map (const char *path, const void **data, uint32_t *size)
+  {
+  const char *rel;
+  if (storage_fs (path, &rel))
+    return ERR_NOTIMPLEMENTED;
+  const RomfsEntry *e = romfs_find (rel);
+  if (!e)
+    return ERR_NOENT;
+  if (e->dir)
+    return ERR_ISDIR;
+  *data = e->data;
+  *size = e->size;
+  return 0;
+  }
+
+/*=========================================================================
+
+  storage_reader_open
+
+  A file that can be mapped is read straight from where it is, as if
+  the whole of it were already buffered
+
+=========================================================================*/
+ErrCode storage_reader_open (StorageReader *r, const char *path)
+  {
+  r->pos = r->len = 0;
+  r->err = 0;
+  r->open = FALSE;
+  r->data = r->buff;
+  const void *data;
+  uint32_t size;
+  ErrCode err = storage_map (path, &data, &size);
+  if (err != ERR_NOTIMPLEMENTED)
+    {
+    if (err == 0)
+      {
+      r->data = data;
+      r->len = size;
+      }
+    return err;
+    }
+  err = storage_file_open (path, STORAGE_O_RDONLY, &r->file);
+  r->open = (err == 0);
+  return err;
+  }
+
+/*=========================================================================
+
+  storage_reader_close
+
+=========================================================================*/
+ErrCode storage_reader_close (StorageReader *r)
+  {
+  r->pos = r->len = 0;
+  if (!r->open)
+    return 0;
+  r->open = FALSE;
+  return storage_file_close (&r->file);
+  }
+
+/*=========================================================================
+
+  storage_reader_fill
+
+=========================================================================*/
+uint32_t storage_reader_fill (StorageReader *r)
+  {
+  if (r->pos < r->len)
+    return r->len - r->pos;
+  r->pos = r->len = 0;
+  if (!r->open || r->err)
+    return 0;
+  r->data = r->buff;
+  int32_t n = storage_file_read (&r->file, r->buff, sizeof (r->buff));
+  if (n < 0)
+    {
+    r->err = (ErrCode) -n;
+    return 0;
+    }
+  r->len = (uint32_t)n;
+  return r->len;
+  }
+
+/*=========================================================================
+
+  storage_reader_chunk
+
+=========================================================================*/
+const char *storage_reader_chunk (StorageReader *r, uint32_t *n)
+  {
+  *n = storage_reader_fill (r);
+  if (*n == 0)
+    return NULL;
+  const char *ret = (const char *)r->data + r->pos;
+  r->pos = r->len;
+  return ret;
+  }
+
+/*=========================================================================
+
+  storage_reader_read
+
+=========================================================================*/
+uint32_t storage_reader_read (StorageReader *r, void *buf, uint32_t n)
+  {
+  uint8_t *p = buf;
+  uint32_t done = 0;
+  while (done < n)
+    {
+    uint32_t avail = r->len - r->pos;
+    if (avail == 0 && n - done >= sizeof (r->buff) && r->open && !r->err)
+      {
+      // Large read with nothing buffered -- don't copy twice
+      int32_t got = storage_file_read (&r->file, p + done, n - done);
+      if (got < 0)
+        r->err = (ErrCode) -got;
+      if (got <= 0)
+        break;
+      done += (uint32_t)got;
+      continue;
+      }
+    if (avail == 0 && (avail = storage_reader_fill (r)) == 0)
+      break;
+    uint32_t k = avail < n - done ? avail : n - done;
+    memcpy (p + done, r->data + r->pos, k);
+    r->pos += k;
+    done += k;
+    }
+  return done;
+  }
+
+/*=========================================================================
+
+  storage_reader_readline
+
+=========================================================================*/
+uint32_t storage_reader_readline (StorageReader *r, char *buf, 
+           uint32_t max, BOOL *eol)
+  {
+  uint32_t done = 0;
+  *eol = FALSE;
+  while (done < max)
+    {
+    uint32_t avail = storage_reader_fill (r);
+    if (avail == 0)
+      break;
+    const uint8_t *start = r->data + r->pos;
+    const uint8_t *nl = memchr (start, '\n', avail);
+    uint32_t k = nl ? (uint32_t)(nl - start) : avail;
+    if (k > max - done)
+      k = max - done;
+    memcpy (buf + done, start, k);
+    r->pos += k;
+    done += k;
+    if (nl && start + k == nl)
+      {
+      r->pos++; // Consume the newline
+      *eol = TRUE;
+      break;
+      }
+    }
+  return done;
+  }
+
+/*=========================================================================
+
+  storage_write_direct
+
+  Open, write, and close a file that can't have a cached handle
+
+=========================================================================*/
+static ErrCode storage_write_direct (const char *filename, 
+     StorageOpenFlags flags, const void *buf, int len)
+  {
+  FileDescriptor file;
+  ErrCode ret = storage_file_open (filename, flags, &file);
+  if (ret)
+    return ret;
+  int32_t n = storage_file_write (&file, buf, (uint32_t)len);
+  ret = storage_file_close (&file);
+  if (n != len)
+    return n < 0 ? (ErrCode) -n : ERR_NOSPC;
+  return ret;
+  }
+
+/*=========================================================================
+
+  storage_write_file
+
+=========================================================================*/
+ErrCode storage_write_file (const char *filename, const void *buf, int len)
+  {
+  create_generation++;
+  ErrCode ret;
+  OpenHandle *h = storage_handle_get (filename, TRUE, &ret);
+  if (!h)
+    {
+    if (ret) 
+      return ret;
+    return storage_write_direct (filename, 
+      STORAGE_O_RDWR | STORAGE_O_CREAT | STORAGE_O_TRUNC, buf, len);
+    }
+
+  storage_handle_dirty (h);
+  int err = lfs_file_truncate (h->fs, &h->file, 0);
+  if (err == 0)
+    err = lfs_file_seek (h->fs, &h->file, 0, LFS_SEEK_SET);
+  if (err < 0)
+    {
+    storage_handle_close (h);
+    return (ErrCode) -err;
+    }
+  lfs_ssize_t n = lfs_file_write (h->fs, &h->file, buf, (lfs_size_t)len);
+  if (n != len)
+    {
+    storage_handle_close (h);
+    return n < 0 ? (ErrCode) -n : ERR_NOSPC;
+    }
+  // A program that writes in a loop might never leave the shell idle
+  return storage_handle_sync_old (h, interface_time_ms ());
+  }
+
+/*=========================================================================
+
+  storage_append_file
+
+=========================================================================*/
+ErrCode storage_append_file (const char *filename, const void *buf, int len)
+  {
+  create_generation++;
+  ErrCode ret;
+  OpenHandle *h = storage_handle_get (filename, TRUE, &ret);
+  if (!h)
+    {
+    if (ret) 
+      return ret;
+    return storage_write_direct (filename, 
+      STORAGE_O_RDWR | STORAGE_O_CREAT | STORAGE_O_APPEND, buf, len);
+    }
+
+  storage_handle_dirty (h);
+  lfs_soff_t pos = lfs_file_seek (h->fs, &h->file, 0, LFS_SEEK_END);
+  if (pos < 0)
+    {
+    storage_handle_close (h);
+    return (ErrCode) -pos;
+    }
+  lfs_ssize_t n = lfs_file_write (h->fs, &h->file, buf, (lfs_size_t)len);
+  if (n != len)
+    {
+    storage_handle_close (h);
+    return n < 0 ? (ErrCode) -n : ERR_NOSPC;
+    }
+  // A program that writes in a loop might never leave the shell idle
+  return storage_handle_sync_old (h, interface_time_ms ());
+  }
 
 /*=========================================================================
 
-  storage_init 
+  storage_rom_list
+
+  Do storage_list_dir or storage_list_dir_ex for a directory in the
+  read-only image
 
 =========================================================================*/
-void storage_init (void)
+static ErrCode storage_rom_list (const char *path, List *list, BOOL ex)
   {
-  interface_block_init ();
-  mounted = FALSE;
-  int err = lfs_mount (&lfs, &cfg);
-  if (err)
+  DirDescriptor dir;
+  ErrCode ret = storage_dir_open (path, &dir);
+  if (ret)
+    return ret;
+  FileInfo info;
+  while (storage_dir_read (&dir, &info) > 0)
     {
-    if (lfs_format (&lfs, &cfg))
+    size_t namelen = strlen (info.name);
+    if (ex)
       {
-      printf ("Format failed\n"); // TODO
+      StorageDirEntry *entry = malloc (sizeof (StorageDirEntry) 
+        + namelen + 1);
+      if (!entry)
+        {
+        ret = ERR_NOMEM;
+        break;
+        }
+      entry->type = info.type;
+      entry->size = info.size;
+      memcpy (entry->name, info.name, namelen + 1);
+      list_append (list, entry);
       }
     else
-      {
-      lfs_mount (&lfs, &cfg);
-      mounted = TRUE; // We hope...
-      }
+      list_append (list, strdup (info.name));
     }
-  else
-    mounted = TRUE;
+  storage_dir_close (&dir);
+  return ret;
   }
 
 /*=========================================================================
 
-  storage_cleanup
+  storage_list_dir
 
 =========================================================================*/
-void storage_cleanup (void)
+ErrCode storage_list_dir (const char *path, List *list)
   {
-  if (mounted)
-    lfs_unmount (&lfs);
-  interface_block_cleanup ();
-  }
+  lfs_dir_t dir;
+  storage_handle_sync_all ();
+  const char *rel;
+  lfs_t *fs = storage_fs (path, &rel);
+  if (!fs)
+    return storage_rom_list (path, list, FALSE);
 
-/*=========================================================================
+  int err = lfs_dir_open (fs, &dir, rel);
+  if (err)
+    return (ErrCode) -err;
 
-  storage_file_open
+  struct lfs_info info;
+  int ret = lfs_dir_read (fs, &dir, &info);
+  while (ret > 0)
+    {
+    list_append (list, strdup (info.name));
+    ret = lfs_dir_read (fs, &dir, &info);
+    }
 
-=========================================================================*/
-ErrCode storage_file_open (const char *filename, StorageOpenFlags flags,
-          FileDescriptor *file)
-  {
-  file->descriptor = calloc (1, sizeof(lfs_file_t));
-  if (file->descriptor == NULL)
-    return ERR_NOMEM;
-  int err = lfs_file_open(&lfs, (lfs_file_t *)file->descriptor, filename,
-    flags);
-  if (err != LFS_ERR_OK)
-    free(file->descriptor);
-  return (ErrCode) -err;
+  lfs_dir_close (fs, &dir);
+
+  return 0;
   }
 
 /*=========================================================================
 
-  storage_file_close
+  storage_info_from_lfs
 
 =========================================================================*/
-ErrCode storage_file_close (FileDescriptor *file)
+static void storage_info_from_lfs (const struct lfs_info *linfo, 
+     FileInfo *info)
   {
-  if (file->descriptor == NULL)
-    return ERR_INVAL;
-  int err = lfs_file_close (&lfs, (lfs_file_t *)file->descriptor);
-  free (file->descriptor);
-  file->descriptor = NULL;
-  return (ErrCode) -err;
+  strncpy (info->name, linfo->name, STORAGE_NAME_MAX);
+  info->name[STORAGE_NAME_MAX] = 0;
+  info->type = linfo->type == LFS_TYPE_DIR ? STORAGE_TYPE_DIR 
+    : STORAGE_TYPE_REG;
+  info->size = linfo->type == LFS_TYPE_REG ? linfo->size : 0; 
   }
 
 /*=========================================================================
 
-  storage_file_read
+  storage_info_from_rom
 
 =========================================================================*/
-int32_t storage_file_read (FileDescriptor *file, void *buff, uint32_t n)
+static void storage_info_from_rom (const RomfsEntry *e, FileInfo *info)
   {
-  return (int32_t)lfs_file_read(&lfs, (lfs_file_t *)file->descriptor, buff,
-                    n);
+  strncpy (info->name, romfs_name (e), STORAGE_NAME_MAX);
+  info->name[STORAGE_NAME_MAX] = 0;
+  info->type = e->dir ? STORAGE_TYPE_DIR : STORAGE_TYPE_REG;
+  info->size = e->size;
   }
 
 /*=========================================================================
 
-  storage_file_getc
+  storage_list_dir_ex
 
 =========================================================================*/
-int storage_file_getc (FileDescriptor *file)
+ErrCode storage_list_dir_ex (const char *path, List *list)
   {
-  char c = 0;
-  lfs_ssize_t read = lfs_file_read(&lfs, (lfs_file_t *)file->descriptor, &c,
-                       1);
-  return read == 1 ? c : EOF;
-  }
+  lfs_dir_t dir;
+  storage_handle_sync_all ();
+  const char *rel;
+  lfs_t *fs = storage_fs (path, &rel);
+  if (!fs)
+    return storage_rom_list (path, list, TRUE);
 
-/*=========================================================================
+  int err = lfs_dir_open (fs, &dir, rel);
+  if (err)
+    return (ErrCode) -err;
 
-  storage_file_write
+  ErrCode ret = 0;
+  struct lfs_info info;
+  int res;
+  while ((res = lfs_dir_read (fs, &dir, &info)) > 0)
+    {
+    size_t namelen = strlen (info.name);
+    StorageDirEntry *entry = malloc (sizeof (StorageDirEntry) + namelen + 1);
+    if (!entry)
+      {
+      ret = ERR_NOMEM;
+      break;
+      }
+    entry->type = info.type == LFS_TYPE_DIR ? STORAGE_TYPE_DIR 
+      : STORAGE_TYPE_REG;
+    entry->size = info.type == LFS_TYPE_REG ? info.size : 0; 
+    if (entry->type == STORAGE_TYPE_REG)
+      storage_compressed_entry (path, info.name, &entry->size);
+    memcpy (entry->name, info.name, namelen + 1);
+    list_append (list, entry);
+    }
+  if (res < 0 && ret == 0)
+    ret = (ErrCode) -res;
 
-=========================================================================*/
-int32_t storage_file_write (FileDescriptor *file, const void *buf,
-          uint32_t len)
-  {
-  return (int32_t)lfs_file_write (&lfs, (lfs_file_t *)file->descriptor, buf,
-                    len);
+  lfs_dir_close (fs, &dir);
+  return ret;
   }
 
 /*=========================================================================
 
-  storage_file_tell
+  storage_dir_open
 
 =========================================================================*/
-int32_t storage_file_tell (FileDescriptor *file)
+ErrCode storage_dir_open (const char *path, DirDescriptor *dir)
   {
-  return (int32_t)lfs_file_tell (&lfs, (lfs_file_t *)file->descriptor);
+  dir->descriptor = malloc (sizeof (StorageDir));
+  if (dir->descriptor == NULL)
+    return ERR_NOMEM;
+  storage_handle_sync_all ();
+  const char *rel;
+  StorageDir *d = dir->descriptor;
+  strncpy (d->path, path, MAX_PATH);
+  d->path[MAX_PATH] = 0;
+  d->fs = storage_fs (path, &rel);
+  int err;
+  if (d->fs)
+    err = lfs_dir_open (d->fs, &d->dir, rel);
+  else
+    {
+    d->rom = romfs_find (rel);
+    d->rom_pos = 0;
+    err = !d->rom ? LFS_ERR_NOENT : !d->rom->dir ? LFS_ERR_NOTDIR : 0;
+    }
+  if (err)
+    {
+    free (dir->descriptor);
+    dir->descriptor = NULL;
+    }
+  return (ErrCode) -err;
   }
 
 /*=========================================================================
 
-  storage_file_size
+  storage_dir_read
+
+  The size of a compressed file is the size it had before compression,
+  as storage_info() gives it, not the size that is stored.
 
 =========================================================================*/
-int32_t storage_file_size (FileDescriptor *file)
+int storage_dir_read (DirDescriptor *dir, FileInfo *info)
   {
-  return (int32_t)lfs_file_size (&lfs, (lfs_file_t *)file->descriptor);
+  if (dir->descriptor == NULL)
+    return -ERR_BADF;
+  StorageDir *d = dir->descriptor;
+  if (!d->fs)
+    {
+    // "." and ".." first, as LittleFS gives them
+    if (d->rom_pos < 2)
+      {
+      strcpy (info->name, d->rom_pos++ ? ".." : ".");
+      info->type = STORAGE_TYPE_DIR;
+      info->size = 0;
+      return 1;
+      }
+    uint32_t pos = d->rom_pos - 2;
+    const RomfsEntry *e = romfs_read_dir (d->rom, &pos);
+    d->rom_pos = pos + 2;
+    if (!e)
+      return 0;
+    storage_info_from_rom (e, info);
+    return 1;
+    }
+  struct lfs_info linfo;
+  int res = lfs_dir_read (d->fs, &d->dir, &linfo);
+  if (res > 0)
+    {
+    storage_info_from_lfs (&linfo, info);
+    if (info->type == STORAGE_TYPE_REG)
+      storage_compressed_entry (d->path, info->name, &info->size);
+    }
+  return res;
   }
 
 /*=========================================================================
 
-  storage_file_eof
+  storage_dir_close
 
 =========================================================================*/
-BOOL storage_file_eof (FileDescriptor *file)
+ErrCode storage_dir_close (DirDescriptor *dir)
   {
-  lfs_soff_t offset = lfs_file_tell (&lfs, (lfs_file_t *)file->descriptor);
-  if (offset < 0)
-    return TRUE;
-
-  lfs_soff_t size = lfs_file_size (&lfs, (lfs_file_t *)file->descriptor);
-  if (size < 0)
-    return TRUE;
-
-  return offset == size;
+  if (dir->descriptor == NULL)
+    return ERR_BADF;
+  StorageDir *d = dir->descriptor;
+  int err = d->fs ? lfs_dir_close (d->fs, &d->dir) : 0;
+  free (dir->descriptor);
+  dir->descriptor = NULL;
+  return (ErrCode) -err;
   }
 
 /*=========================================================================
 
-  storage_write_file
+  storage_allocator_free
+
+  The number of blocks that the LittleFS allocator has yet to hand out,
+  without scanning the filesystem. Its lookahead bitmap covers every 
+  block, so this is exact just after a scan; after that, blocks that 
+  are used are accounted for, but blocks that are freed are not. So the
+  result is never more than the real free space. Returns -1 if the 
+  bitmap has not been filled in since mounting, or doesn't cover the
+  whole filesystem.
 
 =========================================================================*/
-ErrCode storage_write_file (const char *filename, const void *buf, int len)
+static int32_t storage_allocator_free (const StorageMount *m)
   {
-  lfs_file_t file;
-  int err = lfs_file_open (&lfs, &file, filename, 
-       LFS_O_RDWR | LFS_O_CREAT | LFS_O_TRUNC);
-  if (err)
-    return (ErrCode) -err;
-
-  lfs_ssize_t n = lfs_file_write (&lfs, &file, buf, (lfs_size_t)len);
-  lfs_file_close (&lfs, &file);
-
-  if (n != len)
-    return (ErrCode) -n;
-  else 
-    return 0;
+  const lfs_t *fs = m->fs;
+  if (fs->free.size < m->cfg->block_count)
+    return -1;
+  int32_t n = 0;
+  for (lfs_block_t i = fs->free.i; i < fs->free.size; )
+    {
+    if (i % 32 == 0 && i + 32 <= fs->free.size)
+      {
+      n += 32 - __builtin_popcount (fs->free.buffer[i / 32]);
+      i += 32;
+      }
+    else
+      {
+      if (!(fs->free.buffer[i / 32] & (1U << (i % 32)))) 
+        n++;
+      i++;
+      }
+    }
+  return n;
   }
 
 /*=========================================================================
 
-  storage_append_file
+  storage_allocator_scan
+
+  Have LittleFS compact any metadata that is nearly full, then find all 
+  the free blocks again
 
 =========================================================================*/
-ErrCode storage_append_file (const char *filename, const void *buf, int len)
+static ErrCode storage_allocator_scan (StorageMount *m)
   {
-  lfs_file_t file;
-  int err = lfs_file_open (&lfs, &file, filename, 
-     LFS_O_RDWR | LFS_O_APPEND | LFS_O_CREAT);
-  if (err)
-    return (ErrCode) -err;
-
-  lfs_ssize_t n = lfs_file_write (&lfs, &file, buf, (lfs_size_t)len);
-  lfs_file_close (&lfs, &file);
-
-  if (n != len)
-    return (ErrCode) -n;
-  else 
-    return 0;
+  uint64_t start = interface_time_us ();
+  uint64_t erase_us = m->erase_us;
+  ErrCode ret = (ErrCode) -lfs_fs_gc (m->fs);
+  // Blocks erased by compaction were seen by the scan that followed it
+  m->usage_generation = remove_generation;
+  m->usage_erase_count = m->erase_count;
+  m->usage_sync_count = m->sync_count;
+  // The erases were compaction, which the next scan needn't do again, 
+  //   so they'd make it look slower than it will be; if it were timed
+  //   with them, one compaction could keep storage_idle() from ever 
+  //   scanning this filesystem again
+  m->scan_us = (uint32_t)(interface_time_us () - start 
+    - (m->erase_us - erase_us));
+  return ret;
   }
 
 /*=========================================================================
 
-  storage_list_dir
+  storage_idle
+
+  Each call tidies at most one filesystem: one that has had anything
+  committed to it since it was last scanned. 
 
 =========================================================================*/
-ErrCode storage_list_dir (const char *path, List *list)
+BOOL storage_idle (uint32_t budget_us)
   {
-  lfs_dir_t dir;
-
-  int err = lfs_dir_open (&lfs, &dir, path);
-  if (err)
-    return (ErrCode) -err;
-
-  struct lfs_info info;
-  int ret = lfs_dir_read (&lfs, &dir, &info);
-  while (ret > 0)
+  for (unsigned n = 0; n < STORAGE_MOUNTS; n++)
     {
-    list_append (list, strdup (info.name));
-    ret = lfs_dir_read (&lfs, &dir, &info);
+    StorageMount *m = &mounts[idle_next];
+    idle_next = (idle_next + 1) % STORAGE_MOUNTS;
+    if (!m->mounted || !m->fs || (m->usage_generation == remove_generation 
+         && m->usage_sync_count == m->sync_count))
+      continue;
+    if (m->scan_us > budget_us)
+      continue;
+    uint32_t erases = m->erase_count;
+    uint64_t start = interface_time_us ();
+    storage_allocator_scan (m);
+    idle_stats.runs++;
+    idle_stats.erases += m->erase_count - erases;
+    idle_stats.busy_us += interface_time_us () - start;
+    return TRUE;
     }
+  return FALSE;
+  }
 
-  lfs_dir_close (&lfs, &dir);
+/*=========================================================================
 
-  return 0;
+  storage_idle_stats
+
+=========================================================================*/
+void storage_idle_stats (StorageIdleStats *stats, BOOL reset)
+  {
+  *stats = idle_stats;
+  if (reset)
+    memset (&idle_stats, 0, sizeof (idle_stats));
   }
 
 /*=========================================================================
@@ -263,17 +2334,42 @@ ErrCode storage_list_dir (const char *path, List *list)
 =========================================================================*/
 ErrCode storage_df (const char *path, uint32_t *used, uint32_t *total)
   {
-  (void)path; // TODO
-  ErrCode ret = 0;
-  int res = (int)lfs_fs_size (&lfs);
-  if (res >= 0) 
+  const char *rel;
+  StorageMount *m = storage_mount_for (path, &rel);
+  if (!m->fs)
     {
-    *used = (uint32_t)res * INTERFACE_STORAGE_BLOCK_SIZE;
-    *total = INTERFACE_STORAGE_BLOCK_SIZE * INTERFACE_STORAGE_BLOCK_COUNT;
+    // The read-only image is always full
+    *used = *total = romfs_size;
+    return 0;
+    }
+  storage_handle_sync_all ();
+  *total = m->cfg->block_size * m->cfg->block_count;
+
+  // Deleting files frees blocks that the allocator doesn't know about
+  //   until it scans again. Rewriting them does too, but that matters
+  //   only when space is short
+  int32_t nfree = storage_allocator_free (m);
+  if (nfree < 0 || m->usage_generation != remove_generation 
+       || (nfree < STORAGE_DF_RESCAN_BLOCKS 
+           && m->usage_erase_count != m->erase_count))
+    {
+    ErrCode ret = storage_allocator_scan (m);
+    if (ret) 
+      return ret;
+    nfree = storage_allocator_free (m);
+    }
+
+  if (nfree < 0)
+    {
+    // The allocator can't see the whole filesystem at once
+    int res = (int)lfs_fs_size (m->fs);
+    if (res < 0)
+      return (ErrCode) -res;
+    *used = (uint32_t)res * m->cfg->block_size;
     }
   else
-    ret = (ErrCode) -res;
-  return ret;
+    *used = (m->cfg->block_count - (uint32_t)nfree) * m->cfg->block_size;
+  return 0;
   }
 
 /*=========================================================================
@@ -284,14 +2380,27 @@ ErrCode storage_df (const char *path, uint32_t *used, uint32_t *total)
 ErrCode storage_format (void)
   {
   ErrCode ret = 0;
-  if (mounted)
+  StorageMount *root = &mounts[STORAGE_MOUNT_ROOT];
+  storage_handle_drop_all (); // Their contents are about to vanish
+  storage_tmp_unmount ();
+  if (root->mounted)
     lfs_unmount (&lfs); // Continue whether this succeeds or not
-  mounted = FALSE;
+  root->mounted = FALSE;
+  create_generation++;
+  remove_generation++;
   int err = lfs_format (&lfs, &cfg);
   if (err == 0)
     {
     err = lfs_mount (&lfs, &cfg);
-    if (err) ret = (ErrCode) -err;
+    if (err) 
+      ret = (ErrCode) -err;
+    else
+      {
+      root->mounted = TRUE;
+      storage_allocator_scan (root);
+      storage_tmp_mount ();
+      storage_rom_mount ();
+      }
     }
   else
     ret = (ErrCode) -err;
@@ -305,16 +2414,33 @@ ErrCode storage_format (void)
 =========================================================================*/
 BOOL storage_file_exists (const char *path)
   {
-  BOOL ret = FALSE;
-  lfs_file_t file;
-  int err = lfs_file_open (&lfs, &file, path, LFS_O_RDONLY);
-  if (err == 0)
+  uint32_t hash = storage_lookup_hash (path);
+  const LookupEntry *e = storage_lookup_find (path, hash);
+  if (e)
+    return e->exists;
+
+  // A file with a cached handle certainly exists
+  char key[MAX_PATH + 1];
+  if (storage_handle_key (path, key))
     {
-    lfs_file_close (&lfs, &file);
-    ret = TRUE;
+    for (int i = 0; i < STORAGE_HANDLE_CACHE_SIZE; i++)
+      if (handle_cache[i].path && strcmp (handle_cache[i].path, key) == 0)
+        return TRUE;
     }
-  else
-    ret = FALSE;
+
+  struct lfs_info info;
+  const char *rel;
+  lfs_t *fs = storage_fs (path, &rel);
+  if (!fs)
+    {
+    const RomfsEntry *r = romfs_find (rel);
+    return r && !r->dir;
+    }
+  int err = lfs_stat (fs, rel, &info);
+  BOOL ret = (err == 0 && info.type == LFS_TYPE_REG);
+  // Don't remember failures that might be transient
+  if (err == 0 || err == LFS_ERR_NOENT || err == LFS_ERR_NOTDIR)
+    storage_lookup_store (path, hash, ret);
   return ret;
   }
 
@@ -336,38 +2462,17 @@ ErrCode storage_create_empty_file (const char *path)
 ErrCode storage_enumerate_bytes (const char *path, 
                  StorageEnumBytesFn fn, void *user_data)
   {
-  ErrCode ret = 0;
-  lfs_file_t file;
-
-  char *buff = malloc (INTERFACE_STORAGE_BLOCK_SIZE);
-  if (!buff) 
-    return ERR_NOMEM;
-
-  int err = lfs_file_open (&lfs, &file, path, 
-       LFS_O_RDONLY);
-
-  if (err == 0)
-    {
-    lfs_ssize_t n = 0; 
-    do
-      {
-      lfs_ssize_t n = lfs_file_read (&lfs, &file, buff, 
-         INTERFACE_STORAGE_BLOCK_SIZE);
-      if ((int)n > 0)
-        {
-        for (int i = 0; i < n; i++)
-          {
-	  fn ((uint8_t)buff[i], user_data);
-          }
-        }
-      } while (n > 0);
-    lfs_file_close (&lfs, &file);
-    }
-  else
+  StorageReader r;
+  ErrCode ret = storage_reader_open (&r, path);
+  if (ret == 0)
     {
-    ret = (ErrCode) -err;
+    int c;
+    while (ret == 0 && (c = storage_reader_getc (&r)) != EOF)
+      ret = fn ((uint8_t)c, user_data);
+    if (ret == 0)
+      ret = r.err;
+    storage_reader_close (&r);
     }
-  free (buff);
   return ret;
   }
 
@@ -378,7 +2483,13 @@ ErrCode storage_enumerate_bytes (const char *path,
 =========================================================================*/
 extern ErrCode storage_rm (const char *path)
   {
-  int err = lfs_remove (&lfs, path);
+  remove_generation++;
+  storage_handle_drop (path);
+  const char *rel;
+  lfs_t *fs = storage_fs (path, &rel);
+  if (!fs)
+    return ERR_ROFS;
+  int err = lfs_remove (fs, rel);
   
   return (ErrCode)-err;
   }
@@ -391,19 +2502,25 @@ extern ErrCode storage_rm (const char *path)
 ErrCode storage_read_file (const char *path, 
          uint8_t **buff, int *n)
   {
-  ErrCode ret = 0;
-  lfs_file_t file;
-  int err = lfs_file_open (&lfs, &file, path, LFS_O_RDONLY);
-  if (err == 0)
+  FileDescriptor file;
+  ErrCode ret = storage_file_open (path, STORAGE_O_RDONLY, &file);
+  if (ret == 0)
     {
-    int size = (int)lfs_file_size (&lfs, &file);
+    int32_t size = storage_file_size (&file);
     if (size >= 0)
       {
-      *buff = malloc ((unsigned)size);
+      *buff = malloc ((unsigned)size + 1);
       if (*buff)
         {
-	lfs_file_read (&lfs, &file, *buff, (unsigned)size);
-	*n = size;
+        int32_t got = storage_file_read (&file, *buff, (uint32_t)size);
+        if (got == size)
+          *n = size;
+        else
+          {
+          free (*buff);
+          *buff = NULL;
+          ret = got < 0 ? (ErrCode) -got : ERR_IO;
+          }
 	}
       else
         {
@@ -414,10 +2531,8 @@ ErrCode storage_read_file (const char *path,
       {
       ret = (ErrCode)-size;
       }
-    lfs_file_close (&lfs, &file);
+    storage_file_close (&file);
     }
-  else
-    ret = (ErrCode)-err;
   return ret;
   }
 
@@ -429,20 +2544,40 @@ ErrCode storage_read_file (const char *path,
 ErrCode storage_read_partial (const char *filename, int offset, 
                   int count, uint8_t *buff, int *n)
   {
-  ErrCode ret = 0;
-  lfs_file_t file;
-  int err = lfs_file_open (&lfs, &file, filename, LFS_O_RDONLY);
-  if (err == 0)
+  ErrCode ret;
+  *n = 0;
+  OpenHandle *h = storage_handle_get (filename, FALSE, &ret);
+  if (!h)
     {
-    if (lfs_file_seek (&lfs, &file, offset, LFS_SEEK_SET) >= 0)
+    if (ret) 
+      return ret;
+    FileDescriptor file;
+    ret = storage_file_open (filename, STORAGE_O_RDONLY, &file);
+    if (ret)
+      return ret;
+    if (storage_file_seek (&file, offset, STORAGE_SEEK_SET) >= 0)
       {
-      *n = lfs_file_read (&lfs, &file, buff, count);
+      *n = storage_file_read (&file, buff, (uint32_t)count);
       if (*n < 0) 
-        ret = (ErrCode)-err;
+        {
+        ret = (ErrCode) -*n;
+        *n = 0;
+        }
       }
     else
-      return ERR_INVAL;
-    lfs_file_close (&lfs, &file);
+      ret = ERR_INVAL;
+    storage_file_close (&file);
+    return ret;
+    }
+
+  if (lfs_file_seek (h->fs, &h->file, offset, LFS_SEEK_SET) < 0)
+    return ERR_INVAL;
+  *n = lfs_file_read (h->fs, &h->file, buff, (lfs_size_t)count);
+  if (*n < 0)
+    {
+    ret = (ErrCode) -*n;
+    *n = 0;
+    storage_handle_close (h);
     }
   return ret;
   }
@@ -454,48 +2589,156 @@ ErrCode storage_read_partial (const char *filename, int offset,
 =========================================================================*/
 ErrCode storage_copy_file (const char *from, const char *to)
   {
+  if (strcmp (from, to) == 0)
+    return ERR_INVAL; // Opening the target would truncate the source
+  const char *rel_from, *rel_to;
+  lfs_t *fs_from = storage_fs (from, &rel_from);
+  lfs_t *fs_to = storage_fs (to, &rel_to);
+  if (!fs_to)
+    return ERR_ROFS;
+  if (!fs_from)
+    {
+    // A file in the read-only image is already in memory
+    const void *data;
+    uint32_t n;
+    ErrCode ret = storage_map (from, &data, &n);
+    if (ret)
+      return ret;
+    return storage_write_direct (to, 
+      STORAGE_O_WRONLY | STORAGE_O_CREAT | STORAGE_O_TRUNC, data, (int)n);
+    }
+
+  // Ask for a large buffer, but make do with less if memory is short
+  uint32_t size = STORAGE_COPY_BUFFER_SIZE;
+  uint8_t *buff = NULL;
+  while (size >= 256 && (buff = malloc (size)) == NULL)
+    size /= 2;
+  if (!buff)
+    return ERR_NOMEM;
+
   ErrCode ret = 0;
   lfs_file_t file_from;
   lfs_file_t file_to;
-  int err = lfs_file_open (&lfs, &file_from, from, LFS_O_RDONLY);
+  storage_handle_drop (from);
+  storage_handle_drop (to);
+
+  // A compressed file is copied as it is stored, and the copy gets the
+  //   same attribute, which is committed along with its data
+  uint8_t zattr[STORAGE_ZATTR_SIZE] = {0};
+  struct lfs_attr attr = { STORAGE_ATTR_COMPRESSED, zattr, sizeof (zattr) };
+  struct lfs_file_config fcfg;
+  memset (&fcfg, 0, sizeof (fcfg));
+  fcfg.attrs = &attr;
+  fcfg.attr_count = 1;
+  int err = lfs_file_opencfg (fs_from, &file_from, rel_from, LFS_O_RDONLY, &fcfg);
   if (err == 0)
     {
-    char *buff = malloc (INTERFACE_STORAGE_BLOCK_SIZE);
-    if (buff) 
+    create_generation++;
+    ret = storage_prepare_write (to, TRUE);
+    if (ret == 0)
       {
-      int err = lfs_file_open (&lfs, &file_to, to, 
-         LFS_O_RDWR | LFS_O_CREAT | LFS_O_TRUNC);
-      if (err == 0)
+      if (storage_zattr_parse (zattr, NULL))
+        err = lfs_file_opencfg (fs_to, &file_to, rel_to, 
+           LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC, &fcfg);
+      else
+        err = lfs_file_open (fs_to, &file_to, rel_to, 
+           LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+      }
+    if (ret == 0 && err == 0)
+      {
+      lfs_ssize_t n;
+      while ((n = lfs_file_read (fs_from, &file_from, buff, size)) > 0)
         {
-        lfs_ssize_t n = 0;
-        do 
+        lfs_ssize_t w = lfs_file_write (fs_to, &file_to, buff, 
+           (lfs_size_t)n);
+        if (w != n)
           {
-          n = lfs_file_read (&lfs, &file_from, buff, 
-            INTERFACE_STORAGE_BLOCK_SIZE);
-          if ((int)n > 0)
-            {
-            lfs_file_write (&lfs, &file_to, buff, (unsigned)n);
-            }
-          } while (n > 0  && shell_get_interrupt() == FALSE);
-        lfs_file_close (&lfs, &file_to);
-        if (shell_get_interrupt())
+          ret = w < 0 ? (ErrCode) -w : ERR_NOSPC;
+          break;
+          }
+        if (shell_get_interrupt ())
           {
-          storage_rm (to);
+          ret = ERR_INTERRUPTED;
+          break;
           }
         }
-      else
-        ret = (ErrCode)-err;
+      if (n < 0 && ret == 0)
+        ret = (ErrCode) -n;
+      err = lfs_file_close (fs_to, &file_to);
+      if (err && ret == 0)
+        ret = (ErrCode) -err;
+      if (ret)
+        storage_rm (to); // Don't leave a partial copy 
       }
-    else
-      ret = ERR_NOMEM;
-
-    lfs_file_close (&lfs, &file_from);
+    else if (ret == 0)
+      ret = (ErrCode) -err;
+    lfs_file_close (fs_from, &file_from);
     }
   else 
-    ret = (ErrCode)-err;
+    ret = (ErrCode) -err;
+
+  free (buff);
   return ret;
   }
 
+/*=========================================================================
+
+  storage_copy_tree
+
+=========================================================================*/
+ErrCode storage_copy_tree (const char *from, const char *to, 
+     StorageCopyFn fn, void *user_data)
+  {
+  FileInfo info;
+  ErrCode ret = storage_info (from, &info);
+  if (ret)
+    return ret;
+
+  if (info.type == STORAGE_TYPE_REG)
+    {
+    if (fn) fn (from, to, user_data);
+    return storage_copy_file (from, to);
+    }
+
+  // Copying a directory into itself would never finish
+  size_t l = strlen (from);
+  while (l > 0 && from[l - 1] == '/') l--;
+  if (strncmp (from, to, l) == 0 && (to[l] == '/' || to[l] == 0))
+    return ERR_INVAL;
+
+  if (fn) fn (from, to, user_data);
+  ret = storage_mkdir (to);
+  if (ret == ERR_EXIST)
+    ret = 0;
+
+  DirDescriptor dir;
+  if (ret == 0)
+    ret = storage_dir_open (from, &dir);
+  if (ret)
+    return ret;
+
+  int res = 0;
+  while (ret == 0 && (res = storage_dir_read (&dir, &info)) > 0)
+    {
+    if (strcmp (info.name, ".") == 0 || strcmp (info.name, "..") == 0)
+      continue;
+    char *src = malloc (2 * (MAX_PATH + 1));
+    if (!src)
+      {
+      ret = ERR_NOMEM;
+      break;
+      }
+    char *dst = src + MAX_PATH + 1;
+    storage_join_path (from, info.name, src);
+    storage_join_path (to, info.name, dst);
+    ret = storage_copy_tree (src, dst, fn, user_data);
+    free (src);
+    }
+  if (res < 0 && ret == 0)
+    ret = (ErrCode) -res;
+  storage_dir_close (&dir);
+  return ret;
+  }
 /*=========================================================================
 
   storage_info
@@ -504,13 +2747,23 @@ ErrCode storage_copy_file (const char *from, const char *to)
 ErrCode storage_info (const char *path, FileInfo *info)
   {
   struct lfs_info linfo;
-  int err = lfs_stat (&lfs, path, &linfo);
+  storage_handle_sync_all ();
+  const char *rel;
+  lfs_t *fs = storage_fs (path, &rel);
+  if (!fs)
+    {
+    const RomfsEntry *e = romfs_find (rel);
+    if (!e)
+      return ERR_NOENT;
+    storage_info_from_rom (e, info);
+    return 0;
+    }
+  int err = lfs_stat (fs, rel, &linfo);
   if (err == 0)
     {
-    strncpy (info->name, linfo.name, STORAGE_NAME_MAX);
-    info->type = linfo.type == LFS_TYPE_DIR ? STORAGE_TYPE_DIR 
-      : STORAGE_TYPE_REG;
-    info->size = linfo.type == LFS_TYPE_REG ? linfo.size : 0; 
+    storage_info_from_lfs (&linfo, info);
+    if (info->type == STORAGE_TYPE_REG)
+      storage_compressed (path, &info->size);
     return 0;
     }
   else
@@ -524,7 +2777,12 @@ ErrCode storage_info (const char *path, FileInfo *info)
 =========================================================================*/
 ErrCode storage_mkdir (const char *path)
   {
-  int err = lfs_mkdir (&lfs, path);
+  create_generation++;
+  const char *rel;
+  lfs_t *fs = storage_fs (path, &rel);
+  if (!fs)
+    return ERR_ROFS;
+  int err = lfs_mkdir (fs, rel);
   if (err == 0)
     {
     return 0;
@@ -607,7 +2865,30 @@ void storage_get_dir (const char *path, char result[MAX_PATH + 1])
 =========================================================================*/
 ErrCode storage_rename (const char *source, const char *target)
   {
-  return (ErrCode) -lfs_rename (&lfs, source, target);
+  create_generation++;
+  remove_generation++;
+  storage_handle_drop (source);
+  storage_handle_drop (target);
+  const char *rel_source, *rel_target;
+  lfs_t *fs_source = storage_fs (source, &rel_source);
+  lfs_t *fs_target = storage_fs (target, &rel_target);
+  if (!fs_source || !fs_target)
+    return ERR_ROFS;
+  if (fs_source == fs_target)
+    return (ErrCode) -lfs_rename (fs_source, rel_source, rel_target);
+
+  // Files can be moved between filesystems by copying, but directories
+  //   would need the whole tree copying, which the caller can do
+  struct lfs_info info;
+  int err = lfs_stat (fs_source, rel_source, &info);
+  if (err)
+    return (ErrCode) -err;
+  if (info.type != LFS_TYPE_REG)
+    return ERR_XDEV;
+  ErrCode ret = storage_copy_file (source, target);
+  if (ret == 0)
+    ret = storage_rm (source);
+  return ret;
   }
 
 